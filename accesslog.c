@@ -0,0 +1,470 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "accesslog.h"
+#include "metrics.h"
+
+
+// longest log line a record can make: every byte of the target escaped as \u00XX, and the other fields
+#define ACCESS_LOG_MAX_LINE (ACCESS_LOG_MAX_TARGET * 6 + ACCESS_LOG_MAX_METHOD * 6 + 256)
+
+
+/**
+ * The fixed part of a record in a ring, followed by the method and the target. Records are
+ * padded to a multiple of 8 bytes and may wrap around the end of the ring.
+ */
+typedef struct {
+    unsigned int length;               // bytes of the record with its strings and padding
+    int status;                        // status code sent to the client
+    unsigned short method_length;      // bytes of the method that follow
+    unsigned short target_length;      // bytes of the target that follow the method
+    unsigned long long time;           // wall clock microsecond the request ended
+    unsigned long long duration;       // microseconds from the request head to the end of the response
+    unsigned long long bytes;          // bytes of the response sent to the client
+    struct sockaddr_in6 client;        // the address of the client
+} record_header;
+
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER; // protects rings
+static access_log_ring* rings = NULL;                             // the rings of every thread that logged something, newest first
+static _Thread_local access_log_ring* local_ring = NULL;          // the ring of the calling thread, NULL until it logs something
+
+static int log_fd = -1;                                           // the log file, -1 while the access log is off
+static int sample_every = 1;                                      // one request in sample_every is logged
+static size_t ring_capacity = 0;                                  // bytes of each ring, a power of two
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;   // protects writer_stopping
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;     // signaled to stop the writer
+static int writer_stopping = 0;                                   // 1 once the writer has to finish
+static pthread_t writer_thread;                                   // the thread draining the rings
+
+static char* batch = NULL;                                        // log lines gathered by the writer
+static size_t batch_length = 0;                                   // bytes in batch
+static int write_failed = 0;                                      // 1 after a failed write(), until one succeeds
+
+
+
+/**
+ * Allocates the ring of the calling thread and adds it to the registry.
+ *
+ * @return The ring, or NULL if memory allocation fails.
+ */
+static access_log_ring* register_ring(void)
+{
+    access_log_ring* ring = aligned_alloc(ACCESS_LOG_CACHE_LINE, sizeof(access_log_ring));
+    unsigned char* data = malloc(ring_capacity);
+    if (ring == NULL || data == NULL)
+    {
+        free(ring);
+        free(data);
+        return NULL;
+    }
+    memset(ring, 0, sizeof(access_log_ring));
+    ring->capacity = ring_capacity;
+    ring->data = data;
+
+    pthread_mutex_lock(&registry_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&registry_lock);
+
+    return ring;
+}
+
+/**
+ * Copies bytes into a ring at a position that only grows, wrapping around its end.
+ *
+ * @param ring: The ring.
+ * @param position: The position, taken modulo the capacity.
+ * @param data: The bytes.
+ * @param length: The number of bytes, at most the capacity.
+ */
+static void ring_put(access_log_ring* ring, size_t position, const void* data, size_t length)
+{
+    size_t offset = position & (ring->capacity - 1);
+    size_t first = ring->capacity - offset < length ? ring->capacity - offset : length;
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, (const unsigned char*)data + first, length - first);
+}
+
+/**
+ * Copies bytes out of a ring, wrapping around its end.
+ *
+ * @param ring: The ring.
+ * @param position: The position, taken modulo the capacity.
+ * @param out: Receives the bytes.
+ * @param length: The number of bytes, at most the capacity.
+ */
+static void ring_get(const access_log_ring* ring, size_t position, void* out, size_t length)
+{
+    size_t offset = position & (ring->capacity - 1);
+    size_t first = ring->capacity - offset < length ? ring->capacity - offset : length;
+    memcpy(out, ring->data + offset, first);
+    memcpy((unsigned char*)out + first, ring->data, length - first);
+}
+
+/**
+ * Writes the gathered log lines to the file. Lines that cannot be written are dropped.
+ */
+static void flush_batch(void)
+{
+    size_t written = 0;
+    while (written < batch_length)
+    {
+        ssize_t result = write(log_fd, batch + written, batch_length - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+        {
+            // Reported once, not for every batch while the disk stays full
+            if (!write_failed)
+                perror("error: write access log\n");
+            write_failed = 1;
+            break;
+        }
+        written += result;
+        write_failed = 0;
+    }
+
+    batch_length = 0;
+}
+
+/**
+ * Makes room in the batch for one more log line, writing it out if needed.
+ *
+ * @return Where the line goes, with at least ACCESS_LOG_MAX_LINE bytes free.
+ */
+static char* batch_room(void)
+{
+    if (ACCESS_LOG_WRITE_SIZE - batch_length < ACCESS_LOG_MAX_LINE)
+        flush_batch();
+    return batch + batch_length;
+}
+
+/**
+ * Formats a wall clock time as an ISO 8601 UTC timestamp with microseconds.
+ *
+ * @param time: The wall clock microsecond.
+ * @param out: Receives the timestamp, at least 32 bytes.
+ * @return The length of the timestamp.
+ */
+static size_t format_time(unsigned long long time, char* out)
+{
+    // Lines come in bursts of the same second, the calendar part is formatted once for them
+    static time_t cached_second = -1;
+    static char cached[24];
+
+    time_t second = (time_t)(time / 1000000);
+    if (second != cached_second)
+    {
+        struct tm gmt;
+        gmtime_r(&second, &gmt);
+        strftime(cached, sizeof(cached), "%Y-%m-%dT%H:%M:%S", &gmt);
+        cached_second = second;
+    }
+
+    return (size_t)sprintf(out, "%s.%06lluZ", cached, time % 1000000);
+}
+
+/**
+ * Writes a string as the contents of a JSON string, escaping quotes, backslashes and
+ * control characters.
+ *
+ * @param out: Where the text goes, at least 6 bytes per byte of the string.
+ * @param text: The string.
+ * @param length: The bytes of text.
+ * @return The bytes written.
+ */
+static size_t escape_json(char* out, const char* text, size_t length)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t written = 0;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\')
+        {
+            out[written++] = '\\';
+            out[written++] = (char)c;
+        }
+        else if (c < 0x20 || c == 0x7f)
+        {
+            memcpy(out + written, "\\u00", 4);
+            out[written + 4] = hex[c >> 4];
+            out[written + 5] = hex[c & 15];
+            written += 6;
+        }
+        else
+            out[written++] = (char)c;
+    }
+
+    return written;
+}
+
+/**
+ * Formats the address of a client, an IPv4-mapped address as plain IPv4.
+ *
+ * @param client: The address, an IPv4 one on systems without IPv6, family 0 if unknown.
+ * @param out: Receives the address, at least INET6_ADDRSTRLEN bytes.
+ */
+static void format_client(const struct sockaddr_in6* client, char* out)
+{
+    if (client->sin6_family == AF_INET)
+        inet_ntop(AF_INET, &((const struct sockaddr_in*)client)->sin_addr, out, INET6_ADDRSTRLEN);
+    else if (client->sin6_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&client->sin6_addr))
+        inet_ntop(AF_INET, client->sin6_addr.s6_addr + 12, out, INET6_ADDRSTRLEN);
+    else if (client->sin6_family != AF_INET6 || inet_ntop(AF_INET6, &client->sin6_addr, out, INET6_ADDRSTRLEN) == NULL)
+        strcpy(out, "-");
+}
+
+/**
+ * Appends the log line of a record to the batch.
+ *
+ * @param header: The fixed part of the record.
+ * @param strings: The method followed by the target.
+ */
+static void format_record(const record_header* header, const char* strings)
+{
+    char* out = batch_room();
+    char time[32];
+    char client[INET6_ADDRSTRLEN];
+    format_time(header->time, time);
+    format_client(&header->client, client);
+
+    size_t length = (size_t)sprintf(out, "{\"time\":\"%s\",\"client\":\"%s\",\"client_port\":%u,\"method\":\"",
+                                    time, client, ntohs(header->client.sin6_port));
+    length += escape_json(out + length, strings, header->method_length);
+    memcpy(out + length, "\",\"target\":\"", 12);
+    length += 12;
+    length += escape_json(out + length, strings + header->method_length, header->target_length);
+    length += (size_t)sprintf(out + length, "\",\"status\":%d,\"bytes\":%llu,\"duration_us\":%llu}\n",
+                              header->status, header->bytes, header->duration);
+
+    batch_length += length;
+}
+
+/**
+ * Appends a line saying how many records a ring dropped since the last such line.
+ *
+ * @param dropped: The number of records dropped.
+ */
+static void format_dropped(unsigned long long dropped)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    char time[32];
+    format_time((unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000, time);
+
+    char* out = batch_room();
+    batch_length += (size_t)sprintf(out, "{\"time\":\"%s\",\"event\":\"dropped\",\"records\":%llu}\n", time, dropped);
+}
+
+/**
+ * Moves every record the rings hold into log lines, and writes them out.
+ */
+static void drain_rings(void)
+{
+    char strings[ACCESS_LOG_MAX_METHOD + ACCESS_LOG_MAX_TARGET];
+
+    // Rings are only ever added at the front, the ones already there can be walked without the lock
+    pthread_mutex_lock(&registry_lock);
+    access_log_ring* first = rings;
+    pthread_mutex_unlock(&registry_lock);
+
+    for (access_log_ring* ring = first; ring != NULL; ring = ring->next)
+    {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire); // The records up to head are complete
+
+        while (tail != head)
+        {
+            record_header header;
+            ring_get(ring, tail, &header, sizeof(header));
+            ring_get(ring, tail + sizeof(header), strings, header.method_length + header.target_length);
+            format_record(&header, strings);
+            tail += header.length;
+        }
+
+        // The owning thread may reuse the space from here on
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        unsigned long long dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != ring->dropped_reported)
+        {
+            format_dropped(dropped - ring->dropped_reported);
+            ring->dropped_reported = dropped;
+        }
+    }
+
+    if (batch_length > 0)
+        flush_batch();
+}
+
+/**
+ * The body of the writer thread: drains the rings every ACCESS_LOG_FLUSH_MS milliseconds,
+ * and a last time once it is stopped.
+ *
+ * @param arg: Unused.
+ * @return NULL.
+ */
+static void* writer_function(void* arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&writer_lock);
+    while (1)
+    {
+        int stopping = writer_stopping;
+        pthread_mutex_unlock(&writer_lock);
+
+        drain_rings();
+
+        pthread_mutex_lock(&writer_lock);
+        if (stopping)
+            break;
+
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += ACCESS_LOG_FLUSH_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        if (!writer_stopping)
+            pthread_cond_timedwait(&writer_wake, &writer_lock, &until);
+    }
+    pthread_mutex_unlock(&writer_lock);
+
+    return NULL;
+}
+
+
+int access_log_start(const char* path, int sample, size_t ring_size)
+{
+    // The ring holds at least one record of the longest kind
+    ring_capacity = sizeof(record_header) + ACCESS_LOG_MAX_METHOD + ACCESS_LOG_MAX_TARGET;
+    while (ring_capacity & (ring_capacity - 1))
+        ring_capacity &= ring_capacity - 1;
+    ring_capacity <<= 1;
+    while (ring_capacity < ring_size)
+        ring_capacity <<= 1;
+    sample_every = sample > 0 ? sample : 1;
+
+    batch = malloc(ACCESS_LOG_WRITE_SIZE);
+    if (batch == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd == -1)
+    {
+        fprintf(stderr, "Failed to open the access log %s: %s\n", path, strerror(errno));
+        free(batch);
+        batch = NULL;
+        return -1;
+    }
+
+    writer_stopping = 0;
+    if (pthread_create(&writer_thread, NULL, writer_function, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to create the access log thread\n");
+        close(log_fd);
+        log_fd = -1;
+        free(batch);
+        batch = NULL;
+        return -1;
+    }
+
+    return 1;
+}
+
+
+void access_log_record(const access_log_entry* entry)
+{
+    if (log_fd == -1)
+        return;
+
+    access_log_ring* ring = local_ring;
+    if (ring == NULL)
+    {
+        ring = local_ring = register_ring();
+        if (ring == NULL)
+            return;
+    }
+
+    // Errors are rare and worth seeing, they are logged whatever the sampling
+    if (++ring->requests % sample_every != 0 && entry->status < 400)
+        return;
+
+    record_header header;
+    header.method_length = (unsigned short)(entry->method_length < ACCESS_LOG_MAX_METHOD ? entry->method_length : ACCESS_LOG_MAX_METHOD);
+    header.target_length = (unsigned short)(entry->target_length < ACCESS_LOG_MAX_TARGET ? entry->target_length : ACCESS_LOG_MAX_TARGET);
+    header.length = (unsigned int)((sizeof(header) + header.method_length + header.target_length + 7) & ~(size_t)7);
+
+    // Only this thread moves head, the writer only moves tail forward
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (ring->capacity - (head - ring->tail_seen) < header.length)
+    {
+        ring->tail_seen = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (ring->capacity - (head - ring->tail_seen) < header.length)
+        {
+            atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                                  memory_order_relaxed);
+            metrics_count(METRIC_ACCESS_LOG_DROPPED, 1);
+            return;
+        }
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.time = (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    header.duration = entry->started != 0 ? metrics_clock_us() - entry->started : 0;
+    header.status = entry->status;
+    header.bytes = entry->bytes;
+    header.client = entry->client;
+
+    ring_put(ring, head, &header, sizeof(header));
+    ring_put(ring, head + sizeof(header), entry->method, header.method_length);
+    ring_put(ring, head + sizeof(header) + header.method_length, entry->target, header.target_length);
+
+    // Publishes the record, the writer sees its bytes once it sees the new head
+    atomic_store_explicit(&ring->head, head + header.length, memory_order_release);
+}
+
+
+void access_log_stop(void)
+{
+    if (log_fd == -1)
+        return;
+
+    pthread_mutex_lock(&writer_lock);
+    writer_stopping = 1;
+    pthread_cond_signal(&writer_wake);
+    pthread_mutex_unlock(&writer_lock);
+    pthread_join(writer_thread, NULL);
+
+    close(log_fd);
+    log_fd = -1;
+    free(batch);
+    batch = NULL;
+
+    pthread_mutex_lock(&registry_lock);
+    while (rings != NULL)
+    {
+        access_log_ring* next = rings->next;
+        free(rings->data);
+        free(rings);
+        rings = next;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    local_ring = NULL;
+}
@@ -0,0 +1,92 @@
+#ifndef PROXYSERVER_ACCESSLOG_H
+#define PROXYSERVER_ACCESSLOG_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+/**
+ * accesslog.h
+ *
+ * This file declares the access log. A thread finishing a request copies its
+ * record into a ring buffer of its own, with no lock and no system call, and
+ * a writer thread drains the rings of every thread into large write()s of
+ * JSON lines. A ring that is full drops the record and counts it rather than
+ * making the request wait.
+ */
+
+// size of a cache line, the two ends of a ring never share one
+#define ACCESS_LOG_CACHE_LINE 64
+
+// longest method kept in a record, longer ones are cut
+#define ACCESS_LOG_MAX_METHOD 16
+
+// longest request target kept in a record, longer ones are cut
+#define ACCESS_LOG_MAX_TARGET 1024
+
+// milliseconds the writer sleeps between two sweeps of the rings
+#define ACCESS_LOG_FLUSH_MS 100
+
+// bytes of log lines the writer gathers before a write()
+#define ACCESS_LOG_WRITE_SIZE (1024 * 1024)
+
+
+/**
+ * A request to be logged, filled in by the thread that served it
+ */
+typedef struct {
+    struct sockaddr_in6 client;        // the address of the client, IPv4 as IPv4-mapped IPv6
+    const char* method;                // the method, not null-terminated
+    size_t method_length;              // bytes of method
+    const char* target;                // the request target, not null-terminated
+    size_t target_length;              // bytes of target
+    int status;                        // status code sent to the client, 0 if none was
+    unsigned long long bytes;          // bytes of the response sent to the client
+    unsigned long long started;        // monotonic microsecond the request head started to arrive, 0 if unknown
+} access_log_entry;
+
+
+/**
+ * The ring buffer one thread writes its records to, and the writer thread drains. Head and
+ * tail only grow, their difference is the number of bytes held.
+ */
+typedef struct access_log_ring_st {
+    _Alignas(ACCESS_LOG_CACHE_LINE) atomic_size_t head;  // bytes ever written, stored by the owning thread only
+    size_t tail_seen;                                    // the tail as last loaded by the owning thread
+    unsigned long requests;                              // requests seen by the owning thread, for sampling
+    atomic_ullong dropped;                               // records dropped for lack of room, stored by the owning thread only
+    _Alignas(ACCESS_LOG_CACHE_LINE) atomic_size_t tail;  // bytes ever read, stored by the writer only
+    unsigned long long dropped_reported;                 // drops the writer already logged
+    size_t capacity;                                     // size of data, a power of two
+    unsigned char* data;                                 // the records
+    struct access_log_ring_st* next;                     // next ring of the registry
+} access_log_ring;
+
+
+/**
+ * Opens the access log and starts its writer thread.
+ *
+ * @param path: The file the records are appended to, created if missing.
+ * @param sample: One request in sample is logged, error responses always are.
+ * @param ring_size: Bytes of the ring buffer of each thread, rounded up to a power of two.
+ * @return
+ *   - 1 on success.
+ *   - -1 if the file cannot be opened or the thread cannot be created. A message is printed.
+ */
+int access_log_start(const char* path, int sample, size_t ring_size);
+
+/**
+ * Logs a request, unless the access log is off or the request is not sampled. Never blocks:
+ * if the ring of the calling thread is full, the record is dropped and counted.
+ *
+ * @param entry: The request.
+ */
+void access_log_record(const access_log_entry* entry);
+
+/**
+ * Stops the writer once it wrote every record left in the rings, closes the file and frees
+ * the rings. No other thread may log anymore.
+ */
+void access_log_stop(void);
+
+#endif //PROXYSERVER_ACCESSLOG_H
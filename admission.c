@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "admission.h"
+
+
+static admission_shard shards[ADMISSION_SHARDS]; // the counts
+static int client_limit = 0;                     // connections one address may hold, 0 for no limit
+
+
+
+/**
+ * Extracts the address of a client as IPv6, IPv4 addresses being mapped.
+ *
+ * @param client: The address as accept() filled it, a sockaddr_in for an IPv4 listener.
+ * @param address: Receives the address.
+ */
+static void client_key(const struct sockaddr_in6* client, struct in6_addr* address)
+{
+    if (client->sin6_family == AF_INET6)
+    {
+        *address = client->sin6_addr;
+        return;
+    }
+
+    const struct sockaddr_in* v4 = (const struct sockaddr_in*)client;
+    memset(address, 0, sizeof(*address));
+    address->s6_addr[10] = 0xff;
+    address->s6_addr[11] = 0xff;
+    memcpy(&address->s6_addr[12], &v4->sin_addr, 4);
+}
+
+/**
+ * Computes the 32-bit FNV-1a hash of an address.
+ *
+ * @param address: The address.
+ * @return The hash value.
+ */
+static uint32_t hash_address(const struct in6_addr* address)
+{
+    uint32_t hash = 2166136261u; // FNV offset basis
+
+    for (int i = 0; i < 16; i++)
+    {
+        hash ^= address->s6_addr[i];
+        hash *= 16777619u; // FNV prime
+    }
+
+    return hash;
+}
+
+
+int admission_init(int limit)
+{
+    client_limit = limit;
+
+    for (int i = 0; i < ADMISSION_SHARDS; i++)
+    {
+        if (pthread_mutex_init(&shards[i].lock, NULL) != 0)
+        {
+            fprintf(stderr, "Failed to initialize admission mutex\n");
+            while (i-- > 0)
+                pthread_mutex_destroy(&shards[i].lock);
+            return -1;
+        }
+
+        for (int j = 0; j < ADMISSION_BUCKETS_PER_SHARD; j++)
+            shards[i].buckets[j] = NULL;
+    }
+
+    return 1;
+}
+
+
+int admission_enter(const struct sockaddr_in6* client)
+{
+    if (client_limit == 0)
+        return 1;
+
+    struct in6_addr address;
+    client_key(client, &address);
+    uint32_t hash = hash_address(&address);
+    admission_shard* shard = &shards[hash % ADMISSION_SHARDS];
+    admission_client** bucket = &shard->buckets[(hash / ADMISSION_SHARDS) % ADMISSION_BUCKETS_PER_SHARD];
+    int admitted = 1;
+
+    pthread_mutex_lock(&shard->lock);
+
+    admission_client* found = *bucket;
+    while (found != NULL && memcmp(&found->address, &address, sizeof(address)) != 0)
+        found = found->next;
+
+    if (found == NULL)
+    {
+        found = malloc(sizeof(admission_client));
+        if (found != NULL)
+        {
+            found->address = address;
+            found->connections = 0;
+            found->next = *bucket;
+            *bucket = found;
+        }
+    }
+
+    // Without memory for the count the client is refused rather than left unlimited
+    if (found == NULL || found->connections >= client_limit)
+        admitted = 0;
+    else
+        found->connections++;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return admitted;
+}
+
+
+void admission_leave(const struct sockaddr_in6* client)
+{
+    if (client_limit == 0)
+        return;
+
+    struct in6_addr address;
+    client_key(client, &address);
+    uint32_t hash = hash_address(&address);
+    admission_shard* shard = &shards[hash % ADMISSION_SHARDS];
+    admission_client** link = &shard->buckets[(hash / ADMISSION_SHARDS) % ADMISSION_BUCKETS_PER_SHARD];
+
+    pthread_mutex_lock(&shard->lock);
+
+    while (*link != NULL && memcmp(&(*link)->address, &address, sizeof(address)) != 0)
+        link = &(*link)->next;
+
+    // The address is forgotten with its last connection
+    admission_client* found = *link;
+    if (found != NULL && --found->connections == 0)
+    {
+        *link = found->next;
+        free(found);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+
+void admission_shutdown(void)
+{
+    for (int i = 0; i < ADMISSION_SHARDS; i++)
+    {
+        for (int j = 0; j < ADMISSION_BUCKETS_PER_SHARD; j++)
+            while (shards[i].buckets[j] != NULL)
+            {
+                admission_client* client = shards[i].buckets[j];
+                shards[i].buckets[j] = client->next;
+                free(client);
+            }
+
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef PROXYSERVER_ADMISSION_H
+#define PROXYSERVER_ADMISSION_H
+
+#include <pthread.h>
+#include <netinet/in.h>
+
+/**
+ * admission.h
+ *
+ * This file declares the limit on the connections one client address may
+ * hold open at a time. Every accepted connection enters the count of its
+ * address and leaves it when it is closed, and a connection beyond the limit
+ * is answered with a 503 right away instead of taking a worker. The counts
+ * live in a sharded hash table, an address is only kept while it has open
+ * connections.
+ */
+
+// number of independently locked shards of the table
+#define ADMISSION_SHARDS 16
+
+// number of hash buckets per shard
+#define ADMISSION_BUCKETS_PER_SHARD 256
+
+
+/**
+ * The open connections of one client address
+ */
+typedef struct admission_client_st {
+    struct admission_client_st* next;   // next client of the same bucket
+    struct in6_addr address;            // the address, IPv4 as IPv4-mapped IPv6
+    int connections;                    // connections of the address currently open
+} admission_client;
+
+
+/**
+ * A shard of the table, holding the clients whose hash maps to it
+ */
+typedef struct {
+    pthread_mutex_t lock;                                     // protects the buckets
+    admission_client* buckets[ADMISSION_BUCKETS_PER_SHARD];   // hash chains
+} admission_shard;
+
+
+/**
+ * Initializes the table. Must be called before any other admission function.
+ *
+ * @param limit: Connections one address may hold open, 0 for no limit.
+ * @return
+ *   - 1 on success.
+ *   - -1 if a shard lock cannot be initialized.
+ */
+int admission_init(int limit);
+
+/**
+ * Counts a new connection of a client, unless the client already holds the limit.
+ *
+ * @param client: The address of the client, as accept() filled it.
+ * @return
+ *   - 1 if the connection is admitted, admission_leave() must be called once it closes.
+ *   - 0 if the client holds too many connections, nothing was counted.
+ */
+int admission_enter(const struct sockaddr_in6* client);
+
+/**
+ * Uncounts a connection admitted by admission_enter().
+ *
+ * @param client: The address of the client.
+ */
+void admission_leave(const struct sockaddr_in6* client);
+
+/**
+ * Frees the table, once every connection left it.
+ */
+void admission_shutdown(void);
+
+#endif //PROXYSERVER_ADMISSION_H
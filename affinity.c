@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "affinity.h"
+
+
+// the file listing the NUMA nodes that have memory or CPUs online
+#define AFFINITY_NODES_PATH "/sys/devices/system/node/online"
+
+// the file listing the CPUs of a NUMA node, formatted with its number
+#define AFFINITY_NODE_CPUS_PATH "/sys/devices/system/node/node%d/cpulist"
+
+
+static int placement = AFFINITY_NONE;          // the affinity_mode in effect
+static cpu_set_t allowed;                      // the CPUs the process was started on
+static cpu_set_t* unit_cpus = NULL;            // the CPUs of each unit, NULL without pinning
+static int unit_count = 1;                     // number of units
+static short cpu_units[CPU_SETSIZE];           // the unit of each allowed CPU, filled once by affinity_init()
+static short unit_first_cpu[CPU_SETSIZE];      // the lowest CPU of each unit
+
+
+
+/**
+ * Reads a list of numbers in the kernel's format, e.g. "0-3,8,10-11", into a set.
+ *
+ * @param path: The file holding the list.
+ * @param set: Receives the numbers.
+ * @return
+ *   - 1 on success.
+ *   - -1 if the file cannot be read.
+ */
+static int read_list(const char* path, cpu_set_t* set)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    char line[4096];
+    int ok = fgets(line, sizeof(line), file) != NULL;
+    fclose(file);
+    if (!ok)
+        return -1;
+
+    CPU_ZERO(set);
+    char* cursor = line;
+    while (*cursor != '\0' && *cursor != '\n')
+    {
+        char* end;
+        long first = strtol(cursor, &end, 10);
+        if (end == cursor)
+            return -1;
+
+        long last = first;
+        if (*end == '-')
+        {
+            cursor = end + 1;
+            last = strtol(cursor, &end, 10);
+            if (end == cursor)
+                return -1;
+        }
+
+        for (long number = first; number <= last && number < CPU_SETSIZE; number++)
+            if (number >= 0)
+                CPU_SET((int)number, set);
+
+        cursor = *end == ',' ? end + 1 : end;
+    }
+
+    return 1;
+}
+
+/**
+ * Adds a unit holding the allowed CPUs of a set, unless none of them is allowed.
+ *
+ * @param cpus: The CPUs of the unit.
+ */
+static void add_unit(const cpu_set_t* cpus)
+{
+    cpu_set_t usable;
+    CPU_AND(&usable, cpus, &allowed);
+    if (CPU_COUNT(&usable) == 0)
+        return;
+
+    unit_cpus[unit_count] = usable;
+    unit_first_cpu[unit_count] = -1;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &usable))
+        {
+            cpu_units[cpu] = (short)unit_count;
+            if (unit_first_cpu[unit_count] == -1)
+                unit_first_cpu[unit_count] = (short)cpu;
+        }
+
+    unit_count++;
+}
+
+
+int affinity_init(int mode)
+{
+    placement = AFFINITY_NONE;
+    unit_count = 1;
+    memset(cpu_units, 0, sizeof(cpu_units));
+    free(unit_cpus);
+    unit_cpus = NULL;
+
+    if (mode == AFFINITY_NONE)
+        return 1;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        perror("error: sched_getaffinity\n");
+        return -1;
+    }
+
+    unit_cpus = malloc(CPU_SETSIZE * sizeof(cpu_set_t));
+    if (unit_cpus == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    unit_count = 0;
+    if (mode == AFFINITY_CORE)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            cpu_set_t single;
+            CPU_ZERO(&single);
+            CPU_SET(cpu, &single);
+            add_unit(&single);
+        }
+    }
+    else
+    {
+        // Without NUMA information the whole machine is one node
+        cpu_set_t nodes;
+        if (read_list(AFFINITY_NODES_PATH, &nodes) == -1)
+        {
+            CPU_ZERO(&nodes);
+            CPU_SET(0, &nodes);
+        }
+
+        for (int node = 0; node < CPU_SETSIZE; node++)
+        {
+            char path[128];
+            cpu_set_t cpus;
+            snprintf(path, sizeof(path), AFFINITY_NODE_CPUS_PATH, node);
+            if (CPU_ISSET(node, &nodes))
+                add_unit(read_list(path, &cpus) == 1 ? &cpus : &allowed);
+        }
+    }
+
+    if (unit_count == 0)
+    {
+        fprintf(stderr, "No allowed CPU found, threads are not pinned\n");
+        free(unit_cpus);
+        unit_cpus = NULL;
+        unit_count = 1;
+        return -1;
+    }
+
+    placement = mode;
+    return 1;
+}
+
+
+int affinity_units(void)
+{
+    return unit_count;
+}
+
+
+int affinity_pin(int group)
+{
+    if (placement == AFFINITY_NONE)
+        return 1;
+
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &unit_cpus[group % unit_count]);
+    if (error != 0)
+    {
+        fprintf(stderr, "Failed to pin a thread: %s\n", strerror(error));
+        return -1;
+    }
+
+    return 1;
+}
+
+
+void affinity_unpin(void)
+{
+    if (placement != AFFINITY_NONE)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &allowed);
+}
+
+
+int affinity_cpu(int group)
+{
+    if (placement != AFFINITY_CORE)
+        return -1;
+
+    return unit_first_cpu[group % unit_count];
+}
+
+
+int affinity_current_unit(void)
+{
+    if (placement == AFFINITY_NONE)
+        return 0;
+
+    int cpu = sched_getcpu(); // Read from the vDSO, no system call
+    return cpu >= 0 && cpu < CPU_SETSIZE ? cpu_units[cpu] : 0;
+}
@@ -0,0 +1,77 @@
+#ifndef PROXYSERVER_AFFINITY_H
+#define PROXYSERVER_AFFINITY_H
+
+/**
+ * affinity.h
+ *
+ * This file declares the placement of worker threads on the machine. The CPUs
+ * the process may run on are split into units, one per CPU or one per NUMA
+ * node, and every group of workers, an event loop or an acceptor with its
+ * pool threads, is pinned to one unit. With one SO_REUSEPORT listening socket
+ * per unit steered by SO_INCOMING_CPU, a connection is accepted, served and
+ * closed on the unit whose CPU received its packets. Shared structures that
+ * can be split, like the pool of origin connections, keep a shard per unit.
+ */
+
+
+/**
+ * The placements of the workers
+ */
+typedef enum {
+    AFFINITY_NONE,    // the scheduler moves threads freely, a single unit
+    AFFINITY_CORE,    // one unit per CPU
+    AFFINITY_NODE     // one unit per NUMA node
+} affinity_mode;
+
+
+/**
+ * Splits the CPUs the process is allowed on into units. Must be called before any other
+ * affinity function, and before the threads to be pinned are created.
+ *
+ * @param mode: An affinity_mode value.
+ * @return
+ *   - 1 on success.
+ *   - -1 if the allowed CPUs cannot be read. A message is printed and a single unit is used.
+ */
+int affinity_init(int mode);
+
+/**
+ * Returns the number of units.
+ *
+ * @return At least 1, and 1 without pinning.
+ */
+int affinity_units(void);
+
+/**
+ * Pins the calling thread to the unit of a worker group. Threads it creates afterwards
+ * inherit the placement. Nothing is done without pinning.
+ *
+ * @param group: The index of the group, units are handed out round-robin.
+ * @return
+ *   - 1 on success, or if nothing had to be done.
+ *   - -1 if the thread cannot be pinned. A message is printed and the thread stays as it was.
+ */
+int affinity_pin(int group);
+
+/**
+ * Lets the calling thread run on every allowed CPU again, after affinity_pin().
+ */
+void affinity_unpin(void);
+
+/**
+ * Returns the CPU the packets of a worker group's listening socket should arrive on.
+ *
+ * @param group: The index of the group.
+ * @return The CPU number, or -1 unless every unit is a single CPU.
+ */
+int affinity_cpu(int group);
+
+/**
+ * Returns the unit the calling thread runs on right now, to pick the shard of a shared
+ * structure.
+ *
+ * @return A unit index below affinity_units(), 0 without pinning.
+ */
+int affinity_current_unit(void);
+
+#endif //PROXYSERVER_AFFINITY_H
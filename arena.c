@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "arena.h"
+
+
+/**
+ * The released arenas of a thread
+ */
+typedef struct {
+    arena* first;       // the most recently released arena
+    int count;          // number of arenas in the list
+} arena_free_list;
+
+
+static pthread_key_t free_list_key;                       // the arena_free_list of each thread
+static pthread_once_t free_list_once = PTHREAD_ONCE_INIT;
+
+
+
+/**
+ * Allocates a block able to hold at least a given number of bytes.
+ *
+ * @param size: The number of bytes.
+ * @return
+ *   - The empty block.
+ *   - NULL if memory allocation fails.
+ */
+static arena_block* new_block(size_t size)
+{
+    size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+
+    arena_block* block = malloc(sizeof(arena_block) + capacity);
+    if (block == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+
+    block->next = NULL;
+    block->capacity = capacity;
+    block->used = 0;
+    return block;
+}
+
+/**
+ * Frees an arena and its blocks.
+ *
+ * @param a: The arena.
+ */
+static void destroy_arena(arena* a)
+{
+    arena_block* block = a->block;
+    while (block != NULL)
+    {
+        arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    free(a);
+}
+
+/**
+ * Frees the released arenas of an exiting thread.
+ *
+ * @param value: The arena_free_list of the thread.
+ */
+static void destroy_free_list(void* value)
+{
+    arena_free_list* list = (arena_free_list*)value;
+
+    while (list->first != NULL)
+    {
+        arena* next = list->first->next;
+        destroy_arena(list->first);
+        list->first = next;
+    }
+
+    free(list);
+}
+
+/**
+ * Creates the key holding the free list of each thread.
+ */
+static void create_free_list_key(void)
+{
+    if (pthread_key_create(&free_list_key, destroy_free_list) != 0)
+        fprintf(stderr, "Failed to create the arena free list key\n");
+}
+
+/**
+ * Returns the free list of the calling thread, creating it on first use.
+ *
+ * @return
+ *   - The free list.
+ *   - NULL if memory allocation fails.
+ */
+static arena_free_list* thread_free_list(void)
+{
+    pthread_once(&free_list_once, create_free_list_key);
+
+    arena_free_list* list = pthread_getspecific(free_list_key);
+    if (list == NULL)
+    {
+        list = calloc(1, sizeof(arena_free_list));
+        if (list == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            return NULL;
+        }
+        pthread_setspecific(free_list_key, list);
+    }
+
+    return list;
+}
+
+
+arena* arena_acquire(void)
+{
+    arena_free_list* list = thread_free_list();
+
+    // Reuse a released arena of this thread when there is one
+    if (list != NULL && list->first != NULL)
+    {
+        arena* a = list->first;
+        list->first = a->next;
+        list->count--;
+        a->next = NULL;
+        return a;
+    }
+
+    arena* a = malloc(sizeof(arena));
+    if (a == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+
+    a->next = NULL;
+    a->last = NULL;
+    a->block = new_block(ARENA_BLOCK_SIZE);
+    if (a->block == NULL)
+    {
+        free(a);
+        return NULL;
+    }
+
+    return a;
+}
+
+
+void arena_release(arena* a)
+{
+    if (a == NULL)
+        return;
+
+    // Keep the first block only, the ones added for a large request go back to the system
+    while (a->block->next != NULL)
+    {
+        arena_block* next = a->block->next;
+        free(a->block);
+        a->block = next;
+    }
+    a->block->used = 0;
+    a->last = NULL;
+
+    arena_free_list* list = thread_free_list();
+    if (list == NULL || list->count >= ARENA_MAX_FREE)
+    {
+        destroy_arena(a);
+        return;
+    }
+
+    a->next = list->first;
+    list->first = a;
+    list->count++;
+}
+
+
+void* arena_alloc(arena* a, size_t size)
+{
+    // Round up so that the next allocation stays aligned
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    if (a->block->capacity - a->block->used < size)
+    {
+        // Start a new block, whatever is left of the current one is not used again
+        arena_block* block = new_block(size);
+        if (block == NULL)
+            return NULL;
+        block->next = a->block;
+        a->block = block;
+    }
+
+    void* memory = a->block->data + a->block->used;
+    a->block->used += size;
+    a->last = memory;
+    return memory;
+}
+
+
+void* arena_grow(arena* a, void* memory, size_t old_size, size_t new_size)
+{
+    if (memory == NULL)
+        return arena_alloc(a, new_size);
+
+    // The latest allocation of the current block can take the bytes that follow it
+    if (memory == a->last)
+    {
+        size_t start = (unsigned char*)memory - a->block->data;
+        size_t size = (new_size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+        if (a->block->capacity - start >= size)
+        {
+            a->block->used = start + size;
+            return memory;
+        }
+    }
+
+    void* grown = arena_alloc(a, new_size);
+    if (grown != NULL)
+        memcpy(grown, memory, old_size);
+
+    return grown;
+}
+
+
+char* arena_strndup(arena* a, const char* str, size_t length)
+{
+    char* copy = arena_alloc(a, length + 1);
+    if (copy == NULL)
+        return NULL;
+
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
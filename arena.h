@@ -0,0 +1,101 @@
+#ifndef PROXYSERVER_ARENA_H
+#define PROXYSERVER_ARENA_H
+
+#include <stddef.h>
+
+/**
+ * arena.h
+ *
+ * This file declares the request arenas. Everything allocated while one
+ * request is served is carved out of an arena with a pointer bump and is
+ * freed all at once when the arena is released. Released arenas go to a
+ * free list of the releasing thread and are handed out again, so serving
+ * requests does not go through malloc once each thread has warmed up.
+ */
+
+// size of the block an arena starts with, larger allocations get a block of their own
+#define ARENA_BLOCK_SIZE 65536
+
+// maximum number of released arenas a thread keeps for reuse
+#define ARENA_MAX_FREE 64
+
+// alignment of every allocation
+#define ARENA_ALIGNMENT 16
+
+
+/**
+ * A block of memory allocations are carved from
+ */
+typedef struct arena_block_st {
+    struct arena_block_st* next;   // the previously filled block
+    size_t capacity;               // bytes in data
+    size_t used;                   // bytes of data handed out
+    _Alignas(ARENA_ALIGNMENT) unsigned char data[];
+} arena_block;
+
+
+/**
+ * An arena: its current block and the blocks filled before it
+ */
+typedef struct arena_st {
+    struct arena_st* next;         // next arena of a free list
+    arena_block* block;            // the block being carved, the first block is last in the chain
+    void* last;                    // the most recent allocation, which can grow in place
+} arena;
+
+
+/**
+ * Takes an empty arena from the free list of the calling thread, or allocates one.
+ *
+ * @return
+ *   - The arena.
+ *   - NULL if memory allocation fails.
+ */
+arena* arena_acquire(void);
+
+/**
+ * Frees everything allocated from an arena and puts it on the free list of the calling
+ * thread. The blocks added beyond its first one are returned to the system.
+ *
+ * @param a: The arena, may be NULL.
+ */
+void arena_release(arena* a);
+
+/**
+ * Allocates memory from an arena. It stays valid until the arena is released.
+ *
+ * @param a: The arena.
+ * @param size: The number of bytes.
+ * @return
+ *   - The memory, aligned to ARENA_ALIGNMENT.
+ *   - NULL if a new block is needed and cannot be allocated.
+ */
+void* arena_alloc(arena* a, size_t size);
+
+/**
+ * Resizes an allocation of an arena. The most recent allocation grows in place while its
+ * block has room, any other one is copied to a new allocation.
+ *
+ * @param a: The arena.
+ * @param memory: The allocation, or NULL for a new one.
+ * @param old_size: The size the allocation was made with.
+ * @param new_size: The size it needs.
+ * @return
+ *   - The resized allocation, holding the old bytes.
+ *   - NULL if memory allocation fails, the old allocation is left as it was.
+ */
+void* arena_grow(arena* a, void* memory, size_t old_size, size_t new_size);
+
+/**
+ * Copies a string into an arena.
+ *
+ * @param a: The arena.
+ * @param str: The string, not necessarily null-terminated.
+ * @param length: The number of bytes to copy.
+ * @return
+ *   - The null-terminated copy.
+ *   - NULL if memory allocation fails.
+ */
+char* arena_strndup(arena* a, const char* str, size_t length);
+
+#endif //PROXYSERVER_ARENA_H
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""
+compare.py
+
+Compares two result files written by run.sh. Results are matched by their
+benchmark and parameters, and every headline metric is printed with its
+change from the baseline. Changes beyond the threshold are flagged, so a
+regression shows up at a glance.
+
+Usage: bench/compare.py <baseline.jsonl> <candidate.jsonl> [--threshold=percent]
+"""
+
+import json
+import sys
+
+# metric -> 1 if higher is better, -1 if lower is better
+METRICS = {
+    "ns_per_op": -1,
+    "rps": 1,
+    "p50_us": -1,
+    "p99_us": -1,
+    "p999_us": -1,
+    "gbps": 1,
+    "proxy_cores_per_gbps": -1,
+}
+
+# fields naming a result, the rest are measurements
+KEYS = ("suite", "bench", "case", "rules", "bytes", "threads", "engine", "pool", "concurrency", "size")
+
+
+def load(path):
+    """Reads a result file into a dict from result key to result, the last result of a key wins."""
+    results = {}
+    with open(path) as file:
+        for line in file:
+            line = line.strip()
+            if not line.startswith("{"):
+                continue
+            result = json.loads(line)
+            key = tuple((name, result[name]) for name in KEYS if name in result)
+            results[key] = result
+    return results
+
+
+def main(argv):
+    threshold = 5.0
+    paths = []
+    for argument in argv[1:]:
+        if argument.startswith("--threshold="):
+            threshold = float(argument[len("--threshold="):])
+        else:
+            paths.append(argument)
+    if len(paths) != 2:
+        print(__doc__.strip().splitlines()[-1], file=sys.stderr)
+        return 1
+
+    baseline, candidate = load(paths[0]), load(paths[1])
+    regressions = 0
+    for key in sorted(baseline.keys() & candidate.keys(), key=str):
+        name = " ".join(str(value) for field, value in key if field not in ("suite", "engine", "pool"))
+        for metric, direction in METRICS.items():
+            before, after = baseline[key].get(metric), candidate[key].get(metric)
+            if before is None or after is None or before == 0:
+                continue
+            change = (after - before) / before * 100
+            flag = ""
+            if change * direction < -threshold:
+                flag = "  REGRESSION"
+                regressions += 1
+            elif change * direction > threshold:
+                flag = "  improved"
+            print(f"{name:48} {metric:22} {before:14.2f} -> {after:14.2f} {change:+7.1f}%{flag}")
+
+    for key in sorted(baseline.keys() ^ candidate.keys(), key=str):
+        where = paths[0] if key in baseline else paths[1]
+        print(f"only in {where}: " + " ".join(f"{field}={value}" for field, value in key))
+
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,583 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+/**
+ * loadgen.c
+ *
+ * Closed-loop load generator for the end-to-end benchmarks. A fixed number
+ * of keep-alive connections send GET requests for objects of one size
+ * through the proxy, each sending its next request as soon as the previous
+ * response is complete. The run prints one JSON object: requests per second,
+ * latency percentiles, throughput, and the CPU the proxy used per Gbps when
+ * its pid is given.
+ *
+ * Usage: loadgen --proxy=<ip:port> --origin=<host:port> [--concurrency=<n>] [--size=<bytes>]
+ *                [--duration=<seconds>] [--threads=<n>] [--proxy-pid=<pid>]
+ */
+
+// bytes read from a socket at a time
+#define LOADGEN_READ_SIZE 65536
+
+// largest response header block accepted
+#define LOADGEN_MAX_HEAD 16384
+
+
+/**
+ * The states of a client connection
+ */
+typedef enum {
+    CLIENT_CONNECTING,   // waiting for the connection to the proxy
+    CLIENT_SENDING,      // writing the request
+    CLIENT_HEAD,         // reading the response header block
+    CLIENT_BODY,         // reading the response body
+    CLIENT_IDLE          // done, the run is over
+} client_state;
+
+
+/**
+ * One client connection
+ */
+typedef struct {
+    int fd;                            // the socket, -1 if closed
+    client_state state;                // current state
+    size_t request_sent;               // bytes of the request written
+    char head[LOADGEN_MAX_HEAD];       // the response header block read so far
+    size_t head_length;                // bytes in head
+    unsigned long long body_left;      // body bytes still to read
+    int keep_alive;                    // 1 if the connection carries the next request
+    int ok;                            // 1 if the response status is 200
+    unsigned long long started;        // monotonic microsecond the request was started
+} client;
+
+
+/**
+ * A load generating thread and its share of the connections
+ */
+typedef struct {
+    pthread_t thread;                  // the thread
+    client* clients;                   // its connections
+    int client_count;                  // number of connections
+    unsigned long long* latencies;     // microseconds of every successful request
+    size_t latency_count;              // number of latencies
+    size_t latency_capacity;           // size of latencies
+    unsigned long long errors;         // failed requests
+    unsigned long long bytes;          // body bytes received
+} worker;
+
+
+static struct sockaddr_in proxy_address;   // where the requests go
+static char request[1024];                 // the request every connection sends
+static size_t request_length = 0;          // bytes of request
+static unsigned long long run_until = 0;   // monotonic microsecond the run ends
+
+
+
+/**
+ * Returns the monotonic time latencies are measured with.
+ *
+ * @return The monotonic time in microseconds.
+ */
+static unsigned long long clock_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Reads the CPU time a process has used so far.
+ *
+ * @param pid: The process.
+ * @return The CPU seconds, user and system together, or -1 if they cannot be read.
+ */
+static double process_cpu_seconds(int pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    char line[1024];
+    char* read = fgets(line, sizeof(line), file);
+    fclose(file);
+    if (read == NULL)
+        return -1;
+
+    // The command name may hold spaces, the fields are counted from its closing parenthesis
+    char* fields = strrchr(line, ')');
+    unsigned long utime, stime;
+    if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * Records the latency of a successful request.
+ *
+ * @param self: The worker.
+ * @param latency: The latency in microseconds.
+ */
+static void record(worker* self, unsigned long long latency)
+{
+    if (self->latency_count == self->latency_capacity)
+    {
+        size_t capacity = self->latency_capacity == 0 ? 65536 : self->latency_capacity * 2;
+        unsigned long long* latencies = realloc(self->latencies, capacity * sizeof(unsigned long long));
+        if (latencies == NULL)
+            return; // Out of memory, the sample is dropped
+        self->latencies = latencies;
+        self->latency_capacity = capacity;
+    }
+
+    self->latencies[self->latency_count++] = latency;
+}
+
+/**
+ * Closes the socket of a connection.
+ *
+ * @param epoll_fd: The epoll instance of the worker.
+ * @param c: The connection.
+ */
+static void close_client(int epoll_fd, client* c)
+{
+    if (c->fd == -1)
+        return;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/**
+ * Starts the next request of a connection, connecting first if it has no open socket.
+ *
+ * @param epoll_fd: The epoll instance of the worker.
+ * @param c: The connection.
+ * @return
+ *   - 1 on success.
+ *   - -1 if no connection can be opened.
+ */
+static int start_request(int epoll_fd, client* c)
+{
+    c->started = clock_us();
+    c->request_sent = 0;
+    c->head_length = 0;
+    c->state = CLIENT_SENDING;
+
+    if (c->fd != -1)
+    {
+        struct epoll_event event = {.events = EPOLLOUT, .data.ptr = c};
+        return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &event) == 0 ? 1 : -1;
+    }
+
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd == -1)
+        return -1;
+
+    int on = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    if (connect(c->fd, (struct sockaddr*)&proxy_address, sizeof(proxy_address)) == -1 && errno != EINPROGRESS)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    c->state = CLIENT_CONNECTING;
+
+    struct epoll_event event = {.events = EPOLLOUT, .data.ptr = c};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &event) == -1)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    return 1;
+}
+
+/**
+ * Reads the status, Content-Length and Connection header of a complete response head.
+ *
+ * @param c: The connection, with the head in c->head.
+ * @return
+ *   - 1 on success.
+ *   - -1 if the head has no Content-Length, which the benchmark does not handle.
+ */
+static int parse_head(client* c)
+{
+    c->head[c->head_length] = '\0';
+    c->ok = strncmp(c->head, "HTTP/1.1 200", 12) == 0 || strncmp(c->head, "HTTP/1.0 200", 12) == 0;
+    c->keep_alive = strcasestr(c->head, "\r\nConnection: close") == NULL;
+
+    const char* length = strcasestr(c->head, "\r\nContent-Length:");
+    if (length == NULL)
+        return -1;
+    c->body_left = strtoull(length + 17, NULL, 10);
+    return 1;
+}
+
+/**
+ * Ends the current request of a connection and starts the next one while the run lasts.
+ *
+ * @param self: The worker.
+ * @param epoll_fd: The epoll instance of the worker.
+ * @param c: The connection.
+ * @param failed: 1 if the request failed, its connection is closed.
+ */
+static void finish_request(worker* self, int epoll_fd, client* c, int failed)
+{
+    if (failed || !c->ok)
+        self->errors++;
+    else
+        record(self, clock_us() - c->started);
+
+    if (failed || !c->keep_alive)
+        close_client(epoll_fd, c);
+
+    if (clock_us() >= run_until)
+        c->state = CLIENT_IDLE;
+    else if (start_request(epoll_fd, c) == -1)
+    {
+        self->errors++;
+        c->state = CLIENT_IDLE; // The connection is lost for the rest of the run
+    }
+}
+
+/**
+ * Moves a connection forward as far as its socket allows.
+ *
+ * @param self: The worker.
+ * @param epoll_fd: The epoll instance of the worker.
+ * @param c: The connection.
+ * @param buffer: A scratch buffer of LOADGEN_READ_SIZE bytes.
+ */
+static void handle_client(worker* self, int epoll_fd, client* c, char* buffer)
+{
+    if (c->state == CLIENT_CONNECTING)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0)
+        {
+            finish_request(self, epoll_fd, c, 1);
+            return;
+        }
+        c->state = CLIENT_SENDING;
+    }
+
+    if (c->state == CLIENT_SENDING)
+    {
+        while (c->request_sent < request_length)
+        {
+            ssize_t written = write(c->fd, request + c->request_sent, request_length - c->request_sent);
+            if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (written <= 0)
+            {
+                finish_request(self, epoll_fd, c, 1);
+                return;
+            }
+            c->request_sent += written;
+        }
+
+        c->state = CLIENT_HEAD;
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = c};
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+    }
+
+    while (1)
+    {
+        ssize_t received = read(c->fd, buffer, LOADGEN_READ_SIZE);
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (received <= 0)
+        {
+            finish_request(self, epoll_fd, c, 1);
+            return;
+        }
+
+        size_t offset = 0;
+        if (c->state == CLIENT_HEAD)
+        {
+            // Take bytes up to the end of the head, the rest is body
+            size_t room = LOADGEN_MAX_HEAD - 1 - c->head_length;
+            size_t take = (size_t)received < room ? (size_t)received : room;
+            memcpy(c->head + c->head_length, buffer, take);
+            size_t before = c->head_length;
+            c->head_length += take;
+            c->head[c->head_length] = '\0';
+
+            char* end = strstr(c->head, "\r\n\r\n");
+            if (end == NULL)
+            {
+                if (c->head_length == LOADGEN_MAX_HEAD - 1)
+                    finish_request(self, epoll_fd, c, 1);
+                continue;
+            }
+
+            size_t head_end = end + 4 - c->head;
+            c->head_length = head_end;
+            offset = head_end - before;
+            if (parse_head(c) == -1)
+            {
+                finish_request(self, epoll_fd, c, 1);
+                return;
+            }
+            c->state = CLIENT_BODY;
+        }
+
+        unsigned long long body = received - offset;
+        if (body > c->body_left)
+            body = c->body_left; // Nothing is pipelined, extra bytes would be an origin error
+        c->body_left -= body;
+        self->bytes += body;
+
+        if (c->body_left == 0)
+        {
+            finish_request(self, epoll_fd, c, 0);
+            return;
+        }
+    }
+}
+
+/**
+ * The body of a load generating thread: keeps its connections busy until the run ends and
+ * their last responses are in.
+ *
+ * @param arg: The worker.
+ * @return NULL.
+ */
+static void* worker_function(void* arg)
+{
+    worker* self = (worker*)arg;
+    char* buffer = malloc(LOADGEN_READ_SIZE);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (buffer == NULL || epoll_fd == -1)
+    {
+        fprintf(stderr, "Failed to set up a worker\n");
+        free(buffer);
+        return NULL;
+    }
+
+    for (int i = 0; i < self->client_count; i++)
+    {
+        self->clients[i].fd = -1;
+        if (start_request(epoll_fd, &self->clients[i]) == -1)
+        {
+            self->errors++;
+            self->clients[i].state = CLIENT_IDLE;
+        }
+    }
+
+    struct epoll_event events[256];
+    while (1)
+    {
+        // Requests in flight when the run ends are allowed a second to complete
+        unsigned long long now = clock_us();
+        int busy = 0;
+        for (int i = 0; i < self->client_count && !busy; i++)
+            busy = self->clients[i].state != CLIENT_IDLE;
+        if (now >= run_until && (!busy || now >= run_until + 1000000))
+            break;
+
+        int ready = epoll_wait(epoll_fd, events, 256, 10);
+        for (int i = 0; i < ready; i++)
+            handle_client(self, epoll_fd, events[i].data.ptr, buffer);
+    }
+
+    for (int i = 0; i < self->client_count; i++)
+        close_client(epoll_fd, &self->clients[i]);
+    close(epoll_fd);
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Compares two latencies for qsort().
+ */
+static int compare_latencies(const void* a, const void* b)
+{
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Returns a percentile of sorted latencies.
+ *
+ * @param sorted: The latencies, in ascending order.
+ * @param count: The number of latencies, at least 1.
+ * @param fraction: The percentile, between 0 and 1.
+ * @return The latency in microseconds.
+ */
+static unsigned long long percentile(const unsigned long long* sorted, size_t count, double fraction)
+{
+    return sorted[(size_t)(fraction * (count - 1) + 0.5)];
+}
+
+
+int main(int argc, char* argv[])
+{
+    const char* proxy = NULL;
+    const char* origin = NULL;
+    int concurrency = 16;
+    unsigned long long size = 1024;
+    int duration = 10;
+    int threads = 1;
+    int proxy_pid = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--proxy=", 8) == 0)
+            proxy = argv[i] + 8;
+        else if (strncmp(argv[i], "--origin=", 9) == 0)
+            origin = argv[i] + 9;
+        else if (strncmp(argv[i], "--concurrency=", 14) == 0)
+            concurrency = atoi(argv[i] + 14);
+        else if (strncmp(argv[i], "--size=", 7) == 0)
+            size = strtoull(argv[i] + 7, NULL, 10);
+        else if (strncmp(argv[i], "--duration=", 11) == 0)
+            duration = atoi(argv[i] + 11);
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+            threads = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--proxy-pid=", 12) == 0)
+            proxy_pid = atoi(argv[i] + 12);
+        else
+            proxy = NULL, i = argc; // Unknown option, print the usage
+    }
+
+    // The proxy is given as a numeric IPv4 address
+    char proxy_host[64];
+    const char* colon = proxy == NULL ? NULL : strrchr(proxy, ':');
+    if (proxy == NULL || origin == NULL || colon == NULL || colon - proxy >= (long)sizeof(proxy_host) ||
+        concurrency < 1 || duration < 1 || threads < 1 || threads > concurrency)
+    {
+        fprintf(stderr, "Usage: loadgen --proxy=<ip:port> --origin=<host:port> [--concurrency=<n>] [--size=<bytes>]\n"
+                        "               [--duration=<seconds>] [--threads=<n>] [--proxy-pid=<pid>]\n");
+        return EXIT_FAILURE;
+    }
+    memcpy(proxy_host, proxy, colon - proxy);
+    proxy_host[colon - proxy] = '\0';
+    proxy_address.sin_family = AF_INET;
+    proxy_address.sin_port = htons((in_port_t)atoi(colon + 1));
+    if (inet_pton(AF_INET, proxy_host, &proxy_address.sin_addr) != 1)
+    {
+        fprintf(stderr, "Invalid proxy address %s\n", proxy);
+        return EXIT_FAILURE;
+    }
+
+    request_length = snprintf(request, sizeof(request),
+                              "GET http://%s/%llu HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n",
+                              origin, size, origin);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Every connection uses a descriptor
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)concurrency + 64)
+    {
+        limit.rlim_cur = limit.rlim_max < (rlim_t)concurrency + 64 ? limit.rlim_max : (rlim_t)concurrency + 64;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    worker* workers = calloc(threads, sizeof(worker));
+    client* clients = calloc(concurrency, sizeof(client));
+    if (workers == NULL || clients == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return EXIT_FAILURE;
+    }
+
+    double proxy_cpu = proxy_pid > 0 ? process_cpu_seconds(proxy_pid) : -1;
+    struct rusage usage_before;
+    getrusage(RUSAGE_SELF, &usage_before);
+    unsigned long long started = clock_us();
+    run_until = started + (unsigned long long)duration * 1000000;
+
+    // Spread the connections over the threads
+    int assigned = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].clients = clients + assigned;
+        workers[i].client_count = concurrency / threads + (i < concurrency % threads);
+        assigned += workers[i].client_count;
+        if (pthread_create(&workers[i].thread, NULL, worker_function, &workers[i]) != 0)
+        {
+            fprintf(stderr, "Failed to create a worker thread\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    double elapsed = (clock_us() - started) / 1e6;
+    struct rusage usage_after;
+    getrusage(RUSAGE_SELF, &usage_after);
+    double client_cpu = (usage_after.ru_utime.tv_sec - usage_before.ru_utime.tv_sec) +
+                        (usage_after.ru_utime.tv_usec - usage_before.ru_utime.tv_usec) / 1e6 +
+                        (usage_after.ru_stime.tv_sec - usage_before.ru_stime.tv_sec) +
+                        (usage_after.ru_stime.tv_usec - usage_before.ru_stime.tv_usec) / 1e6;
+    if (proxy_cpu >= 0)
+    {
+        double after = process_cpu_seconds(proxy_pid);
+        proxy_cpu = after >= 0 ? after - proxy_cpu : -1;
+    }
+
+    // Merge the latencies of every thread
+    size_t count = 0;
+    unsigned long long errors = 0, bytes = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        count += workers[i].latency_count;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+    }
+    unsigned long long* latencies = malloc((count > 0 ? count : 1) * sizeof(unsigned long long));
+    if (latencies == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return EXIT_FAILURE;
+    }
+    size_t merged = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        memcpy(latencies + merged, workers[i].latencies, workers[i].latency_count * sizeof(unsigned long long));
+        merged += workers[i].latency_count;
+        free(workers[i].latencies);
+    }
+    qsort(latencies, count, sizeof(unsigned long long), compare_latencies);
+
+    double gbps = bytes * 8 / elapsed / 1e9;
+    printf("{\"suite\":\"e2e\",\"concurrency\":%d,\"size\":%llu,\"threads\":%d,\"duration_s\":%.3f,"
+           "\"requests\":%zu,\"errors\":%llu,\"rps\":%.1f,\"p50_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,"
+           "\"max_us\":%llu,\"gbps\":%.4f,\"client_cpu_cores\":%.3f",
+           concurrency, size, threads, elapsed, count, errors, count / elapsed,
+           count > 0 ? percentile(latencies, count, 0.50) : 0, count > 0 ? percentile(latencies, count, 0.99) : 0,
+           count > 0 ? percentile(latencies, count, 0.999) : 0, count > 0 ? latencies[count - 1] : 0,
+           gbps, client_cpu / elapsed);
+    if (proxy_cpu >= 0)
+        printf(",\"proxy_cpu_cores\":%.3f,\"proxy_cores_per_gbps\":%.3f",
+               proxy_cpu / elapsed, gbps > 0 ? proxy_cpu / elapsed / gbps : 0);
+    printf("}\n");
+
+    free(latencies);
+    free(clients);
+    free(workers);
+    return count > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+#include "../proxyServer.h"
+
+/**
+ * microbench.c
+ *
+ * Microbenchmarks of the hot paths of the proxy: matching a host against
+ * filters of growing size with is_filtered_host(), parsing request heads
+ * with http_request_parse() and read_from_client_socket(), and the queue of
+ * the thread pool through dispatch() and do_work(). Every result is printed
+ * as one JSON object per line; results that are wrong are reported on stderr.
+ *
+ * Usage: microbench [filter|parse|queue|all] [--iterations=<n>] [--threads=<n>]
+ */
+
+// number of distinct keys cycled through by the lookup benchmarks, so the branch predictor cannot learn one
+#define BENCH_KEYS 4096
+
+// a request head the way a browser sends it
+static const char* const sample_request =
+    "GET http://www.example.com/images/logo.png?size=large HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: image/avif,image/webp,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Cookie: session=4f6c8a1e2b3d; theme=dark; consent=1\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: no-cache\r\n"
+    "\r\n";
+
+static unsigned long iterations = 1000000; // operations timed per benchmark
+static int threads = 0;                    // pool threads of the queue benchmark, 0 runs 1, 2 and 4
+
+
+
+/**
+ * Returns the monotonic time the benchmarks are measured with.
+ *
+ * @return The monotonic time in nanoseconds.
+ */
+static unsigned long long clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Prints the result of a timed benchmark.
+ *
+ * @param bench: The benchmark.
+ * @param test_case: The case of the benchmark.
+ * @param parameter: The name of the parameter the case was run with.
+ * @param value: The value of the parameter.
+ * @param operations: The number of operations timed.
+ * @param elapsed: Nanoseconds they took.
+ */
+static void report(const char* bench, const char* test_case, const char* parameter, long value,
+                   unsigned long operations, unsigned long long elapsed)
+{
+    printf("{\"suite\":\"micro\",\"bench\":\"%s\",\"case\":\"%s\",\"%s\":%ld,\"iterations\":%lu,"
+           "\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f}\n",
+           bench, test_case, parameter, value, operations,
+           (double)elapsed / operations, operations / ((double)elapsed / 1e9));
+    fflush(stdout);
+}
+
+/**
+ * Builds the text of a filter file: half hostnames, half single IPv4 addresses of 10.0.0.0/8,
+ * and a few networks and wildcard domains.
+ *
+ * @param rules: The number of rules.
+ * @return The text, freed by the caller, or NULL if memory allocation fails.
+ */
+static char* build_filter(size_t rules)
+{
+    char* text = malloc(rules * 32 + 1);
+    if (text == NULL)
+        return NULL;
+
+    size_t length = 0;
+    for (size_t i = 0; i < rules; i++)
+    {
+        size_t n = i / 2;
+        if (i % 64 == 63)
+            length += sprintf(text + length, "172.%zu.%zu.0/24\n", 16 + n % 16, n / 16 % 256);
+        else if (i % 64 == 62)
+            length += sprintf(text + length, "*.zone%zu.bench.test\n", n);
+        else if (i % 2 == 0)
+            length += sprintf(text + length, "host%zu.bench.test\n", n);
+        else
+            length += sprintf(text + length, "10.%zu.%zu.%zu\n", n >> 16 & 255, n >> 8 & 255, n & 255);
+    }
+    text[length] = '\0';
+
+    return text;
+}
+
+/**
+ * Times is_filtered_host() over keys cycled through in order.
+ *
+ * @param filter: The compiled filter.
+ * @param rules: The number of rules of the filter.
+ * @param test_case: The name of the case.
+ * @param keys: BENCH_KEYS host strings.
+ */
+static void time_lookups(const filter_set* filter, size_t rules, const char* test_case, char keys[][64])
+{
+    resolver_answer answer;
+    int matched = 0;
+
+    unsigned long long started = clock_ns();
+    for (unsigned long i = 0; i < iterations; i++)
+        matched += is_filtered_host(filter, keys[i % BENCH_KEYS], &answer) == 1;
+    unsigned long long elapsed = clock_ns() - started;
+
+    if (matched != 0 && matched != (int)iterations)
+        fprintf(stderr, "%s: %d of %lu lookups matched\n", test_case, matched, iterations);
+
+    report("filter", test_case, "rules", (long)rules, iterations, elapsed);
+}
+
+/**
+ * Times filter_match_ip_batch() over BENCH_KEYS addresses at a time.
+ *
+ * @param filter: The compiled filter.
+ * @param rules: The number of rules of the filter.
+ * @param addresses: BENCH_KEYS IPv4 addresses in host byte order.
+ */
+static void time_batch(const filter_set* filter, size_t rules, const uint32_t* addresses)
+{
+    static uint64_t bitmap[BENCH_KEYS / 64];
+    unsigned long batches = (iterations + BENCH_KEYS - 1) / BENCH_KEYS;
+    int matched = 0;
+
+    unsigned long long started = clock_ns();
+    for (unsigned long i = 0; i < batches; i++)
+    {
+        filter_match_ip_batch(filter, addresses, BENCH_KEYS, bitmap);
+        matched += bitmap[i % (BENCH_KEYS / 64)] != 0;
+    }
+    unsigned long long elapsed = clock_ns() - started;
+
+    if (matched == 0)
+        fprintf(stderr, "ip_batch: no address matched\n");
+
+    report("filter", "ip_batch", "rules", (long)rules, batches * BENCH_KEYS, elapsed);
+}
+
+/**
+ * Checks is_filtered_address() on answers without IPv4 addresses, which the batch of IPv4
+ * addresses has nothing to match in.
+ *
+ * @param filter: The compiled filter, holding no IPv6 rules.
+ */
+static void check_ipv6_answers(const filter_set* filter)
+{
+    resolver_answer answer = {.count = 0};
+    for (int i = 0; i < RESOLVER_MAX_ADDRESSES; i++)
+    {
+        answer.list[i].family = AF_INET6;
+        inet_pton(AF_INET6, "2001:db8::1", answer.list[i].bytes);
+        answer.list[i].bytes[15] = (uint8_t)i;
+
+        answer.count = i + 1;
+        if (is_filtered_address(filter, &answer) != 0)
+            fprintf(stderr, "ipv6_only: an answer of %d IPv6 addresses was filtered\n", answer.count);
+    }
+}
+
+/**
+ * Benchmarks the filter with a given number of rules: compiling it, and matching listed
+ * hostnames, subdomains of wildcard rules, IP literals inside the listed networks, batches
+ * of addresses and IP literals outside of them.
+ *
+ * @param rules: The number of rules.
+ */
+static void bench_filter_size(size_t rules)
+{
+    static char keys[BENCH_KEYS][64];
+
+    char* text = build_filter(rules);
+    if (text == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return;
+    }
+
+    unsigned long long started = clock_ns();
+    filter_set* filter = filter_compile(text);
+    unsigned long long elapsed = clock_ns() - started;
+    free(text);
+    if (filter == NULL)
+        return;
+    report("filter_compile", "compile", "rules", (long)rules, 1, elapsed);
+
+    // Keys are spread over the rules, hostnames sit at the even rules and addresses at the odd ones
+    size_t pairs = rules / 2 > 0 ? rules / 2 : 1;
+    for (size_t i = 0; i < BENCH_KEYS; i++)
+    {
+        size_t n = (i * 2654435761u) % pairs;
+        if (n % 32 == 31)
+            n--; // Every 64th rule is a wildcard domain instead of a hostname
+        snprintf(keys[i], sizeof(keys[i]), "host%zu.bench.test", n);
+    }
+    time_lookups(filter, rules, "host_hit", keys);
+
+    // Subdomains a few labels below the wildcard rules, which only exist from 64 rules on
+    if (rules >= 64)
+    {
+        for (size_t i = 0; i < BENCH_KEYS; i++)
+            snprintf(keys[i], sizeof(keys[i]), "www.api.zone%zu.bench.test",
+                     ((i * 2654435761u) % (rules / 64)) * 32 + 31);
+        time_lookups(filter, rules, "suffix_hit", keys);
+    }
+
+    for (size_t i = 0; i < BENCH_KEYS; i++)
+    {
+        size_t n = (i * 2654435761u) % pairs;
+        if (n % 32 == 31)
+            n--; // Every 64th rule is a network instead of an address
+        snprintf(keys[i], sizeof(keys[i]), "10.%zu.%zu.%zu:8080", n >> 16 & 255, n >> 8 & 255, n & 255);
+    }
+    time_lookups(filter, rules, "ip_hit", keys);
+
+    // Listed and unlisted addresses matched together, as they are already resolved
+    static uint32_t addresses[BENCH_KEYS];
+    for (size_t i = 0; i < BENCH_KEYS; i++)
+    {
+        size_t n = (i * 2654435761u) % pairs;
+        addresses[i] = i % 2 == 0 ? (10u << 24 | (uint32_t)(n & 0xFFFFFF)) : (192u << 24 | 168u << 16 | (uint32_t)i);
+    }
+    time_batch(filter, rules, addresses);
+
+    for (size_t i = 0; i < BENCH_KEYS; i++)
+        snprintf(keys[i], sizeof(keys[i]), "192.168.%zu.%zu", i >> 8 & 255, i & 255);
+    time_lookups(filter, rules, "ip_miss", keys);
+
+    check_ipv6_answers(filter);
+    filter_release(filter);
+}
+
+/**
+ * Benchmarks is_filtered_host() at 10, 10k and 1M rules.
+ */
+static void bench_filter(void)
+{
+    size_t sizes[] = {10, 10000, 1000000};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        bench_filter_size(sizes[i]);
+}
+
+/**
+ * Benchmarks parsing a request head from a buffer, and reading and parsing it from a socket
+ * the way a pool thread does.
+ */
+static void bench_parse(void)
+{
+    size_t length = strlen(sample_request);
+    http_request request;
+    int complete = 0;
+
+    unsigned long long started = clock_ns();
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+        http_request_init(&request);
+        complete += http_request_parse(&request, sample_request, length);
+    }
+    unsigned long long elapsed = clock_ns() - started;
+    if (complete != (int)iterations)
+        fprintf(stderr, "parse: %d of %lu requests complete\n", complete, iterations);
+    report("parse", "http_request_parse", "bytes", (long)length, iterations, elapsed);
+
+    // The client end writes the head, the proxy end reads it with read_from_client_socket()
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) == -1)
+    {
+        perror("error: socketpair\n");
+        return;
+    }
+
+    communication_info* ci = malloc(sizeof(communication_info));
+    if (ci == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        close(sockets[0]);
+        close(sockets[1]);
+        return;
+    }
+    init_communication_info(ci);
+    ci->client_socket = sockets[0];
+
+    unsigned long done = 0;
+    started = clock_ns();
+    for (; done < iterations; done++)
+    {
+        if (write(sockets[1], sample_request, length) != (ssize_t)length)
+        {
+            perror("error: write\n");
+            break;
+        }
+        if (read_from_client_socket(ci) == NULL)
+            break;
+        reset_request_info(ci);
+    }
+    elapsed = clock_ns() - started;
+    if (done > 0)
+        report("parse", "read_from_client_socket", "bytes", (long)length, done, elapsed);
+
+    destroy_communication_info(ci); // Closes the proxy end
+    close(sockets[1]);
+}
+
+/**
+ * A job doing nothing, so the queue itself is measured.
+ *
+ * @param arg: Unused.
+ * @return 0.
+ */
+static int empty_job(void* arg)
+{
+    (void)arg;
+    return 0;
+}
+
+/**
+ * Benchmarks dispatching jobs to a pool and running them, until every job ran.
+ *
+ * @param pool_threads: The number of pool threads.
+ */
+static void bench_queue_threads(int pool_threads)
+{
+    threadpool* pool = create_threadpool(pool_threads);
+    if (pool == NULL)
+        return;
+
+    unsigned long long started = clock_ns();
+    for (unsigned long i = 0; i < iterations; i++)
+        dispatch(pool, empty_job, NULL);
+    destroy_threadpool(pool); // Returns once the queue is drained
+    unsigned long long elapsed = clock_ns() - started;
+
+    report("queue", "dispatch_do_work", "threads", pool_threads, iterations, elapsed);
+}
+
+/**
+ * Benchmarks the queue of the thread pool with the configured number of threads.
+ */
+static void bench_queue(void)
+{
+    if (threads > 0)
+    {
+        bench_queue_threads(threads);
+        return;
+    }
+
+    for (int n = 1; n <= 4; n *= 2)
+        bench_queue_threads(n);
+}
+
+
+int main(int argc, char* argv[])
+{
+    const char* which = "all";
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--iterations=", 13) == 0)
+            iterations = strtoul(argv[i] + 13, NULL, 10);
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+            threads = atoi(argv[i] + 10);
+        else if (argv[i][0] != '-')
+            which = argv[i];
+        else
+        {
+            fprintf(stderr, "Usage: microbench [filter|parse|queue|all] [--iterations=<n>] [--threads=<n>]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (iterations == 0 || threads < 0 || threads > MAXT_IN_POOL)
+    {
+        fprintf(stderr, "Invalid --iterations or --threads\n");
+        return EXIT_FAILURE;
+    }
+
+    // Numeric hosts never reach the DNS, but the resolver cache is what is_filtered_host() uses
+    if (resolver_init() == -1)
+        return EXIT_FAILURE;
+
+    int all = strcmp(which, "all") == 0;
+    if (all || strcmp(which, "filter") == 0)
+        bench_filter();
+    if (all || strcmp(which, "parse") == 0)
+        bench_parse();
+    if (all || strcmp(which, "queue") == 0)
+        bench_queue();
+
+    resolver_shutdown();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/**
+ * origin_stub.c
+ *
+ * A minimal origin for the end-to-end benchmarks. Every request is answered
+ * with a body of as many bytes as the last segment of its path says, e.g.
+ * "/65536", with a Content-Length and keep-alive, so the time measured is the
+ * proxy's and not the origin's. Each connection is served by a thread of its own.
+ *
+ * Usage: origin_stub <port>
+ */
+
+// largest body served, larger requests are capped
+#define STUB_MAX_BODY (64 * 1024 * 1024)
+
+// size of the buffer the body is written from
+#define STUB_CHUNK (256 * 1024)
+
+// largest request header block accepted
+#define STUB_MAX_REQUEST 16384
+
+static char body[STUB_CHUNK]; // the bytes every body is made of
+
+
+
+/**
+ * Writes a whole buffer to a socket.
+ *
+ * @param sd: The socket.
+ * @param data: The bytes.
+ * @param length: The number of bytes.
+ * @return
+ *   - 1 if everything was written.
+ *   - -1 otherwise.
+ */
+static int write_all(int sd, const char* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(sd, data, length);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        data += written;
+        length -= written;
+    }
+
+    return 1;
+}
+
+/**
+ * Finds the body size a request asks for: the number ending its request target.
+ *
+ * @param request: The request head, null-terminated.
+ * @return The number of body bytes to send.
+ */
+static size_t requested_size(const char* request)
+{
+    const char* target = strchr(request, ' ');
+    if (target == NULL)
+        return 0;
+    const char* end = strchr(target + 1, ' ');
+    if (end == NULL)
+        return 0;
+
+    // Walk back over the digits of the last path segment
+    const char* digits = end;
+    while (digits > target + 1 && digits[-1] >= '0' && digits[-1] <= '9')
+        digits--;
+
+    size_t size = strtoul(digits, NULL, 10);
+    return size > STUB_MAX_BODY ? STUB_MAX_BODY : size;
+}
+
+/**
+ * Serves the requests of one connection until the client closes it.
+ *
+ * @param arg: The socket, as an intptr_t.
+ * @return NULL.
+ */
+static void* serve_connection(void* arg)
+{
+    int sd = (int)(intptr_t)arg;
+    char request[STUB_MAX_REQUEST + 1];
+    size_t length = 0;
+
+    while (1)
+    {
+        // Requests past the current one may already be buffered
+        char* end = memmem(request, length, "\r\n\r\n", 4);
+        if (end == NULL)
+        {
+            if (length == STUB_MAX_REQUEST)
+                break; // Too large, drop the connection
+            ssize_t received = read(sd, request + length, STUB_MAX_REQUEST - length);
+            if (received < 0 && errno == EINTR)
+                continue;
+            if (received <= 0)
+                break;
+            length += received;
+            continue;
+        }
+
+        size_t head_length = end + 4 - request;
+        char saved = request[head_length];
+        request[head_length] = '\0';
+        size_t size = requested_size(request);
+        int keep_alive = strcasestr(request, "\r\nConnection: close") == NULL;
+        request[head_length] = saved;
+
+        char head[256];
+        int head_size = snprintf(head, sizeof(head),
+                                 "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                                 "Content-Length: %zu\r\nConnection: %s\r\n\r\n",
+                                 size, keep_alive ? "keep-alive" : "close");
+        if (write_all(sd, head, head_size) == -1)
+            break;
+
+        size_t sent = 0;
+        while (sent < size)
+        {
+            size_t chunk = size - sent < STUB_CHUNK ? size - sent : STUB_CHUNK;
+            if (write_all(sd, body, chunk) == -1)
+                break;
+            sent += chunk;
+        }
+        if (sent < size || !keep_alive)
+            break;
+
+        // Keep the bytes of the next request
+        length -= head_length;
+        memmove(request, request + head_length, length);
+    }
+
+    close(sd);
+    return NULL;
+}
+
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: origin_stub <port>\n");
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(body, 'x', sizeof(body));
+
+    int ws = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int on = 1;
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons((in_port_t)atoi(argv[1]))};
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (ws == -1 || setsockopt(ws, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+        bind(ws, (struct sockaddr*)&address, sizeof(address)) == -1 || listen(ws, 4096) == -1)
+    {
+        perror("error: listen\n");
+        return EXIT_FAILURE;
+    }
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attributes, 256 * 1024);
+
+    while (1)
+    {
+        int sd = accept4(ws, NULL, NULL, SOCK_CLOEXEC);
+        if (sd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EMFILE || errno == ENFILE)
+            {
+                usleep(1000); // Out of descriptors, wait for connections to close
+                continue;
+            }
+            perror("error: accept\n");
+            return EXIT_FAILURE;
+        }
+        setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        pthread_t thread;
+        if (pthread_create(&thread, &attributes, serve_connection, (void*)(intptr_t)sd) != 0)
+        {
+            fprintf(stderr, "Failed to create a connection thread\n");
+            close(sd);
+        }
+    }
+}
@@ -0,0 +1,108 @@
+#!/bin/bash
+#
+# run.sh
+#
+# Builds the proxy and the benchmarks, runs the microbenchmarks, then a sweep
+# of end-to-end load tests through a proxy in front of the origin stub.
+# Every result is a JSON object on a line of its own, tagged with the commit
+# it was measured on, so two runs can be compared with compare.py.
+#
+# Usage: bench/run.sh [-o results.jsonl] [-c "1 16 64"] [-s "1024 65536 1048576"] [-d seconds]
+#                     [-e epoll|threads] [-p pool-size] [-i iterations] [-m] [-l]
+#   -m  skip the microbenchmarks    -l  skip the load tests
+
+set -e
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+OUTPUT="$ROOT/bench/results/$(date +%Y%m%d-%H%M%S).jsonl"
+CONCURRENCY="1 16 64"
+SIZES="1024 65536 1048576"
+DURATION=10
+ENGINE=epoll
+POOL=4
+ITERATIONS=1000000
+MICRO=1
+LOAD=1
+PROXY_PORT=18080
+ORIGIN_PORT=18081
+
+while getopts "o:c:s:d:e:p:i:ml" option; do
+    case "$option" in
+        o) OUTPUT="$OPTARG" ;;
+        c) CONCURRENCY="$OPTARG" ;;
+        s) SIZES="$OPTARG" ;;
+        d) DURATION="$OPTARG" ;;
+        e) ENGINE="$OPTARG" ;;
+        p) POOL="$OPTARG" ;;
+        i) ITERATIONS="$OPTARG" ;;
+        m) MICRO=0 ;;
+        l) LOAD=0 ;;
+        *) sed -n '11,13p' "$0" | sed 's/^# \{0,1\}//'; exit 1 ;;
+    esac
+done
+
+BUILD="$(mktemp -d)"
+PIDS=()
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null || true
+        wait "$pid" 2>/dev/null || true
+    done
+    rm -rf "$BUILD"
+}
+trap cleanup EXIT
+
+# Build the proxy, and its objects again with main renamed so microbench can link them
+CFLAGS="-O2 -Wall"
+gcc $CFLAGS "$ROOT"/*.c -o "$BUILD/proxyServer" -lpthread -lz
+for source in "$ROOT"/*.c; do
+    object="$BUILD/$(basename "${source%.c}").o"
+    if [ "$(basename "$source")" = proxyServer.c ]; then
+        gcc $CFLAGS -Dmain=proxy_server_main -c "$source" -o "$object"
+    else
+        gcc $CFLAGS -c "$source" -o "$object"
+    fi
+done
+gcc $CFLAGS "$ROOT/bench/microbench.c" "$BUILD"/*.o -o "$BUILD/microbench" -lpthread -lz
+gcc $CFLAGS "$ROOT/bench/loadgen.c" -o "$BUILD/loadgen" -lpthread
+gcc $CFLAGS "$ROOT/bench/origin_stub.c" -o "$BUILD/origin_stub" -lpthread
+
+mkdir -p "$(dirname "$OUTPUT")"
+: > "$OUTPUT"
+COMMIT="$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)"
+if [ -n "$(git -C "$ROOT" status --porcelain --untracked-files=no 2>/dev/null)" ]; then
+    COMMIT="$COMMIT-dirty"
+fi
+
+# Tags every result line with the commit and the settings, keeps it and shows it
+record() {
+    sed -u "s/^{/{\"commit\":\"$COMMIT\",\"engine\":\"$ENGINE\",\"pool\":$POOL,/" | tee -a "$OUTPUT"
+}
+
+if [ "$MICRO" = 1 ]; then
+    "$BUILD/microbench" all --iterations="$ITERATIONS" | record
+fi
+
+if [ "$LOAD" = 1 ]; then
+    # An empty filter, so only the relay is measured
+    : > "$BUILD/filter.txt"
+
+    "$BUILD/origin_stub" "$ORIGIN_PORT" &
+    PIDS+=($!)
+    "$BUILD/proxyServer" "$PROXY_PORT" "$POOL" 2000000000 "$BUILD/filter.txt" --engine="$ENGINE" \
+        --max-requests-per-connection=1000000 > /dev/null &
+    PROXY_PID=$!
+    PIDS+=($PROXY_PID)
+    sleep 1
+
+    for size in $SIZES; do
+        for concurrency in $CONCURRENCY; do
+            threads=$(( concurrency < $(nproc) ? concurrency : $(nproc) ))
+            "$BUILD/loadgen" --proxy=127.0.0.1:"$PROXY_PORT" --origin=127.0.0.1:"$ORIGIN_PORT" \
+                --concurrency="$concurrency" --size="$size" --duration="$DURATION" --threads="$threads" \
+                --proxy-pid="$PROXY_PID" | record || echo "load test at concurrency $concurrency, size $size failed" >&2
+        done
+    done
+fi
+
+echo "Results written to $OUTPUT" >&2
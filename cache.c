@@ -0,0 +1,987 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "cache.h"
+#include "http.h"
+
+
+/**
+ * The start of the slab file: its format and the item size of every page
+ */
+typedef struct {
+    uint32_t magic;         // CACHE_FILE_MAGIC
+    uint32_t page_size;     // CACHE_PAGE_SIZE
+    uint32_t page_count;    // number of pages
+    uint32_t pages[];       // item size of each page, 0 while the page is unused
+} cache_file_header;
+
+
+static int cache_fd = -1;                          // the slab file, -1 if caching is disabled
+static unsigned char* mapping = NULL;              // the mapped slab file
+static size_t mapping_size = 0;                    // size of the mapping
+static size_t pages_offset = 0;                    // offset of the first page in the file
+static cache_file_header* file_header = NULL;      // the start of the mapping
+static uint32_t next_page = 0;                     // pages below it were given to a class
+static cache_shard shards[CACHE_SHARDS];           // the index
+static cache_class classes[CACHE_CLASSES];         // the item size classes
+static pthread_mutex_t class_lock = PTHREAD_MUTEX_INITIALIZER; // protects the classes and next_page
+
+
+
+/**
+ * Computes the 32-bit FNV-1a hash of a key.
+ *
+ * @param key: The key.
+ * @param length: The length of the key.
+ * @return The hash value.
+ */
+static uint32_t hash_key(const char* key, size_t length)
+{
+    uint32_t hash = 2166136261u; // FNV offset basis
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u; // FNV prime
+    }
+
+    return hash;
+}
+
+/**
+ * Returns the shard of a hash.
+ *
+ * @param hash: The hash of a key.
+ * @return The shard.
+ */
+static cache_shard* shard_of(uint32_t hash)
+{
+    return &shards[hash % CACHE_SHARDS];
+}
+
+/**
+ * Returns the hash chain of a hash in its shard.
+ *
+ * @param hash: The hash of a key.
+ * @return The head of the chain.
+ */
+static cache_object** bucket_of(uint32_t hash)
+{
+    return &shard_of(hash)->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS_PER_SHARD];
+}
+
+/**
+ * Returns the key stored in an item.
+ *
+ * @param item: The item.
+ * @return The key, not null-terminated.
+ */
+static const char* item_key(const cache_item* item)
+{
+    return (const char*)(item + 1);
+}
+
+/**
+ * Returns the response head stored in an item.
+ *
+ * @param item: The item.
+ * @return The head, not null-terminated.
+ */
+static const char* item_head(const cache_item* item)
+{
+    return item_key(item) + item->key_length;
+}
+
+/**
+ * Returns the offset of the body of an item from the start of the item.
+ *
+ * @param item: The item.
+ * @return The offset.
+ */
+static size_t body_start(const cache_item* item)
+{
+    return sizeof(cache_item) + item->key_length + item->head_length;
+}
+
+/**
+ * Returns the class of the smallest items able to hold a number of bytes.
+ *
+ * @param size: The number of bytes.
+ * @return The class, or NULL if even a whole page is too small.
+ */
+static cache_class* class_for(size_t size)
+{
+    for (int i = 0; i < CACHE_CLASSES; i++)
+        if (classes[i].item_size >= size)
+            return &classes[i];
+
+    return NULL;
+}
+
+/**
+ * Finds the object stored for a key in its chain. The shard lock must be held.
+ *
+ * @param key: The key.
+ * @param key_length: The length of the key.
+ * @param hash: The hash of the key.
+ * @return The indexed object, or NULL.
+ */
+static cache_object* find_object(const char* key, size_t key_length, uint32_t hash)
+{
+    cache_object* object = *bucket_of(hash);
+
+    while (object != NULL && (object->hash != hash || object->item->key_length != key_length ||
+                              memcmp(item_key(object->item), key, key_length) != 0))
+        object = object->next;
+
+    return object;
+}
+
+/**
+ * Removes an object from its chain. The shard lock must be held.
+ *
+ * @param object: The indexed object.
+ */
+static void unlink_object(cache_object* object)
+{
+    cache_object** link = bucket_of(object->hash);
+    while (*link != object)
+        link = &(*link)->next;
+
+    *link = object->next;
+    object->next = NULL;
+}
+
+/**
+ * Gives a page to a class and adds its slots to the slots of the class. The class lock
+ * must be held, or no other thread may run yet.
+ *
+ * @param cls: The class.
+ * @param page: The page.
+ * @return
+ *   - 1 on success.
+ *   - -1 if memory allocation fails.
+ */
+static int assign_page(cache_class* cls, uint32_t page)
+{
+    size_t count = CACHE_PAGE_SIZE / cls->item_size;
+
+    cache_object** slots = realloc(cls->slots, (cls->slot_count + count) * sizeof(cache_object*));
+    cache_object* objects = calloc(count, sizeof(cache_object));
+    if (slots != NULL)
+        cls->slots = slots;
+    if (slots == NULL || objects == NULL)
+    {
+        free(objects);
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    file_header->pages[page] = (uint32_t)cls->item_size;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        cache_object* object = &objects[i];
+        object->offset = pages_offset + (off_t)page * CACHE_PAGE_SIZE + i * cls->item_size;
+        object->item = (cache_item*)(mapping + object->offset);
+        object->item_size = cls->item_size;
+        atomic_init(&object->state, CACHE_SLOT_FREE);
+        atomic_init(&object->refs, 0);
+        atomic_init(&object->referenced, 0);
+        atomic_init(&object->stored, 0);
+        atomic_init(&object->lifetime, 0);
+        cls->slots[cls->slot_count++] = object;
+    }
+
+    return 1;
+}
+
+/**
+ * Puts a slot back on the free list of its class.
+ *
+ * @param object: The slot, neither indexed nor in use.
+ */
+static void free_slot(cache_object* object)
+{
+    cache_class* cls = class_for(object->item_size);
+
+    object->item->magic = 0; // The item no longer holds a response, also after a restart
+    atomic_store(&object->state, CACHE_SLOT_FREE);
+
+    pthread_mutex_lock(&class_lock);
+    object->next = cls->free;
+    cls->free = object;
+    pthread_mutex_unlock(&class_lock);
+}
+
+/**
+ * Takes a slot for a new item: a free one, one of a page given to the class now, or the
+ * first unused object the CLOCK hand of the class finds. The class lock must be held.
+ *
+ * @param cls: The class.
+ * @return The slot, or NULL if every object of the class is in use.
+ */
+static cache_object* take_slot(cache_class* cls)
+{
+    if (cls->free == NULL && next_page < file_header->page_count && assign_page(cls, next_page) == 1)
+    {
+        // Every slot of a new page is free, whatever an older file left in it
+        for (size_t i = cls->slot_count - CACHE_PAGE_SIZE / cls->item_size; i < cls->slot_count; i++)
+        {
+            cls->slots[i]->item->magic = 0;
+            cls->slots[i]->next = cls->free;
+            cls->free = cls->slots[i];
+        }
+        next_page++;
+    }
+
+    if (cls->free != NULL)
+    {
+        cache_object* object = cls->free;
+        cls->free = object->next;
+        object->next = NULL;
+        return object;
+    }
+
+    // Objects hit since the hand last passed get a second chance
+    for (size_t step = 0; step < 2 * cls->slot_count; step++)
+    {
+        cache_object* object = cls->slots[cls->hand];
+        cls->hand = (cls->hand + 1) % cls->slot_count;
+
+        // Only the index refers to an unused object
+        if (atomic_load(&object->state) != CACHE_SLOT_INDEXED || atomic_load(&object->refs) != 1)
+            continue;
+        if (atomic_exchange(&object->referenced, 0))
+            continue;
+
+        cache_shard* shard = shard_of(object->hash);
+        pthread_mutex_lock(&shard->lock);
+        int evicted = atomic_load(&object->state) == CACHE_SLOT_INDEXED && atomic_load(&object->refs) == 1;
+        if (evicted)
+        {
+            unlink_object(object);
+            atomic_store(&object->state, CACHE_SLOT_FREE);
+            atomic_store(&object->refs, 0);
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        if (evicted)
+        {
+            object->item->magic = 0;
+            return object;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Rebuilds the index from the complete items of the pages given to a class.
+ *
+ * @param cls: The class.
+ * @param first_slot: The first slot of the page in the slots of the class.
+ */
+static void load_page(cache_class* cls, size_t first_slot)
+{
+    for (size_t i = first_slot; i < cls->slot_count; i++)
+    {
+        cache_object* object = cls->slots[i];
+        cache_item* item = object->item;
+
+        // Items written halfway, or of an older layout, are reused
+        if (item->magic != CACHE_ITEM_MAGIC || item->key_length > CACHE_MAX_KEY ||
+            item->head_length > HTTP_MAX_HEADER_SIZE || item->body_length > object->item_size ||
+            body_start(item) + item->body_length > object->item_size)
+        {
+            free_slot(object);
+            continue;
+        }
+
+        object->hash = hash_key(item_key(item), item->key_length);
+        object->filled = item->body_length;
+        atomic_store(&object->stored, item->stored);
+        atomic_store(&object->lifetime, item->lifetime);
+
+        // Keep the newer response if a key was stored twice
+        cache_object* other = find_object(item_key(item), item->key_length, object->hash);
+        if (other != NULL && other->item->stored >= item->stored)
+        {
+            free_slot(object);
+            continue;
+        }
+        if (other != NULL)
+        {
+            unlink_object(other);
+            atomic_store(&other->refs, 0);
+            free_slot(other);
+        }
+
+        atomic_store(&object->state, CACHE_SLOT_INDEXED);
+        atomic_store(&object->refs, 1); // The reference of the index
+        object->next = *bucket_of(object->hash);
+        *bucket_of(object->hash) = object;
+    }
+}
+
+/**
+ * Calls back and dequeues every waiter of a flight after it moved on. The flight lock
+ * must be held.
+ *
+ * @param flight: The flight.
+ */
+static void notify_flight(cache_flight* flight)
+{
+    pthread_cond_broadcast(&flight->changed);
+
+    cache_waiter* waiter = flight->waiters;
+    flight->waiters = NULL;
+    while (waiter != NULL)
+    {
+        cache_waiter* next = waiter->next; // The callback may queue the waiter again later
+        waiter->next = NULL;
+        waiter->callback(waiter);
+        waiter = next;
+    }
+}
+
+/**
+ * Parses an HTTP date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+ *
+ * @param value: The date, not necessarily null-terminated.
+ * @param length: The length of the date.
+ * @return The wall-clock second, or -1 if the date cannot be parsed.
+ */
+static time_t parse_http_date(const char* value, size_t length)
+{
+    char date[64];
+    if (length >= sizeof(date))
+        return -1;
+
+    memcpy(date, value, length);
+    date[length] = '\0';
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0')
+        return -1;
+
+    return timegm(&tm);
+}
+
+/**
+ * Finds the seconds of a Cache-Control directive such as "max-age=60".
+ *
+ * @param value: The Cache-Control value.
+ * @param length: The length of the value.
+ * @param name: The directive, without the "=".
+ * @return The seconds, or -1 if the directive is absent or invalid.
+ */
+static long directive_seconds(const char* value, size_t length, const char* name)
+{
+    size_t name_length = strlen(name);
+    const char* end = value + length;
+
+    while (value < end)
+    {
+        // Skip separators and whitespace before the directive
+        while (value < end && (*value == ',' || *value == ' ' || *value == '\t'))
+            value++;
+
+        const char* directive_end = memchr(value, ',', end - value);
+        if (directive_end == NULL)
+            directive_end = end;
+
+        if ((size_t)(directive_end - value) > name_length + 1 && value[name_length] == '=' &&
+            strncasecmp(value, name, name_length) == 0)
+        {
+            long seconds = 0;
+            const char* digit = value + name_length + 1;
+            if (digit < directive_end && *digit == '"')
+                digit++; // Quoted values are tolerated
+            if (digit == directive_end || *digit < '0' || *digit > '9')
+                return -1;
+            while (digit < directive_end && *digit >= '0' && *digit <= '9' && seconds < 1000000000L)
+                seconds = seconds * 10 + (*digit++ - '0');
+            return seconds;
+        }
+
+        value = directive_end;
+    }
+
+    return -1;
+}
+
+/**
+ * Computes the freshness lifetime a response states explicitly.
+ *
+ * @param head: The response header block.
+ * @param head_length: The length of the header block.
+ * @param now: The current wall-clock second.
+ * @param forbidden: Set to 1 if the response may not be stored.
+ * @return The lifetime in seconds, or -1 if the response states none.
+ */
+static long explicit_lifetime(const char* head, size_t head_length, time_t now, int* forbidden)
+{
+    size_t length;
+    const char* value = http_head_header(head, head_length, "Cache-Control", &length);
+    if (value != NULL)
+    {
+        if (http_has_token(value, length, "no-store") || http_has_token(value, length, "private"))
+            *forbidden = 1;
+        if (http_has_token(value, length, "no-cache"))
+            return 0; // Every use has to be revalidated
+
+        // The shared-cache lifetime wins over the general one
+        long seconds = directive_seconds(value, length, "s-maxage");
+        if (seconds < 0)
+            seconds = directive_seconds(value, length, "max-age");
+        if (seconds >= 0)
+            return seconds;
+    }
+
+    value = http_head_header(head, head_length, "Expires", &length);
+    if (value == NULL)
+        return -1;
+
+    // Expires is relative to the origin's clock, an invalid date means already expired
+    time_t expires = parse_http_date(value, length);
+    const char* date = http_head_header(head, head_length, "Date", &length);
+    time_t origin_now = date != NULL ? parse_http_date(date, length) : -1;
+    if (origin_now == -1)
+        origin_now = now;
+
+    return expires > origin_now ? (long)(expires - origin_now) : 0;
+}
+
+
+int cache_init(const char* path, int size_mb)
+{
+    uint32_t page_count = (uint32_t)size_mb * ((1 << 20) / CACHE_PAGE_SIZE);
+    size_t header_size = sizeof(cache_file_header) + page_count * sizeof(uint32_t);
+    pages_offset = (header_size + CACHE_MIN_ITEM_SIZE - 1) & ~(size_t)(CACHE_MIN_ITEM_SIZE - 1);
+    mapping_size = pages_offset + (size_t)page_count * CACHE_PAGE_SIZE;
+
+    cache_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (cache_fd == -1)
+    {
+        perror("error: open cache file\n");
+        return -1;
+    }
+
+    // A file of another size is started over, truncating it first drops its contents
+    struct stat st;
+    if (fstat(cache_fd, &st) == -1 || (size_t)st.st_size != mapping_size)
+    {
+        if (ftruncate(cache_fd, 0) == -1 || ftruncate(cache_fd, (off_t)mapping_size) == -1)
+        {
+            perror("error: ftruncate\n");
+            close(cache_fd);
+            cache_fd = -1;
+            return -1;
+        }
+    }
+
+    mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache_fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        perror("error: mmap\n");
+        mapping = NULL;
+        close(cache_fd);
+        cache_fd = -1;
+        return -1;
+    }
+
+    file_header = (cache_file_header*)mapping;
+    if (file_header->magic != CACHE_FILE_MAGIC || file_header->page_size != CACHE_PAGE_SIZE ||
+        file_header->page_count != page_count)
+    {
+        // Forget the pages of another format, their items are never looked at
+        memset(file_header, 0, header_size);
+        file_header->magic = CACHE_FILE_MAGIC;
+        file_header->page_size = CACHE_PAGE_SIZE;
+        file_header->page_count = page_count;
+    }
+
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        memset(shards[i].buckets, 0, sizeof(shards[i].buckets));
+        shards[i].flights = NULL;
+    }
+
+    for (int i = 0; i < CACHE_CLASSES; i++)
+    {
+        memset(&classes[i], 0, sizeof(cache_class));
+        classes[i].item_size = (size_t)CACHE_MIN_ITEM_SIZE << i;
+    }
+
+    // Give the used pages back to their classes and index their complete items
+    next_page = 0;
+    for (uint32_t page = 0; page < page_count; page++)
+    {
+        cache_class* cls = class_for(file_header->pages[page]);
+        if (file_header->pages[page] == 0 || cls == NULL || cls->item_size != file_header->pages[page])
+            continue;
+
+        // Pages are handed out in order, only the ones past the last used page are unused
+        size_t first_slot = cls->slot_count;
+        if (assign_page(cls, page) == 1)
+            load_page(cls, first_slot);
+        next_page = page + 1;
+    }
+
+    // Pages past the last used one are given out again with a clean header
+    for (uint32_t page = next_page; page < page_count; page++)
+        file_header->pages[page] = 0;
+
+    return 1;
+}
+
+
+void cache_shutdown(void)
+{
+    if (cache_fd == -1)
+        return;
+
+    for (int i = 0; i < CACHE_CLASSES; i++)
+    {
+        // Slots are allocated a page at a time, the first slot of a page owns the array
+        for (size_t j = 0; j < classes[i].slot_count; j += CACHE_PAGE_SIZE / classes[i].item_size)
+            free(classes[i].slots[j]);
+        free(classes[i].slots);
+        classes[i].slots = NULL;
+        classes[i].slot_count = 0;
+    }
+
+    for (int i = 0; i < CACHE_SHARDS; i++)
+        pthread_mutex_destroy(&shards[i].lock);
+
+    munmap(mapping, mapping_size);
+    close(cache_fd);
+    mapping = NULL;
+    cache_fd = -1;
+}
+
+
+int cache_enabled(void)
+{
+    return cache_fd != -1;
+}
+
+
+cache_object* cache_lookup(const char* key, size_t key_length)
+{
+    uint32_t hash = hash_key(key, key_length);
+    cache_shard* shard = shard_of(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    cache_object* object = find_object(key, key_length, hash);
+    if (object != NULL)
+    {
+        atomic_fetch_add(&object->refs, 1); // Taken under the lock, so eviction sees it
+        atomic_store(&object->referenced, 1);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return object;
+}
+
+
+void cache_release(cache_object* object)
+{
+    if (object != NULL && atomic_fetch_sub(&object->refs, 1) == 1)
+        free_slot(object); // The last reference of an object that left the index
+}
+
+
+int cache_is_fresh(const cache_object* object, time_t now)
+{
+    return now < atomic_load(&object->stored) + atomic_load(&object->lifetime);
+}
+
+
+const char* cache_header(const cache_object* object, const char* name, size_t* length)
+{
+    return http_head_header(item_head(object->item), object->item->head_length, name, length);
+}
+
+
+const char* cache_head(const cache_object* object, size_t* length)
+{
+    *length = object->item->head_length;
+    return item_head(object->item);
+}
+
+
+const void* cache_body(const cache_object* object)
+{
+    return (const unsigned char*)object->item + body_start(object->item);
+}
+
+
+void cache_refresh(cache_object* object, const char* head, size_t head_length)
+{
+    time_t now = time(NULL);
+    int forbidden = 0;
+
+    long lifetime = explicit_lifetime(head, head_length, now, &forbidden);
+    if (lifetime >= 0)
+    {
+        atomic_store(&object->lifetime, lifetime);
+        object->item->lifetime = lifetime;
+    }
+
+    atomic_store(&object->stored, now);
+    object->item->stored = now; // Kept across restarts
+}
+
+
+size_t cache_build_head(const cache_object* object, int keep_alive, char* out, size_t size)
+{
+    const cache_item* item = object->item;
+    if (size < item->head_length + 64)
+        return 0;
+
+    // The rewritten head ends with the Connection header and the empty line, Age goes before them
+    size_t length = http_rewrite_head(item_head(item), item->head_length, keep_alive, out);
+    long age = (long)(time(NULL) - atomic_load(&object->stored));
+    length -= 2;
+    length += snprintf(out + length, size - length, "Age: %ld\r\n\r\n", age > 0 ? age : 0);
+
+    return length;
+}
+
+
+size_t cache_body_length(const cache_object* object)
+{
+    return object->item->body_length;
+}
+
+
+int cache_send_body(const cache_object* object, int sd, size_t* sent, size_t end)
+{
+    size_t length = end < object->item->body_length ? end : object->item->body_length;
+
+    while (*sent < length)
+    {
+        off_t offset = object->offset + (off_t)body_start(object->item) + (off_t)*sent;
+        ssize_t moved = sendfile(sd, cache_fd, &offset, length - *sent);
+        if (moved < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        if (moved == 0)
+            return -1; // The file is shorter than the mapping says
+
+        *sent += moved;
+    }
+
+    return 1;
+}
+
+
+long cache_response_lifetime(const char* head, size_t head_length, time_t now)
+{
+    size_t length;
+
+    // Per-user and negotiated responses cannot be shared
+    if (http_head_header(head, head_length, "Set-Cookie", &length) != NULL ||
+        http_head_header(head, head_length, "Vary", &length) != NULL)
+        return -1;
+
+    int forbidden = 0;
+    long lifetime = explicit_lifetime(head, head_length, now, &forbidden);
+    if (forbidden)
+        return -1;
+
+    // A response that has to be revalidated is only worth storing with a validator
+    if (lifetime <= 0)
+    {
+        int validator = http_head_header(head, head_length, "ETag", &length) != NULL ||
+                        http_head_header(head, head_length, "Last-Modified", &length) != NULL;
+        return validator ? 0 : -1;
+    }
+
+    return lifetime;
+}
+
+
+cache_object* cache_store_begin(const char* key, size_t key_length, const char* head, size_t head_length,
+                                unsigned long long body_length, long lifetime)
+{
+    if (cache_fd == -1 || key_length > CACHE_MAX_KEY || head_length > HTTP_MAX_HEADER_SIZE || body_length > CACHE_PAGE_SIZE)
+        return NULL;
+
+    cache_class* cls = class_for(sizeof(cache_item) + key_length + head_length + (size_t)body_length);
+    if (cls == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&class_lock);
+    cache_object* object = take_slot(cls);
+    pthread_mutex_unlock(&class_lock);
+    if (object == NULL)
+        return NULL;
+
+    // sendfile() leaves the pages of earlier responses queued on client sockets. Dropping them
+    // from the file lets those go out unchanged, the new item is written to fresh pages
+    if (fallocate(cache_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, object->offset, (off_t)object->item_size) == -1)
+    {
+        perror("error: fallocate\n");
+        free_slot(object);
+        return NULL;
+    }
+
+    time_t now = time(NULL);
+    object->hash = hash_key(key, key_length);
+    object->filled = 0;
+    atomic_store(&object->state, CACHE_SLOT_FILLING);
+    atomic_store(&object->refs, 1); // The reference of the writer
+    atomic_store(&object->referenced, 0);
+    atomic_store(&object->stored, now);
+    atomic_store(&object->lifetime, lifetime);
+
+    // The magic is written last, once the whole response is in the item
+    cache_item* item = object->item;
+    item->magic = 0;
+    item->key_length = (uint32_t)key_length;
+    item->head_length = (uint32_t)head_length;
+    item->unused = 0;
+    item->body_length = body_length;
+    item->stored = now;
+    item->lifetime = lifetime;
+    memcpy((char*)item_key(item), key, key_length);
+    memcpy((char*)item_head(item), head, head_length);
+
+    return object;
+}
+
+
+void cache_store_append(cache_object* object, const void* data, size_t length)
+{
+    if (object == NULL)
+        return;
+
+    size_t room = object->item->body_length - object->filled;
+    if (length > room)
+        length = room;
+
+    memcpy((unsigned char*)object->item + body_start(object->item) + object->filled, data, length);
+    object->filled += length;
+}
+
+
+int cache_store_end(cache_object* object)
+{
+    if (object == NULL)
+        return 0;
+
+    if (object->filled != object->item->body_length)
+    {
+        cache_release(object); // An incomplete response is never served
+        return 0;
+    }
+
+    object->item->magic = CACHE_ITEM_MAGIC;
+
+    // The writer's reference becomes the one of the index
+    cache_shard* shard = shard_of(object->hash);
+    pthread_mutex_lock(&shard->lock);
+    cache_object* old = find_object(item_key(object->item), object->item->key_length, object->hash);
+    if (old != NULL)
+    {
+        unlink_object(old);
+        atomic_store(&old->state, CACHE_SLOT_UNLINKED);
+    }
+    atomic_store(&object->state, CACHE_SLOT_INDEXED);
+    object->next = *bucket_of(object->hash);
+    *bucket_of(object->hash) = object;
+    pthread_mutex_unlock(&shard->lock);
+
+    cache_release(old); // Freed now, or by its last reader
+    return 1;
+}
+
+
+cache_flight* cache_flight_join(const char* key, size_t key_length, int* leader)
+{
+    uint32_t hash = hash_key(key, key_length);
+    cache_shard* shard = shard_of(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    cache_flight* flight = shard->flights;
+    while (flight != NULL && (flight->hash != hash || flight->key_length != key_length ||
+                              memcmp(flight->key, key, key_length) != 0))
+        flight = flight->next;
+
+    if (flight != NULL)
+    {
+        atomic_fetch_add(&flight->refs, 1); // The leader is still in a listed flight
+        pthread_mutex_unlock(&shard->lock);
+        *leader = 0;
+        return flight;
+    }
+
+    flight = calloc(1, sizeof(cache_flight));
+    char* copy = malloc(key_length);
+    if (flight == NULL || copy == NULL)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        free(flight);
+        free(copy);
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+
+    memcpy(copy, key, key_length);
+    flight->hash = hash;
+    flight->key = copy;
+    flight->key_length = key_length;
+    atomic_init(&flight->refs, 1);
+    pthread_mutex_init(&flight->lock, NULL);
+    pthread_cond_init(&flight->changed, NULL);
+    flight->state = CACHE_FLIGHT_PENDING;
+
+    flight->next = shard->flights;
+    shard->flights = flight;
+    pthread_mutex_unlock(&shard->lock);
+
+    *leader = 1;
+    return flight;
+}
+
+
+void cache_flight_start(cache_flight* flight, cache_object* object)
+{
+    if (object == NULL)
+    {
+        cache_flight_finish(flight, NULL); // Not stored, so nothing to stream
+        return;
+    }
+
+    atomic_fetch_add(&object->refs, 1); // Kept until the last follower left
+
+    pthread_mutex_lock(&flight->lock);
+    flight->object = object;
+    flight->filled = object->filled;
+    flight->state = CACHE_FLIGHT_FILLING;
+    notify_flight(flight);
+    pthread_mutex_unlock(&flight->lock);
+}
+
+
+void cache_flight_progress(cache_flight* flight)
+{
+    pthread_mutex_lock(&flight->lock);
+    if (flight->state == CACHE_FLIGHT_FILLING && flight->filled != flight->object->filled)
+    {
+        flight->filled = flight->object->filled;
+        notify_flight(flight);
+    }
+    pthread_mutex_unlock(&flight->lock);
+}
+
+
+void cache_flight_finish(cache_flight* flight, cache_object* complete)
+{
+    pthread_mutex_lock(&flight->lock);
+    if (flight->state == CACHE_FLIGHT_DONE || flight->state == CACHE_FLIGHT_FAILED)
+    {
+        pthread_mutex_unlock(&flight->lock);
+        return;
+    }
+
+    // Followers that streamed part of a dropped object cannot be served the rest
+    cache_object* previous = flight->object;
+    if (complete != NULL)
+        atomic_fetch_add(&complete->refs, 1);
+    flight->object = complete;
+    flight->filled = complete != NULL ? complete->item->body_length : 0;
+    flight->state = complete != NULL ? CACHE_FLIGHT_DONE : CACHE_FLIGHT_FAILED;
+    notify_flight(flight);
+    pthread_mutex_unlock(&flight->lock);
+
+    cache_release(previous);
+
+    // New requests find the stored response instead, or start a new flight
+    cache_shard* shard = shard_of(flight->hash);
+    pthread_mutex_lock(&shard->lock);
+    cache_flight** link = &shard->flights;
+    while (*link != NULL && *link != flight)
+        link = &(*link)->next;
+    if (*link != NULL)
+        *link = flight->next;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+
+cache_flight_state cache_flight_status(cache_flight* flight, cache_object** object, size_t* filled)
+{
+    pthread_mutex_lock(&flight->lock);
+    cache_flight_state state = flight->state;
+    *object = flight->object;
+    *filled = flight->filled;
+    pthread_mutex_unlock(&flight->lock);
+
+    return state;
+}
+
+
+int cache_flight_wait(cache_flight* flight, size_t seen, cache_waiter* waiter)
+{
+    pthread_mutex_lock(&flight->lock);
+    while (flight->state == CACHE_FLIGHT_PENDING || (flight->state == CACHE_FLIGHT_FILLING && flight->filled <= seen))
+    {
+        if (waiter != NULL)
+        {
+            waiter->next = flight->waiters;
+            flight->waiters = waiter;
+            pthread_mutex_unlock(&flight->lock);
+            return 0;
+        }
+
+        pthread_cond_wait(&flight->changed, &flight->lock);
+    }
+    pthread_mutex_unlock(&flight->lock);
+
+    return 1;
+}
+
+
+void cache_flight_cancel(cache_flight* flight, cache_waiter* waiter)
+{
+    pthread_mutex_lock(&flight->lock);
+    cache_waiter** link = &flight->waiters;
+    while (*link != NULL && *link != waiter)
+        link = &(*link)->next;
+    if (*link != NULL)
+        *link = waiter->next;
+    pthread_mutex_unlock(&flight->lock);
+}
+
+
+void cache_flight_leave(cache_flight* flight)
+{
+    if (flight == NULL || atomic_fetch_sub(&flight->refs, 1) != 1)
+        return;
+
+    // The leader finished the flight before leaving it, so it is not listed anymore
+    cache_release(flight->object);
+    pthread_cond_destroy(&flight->changed);
+    pthread_mutex_destroy(&flight->lock);
+    free(flight->key);
+    free(flight);
+}
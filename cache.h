@@ -0,0 +1,422 @@
+#ifndef PROXYSERVER_CACHE_H
+#define PROXYSERVER_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/**
+ * cache.h
+ *
+ * This file declares the shared response cache. Cacheable GET responses are
+ * stored in a slab file mapped into memory: the file is cut into pages, every
+ * page holds items of one size class, and every item holds the key, the
+ * response head and the body of one response. A sharded hash table indexes
+ * the items, and each size class evicts with the CLOCK algorithm. Bodies are
+ * served from the file with sendfile(), and the index is rebuilt from the
+ * file on startup, so the cache survives restarts. Identical requests that miss
+ * at the same time share one fetch from the origin: the first one leads a flight,
+ * the others follow it and stream the response as it is stored.
+ */
+
+// size of a slab page, also the largest item
+#define CACHE_PAGE_SIZE (1 << 20)
+
+// size of the smallest item class, each next class doubles it up to the page size
+#define CACHE_MIN_ITEM_SIZE 4096
+
+// number of item size classes
+#define CACHE_CLASSES 9
+
+// number of independently locked index shards
+#define CACHE_SHARDS 16
+
+// number of hash buckets per shard
+#define CACHE_BUCKETS_PER_SHARD 1024
+
+// largest stored key, a host name and a request target
+#define CACHE_MAX_KEY 2048
+
+// marks the header of an item that holds a complete response
+#define CACHE_ITEM_MAGIC 0x4d455449u
+
+// marks a slab file written by this version of the cache
+#define CACHE_FILE_MAGIC 0x48434143u
+
+
+/**
+ * The header of an item, at the start of its slot in the slab file. The key, the
+ * response head and the body follow it.
+ */
+typedef struct {
+    uint32_t magic;            // CACHE_ITEM_MAGIC once the item is complete, 0 otherwise
+    uint32_t key_length;       // bytes of the key
+    uint32_t head_length;      // bytes of the response head
+    uint32_t unused;
+    uint64_t body_length;      // bytes of the body
+    int64_t stored;            // wall-clock second the response was received or revalidated
+    int64_t lifetime;          // seconds the response stays fresh after stored
+} cache_item;
+
+
+/**
+ * The states of an item slot
+ */
+typedef enum {
+    CACHE_SLOT_FREE,           // on the free list of its class
+    CACHE_SLOT_FILLING,        // being written, not indexed yet
+    CACHE_SLOT_INDEXED,        // in the index
+    CACHE_SLOT_UNLINKED        // out of the index, freed once its last reader is done
+} cache_slot_state;
+
+
+/**
+ * An item slot of the slab file and the object it holds. The index holds one
+ * reference on an indexed object, every reader and the writer one more.
+ */
+typedef struct cache_object_st {
+    struct cache_object_st* next;  // next object of the hash chain, or of the free list
+    cache_item* item;              // the item in the mapping
+    off_t offset;                  // offset of the item in the slab file
+    size_t item_size;              // size of the slot
+    uint32_t hash;                 // hash of the key
+    atomic_int state;              // a cache_slot_state, changed under the shard lock once indexed
+    atomic_int refs;               // references held on the object
+    atomic_int referenced;         // CLOCK bit, set by every hit
+    atomic_llong stored;           // the stored second of the item, read without the lock
+    atomic_llong lifetime;         // the lifetime of the item, read without the lock
+    size_t filled;                 // body bytes written so far
+} cache_object;
+
+
+/**
+ * An item size class: the slots of the pages given to it
+ */
+typedef struct {
+    size_t item_size;              // size of each slot
+    cache_object** slots;          // every slot of the class
+    size_t slot_count;             // number of slots
+    size_t hand;                   // the CLOCK hand, an index in slots
+    cache_object* free;            // slots holding nothing
+} cache_class;
+
+
+/**
+ * The progress of a fetch shared by identical requests
+ */
+typedef enum {
+    CACHE_FLIGHT_PENDING,      // the leading request waits for the response head
+    CACHE_FLIGHT_FILLING,      // the response is being stored, followers stream what arrived
+    CACHE_FLIGHT_DONE,         // the whole response can be served to followers
+    CACHE_FLIGHT_FAILED        // nothing to share, followers fetch the response themselves
+} cache_flight_state;
+
+
+/**
+ * A follower waiting for a flight to move on without blocking. The waiter is owned by the
+ * caller; it is queued once per wait and dequeued before its callback runs.
+ */
+typedef struct cache_waiter_st {
+    struct cache_waiter_st* next;                     // next waiter of the same flight
+    void (*callback)(struct cache_waiter_st* waiter); // called under the flight lock, must not block
+    void* context;                                    // free for the caller's use
+} cache_waiter;
+
+
+/**
+ * A fetch from the origin that identical requests for the same key join instead of
+ * sending their own. The leading request stores the response and the followers stream
+ * it from the object being filled.
+ */
+typedef struct cache_flight_st {
+    struct cache_flight_st* next;  // next flight of the shard
+    uint32_t hash;                 // hash of the key
+    char* key;                     // the key
+    size_t key_length;             // length of the key
+    atomic_int refs;               // the leading request and every follower
+    pthread_mutex_t lock;          // protects the fields below
+    pthread_cond_t changed;        // signaled whenever the flight moves on
+    cache_flight_state state;      // progress of the fetch
+    cache_object* object;          // the response, once FILLING, referenced by the flight
+    size_t filled;                 // body bytes of object that can be sent
+    cache_waiter* waiters;         // followers waiting without blocking
+} cache_flight;
+
+
+/**
+ * An index shard, holding the objects whose hash maps to it
+ */
+typedef struct {
+    pthread_mutex_t lock;                              // protects the chains, the states of their objects and the flights
+    cache_object* buckets[CACHE_BUCKETS_PER_SHARD];    // hash chains
+    cache_flight* flights;                             // fetches in flight
+} cache_shard;
+
+
+/**
+ * Opens the slab file, creating or resizing it as needed, maps it and rebuilds the index
+ * from the complete items it holds. A file of another size or format is started over.
+ *
+ * @param path: The slab file.
+ * @param size_mb: The size of the cache in megabytes, one page each.
+ * @return
+ *   - 1 on success.
+ *   - -1 if the file cannot be opened or mapped. A message is printed.
+ */
+int cache_init(const char* path, int size_mb);
+
+/**
+ * Unmaps and closes the slab file. No object may be in use anymore.
+ */
+void cache_shutdown(void);
+
+/**
+ * Tells whether the cache was initialized.
+ *
+ * @return
+ *   - 1 if responses can be cached.
+ *   - 0 otherwise.
+ */
+int cache_enabled(void);
+
+/**
+ * Looks up the response stored for a key and takes a reference on it.
+ *
+ * @param key: The key, not necessarily null-terminated.
+ * @param key_length: The length of the key.
+ * @return
+ *   - The object, to be released with cache_release().
+ *   - NULL if nothing is stored for the key.
+ */
+cache_object* cache_lookup(const char* key, size_t key_length);
+
+/**
+ * Drops a reference taken on an object. The slot of an object that left the index is
+ * freed with its last reference.
+ *
+ * @param object: The object, may be NULL.
+ */
+void cache_release(cache_object* object);
+
+/**
+ * Tells whether a stored response can be served without asking the origin.
+ *
+ * @param object: The object.
+ * @param now: The current wall-clock second.
+ * @return
+ *   - 1 if it is fresh.
+ *   - 0 if it is stale.
+ */
+int cache_is_fresh(const cache_object* object, time_t now);
+
+/**
+ * Finds a header of a stored response, e.g. its ETag for a conditional request.
+ *
+ * @param object: The object.
+ * @param name: The header name, without the colon.
+ * @param length: Receives the length of the value.
+ * @return
+ *   - A pointer to the value inside the mapping, valid while the reference is held.
+ *   - NULL if the header is not present.
+ */
+const char* cache_header(const cache_object* object, const char* name, size_t* length);
+
+/**
+ * Returns the header block of a stored response.
+ *
+ * @param object: The object.
+ * @param length: Receives the length of the header block.
+ * @return The header block inside the mapping, valid while the reference is held.
+ */
+const char* cache_head(const cache_object* object, size_t* length);
+
+/**
+ * Returns the body of a stored response, cache_body_length() bytes long.
+ *
+ * @param object: The object.
+ * @return The body inside the mapping, valid while the reference is held.
+ */
+const void* cache_body(const cache_object* object);
+
+/**
+ * Marks a stored response fresh again after the origin answered a conditional request
+ * with 304 Not Modified. The freshness lifetime of the 304 response applies if it has
+ * one, the stored one otherwise.
+ *
+ * @param object: The object.
+ * @param head: The header block of the 304 response.
+ * @param head_length: The length of the header block.
+ */
+void cache_refresh(cache_object* object, const char* head, size_t head_length);
+
+/**
+ * Builds the head sent to a client served from the cache: the stored head with its
+ * Connection header replaced and an Age header added.
+ *
+ * @param object: The object.
+ * @param keep_alive: 1 to announce "Connection: keep-alive", 0 for "Connection: close".
+ * @param out: Receives the head.
+ * @param size: The size of out, HTTP_MAX_HEADER_SIZE + 64 is always enough.
+ * @return
+ *   - The length of the head.
+ *   - 0 if it does not fit.
+ */
+size_t cache_build_head(const cache_object* object, int keep_alive, char* out, size_t size);
+
+/**
+ * Returns the Content-Length of a stored response.
+ *
+ * @param object: The object.
+ * @return The length of the body.
+ */
+size_t cache_body_length(const cache_object* object);
+
+/**
+ * Sends body bytes of a stored response to a socket with sendfile().
+ *
+ * @param object: The object.
+ * @param sd: The socket.
+ * @param sent: In: body bytes already sent. Out: advanced by the bytes sent now.
+ * @param end: The body bytes to send in total, the body length or the bytes filled so far.
+ * @return
+ *   - 1 once end bytes were sent.
+ *   - 0 if a non-blocking socket is full.
+ *   - -1 on error.
+ */
+int cache_send_body(const cache_object* object, int sd, size_t* sent, size_t end);
+
+/**
+ * Computes how long a response stays fresh, or whether it may be stored at all. Responses
+ * with "Cache-Control: no-store" or "private", Set-Cookie or Vary are never stored. The
+ * lifetime comes from s-maxage, max-age, or Expires against Date. Responses without any
+ * but with an ETag or a Last-Modified date are stored stale, to be revalidated on use.
+ *
+ * @param head: The response header block.
+ * @param head_length: The length of the header block.
+ * @param now: The current wall-clock second.
+ * @return
+ *   - The freshness lifetime in seconds, 0 if every use needs revalidation.
+ *   - -1 if the response may not be stored.
+ */
+long cache_response_lifetime(const char* head, size_t head_length, time_t now);
+
+/**
+ * Starts storing a response: a slot of the matching class is taken, evicting the least
+ * recently used object of that class if none is free, and the key and the head are
+ * written to it. The object is not visible to lookups before cache_store_end().
+ *
+ * @param key: The key, not necessarily null-terminated.
+ * @param key_length: The length of the key.
+ * @param head: The response header block as received.
+ * @param head_length: The length of the header block.
+ * @param body_length: The Content-Length of the body.
+ * @param lifetime: The freshness lifetime from cache_response_lifetime().
+ * @return
+ *   - The object being filled.
+ *   - NULL if the response is too large or no slot can be freed.
+ */
+cache_object* cache_store_begin(const char* key, size_t key_length, const char* head, size_t head_length,
+                                unsigned long long body_length, long lifetime);
+
+/**
+ * Appends body bytes to an object being filled. Bytes past its Content-Length are ignored.
+ *
+ * @param object: The object being filled, may be NULL.
+ * @param data: The bytes.
+ * @param length: The number of bytes.
+ */
+void cache_store_append(cache_object* object, const void* data, size_t length);
+
+/**
+ * Finishes storing a response. A complete object replaces the one stored for its key, an
+ * incomplete one is dropped.
+ *
+ * @param object: The object being filled, may be NULL.
+ * @return
+ *   - 1 if the object was stored.
+ *   - 0 if it was dropped or NULL.
+ */
+int cache_store_end(cache_object* object);
+
+/**
+ * Joins the fetch in flight for a key, or starts one with the caller leading it.
+ *
+ * @param key: The key, not necessarily null-terminated.
+ * @param key_length: The length of the key.
+ * @param leader: Set to 1 if the caller leads the new flight, to 0 if it follows.
+ * @return
+ *   - The flight, to be left with cache_flight_leave().
+ *   - NULL if memory allocation fails.
+ */
+cache_flight* cache_flight_join(const char* key, size_t key_length, int* leader);
+
+/**
+ * Tells the followers of a flight that its response is being stored. Called by the leader
+ * once the response head arrived.
+ *
+ * @param flight: The flight.
+ * @param object: The object being filled, from cache_store_begin().
+ */
+void cache_flight_start(cache_flight* flight, cache_object* object);
+
+/**
+ * Tells the followers of a flight that more body bytes were stored. Called by the leader
+ * after cache_store_append().
+ *
+ * @param flight: The flight, started.
+ */
+void cache_flight_progress(cache_flight* flight);
+
+/**
+ * Ends a flight, new requests for its key no longer join it. Called by the leader; later
+ * calls are ignored.
+ *
+ * @param flight: The flight.
+ * @param complete: A complete object the followers are served, the stored or revalidated
+ *                  response. NULL if the leader has nothing to share.
+ */
+void cache_flight_finish(cache_flight* flight, cache_object* complete);
+
+/**
+ * Reads the progress of a flight.
+ *
+ * @param flight: The flight.
+ * @param object: Receives the object to serve once the state is FILLING or DONE. It stays
+ *                valid while the caller is in the flight.
+ * @param filled: Receives the body bytes of the object that can be sent.
+ * @return The state of the flight.
+ */
+cache_flight_state cache_flight_status(cache_flight* flight, cache_object** object, size_t* filled);
+
+/**
+ * Waits until a flight got further than a follower: it left PENDING, and past FILLING or
+ * beyond seen body bytes.
+ *
+ * @param flight: The flight.
+ * @param seen: The body bytes the follower already sent.
+ * @param waiter: Queued to be called back, with its callback set. NULL to block instead.
+ * @return
+ *   - 1 if the flight already got further.
+ *   - 0 if the waiter was queued.
+ */
+int cache_flight_wait(cache_flight* flight, size_t seen, cache_waiter* waiter);
+
+/**
+ * Dequeues a waiter that is still queued. Once this returns its callback does not run anymore.
+ *
+ * @param flight: The flight.
+ * @param waiter: The waiter.
+ */
+void cache_flight_cancel(cache_flight* flight, cache_waiter* waiter);
+
+/**
+ * Leaves a flight. The last request to leave frees it.
+ *
+ * @param flight: The flight, may be NULL.
+ */
+void cache_flight_leave(cache_flight* flight);
+
+#endif //PROXYSERVER_CACHE_H
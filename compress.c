@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "compress.h"
+#include "http.h"
+
+
+// media types compressed besides text/*, matched up to their parameters
+static const char* const compressible_types[] = {
+    "application/json",
+    "application/javascript",
+    "application/x-javascript",
+    "application/xml",
+    "application/xhtml+xml",
+    "application/rss+xml",
+    "application/atom+xml",
+    "image/svg+xml",
+    NULL
+};
+
+
+
+/**
+ * Allocates the memory of the deflate state from the arena of the request.
+ *
+ * @param opaque: The arena.
+ * @param items: The number of items.
+ * @param size: The size of an item.
+ * @return The memory, or NULL if allocation fails.
+ */
+static voidpf arena_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    return arena_alloc((arena*)opaque, (size_t)items * size);
+}
+
+/**
+ * Frees nothing, the deflate state goes with the arena.
+ *
+ * @param opaque: The arena.
+ * @param address: The memory.
+ */
+static void arena_zfree(voidpf opaque, voidpf address)
+{
+    (void)opaque;
+    (void)address;
+}
+
+/**
+ * Prepares a deflate stream producing gzip, with its memory taken from an arena.
+ *
+ * @param stream: The stream.
+ * @param a: The arena.
+ * @param level: The zlib compression level (1 - 9).
+ * @return
+ *   - 1 on success.
+ *   - -1 if memory allocation fails.
+ */
+static int start_gzip(z_stream* stream, arena* a, int level)
+{
+    memset(stream, 0, sizeof(*stream));
+    stream->zalloc = arena_zalloc;
+    stream->zfree = arena_zfree;
+    stream->opaque = a;
+
+    // 16 added to the window bits asks for the gzip header and trailer
+    return deflateInit2(stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK ? 1 : -1;
+}
+
+/**
+ * Appends bytes to a head being built.
+ *
+ * @param out: The head.
+ * @param length: In: the bytes of the head so far. Out: advanced by the bytes appended.
+ * @param size: The size of out.
+ * @param data: The bytes.
+ * @param data_length: The number of bytes.
+ * @return
+ *   - 1 on success.
+ *   - 0 if they do not fit.
+ */
+static int append(char* out, size_t* length, size_t size, const char* data, size_t data_length)
+{
+    if (size - *length < data_length)
+        return 0;
+
+    memcpy(out + *length, data, data_length);
+    *length += data_length;
+    return 1;
+}
+
+/**
+ * Tells whether a media type is compressed.
+ *
+ * @param type: The value of the Content-Type header, not necessarily null-terminated.
+ * @param length: The length of the value.
+ * @return
+ *   - 1 if it is text-like.
+ *   - 0 otherwise.
+ */
+static int is_compressible_type(const char* type, size_t length)
+{
+    // Parameters such as the charset do not matter
+    const char* parameters = memchr(type, ';', length);
+    if (parameters != NULL)
+        length = parameters - type;
+    while (length > 0 && isspace((unsigned char)type[length - 1]))
+        length--;
+
+    if (length == 17 && strncasecmp(type, "text/event-stream", 17) == 0)
+        return 0;
+    if (length > 5 && strncasecmp(type, "text/", 5) == 0)
+        return 1;
+
+    for (int i = 0; compressible_types[i] != NULL; i++)
+        if (strlen(compressible_types[i]) == length && strncasecmp(type, compressible_types[i], length) == 0)
+            return 1;
+
+    // Structured syntax suffixes, e.g. application/ld+json
+    return (length > 5 && strncasecmp(type + length - 5, "+json", 5) == 0) ||
+           (length > 4 && strncasecmp(type + length - 4, "+xml", 4) == 0);
+}
+
+
+int compress_accepts(const char* value, size_t length)
+{
+    int gzip = -1; // The quality given to gzip is above zero, -1 while it is not named
+    int any = 0;   // 1 if "*" is accepted
+    const char* end = value + length;
+
+    for (const char* token = value; token < end;)
+    {
+        const char* token_end = memchr(token, ',', end - token);
+        token_end = token_end != NULL ? token_end : end;
+
+        while (token < token_end && isspace((unsigned char)*token))
+            token++;
+        const char* name_end = token;
+        while (name_end < token_end && *name_end != ';' && !isspace((unsigned char)*name_end))
+            name_end++;
+
+        // A quality of zero refuses the coding, e.g. "gzip;q=0"
+        int accepted = 1;
+        const char* q = memchr(name_end, ';', token_end - name_end);
+        if (q != NULL)
+        {
+            while (++q < token_end && isspace((unsigned char)*q))
+                ;
+            if (token_end - q >= 2 && (*q == 'q' || *q == 'Q') && q[1] == '=')
+            {
+                accepted = 0;
+                for (q += 2; q < token_end && !isspace((unsigned char)*q); q++)
+                    if (*q >= '1' && *q <= '9')
+                        accepted = 1;
+            }
+        }
+
+        size_t name_length = name_end - token;
+        if ((name_length == 4 && strncasecmp(token, "gzip", 4) == 0) ||
+            (name_length == 6 && strncasecmp(token, "x-gzip", 6) == 0))
+            gzip = accepted;
+        else if (name_length == 1 && *token == '*')
+            any = accepted;
+
+        token = token_end + 1;
+    }
+
+    return gzip == -1 ? any : gzip;
+}
+
+
+int compress_eligible(const char* head, size_t head_length)
+{
+    size_t length;
+
+    const char* encoding = http_head_header(head, head_length, "Content-Encoding", &length);
+    if (encoding != NULL && !(length == 8 && strncasecmp(encoding, "identity", 8) == 0))
+        return 0; // Compressed already
+
+    const char* cache_control = http_head_header(head, head_length, "Cache-Control", &length);
+    if (cache_control != NULL && http_has_token(cache_control, length, "no-transform"))
+        return 0;
+
+    const char* type = http_head_header(head, head_length, "Content-Type", &length);
+    return type != NULL && is_compressible_type(type, length);
+}
+
+
+size_t compress_rewrite_head(const char* head, size_t head_length, long long body_length, char* out, size_t size)
+{
+    const char* end = head + head_length;
+    size_t length = 0;
+
+    // Copy every line but the ones describing the body as the origin sent it, and the final empty line
+    for (const char* line = head; line < end;)
+    {
+        const char* line_end = memchr(line, '\n', end - line);
+        line_end = line_end != NULL ? line_end + 1 : end;
+
+        int empty = line[0] == '\n' || (line[0] == '\r' && line + 1 < end && line[1] == '\n');
+        if (empty)
+            break;
+
+        if (line != head && (strncasecmp(line, "Content-Length:", 15) == 0 ||
+                             strncasecmp(line, "Transfer-Encoding:", 18) == 0 ||
+                             strncasecmp(line, "Content-Encoding:", 17) == 0))
+        {
+            line = line_end;
+            continue;
+        }
+
+        // A strong ETag promises the same bytes, the compressed ones only mean the same
+        if (line != head && strncasecmp(line, "ETag:", 5) == 0)
+        {
+            const char* value = line + 5;
+            while (value < line_end && (*value == ' ' || *value == '\t'))
+                value++;
+            if (line_end - value < 2 || strncmp(value, "W/", 2) != 0)
+            {
+                if (!append(out, &length, size, "ETag: W/", 8) || !append(out, &length, size, value, line_end - value))
+                    return 0;
+                line = line_end;
+                continue;
+            }
+        }
+
+        if (!append(out, &length, size, line, line_end - line))
+            return 0;
+        line = line_end;
+    }
+
+    char framing[48];
+    int framing_length = body_length < 0 ? snprintf(framing, sizeof(framing), "Transfer-Encoding: chunked\r\n")
+                                         : snprintf(framing, sizeof(framing), "Content-Length: %lld\r\n", body_length);
+    const char* coding = "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n";
+    if (!append(out, &length, size, coding, strlen(coding)) || !append(out, &length, size, framing, framing_length) ||
+        !append(out, &length, size, "\r\n", 2))
+        return 0;
+
+    return length;
+}
+
+
+int compressor_init(compressor* c, arena* a, int level)
+{
+    c->finished = 0;
+    return start_gzip(&c->stream, a, level);
+}
+
+
+size_t compressor_chunk(compressor* c, const void* data, size_t length, size_t* consumed, int finish,
+                        char* out, size_t size)
+{
+    *consumed = 0;
+    if (c->finished || size <= COMPRESS_CHUNK_OVERHEAD)
+        return 0;
+
+    // The data goes after room for the size line, which is only known afterwards
+    size_t room = size - COMPRESS_CHUNK_OVERHEAD;
+    c->stream.next_in = (Bytef*)data;
+    c->stream.avail_in = (uInt)length;
+    c->stream.next_out = (Bytef*)out + 10;
+    c->stream.avail_out = (uInt)room;
+
+    int result = deflate(&c->stream, finish ? Z_FINISH : Z_NO_FLUSH);
+    *consumed = length - c->stream.avail_in;
+    size_t produced = room - c->stream.avail_out;
+
+    // A chunk of zero bytes would end the body, nothing is sent until deflate gives something
+    size_t total = 0;
+    if (produced > 0)
+    {
+        // avail_out is an uInt, so 8 hex digits always hold the size
+        char size_line[16];
+        snprintf(size_line, sizeof(size_line), "%08x\r\n", (unsigned int)produced);
+        memcpy(out, size_line, 10);
+        memcpy(out + 10 + produced, "\r\n", 2);
+        total = produced + 12;
+    }
+
+    if (result == Z_STREAM_END)
+    {
+        memcpy(out + total, "0\r\n\r\n", 5);
+        total += 5;
+        c->finished = 1;
+    }
+
+    return total;
+}
+
+
+unsigned char* compress_body(arena* a, int level, const void* data, size_t length, size_t* compressed_length)
+{
+    z_stream stream;
+    if (start_gzip(&stream, a, level) == -1)
+        return NULL;
+
+    // The bound leaves room for incompressible data, so one call finishes the stream
+    uLong bound = deflateBound(&stream, (uLong)length);
+    unsigned char* out = arena_alloc(a, bound);
+    if (out == NULL)
+        return NULL;
+
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = (uInt)length;
+    stream.next_out = out;
+    stream.avail_out = (uInt)bound;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+        return NULL;
+
+    *compressed_length = bound - stream.avail_out;
+    return out;
+}
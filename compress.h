@@ -0,0 +1,122 @@
+#ifndef PROXYSERVER_COMPRESS_H
+#define PROXYSERVER_COMPRESS_H
+
+#include <stddef.h>
+#include <zlib.h>
+#include "arena.h"
+
+/**
+ * compress.h
+ *
+ * This file declares the gzip stage of the relay. A response of a compressible
+ * type that the client accepts gzip for is deflated as it streams from the
+ * origin, and sent to the client in chunks; the deflate state is the only
+ * memory the stage takes, and it comes from the arena of the request. A stored
+ * response is compressed once into a variant of its own in the cache, which
+ * later requests are served from.
+ */
+
+// what the key of a compressed variant adds to the key of the response, a space never occurs in a target
+#define COMPRESS_VARIANT_SUFFIX " gzip"
+
+// bytes a chunk adds around the compressed bytes: a size line of 8 hex digits, the CRLF after the data and the last chunk
+#define COMPRESS_CHUNK_OVERHEAD (10 + 2 + 5)
+
+// bytes the head of a compressed response may grow by: Content-Encoding, Vary and Transfer-Encoding or Content-Length
+#define COMPRESS_HEAD_EXTRA 96
+
+
+/**
+ * A gzip stream framed in chunks
+ */
+typedef struct {
+    z_stream stream;   // the deflate state, allocated from the arena of the request
+    int finished;      // 1 once the gzip trailer and the last chunk were produced
+} compressor;
+
+
+/**
+ * Tells whether an Accept-Encoding header allows gzip, named or through "*", with a quality
+ * above zero.
+ *
+ * @param value: The value of the header, not necessarily null-terminated.
+ * @param length: The length of the value.
+ * @return
+ *   - 1 if the client accepts gzip.
+ *   - 0 otherwise.
+ */
+int compress_accepts(const char* value, size_t length);
+
+/**
+ * Tells whether the body of a response is worth compressing from its head: a text-like
+ * Content-Type, no Content-Encoding, and no "Cache-Control: no-transform". Streams such as
+ * text/event-stream are left alone, since deflate holds bytes back.
+ *
+ * @param head: The response header block.
+ * @param head_length: The length of the header block.
+ * @return
+ *   - 1 if the body may be compressed.
+ *   - 0 otherwise.
+ */
+int compress_eligible(const char* head, size_t head_length);
+
+/**
+ * Rewrites the head of a response whose body is compressed: Content-Length and
+ * Transfer-Encoding are replaced, a strong ETag is made weak since the bytes differ, and
+ * "Content-Encoding: gzip" and "Vary: Accept-Encoding" are added.
+ *
+ * @param head: The response header block.
+ * @param head_length: The length of the header block.
+ * @param body_length: The length of the compressed body, or -1 to send it chunked.
+ * @param out: Receives the head, ending with the empty line.
+ * @param size: The size of out, head_length + COMPRESS_HEAD_EXTRA is always enough.
+ * @return
+ *   - The length of the head.
+ *   - 0 if it does not fit.
+ */
+size_t compress_rewrite_head(const char* head, size_t head_length, long long body_length, char* out, size_t size);
+
+/**
+ * Starts a gzip stream.
+ *
+ * @param c: The compressor.
+ * @param a: The arena of the request, the deflate state is freed with it.
+ * @param level: The zlib compression level (1 - 9).
+ * @return
+ *   - 1 on success.
+ *   - -1 if memory allocation fails.
+ */
+int compressor_init(compressor* c, arena* a, int level);
+
+/**
+ * Compresses bytes into one chunk. Deflate keeps bytes back until it has enough, so a call
+ * may produce nothing; with finish set, what is left is flushed and the stream ends with the
+ * last chunk once the output has room.
+ *
+ * @param c: The compressor.
+ * @param data: The bytes.
+ * @param length: The number of bytes.
+ * @param consumed: Receives the number of bytes taken, all of them unless out filled up.
+ * @param finish: 1 once the whole body was passed in.
+ * @param out: Receives the chunk.
+ * @param size: The size of out, more than COMPRESS_CHUNK_OVERHEAD.
+ * @return The number of bytes written to out, 0 if nothing is ready yet.
+ */
+size_t compressor_chunk(compressor* c, const void* data, size_t length, size_t* consumed, int finish,
+                        char* out, size_t size);
+
+/**
+ * Compresses a whole body at once into a gzip stream, without chunks.
+ *
+ * @param a: The arena the output is allocated from.
+ * @param level: The zlib compression level (1 - 9).
+ * @param data: The body.
+ * @param length: The length of the body.
+ * @param compressed_length: Receives the length of the output.
+ * @return
+ *   - The compressed body, freed with the arena.
+ *   - NULL if memory allocation fails.
+ */
+unsigned char* compress_body(arena* a, int level, const void* data, size_t length, size_t* compressed_length);
+
+#endif //PROXYSERVER_COMPRESS_H
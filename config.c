@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "config.h"
+#include "threadpool.h"
+#include "affinity.h"
+
+
+proxy_config config = {
+    .engine = ENGINE_EPOLL,
+    .client_idle_timeout = 5,
+    .tunnel_idle_timeout = 300,
+    .send_timeout = 60,
+    .dns_timeout = 5,
+    .connect_timeout = 10,
+    .connect_attempt_delay = 250,
+    .first_byte_timeout = 30,
+    .origin_idle_timeout = 60,
+    .request_timeout = 0,
+    .max_requests_per_connection = 100,
+    .splice = 1,
+    .relay_buffer_size = 16384,
+    .body_buffer_size = 16384,
+    .tcp_nodelay = 1,
+    .socket_send_buffer = 0,
+    .socket_receive_buffer = 0,
+    .notsent_lowat = 131072,
+    .acceptors = 0,
+    .listen_backlog = 1024,
+    .defer_accept = 0,
+    .cache_file = NULL,
+    .cache_size = 256,
+    .metrics_port = 0,
+    .access_log = NULL,
+    .access_log_sample = 1,
+    .access_log_buffer = 256,
+    .error_keep_alive = 0,
+    .affinity = AFFINITY_NONE,
+    .queue_limit = 0,
+    .queue_delay_target = 0,
+    .queue_delay_interval = 100,
+    .max_client_connections = 0,
+    .drain_timeout = 30,
+    .upgrade_socket = NULL,
+    .compress = 0,
+    .compress_level = 6,
+    .compress_min_size = 1024,
+};
+
+
+/**
+ * Describes one option. Numeric options take a number in [min, max], choice options take
+ * one of the listed names and store its index, string options keep the text given.
+ */
+typedef struct {
+    const char* name;            // option name, without the leading "--"
+    int* value;                  // the setting it controls, NULL for string options
+    long min;                    // smallest accepted value
+    long max;                    // largest accepted value
+    const char* description;     // one line of help
+    const char* const* choices;  // NULL-terminated accepted names, NULL for numeric options
+    const char** text;           // the setting of a string option, NULL otherwise
+} config_option;
+
+
+static const char* const engine_names[] = {"epoll", "threads", NULL}; // indexed by proxy_engine
+static const char* const affinity_names[] = {"none", "core", "node", NULL}; // indexed by affinity_mode
+
+static const config_option options[] = {
+    {"engine", &config.engine, 0, 0,
+     "connection engine, event loops or one thread per connection", engine_names, NULL},
+    {"client-idle-timeout", &config.client_idle_timeout, 1, 3600,
+     "seconds to wait for the next request on a client connection", NULL, NULL},
+    {"tunnel-idle-timeout", &config.tunnel_idle_timeout, 1, 86400,
+     "seconds a CONNECT tunnel may carry no bytes either way before it is closed", NULL, NULL},
+    {"send-timeout", &config.send_timeout, 1, 86400,
+     "seconds a client may take no bytes of a response before its connection is dropped", NULL, NULL},
+    {"dns-timeout", &config.dns_timeout, 1, 3600,
+     "seconds a lookup of the origin may take", NULL, NULL},
+    {"connect-timeout", &config.connect_timeout, 1, 3600,
+     "seconds the connection to the origin may take to be established", NULL, NULL},
+    {"connect-attempt-delay", &config.connect_attempt_delay, 10, 10000,
+     "milliseconds a connection attempt gets before the next address of the origin is tried as well (happy eyeballs)", NULL, NULL},
+    {"first-byte-timeout", &config.first_byte_timeout, 1, 86400,
+     "seconds the origin may take to start its response once the request was sent", NULL, NULL},
+    {"origin-idle-timeout", &config.origin_idle_timeout, 1, 86400,
+     "seconds the exchange with the origin may move no bytes, while a body is sent or a response relayed", NULL, NULL},
+    {"request-timeout", &config.request_timeout, 0, 86400,
+     "seconds a request may take from its head to the end of its response (0: no limit)", NULL, NULL},
+    {"max-requests-per-connection", &config.max_requests_per_connection, 1, 1000000,
+     "requests served on one client connection before it is closed (1 disables keep-alive)", NULL, NULL},
+    {"splice", &config.splice, 0, 1,
+     "relay large response bodies origin to client with splice() instead of copying them (0 copies)", NULL, NULL},
+    {"relay-buffer-size", &config.relay_buffer_size, 1024, 16777216,
+     "bytes read from the origin at a time while relaying a response", NULL, NULL},
+    {"body-buffer-size", &config.body_buffer_size, 1024, 16777216,
+     "bytes of a request body buffered between the client and the origin", NULL, NULL},
+    {"tcp-nodelay", &config.tcp_nodelay, 0, 1,
+     "send small writes right away with TCP_NODELAY on client and origin sockets (0 keeps Nagle's algorithm)", NULL, NULL},
+    {"socket-send-buffer", &config.socket_send_buffer, 0, 67108864,
+     "SO_SNDBUF of client and origin sockets in bytes (0 keeps the kernel's autotuning)", NULL, NULL},
+    {"socket-receive-buffer", &config.socket_receive_buffer, 0, 67108864,
+     "SO_RCVBUF of client and origin sockets in bytes (0 keeps the kernel's autotuning)", NULL, NULL},
+    {"notsent-lowat", &config.notsent_lowat, 0, 67108864,
+     "bytes a socket may hold unsent before the relay stops reading the other side (TCP_NOTSENT_LOWAT, 0 keeps the kernel's)", NULL, NULL},
+    {"acceptors", &config.acceptors, 0, MAXT_IN_POOL,
+     "SO_REUSEPORT listening sockets, each feeding its own share of the workers (0: one per event loop, or 1 with threads)", NULL, NULL},
+    {"listen-backlog", &config.listen_backlog, 1, 65535,
+     "connections the kernel queues on a listening socket before they are accepted", NULL, NULL},
+    {"defer-accept", &config.defer_accept, 0, 3600,
+     "seconds a new connection may wait for its first bytes before being accepted anyway (0 disables TCP_DEFER_ACCEPT)", NULL, NULL},
+    {"cache-file", NULL, 0, 0,
+     "slab file caching GET responses across restarts (default none: no caching)", NULL, &config.cache_file},
+    {"cache-size", &config.cache_size, 1, 65536,
+     "megabytes of the response cache file", NULL, NULL},
+    {"metrics-port", &config.metrics_port, 0, 65535,
+     "port answering GET /metrics in the Prometheus text format (0 disables it)", NULL, NULL},
+    {"access-log", NULL, 0, 0,
+     "file the access log is appended to as JSON lines (default none: no access log)", NULL, &config.access_log},
+    {"access-log-sample", &config.access_log_sample, 1, 1000000,
+     "log one request in this many, error responses are always logged", NULL, NULL},
+    {"access-log-buffer", &config.access_log_buffer, 4, 65536,
+     "kilobytes of access log records each thread buffers; records that do not fit are dropped and counted", NULL, NULL},
+    {"error-keep-alive", &config.error_keep_alive, 0, 1,
+     "keep the client connection open after refusing a request with 403 or 404 (0 closes it)", NULL, NULL},
+    {"affinity", &config.affinity, 0, 0,
+     "pin every event loop, or acceptor with its pool threads, to a CPU or a NUMA node", affinity_names, NULL},
+    {"queue-limit", &config.queue_limit, 0, THREADPOOL_QUEUE_SIZE,
+     "connections waiting for a pool thread at which new ones are refused with 503 (0 waits for room)", NULL, NULL},
+    {"queue-delay-target", &config.queue_delay_target, 0, 60000,
+     "milliseconds a connection may wait for a pool thread while the pool is overloaded before it gets a 503 (0 never sheds)", NULL, NULL},
+    {"queue-delay-interval", &config.queue_delay_interval, 1, 60000,
+     "milliseconds of the window the queue delay is judged over, and the wait tolerated when not overloaded", NULL, NULL},
+    {"max-connections-per-client", &config.max_client_connections, 0, 1000000,
+     "connections one client address may hold open, more are refused with 503 (0 for no limit)", NULL, NULL},
+    {"drain-timeout", &config.drain_timeout, 1, 86400,
+     "seconds the requests in flight get to finish after SIGTERM or an upgrade before they are cut short", NULL, NULL},
+    {"upgrade-socket", NULL, 0, 0,
+     "UNIX socket a new proxy takes the listening sockets over from, without dropping a connection (default none)", NULL, &config.upgrade_socket},
+    {"compress", &config.compress, 0, 1,
+     "gzip text responses for clients that accept it, and cache the compressed variants (0 relays bodies as they are)", NULL, NULL},
+    {"compress-level", &config.compress_level, 1, 9,
+     "zlib compression level of the responses, 1 is fastest and 9 smallest", NULL, NULL},
+    {"compress-min-size", &config.compress_min_size, 0, 16777216,
+     "bytes below which a response of known length is not worth compressing", NULL, NULL},
+};
+
+
+/**
+ * Applies the value of a choice option.
+ *
+ * @param option: The option.
+ * @param value: The name given on the command line.
+ * @return
+ *   - 1 if the name is one of the choices.
+ *   - -1 otherwise. A message is printed.
+ */
+static int parse_choice(const config_option* option, const char* value)
+{
+    for (int i = 0; option->choices[i] != NULL; i++)
+        if (strcmp(option->choices[i], value) == 0)
+        {
+            *option->value = i;
+            return 1;
+        }
+
+    fprintf(stderr, "Invalid value for --%s, expected one of:", option->name);
+    for (int i = 0; option->choices[i] != NULL; i++)
+        fprintf(stderr, " %s", option->choices[i]);
+    fprintf(stderr, "\n");
+    return -1;
+}
+
+
+int config_parse_option(const char* option)
+{
+    if (strncmp(option, "--", 2) != 0)
+    {
+        fprintf(stderr, "Invalid option %s, expected --name=value\n", option);
+        return -1;
+    }
+
+    const char* name = option + 2;
+    const char* equals = strchr(name, '=');
+    if (equals == NULL)
+    {
+        fprintf(stderr, "Invalid option %s, expected --name=value\n", option);
+        return -1;
+    }
+
+    size_t name_length = equals - name;
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++)
+    {
+        if (strlen(options[i].name) != name_length || strncmp(options[i].name, name, name_length) != 0)
+            continue;
+
+        if (options[i].choices != NULL)
+            return parse_choice(&options[i], equals + 1);
+
+        if (options[i].text != NULL)
+        {
+            if (equals[1] == '\0')
+            {
+                fprintf(stderr, "Invalid value for --%s, expected a path\n", options[i].name);
+                return -1;
+            }
+            *options[i].text = equals + 1; // The argument outlives the settings
+            return 1;
+        }
+
+        char* end_ptr;
+        errno = 0;
+        long value = strtol(equals + 1, &end_ptr, 10);
+        if (errno != 0 || end_ptr == equals + 1 || *end_ptr != '\0' || value < options[i].min || value > options[i].max)
+        {
+            fprintf(stderr, "Invalid value for --%s, expected %ld to %ld\n", options[i].name, options[i].min, options[i].max);
+            return -1;
+        }
+
+        *options[i].value = (int)value;
+        return 1;
+    }
+
+    fprintf(stderr, "Unknown option --%.*s\n", (int)name_length, name);
+    return -1;
+}
+
+
+void config_print_options(FILE* out)
+{
+    fprintf(out, "Options:\n");
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++)
+    {
+        if (options[i].text != NULL)
+        {
+            fprintf(out, "  --%s=<path>  %s\n", options[i].name, options[i].description);
+            continue;
+        }
+
+        if (options[i].choices == NULL)
+        {
+            fprintf(out, "  --%s=<n>  %s (default %d)\n", options[i].name, options[i].description, *options[i].value);
+            continue;
+        }
+
+        fprintf(out, "  --%s=<", options[i].name);
+        for (int j = 0; options[i].choices[j] != NULL; j++)
+            fprintf(out, "%s%s", j > 0 ? "|" : "", options[i].choices[j]);
+        fprintf(out, ">  %s (default %s)\n", options[i].description, options[i].choices[*options[i].value]);
+    }
+}
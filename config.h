@@ -0,0 +1,90 @@
+#ifndef PROXYSERVER_CONFIG_H
+#define PROXYSERVER_CONFIG_H
+
+#include <stdio.h>
+
+/**
+ * config.h
+ *
+ * This file declares the runtime settings of the proxy. Every setting has a
+ * default and can be overridden on the command line with "--name=value"
+ * after the positional arguments.
+ */
+
+
+/**
+ * The connection engines
+ */
+typedef enum {
+    ENGINE_EPOLL,     // non-blocking event loops, each serving many connections
+    ENGINE_THREADS    // one pool thread per connection, blocking I/O
+} proxy_engine;
+
+
+/**
+ * The runtime settings
+ */
+typedef struct {
+    int engine;                        // a proxy_engine value
+    int client_idle_timeout;           // seconds to wait for the next request on a client connection
+    int tunnel_idle_timeout;           // seconds a CONNECT tunnel may carry nothing before it is closed
+    int send_timeout;                  // seconds a client may take no bytes of a response before it is dropped
+    int dns_timeout;                   // seconds a lookup of the origin may take
+    int connect_timeout;               // seconds the connection to the origin may take to be established
+    int connect_attempt_delay;         // milliseconds a connection attempt to the origin gets before the next address joins the race
+    int first_byte_timeout;            // seconds the origin may take to start its response once the request was sent
+    int origin_idle_timeout;           // seconds the exchange with the origin may make no progress
+    int request_timeout;               // seconds a request may take from its head to the end of its response, 0 for no limit
+    int max_requests_per_connection;   // requests served on one client connection before it is closed
+    int splice;                        // 1 to relay large bodies with splice() instead of copying them
+    int relay_buffer_size;             // bytes of the buffer relaying a response from the origin to the client
+    int body_buffer_size;              // bytes of the buffer streaming a request body from the client to the origin
+    int tcp_nodelay;                   // 1 to disable Nagle's algorithm on client and origin sockets
+    int socket_send_buffer;            // SO_SNDBUF of client and origin sockets in bytes, 0 leaves it to the kernel
+    int socket_receive_buffer;         // SO_RCVBUF of client and origin sockets in bytes, 0 leaves it to the kernel
+    int notsent_lowat;                 // TCP_NOTSENT_LOWAT of client and origin sockets in bytes, 0 leaves it to the kernel
+    int acceptors;                     // listening sockets with their own acceptor, 0 picks per engine
+    int listen_backlog;                // length of the queue of connections waiting to be accepted
+    int defer_accept;                  // seconds the kernel holds a connection until its request arrives, 0 disables
+    const char* cache_file;            // slab file of the response cache, NULL disables caching
+    int cache_size;                    // size of the response cache in megabytes
+    int metrics_port;                  // admin port serving the metrics, 0 disables it
+    const char* access_log;            // file the access log is appended to, NULL disables it
+    int access_log_sample;             // one request in this many is logged, error responses always are
+    int access_log_buffer;             // kilobytes of the access log ring of each thread
+    int error_keep_alive;              // 1 to keep client connections open after a 403 or 404
+    int affinity;                      // an affinity_mode value, how workers are pinned to CPUs
+    int queue_limit;                   // connections queued for a pool thread at which new ones get a 503, 0 waits for room
+    int queue_delay_target;            // milliseconds of queueing tolerated while a pool is overloaded, 0 never sheds
+    int queue_delay_interval;          // milliseconds of a window of the queue delay, and the queueing tolerated otherwise
+    int max_client_connections;        // connections one client address may hold open, 0 for no limit
+    int drain_timeout;                 // seconds the requests in flight get to finish once draining
+    const char* upgrade_socket;        // UNIX socket the listening sockets are handed over on, NULL disables upgrades
+    int compress;                      // 1 to gzip text responses for clients accepting it
+    int compress_level;                // zlib compression level of the responses (1 - 9)
+    int compress_min_size;             // bytes below which a response of known length is sent as is
+} proxy_config;
+
+
+// the settings in effect, shared read-only by all threads once parsing is done
+extern proxy_config config;
+
+
+/**
+ * Applies a single "--name=value" command line option to the settings.
+ *
+ * @param option: The command line argument.
+ * @return
+ *   - 1 if the option was applied.
+ *   - -1 if the option is unknown or its value is invalid. A message is printed.
+ */
+int config_parse_option(const char* option);
+
+/**
+ * Prints the list of supported options with their defaults.
+ *
+ * @param out: The stream to print to.
+ */
+void config_print_options(FILE* out);
+
+#endif //PROXYSERVER_CONFIG_H
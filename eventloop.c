@@ -0,0 +1,2361 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "eventloop.h"
+
+
+static size_t accept_limit = 0;             // connections to accept in total
+static atomic_size_t accepted = 0;          // connections accepted, or about to be, by all loops
+
+
+static void start_request(connection* conn);
+static void relay_response(connection* conn);
+static void start_body(connection* conn);
+static void finish_response(connection* conn, int reusable);
+
+
+
+/**
+ * Sets the epoll events a handle of a connection is watched for, registering the descriptor
+ * when needed. Nothing is done if the interest does not change.
+ *
+ * @param loop: The loop owning the handle.
+ * @param handle: The handle.
+ * @param events: The epoll events, 0 to only be told about errors and hang-ups.
+ */
+static void watch(event_loop* loop, loop_handle* handle, uint32_t events)
+{
+    if (handle->fd == -1 || (handle->registered && handle->events == events))
+        return;
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = handle;
+
+    if (epoll_ctl(loop->epoll_fd, handle->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, handle->fd, &event) == -1)
+    {
+        perror("error: epoll_ctl\n");
+        return;
+    }
+
+    handle->registered = 1;
+    handle->events = events;
+}
+
+/**
+ * Takes a handle of a connection out of the epoll set. A socket nothing is expected from
+ * anymore would otherwise keep reporting its hang-up.
+ *
+ * @param loop: The loop owning the handle.
+ * @param handle: The handle.
+ */
+static void unwatch(event_loop* loop, loop_handle* handle)
+{
+    if (handle->fd == -1 || !handle->registered)
+        return;
+
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, handle->fd, NULL);
+    handle->registered = 0;
+    handle->events = 0;
+}
+
+/**
+ * Computes when a connection expires in its current state: the client has the idle timeout
+ * to send a request, the origin has the DNS, connect and first byte timeouts of its phase and
+ * then the origin idle timeout between bytes, and a client whose socket is full has the send
+ * timeout to take more bytes. The request timeout bounds everything from the request head on.
+ *
+ * @param conn: The connection.
+ * @return The monotonic millisecond the connection expires at, ULLONG_MAX if never.
+ */
+static unsigned long long connection_deadline(const connection* conn)
+{
+    unsigned long long deadline = ULLONG_MAX;
+
+    switch (conn->state)
+    {
+        case CONN_READ_REQUEST:
+            return conn->last_active + config.client_idle_timeout * 1000ULL;
+
+        case CONN_TUNNEL:
+            return conn->last_active + config.tunnel_idle_timeout * 1000ULL;
+
+        case CONN_RESOLVING:
+            deadline = conn->phase_started + config.dns_timeout * 1000ULL;
+            break;
+
+        case CONN_CONNECTING:
+            deadline = conn->phase_started + config.connect_timeout * 1000ULL;
+            // The next address joins the race once the attempt delay passed
+            if (conn->next_address < conn->ci->host_addresses.count && conn->next_attempt < deadline)
+                deadline = conn->next_attempt;
+            break;
+
+        case CONN_SEND_BODY:
+            deadline = conn->last_active + config.client_idle_timeout * 1000ULL;
+            break;
+
+        case CONN_SEND_REQUEST:
+        case CONN_RELAY:
+            if (conn->client.events & EPOLLOUT)
+                deadline = conn->last_active + config.send_timeout * 1000ULL;
+            else if (conn->response_started)
+                deadline = conn->upstream_active + config.origin_idle_timeout * 1000ULL;
+            else
+                deadline = conn->upstream_active + config.first_byte_timeout * 1000ULL;
+            break;
+
+        default:
+            // Only a full client socket holds up a stored response, a followed flight or an error
+            if (conn->client.events & EPOLLOUT)
+                deadline = conn->last_active + config.send_timeout * 1000ULL;
+            break;
+    }
+
+    if (config.request_timeout > 0 && conn->request_started + config.request_timeout * 1000ULL < deadline)
+        deadline = conn->request_started + config.request_timeout * 1000ULL;
+
+    return deadline;
+}
+
+/**
+ * Schedules the timer of a connection at its current deadline. Only a deadline that moved
+ * earlier needs this, one pushed back by activity is noticed when the timer fires.
+ *
+ * @param conn: The connection.
+ */
+static void arm_deadline(connection* conn)
+{
+    unsigned long long deadline = connection_deadline(conn);
+    if (deadline == ULLONG_MAX)
+        timer_wheel_cancel(&conn->loop->timers, &conn->deadline);
+    else
+        timer_wheel_schedule(&conn->loop->timers, &conn->deadline, timer_wheel_tick(deadline));
+}
+
+/**
+ * Moves a connection to another state and schedules the deadline of the new phase.
+ *
+ * @param conn: The connection.
+ * @param state: The new state.
+ */
+static void set_state(connection* conn, connection_state state)
+{
+    unsigned long long now = timer_wheel_clock_ms();
+    unsigned long long clock = metrics_clock_us();
+
+    if (conn->state == CONN_READ_REQUEST && state != CONN_READ_REQUEST)
+        conn->request_started = now; // The request head is complete
+    if (state == CONN_SEND_REQUEST || state == CONN_RELAY)
+        conn->upstream_active = now; // The first byte is awaited from the end of the request
+
+    // The lookup ends whichever way it went, a connection only once it is established
+    if (conn->state == CONN_RESOLVING && state != CONN_RESOLVING)
+        metrics_observe(METRIC_PHASE_DNS, clock - conn->phase_clock);
+    if (conn->state == CONN_CONNECTING && (state == CONN_SEND_REQUEST || state == CONN_TUNNEL))
+        metrics_observe(METRIC_PHASE_CONNECT, clock - conn->phase_clock);
+    if (state == CONN_SEND_REQUEST)
+        conn->ci->exchange_clock = clock; // The first byte of the response is awaited from here
+
+    conn->state = state;
+    conn->phase_started = now;
+    conn->phase_clock = clock;
+    arm_deadline(conn);
+}
+
+/**
+ * Waits for the client socket of a connection to take more bytes. Nothing more is read for
+ * the client in the meantime, and the connection expires once the client took nothing for
+ * the send timeout.
+ *
+ * @param conn: The connection, with bytes the client socket did not take.
+ */
+static void wait_for_room(connection* conn)
+{
+    conn->last_active = timer_wheel_clock_ms();
+    watch(conn->loop, &conn->client, EPOLLOUT);
+    arm_deadline(conn);
+}
+
+/**
+ * Writes as much of a buffer as the socket takes without blocking.
+ *
+ * @param sd: The non-blocking socket.
+ * @param data: The bytes to write.
+ * @param length: The number of bytes to write.
+ * @param sent: In: bytes already written. Out: advanced by the bytes written now.
+ * @return
+ *   - 1 if everything was written.
+ *   - 0 if the socket is full, the caller waits for EPOLLOUT.
+ *   - -1 if the write failed.
+ */
+static int write_some(int sd, const void* data, size_t length, size_t* sent)
+{
+    while (*sent < length)
+    {
+        ssize_t wrote_bytes = write(sd, (const char*)data + *sent, length - *sent);
+        if (wrote_bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        *sent += wrote_bytes;
+    }
+
+    return 1;
+}
+
+/**
+ * Writes as much of the edited request as the origin socket takes without blocking. The
+ * client's bytes and the edits go out together with writev().
+ *
+ * @param conn: The connection, sending its request.
+ * @return
+ *   - 1 if the whole request was written.
+ *   - 0 if the socket is full, the caller waits for EPOLLOUT.
+ *   - -1 if the write failed.
+ */
+static int write_request(connection* conn)
+{
+    communication_info* ci = conn->ci;
+    size_t length = ci->parsed.length + ci->edits.delta;
+    struct iovec segments[HTTP_MAX_REQUEST_SEGMENTS];
+
+    while (conn->request_sent < length)
+    {
+        int count = http_edits_segments(&ci->edits, ci->request, ci->parsed.length, conn->request_sent, segments);
+        ssize_t wrote_bytes = writev(conn->upstream.fd, segments, count);
+        if (wrote_bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        conn->request_sent += wrote_bytes;
+        metrics_count(METRIC_BYTES_TO_ORIGIN, wrote_bytes);
+    }
+
+    return 1;
+}
+
+/**
+ * Closes the connection attempts to the origin still in progress.
+ *
+ * @param conn: The connection.
+ */
+static void drop_attempts(connection* conn)
+{
+    for (int i = 0; i < RESOLVER_MAX_ADDRESSES && conn->attempts_pending > 0; i++)
+    {
+        loop_handle* attempt = &conn->attempts[i];
+        if (attempt->fd == -1)
+            continue;
+
+        close(attempt->fd); // Leaves the epoll set
+        attempt->fd = -1;
+        attempt->registered = 0;
+        attempt->events = 0;
+        conn->attempts_pending--;
+    }
+}
+
+/**
+ * Drops the origin connection of a connection, handing it back to the pool if it can carry
+ * another request, and the connection attempts still racing for it.
+ *
+ * @param conn: The connection.
+ * @param reusable: 1 if the origin connection can be reused.
+ */
+static void release_upstream(connection* conn, int reusable)
+{
+    drop_attempts(conn);
+
+    if (conn->upstream.fd == -1)
+        return;
+
+    // A pooled descriptor stays open, so it must leave the epoll set explicitly
+    if (conn->upstream.registered)
+        epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->upstream.fd, NULL);
+
+    upstream_release(&conn->ci->host_address, conn->ci->host_port, conn->upstream.fd, reusable);
+
+    conn->upstream.fd = -1;
+    conn->upstream.registered = 0;
+    conn->upstream.events = 0;
+}
+
+/**
+ * Gives a connection a pipe to splice body bytes through, taking an empty one of the loop
+ * when available.
+ *
+ * @param conn: The connection.
+ * @return
+ *   - 1 if the connection has a pipe.
+ *   - -1 if no pipe can be created, the body is copied instead.
+ */
+static int take_pipe(connection* conn)
+{
+    event_loop* loop = conn->loop;
+
+    if (conn->pipe != NULL)
+        return 1;
+
+    if (loop->free_pipes != NULL)
+    {
+        conn->pipe = loop->free_pipes;
+        loop->free_pipes = conn->pipe->next;
+        loop->free_pipe_count--;
+        return 1;
+    }
+
+    relay_pipe* pipe = malloc(sizeof(relay_pipe));
+    if (pipe == NULL || relay_pipe_open(pipe) == -1)
+    {
+        free(pipe);
+        return -1;
+    }
+
+    conn->pipe = pipe;
+    return 1;
+}
+
+/**
+ * Takes the pipe away from a connection. An empty pipe goes back to the loop, one that still
+ * holds bytes is closed since they belong to this connection only.
+ *
+ * @param conn: The connection.
+ */
+static void release_pipe(connection* conn)
+{
+    event_loop* loop = conn->loop;
+    relay_pipe* pipe = conn->pipe;
+
+    if (pipe == NULL)
+        return;
+
+    conn->pipe = NULL;
+
+    if (pipe->buffered == 0 && loop->free_pipe_count < EVENTLOOP_MAX_FREE_PIPES)
+    {
+        pipe->next = loop->free_pipes;
+        loop->free_pipes = pipe;
+        loop->free_pipe_count++;
+        return;
+    }
+
+    relay_pipe_close(pipe);
+    free(pipe);
+}
+
+/**
+ * Allocates memory for the current request from the arena of the connection's request,
+ * taking an arena first if the request has none yet.
+ *
+ * @param conn: The connection.
+ * @param size: The number of bytes.
+ * @return
+ *   - The memory, freed when the request is done.
+ *   - NULL if memory allocation fails.
+ */
+static void* request_alloc(connection* conn, size_t size)
+{
+    if (conn->ci->arena == NULL)
+        conn->ci->arena = arena_acquire();
+    if (conn->ci->arena == NULL)
+        return NULL;
+
+    return arena_alloc(conn->ci->arena, size);
+}
+
+/**
+ * Drops the buffers used while a response is relayed. They belong to the arena of the
+ * request, which frees them when the request is done.
+ *
+ * @param conn: The connection.
+ */
+static void free_response_buffers(connection* conn)
+{
+    release_pipe(conn);
+
+    conn->framer = NULL;
+    conn->relay = NULL;
+    conn->body_framer = NULL;
+    conn->body = NULL;
+    conn->body_length = 0;
+    conn->output = NULL;
+    conn->output_length = 0;
+    conn->output_sent = 0;
+    conn->packed = NULL;
+    conn->packed_length = 0;
+    conn->packed_sent = 0;
+    conn->origin_closed = 0;
+}
+
+/**
+ * Makes sure a follower is not called back anymore, before it leaves its flight.
+ *
+ * @param conn: The connection.
+ */
+static void stop_following(connection* conn)
+{
+    communication_info* ci = conn->ci;
+    if (ci == NULL || ci->flight == NULL || ci->flight_leader)
+        return;
+
+    cache_flight_cancel(ci->flight, &conn->flight_waiter);
+
+    // The callback may already have queued the connection for the loop
+    event_loop* loop = conn->loop;
+    pthread_mutex_lock(&loop->lock);
+    if (conn->flight_queued)
+    {
+        connection** link = &loop->flights;
+        while (*link != conn)
+            link = &(*link)->next_flight;
+        *link = conn->next_flight;
+        conn->flight_queued = 0;
+    }
+    pthread_mutex_unlock(&loop->lock);
+}
+
+/**
+ * Closes a connection. Its memory is freed once the current batch of events is handled,
+ * or once the resolver hands back its waiter, whichever comes last.
+ *
+ * @param conn: The connection.
+ */
+static void close_connection(connection* conn)
+{
+    event_loop* loop = conn->loop;
+
+    if (conn->closed)
+        return;
+
+    release_upstream(conn, 0);
+    free_response_buffers(conn);
+    stop_following(conn);
+    timer_wheel_cancel(&loop->timers, &conn->deadline);
+    if (conn->tunnel != NULL)
+    {
+        metrics_count(METRIC_BYTES_TO_ORIGIN, conn->tunnel[0].relayed);
+        metrics_count(METRIC_BYTES_TO_CLIENT, conn->tunnel[1].relayed);
+        conn->ci->response_bytes += conn->tunnel[1].relayed;
+        relay_stream_close(&conn->tunnel[0]);
+        relay_stream_close(&conn->tunnel[1]);
+        conn->tunnel = NULL;
+    }
+    free(conn->input);
+    conn->input = NULL;
+
+    destroy_communication_info(conn->ci); // Closes the client socket, which leaves the epoll set
+    conn->ci = NULL;
+    conn->client.fd = -1;
+
+    // Move the connection from the served list to the closed list
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        loop->connections = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    loop->connection_count--;
+
+    conn->closed = 1;
+    conn->next = loop->closed;
+    loop->closed = conn;
+}
+
+/**
+ * Answers the client with an error and closes the connection once the answer is written,
+ * unless the refusal leaves it usable for the next request. The prebuilt response is written
+ * straight from its shared buffers, only what the socket does not take at once is copied.
+ *
+ * @param conn: The connection.
+ * @param error: The error to answer with.
+ */
+static void send_error(connection* conn, ErrorType error)
+{
+    release_upstream(conn, 0);
+    free_response_buffers(conn);
+
+    char date[RESPONSES_DATE_LENGTH];
+    struct iovec parts[RESPONSES_ERROR_PARTS];
+    conn->keep_alive = error_keeps_alive(conn->ci, error, conn->keep_alive);
+    size_t length = responses_error(error, conn->keep_alive, date, parts);
+    conn->ci->status = error;
+    conn->ci->response_bytes += length;
+    metrics_count_error(error);
+    set_state(conn, CONN_SEND_ERROR);
+
+    ssize_t written;
+    do {
+        written = writev(conn->client.fd, parts, RESPONSES_ERROR_PARTS);
+    } while (written < 0 && errno == EINTR);
+
+    if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        close_connection(conn);
+        return;
+    }
+    if (written < 0)
+        written = 0;
+    if ((size_t)written == length)
+    {
+        finish_response(conn, 0);
+        return;
+    }
+
+    // Keep the rest for when the client drains its socket, the date buffer is gone by then
+    conn->output = request_alloc(conn, length - written);
+    if (conn->output == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        close_connection(conn);
+        return;
+    }
+
+    size_t skip = (size_t)written;
+    conn->output_length = 0;
+    for (int i = 0; i < RESPONSES_ERROR_PARTS; i++)
+    {
+        size_t from = skip < parts[i].iov_len ? skip : parts[i].iov_len;
+        skip -= from;
+        memcpy(conn->output + conn->output_length, (const char*)parts[i].iov_base + from, parts[i].iov_len - from);
+        conn->output_length += parts[i].iov_len - from;
+    }
+    conn->output_sent = 0;
+    wait_for_room(conn); // Finish once the client drains its socket
+}
+
+/**
+ * Ends the exchange with the origin once the response is relayed, and waits for the next
+ * request if the client keeps the connection open.
+ *
+ * @param conn: The connection.
+ * @param reusable: 1 if the origin connection can carry another request.
+ */
+static void finish_response(connection* conn, int reusable)
+{
+    release_upstream(conn, reusable);
+    free_response_buffers(conn);
+    stop_following(conn);
+    reset_request_info(conn->ci); // Free the per-request data before the next request
+
+    if (!conn->keep_alive)
+    {
+        close_connection(conn);
+        return;
+    }
+
+    conn->last_active = timer_wheel_clock_ms();
+    set_state(conn, CONN_READ_REQUEST);
+    watch(conn->loop, &conn->client, EPOLLIN);
+
+    // A pipelined request may already be buffered, its head is parsed from now on
+    if (conn->input_length > 0)
+        conn->request_arrived = metrics_clock_us();
+    start_request(conn);
+}
+
+/**
+ * Relays the bytes of a tunnel both ways as far as the sockets allow, and closes the
+ * connection once both sides ended their stream or one of them failed. The answer to the
+ * CONNECT request reaches the client before any byte of the origin, and the bytes the client
+ * sent past its CONNECT head reach the origin before the rest.
+ *
+ * @param conn: The connection, tunneling.
+ */
+static void pump_tunnel(connection* conn)
+{
+    event_loop* loop = conn->loop;
+    relay_stream* up = &conn->tunnel[0];   // Client to origin
+    relay_stream* down = &conn->tunnel[1]; // Origin to client
+    unsigned long long relayed = up->relayed + down->relayed;
+
+    int head = write_some(conn->client.fd, conn->output, conn->output_length, &conn->output_sent);
+    int early = write_some(conn->upstream.fd, conn->input, conn->input_length, &conn->request_sent);
+    if (early == 1)
+        conn->input_length = 0;
+
+    if (head == -1 || early == -1 || (head == 1 && relay_stream_pump(down) == -1) ||
+        (early == 1 && relay_stream_pump(up) == -1) || (up->shut && down->shut))
+    {
+        close_connection(conn);
+        return;
+    }
+
+    if (up->relayed + down->relayed != relayed)
+        conn->last_active = timer_wheel_clock_ms(); // Only a tunnel that moves nothing expires
+
+    uint32_t client_events = 0;
+    if (early == 1 && relay_stream_wants_read(up))
+        client_events |= EPOLLIN;
+    if (head == 0 || relay_stream_wants_write(down))
+        client_events |= EPOLLOUT;
+
+    uint32_t upstream_events = 0;
+    if (head == 1 && relay_stream_wants_read(down))
+        upstream_events |= EPOLLIN;
+    if (early == 0 || relay_stream_wants_write(up))
+        upstream_events |= EPOLLOUT;
+
+    if (client_events != 0)
+        watch(loop, &conn->client, client_events);
+    else
+        unwatch(loop, &conn->client);
+    if (upstream_events != 0)
+        watch(loop, &conn->upstream, upstream_events);
+    else
+        unwatch(loop, &conn->upstream);
+}
+
+/**
+ * Turns the connection into a tunnel once the origin of its CONNECT request is connected.
+ *
+ * @param conn: The connection, connected to the origin.
+ */
+static void open_tunnel(connection* conn)
+{
+    size_t length = strlen(TUNNEL_ESTABLISHED);
+    relay_stream* tunnel = request_alloc(conn, 2 * sizeof(relay_stream));
+    conn->output = request_alloc(conn, length);
+    if (tunnel == NULL || conn->output == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        send_error(conn, ERROR_500_INTERNAL);
+        return;
+    }
+
+    if (relay_stream_open(&tunnel[0], conn->client.fd, conn->upstream.fd) == -1)
+    {
+        send_error(conn, ERROR_500_INTERNAL);
+        return;
+    }
+    if (relay_stream_open(&tunnel[1], conn->upstream.fd, conn->client.fd) == -1)
+    {
+        relay_stream_close(&tunnel[0]);
+        send_error(conn, ERROR_500_INTERNAL);
+        return;
+    }
+
+    memcpy(conn->output, TUNNEL_ESTABLISHED, length);
+    conn->output_length = length;
+    conn->ci->status = 200;
+    conn->ci->response_bytes = length;
+    conn->output_sent = 0;
+    conn->request_sent = 0; // Counts the early client bytes written to the origin
+    conn->tunnel = tunnel;
+    conn->keep_alive = 0;
+    conn->last_active = timer_wheel_clock_ms();
+    set_state(conn, CONN_TUNNEL);
+
+    pump_tunnel(conn);
+}
+
+/**
+ * Continues once the connection to the origin is established: the request is sent, or the
+ * tunnel of a CONNECT request is opened.
+ *
+ * @param conn: The connection, connected to the origin.
+ */
+static void upstream_connected(connection* conn)
+{
+    if (conn->ci->tunnel)
+    {
+        open_tunnel(conn);
+        return;
+    }
+
+    set_state(conn, CONN_SEND_REQUEST);
+    relay_response(conn);
+}
+
+/**
+ * Makes a connection attempt that succeeded the origin connection, and drops the others.
+ *
+ * @param conn: The connection, connecting.
+ * @param index: The index of the address the attempt connected to.
+ */
+static void win_attempt(connection* conn, int index)
+{
+    loop_handle* attempt = &conn->attempts[index];
+
+    unwatch(conn->loop, attempt); // The descriptor is watched through the upstream handle from now on
+    conn->upstream.fd = attempt->fd;
+    conn->upstream.registered = 0;
+    attempt->fd = -1;
+    conn->attempts_pending--;
+    drop_attempts(conn);
+
+    conn->ci->host_address = conn->ci->host_addresses.list[index];
+    watch(conn->loop, &conn->upstream, EPOLLOUT);
+    upstream_connected(conn);
+}
+
+/**
+ * Lets the next address of the origin join the race, skipping the addresses that fail right
+ * away. The request fails once no address is left and no attempt is in progress.
+ *
+ * @param conn: The connection, connecting.
+ */
+static void start_attempt(connection* conn)
+{
+    communication_info* ci = conn->ci;
+
+    while (conn->next_address < ci->host_addresses.count)
+    {
+        int index = conn->next_address++;
+        int connected;
+        int sd = start_connect_attempt(&ci->host_addresses.list[index], ci->host_port, &connected);
+        if (sd == -1)
+            continue; // Failed right away, the next address goes at once
+
+        conn->attempts[index].fd = sd;
+        conn->attempts_pending++;
+        if (connected)
+        {
+            win_attempt(conn, index);
+            return;
+        }
+
+        watch(conn->loop, &conn->attempts[index], EPOLLOUT); // Completion is reported as writability
+        conn->next_attempt = timer_wheel_clock_ms() + config.connect_attempt_delay;
+        break;
+    }
+
+    if (conn->attempts_pending == 0)
+    {
+        fprintf(stderr, "error: could not connect to %s\n", ci->clean_host_name);
+        send_error(conn, ERROR_500_INTERNAL);
+        return;
+    }
+
+    arm_deadline(conn);
+}
+
+/**
+ * Checks the outcome of a connection attempt to one address of the origin. The first one that
+ * succeeds wins the race, a failure lets the next address go right away.
+ *
+ * @param conn: The connection, connecting.
+ * @param attempt: The handle of the attempt.
+ */
+static void finish_attempt(connection* conn, loop_handle* attempt)
+{
+    if (conn->state != CONN_CONNECTING || attempt->fd == -1)
+        return; // Dropped while handling an earlier event of this batch
+
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if (getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1)
+        error = errno;
+
+    if (error == 0)
+    {
+        win_attempt(conn, (int)(attempt - conn->attempts));
+        return;
+    }
+
+    errno = error;
+    perror("error: connect\n");
+    close(attempt->fd);
+    attempt->fd = -1;
+    attempt->registered = 0;
+    attempt->events = 0;
+    conn->attempts_pending--;
+
+    start_attempt(conn);
+}
+
+/**
+ * Connects to the origin of the current request, preferring an idle pooled connection to any
+ * of its addresses. Otherwise connections to the addresses are raced the happy eyeballs way
+ * (RFC 8305), in the order the resolver gave them.
+ *
+ * @param conn: The connection, with the origin resolved.
+ * @param allow_pooled: 0 to force a new connection.
+ */
+static void connect_upstream(connection* conn, int allow_pooled)
+{
+    communication_info* ci = conn->ci;
+
+    conn->request_sent = 0;
+    conn->response_started = 0;
+
+    // The client is not read while its request is served, extra bytes wait in the kernel
+    watch(conn->loop, &conn->client, 0);
+
+    int sd = allow_pooled ? acquire_pooled_connection(ci) : -1;
+    conn->upstream_reused = sd != -1;
+
+    if (sd != -1)
+    {
+        fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK); // Pooled sockets may come from a blocking caller
+        conn->upstream.fd = sd;
+        conn->upstream.registered = 0;
+        watch(conn->loop, &conn->upstream, EPOLLOUT);
+        upstream_connected(conn);
+        return;
+    }
+
+    conn->next_address = 0;
+    set_state(conn, CONN_CONNECTING);
+    start_attempt(conn);
+}
+
+/**
+ * Replaces a pooled origin connection that turned out to be closed, once per request, as
+ * long as no body bytes were taken from the client.
+ *
+ * @param conn: The connection.
+ * @return
+ *   - 1 if a new connection is being set up.
+ *   - 0 if the request was already retried or the connection was not pooled.
+ */
+static int retry_upstream(connection* conn)
+{
+    // A body read from the client cannot be sent again
+    if (!conn->upstream_reused || conn->retried || conn->response_started || conn->body_framer != NULL)
+        return 0;
+
+    release_upstream(conn, 0);
+    conn->retried = 1;
+    http_framer_init(conn->framer, conn->framer->head_request);
+    conn->relay_length = 0;
+    conn->relay_offset = 0;
+    conn->relay_framed = 0;
+
+    connect_upstream(conn, 0);
+    return 1;
+}
+
+/**
+ * Writes as much of the stored response as the client socket takes, the head first and
+ * then the body straight from the cache file.
+ *
+ * @param conn: The connection, sending a stored response.
+ */
+static void send_cached(connection* conn)
+{
+    int result = write_some(conn->client.fd, conn->output, conn->output_length, &conn->output_sent);
+    if (result == 1)
+        result = cache_send_body(conn->ci->cached, conn->client.fd, &conn->cached_sent, cache_body_length(conn->ci->cached));
+
+    if (result == 0)
+    {
+        wait_for_room(conn); // Continue once the client drains its socket
+        return;
+    }
+    if (result == -1)
+    {
+        close_connection(conn);
+        return;
+    }
+
+    finish_response(conn, 0);
+}
+
+/**
+ * Answers the current request with the stored response in ci->cached.
+ *
+ * @param conn: The connection, with no origin connection left.
+ */
+static void start_cached(connection* conn)
+{
+    free_response_buffers(conn);
+
+    conn->output = request_alloc(conn, HTTP_MAX_HEADER_SIZE + 64);
+    if (conn->output == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        send_error(conn, ERROR_500_INTERNAL);
+        return;
+    }
+
+    conn->output_length = cache_build_head(conn->ci->cached, conn->keep_alive, conn->output, HTTP_MAX_HEADER_SIZE + 64);
+    conn->output_sent = 0;
+    conn->cached_sent = 0;
+    conn->ci->status = 200; // A revalidated response replaces the 304 of the origin
+    conn->ci->response_bytes = cache_body_length(conn->ci->cached);
+    set_state(conn, CONN_SEND_CACHED);
+
+    send_cached(conn);
+}
+
+/**
+ * Sends the current request to its origin.
+ *
+ * @param conn: The connection.
+ */
+static void forward_to_origin(connection* conn)
+{
+    conn->framer = request_alloc(conn, sizeof(http_response_framer));
+    conn->relay = request_alloc(conn, config.relay_buffer_size);
+    if (conn->framer == NULL || conn->relay == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        send_error(conn, ERROR_500_INTERNAL);
+        return;
+    }
+
+    http_framer_init(conn->framer, http_span_equals(conn->ci->request, conn->ci->parsed.method, "HEAD"));
+    conn->relay_length = 0;
+    conn->relay_offset = 0;
+    conn->relay_framed = 0;
+    conn->retried = 0;
+    conn->origin_closed = 0;
+
+    connect_upstream(conn, 1);
+}
+
+/**
+ * Streams the response of the flight the current request follows to the client, as far as
+ * the leader stored it and the client socket takes it. The client is not watched while
+ * the connection waits for the leader.
+ *
+ * @param conn: The connection, following a flight.
+ */
+static void follow_flight(connection* conn)
+{
+    communication_info* ci = conn->ci;
+
+    while (1)
+    {
+        // The stored head goes first
+        if (conn->output_sent < conn->output_length)
+        {
+            int result = write_some(conn->client.fd, conn->output, conn->output_length, &conn->output_sent);
+            if (result == 0)
+            {
+                wait_for_room(conn);
+                return;
+            }
+            if (result == -1)
+            {
+                close_connection(conn);
+                return;
+            }
+            continue;
+        }
+
+        cache_object* object;
+        size_t filled;
+        cache_flight_state state = cache_flight_status(ci->flight, &object, &filled);
+
+        if (state == CACHE_FLIGHT_FAILED)
+        {
+            // Once the client saw part of the response it cannot be told anything else
+            if (conn->output != NULL)
+            {
+                close_connection(conn);
+                return;
+            }
+
+            // The leader got nothing to share, fetch the response separately
+            stop_following(conn);
+            cache_flight_leave(ci->flight);
+            ci->flight = NULL;
+            forward_to_origin(conn);
+            return;
+        }
+
+        if (state != CACHE_FLIGHT_PENDING && conn->output == NULL)
+        {
+            conn->output = request_alloc(conn, HTTP_MAX_HEADER_SIZE + 64);
+            if (conn->output == NULL)
+            {
+                fprintf(stderr, "Memory allocation failed\n");
+                send_error(conn, ERROR_500_INTERNAL);
+                return;
+            }
+            conn->output_length = cache_build_head(object, conn->keep_alive, conn->output, HTTP_MAX_HEADER_SIZE + 64);
+            conn->output_sent = 0;
+            ci->status = 200;
+            continue;
+        }
+
+        // Then the body bytes the leader stored so far
+        if (state != CACHE_FLIGHT_PENDING && conn->cached_sent < filled)
+        {
+            int result = cache_send_body(object, conn->client.fd, &conn->cached_sent, filled);
+            ci->response_bytes = conn->cached_sent;
+            if (result == 0)
+            {
+                wait_for_room(conn);
+                return;
+            }
+            if (result == -1)
+            {
+                close_connection(conn);
+                return;
+            }
+            continue;
+        }
+
+        if (state == CACHE_FLIGHT_DONE)
+        {
+            finish_response(conn, 0);
+            return;
+        }
+
+        // Wait for the leader to store more
+        if (cache_flight_wait(ci->flight, conn->cached_sent, &conn->flight_waiter) == 0)
+        {
+            watch(conn->loop, &conn->client, 0);
+            return;
+        }
+    }
+}
+
+/**
+ * Flight callback. It runs on the thread of the leading request, so it only queues the
+ * connection for its loop and wakes the loop up.
+ *
+ * @param waiter: The flight waiter embedded in the connection.
+ */
+static void flight_moved(cache_waiter* waiter)
+{
+    connection* conn = (connection*)waiter->context;
+    event_loop* loop = conn->loop;
+
+    pthread_mutex_lock(&loop->lock);
+    if (!conn->flight_queued)
+    {
+        conn->next_flight = loop->flights;
+        loop->flights = conn;
+        conn->flight_queued = 1;
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    uint64_t one = 1;
+    if (write(loop->wakeup.fd, &one, sizeof(one)) == -1)
+        perror("error: write\n");
+}
+
+/**
+ * Starts forwarding the current request once its origin is known to be allowed, unless a
+ * fresh stored response answers it or an identical request is already fetching it.
+ *
+ * @param conn: The connection.
+ */
+static void start_forwarding(connection* conn)
+{
+    // A tunnel gets an origin connection of its own, never a pooled one
+    if (conn->ci->tunnel)
+    {
+        free_response_buffers(conn);
+        connect_upstream(conn, 0);
+        return;
+    }
+
+    int cached = check_cache(conn->ci);
+    if (cached == 1)
+    {
+        start_cached(conn); // The origin is not contacted
+        return;
+    }
+
+    if (cached == 2)
+    {
+        // Stream the response of the identical request
+        free_response_buffers(conn);
+        conn->cached_sent = 0;
+        set_state(conn, CONN_FOLLOW);
+        follow_flight(conn);
+        return;
+    }
+
+    forward_to_origin(conn);
+}
+
+/**
+ * Continues with the answer of the resolver: the addresses are matched against the CIDR rules
+ * and the request is forwarded.
+ *
+ * @param conn: The connection, with the addresses of the origin in ci->host_addresses.
+ * @param result: 1 if the origin was resolved, -1 otherwise.
+ */
+static void resolution_done(connection* conn, int result)
+{
+    if (result != 1)
+    {
+        send_error(conn, ERROR_404_NOT_FOUND);
+        return;
+    }
+
+    unsigned long long started = metrics_clock_us();
+    int filtered = is_filtered_address(conn->ci->filter, &conn->ci->host_addresses);
+    metrics_observe(METRIC_PHASE_FILTER, conn->filter_time + metrics_clock_us() - started);
+    if (filtered)
+    {
+        metrics_count(METRIC_FILTER_ADDRESS_HITS, 1);
+        send_error(conn, ERROR_403_FORBIDDEN);
+        return;
+    }
+
+    start_forwarding(conn);
+}
+
+/**
+ * Resolver callback. It runs on a resolver thread, so it only queues the connection for its
+ * loop and wakes the loop up.
+ *
+ * @param waiter: The waiter embedded in the connection.
+ */
+static void resolution_completed(resolver_waiter* waiter)
+{
+    connection* conn = (connection*)waiter->context;
+    event_loop* loop = conn->loop;
+
+    pthread_mutex_lock(&loop->lock);
+    conn->next_resolved = loop->resolved;
+    loop->resolved = conn;
+    pthread_mutex_unlock(&loop->lock);
+
+    uint64_t one = 1;
+    if (write(loop->wakeup.fd, &one, sizeof(one)) == -1)
+        perror("error: write\n");
+}
+
+/**
+ * Takes the next request out of the client's bytes, if a complete header block arrived,
+ * and starts serving it: the request is checked and filtered, then its origin is resolved.
+ *
+ * @param conn: The connection, waiting for a request.
+ */
+static void start_request(connection* conn)
+{
+    communication_info* ci = conn->ci;
+
+    if (conn->state != CONN_READ_REQUEST || conn->input_length == 0)
+        return;
+
+    // Only the bytes that arrived since the previous call are parsed, the index survives between reads
+    if (!http_request_parse(&ci->parsed, conn->input, conn->input_length))
+    {
+        if (conn->input_length >= EVENTLOOP_MAX_REQUEST_SIZE)
+            send_error(conn, ERROR_400_BAD_REQUEST);
+        return;
+    }
+
+    // Copy the request out and keep whatever follows for the next one
+    size_t request_length = ci->parsed.length;
+    ci->request = request_alloc(conn, request_length + 1);
+    if (ci->request == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        send_error(conn, ERROR_500_INTERNAL);
+        return;
+    }
+    memcpy(ci->request, conn->input, request_length);
+    ci->request[request_length] = '\0';
+    conn->input_length -= request_length;
+    memmove(conn->input, conn->input + request_length, conn->input_length);
+
+    metrics_count(METRIC_REQUESTS, 1);
+    metrics_observe(METRIC_PHASE_PARSE, metrics_clock_us() - conn->request_arrived);
+    ci->arrived = conn->request_arrived;
+    conn->request_arrived = 0;
+
+    // Long-lived connections pick up a reloaded filter on their next request
+    if (conn->served > 0)
+    {
+        filter_release(ci->filter);
+        ci->filter = filter_acquire_current();
+    }
+
+    // Decide whether the client connection stays open once this request is answered
+    conn->keep_alive = is_client_keep_alive(ci) && conn->served + 1 < config.max_requests_per_connection &&
+                       !lifecycle_draining();
+    conn->served++;
+
+    // Ask the origin to keep the connection open so it can go back to the pool
+    if (set_request_header(ci, "Connection", "keep-alive") != 1)
+    {
+        send_error(conn, ERROR_500_INTERNAL);
+        return;
+    }
+
+    // Validate the request format and headers
+    int error = check_request(ci);
+    if (error != 0)
+    {
+        send_error(conn, error);
+        return;
+    }
+
+    // Clean the host name and get the port from the host header
+    ci->clean_host_name = get_clean_host(ci->arena, ci->host_name);
+    ci->host_port = get_port(ci->host_name);
+    if (ci->clean_host_name == NULL || ci->host_port == -1)
+    {
+        send_error(conn, ERROR_500_INTERNAL);
+        return;
+    }
+
+    // Listed hostnames are refused without resolving them
+    unsigned long long started = metrics_clock_us();
+    int listed = filter_match_host(ci->filter, ci->host_name);
+    conn->filter_time = metrics_clock_us() - started;
+    if (listed)
+    {
+        metrics_observe(METRIC_PHASE_FILTER, conn->filter_time);
+        metrics_count(METRIC_FILTER_HOST_HITS, 1);
+        send_error(conn, ERROR_403_FORBIDDEN);
+        return;
+    }
+
+    set_state(conn, CONN_RESOLVING);
+    watch(conn->loop, &conn->client, 0);
+
+    int result = resolver_resolve_async(ci->clean_host_name, &ci->host_addresses, &conn->waiter);
+    if (result == 0)
+    {
+        // The answer arrives through resolution_completed()
+        conn->resolving = 1;
+        conn->loop->resolving_count++;
+        return;
+    }
+
+    resolution_done(conn, result);
+}
+
+/**
+ * Reads what the client sent and starts serving the request once it is complete.
+ *
+ * @param conn: The connection, waiting for a request.
+ */
+static void read_request(connection* conn)
+{
+    // Grow the input buffer when it is full
+    if (conn->input_length == conn->input_capacity)
+    {
+        size_t capacity = conn->input_capacity == 0 ? BUFFER_SIZE : conn->input_capacity * 2;
+        char* input = realloc(conn->input, capacity);
+        if (input == NULL)
+        {
+            fprintf(stderr, "Buffer reallocation failed\n");
+            close_connection(conn);
+            return;
+        }
+        conn->input = input;
+        conn->input_capacity = capacity;
+    }
+
+    ssize_t bytes_read = read(conn->client.fd, conn->input + conn->input_length, conn->input_capacity - conn->input_length);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+
+    if (bytes_read <= 0)
+    {
+        // Closing between requests is not an error
+        if (bytes_read < 0)
+            perror("error: read\n");
+        close_connection(conn);
+        return;
+    }
+
+    conn->input_length += bytes_read;
+    conn->last_active = timer_wheel_clock_ms();
+    if (conn->request_arrived == 0)
+        conn->request_arrived = metrics_clock_us();
+
+    start_request(conn);
+}
+
+/**
+ * Builds the head to send to the client once the framer has read the origin's header block.
+ *
+ * @param conn: The connection.
+ * @return
+ *   - 1 on success.
+ *   - -1 if memory allocation fails.
+ */
+static int prepare_head(connection* conn)
+{
+    conn->output = request_alloc(conn, RESPONSE_HEAD_SIZE);
+    if (conn->output == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    // A body delimited by close ends the client connection too
+    http_response_framer* framer = conn->framer;
+    if (framer->mode == HTTP_BODY_UNTIL_CLOSE)
+        conn->keep_alive = 0;
+
+    cache_response_head(conn->ci, framer);
+    conn->ci->status = framer->status_code;
+
+    conn->output_length = build_response_head(conn->ci, framer, conn->keep_alive, conn->output);
+    conn->output_sent = 0;
+    return 1;
+}
+
+/**
+ * Compresses the framed body bytes not relayed yet into the next chunk for the client. The
+ * chunk is built in packed, which is only refilled once it was written, so a compressed body
+ * takes no more memory than a plain one.
+ *
+ * @param conn: The connection, relaying a compressed response.
+ * @param finish: 1 once the body is over, the stream is then ended.
+ * @return
+ *   - 1 on success.
+ *   - -1 if memory allocation fails.
+ */
+static int compress_relay(connection* conn, int finish)
+{
+    size_t size = config.relay_buffer_size + COMPRESS_CHUNK_OVERHEAD;
+    if (conn->packed == NULL && (conn->packed = request_alloc(conn, size)) == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    size_t consumed;
+    conn->packed_length = compressor_chunk(conn->ci->compressor, conn->relay + conn->relay_offset,
+                                           conn->relay_framed - conn->relay_offset, &consumed, finish,
+                                           conn->packed, size);
+    conn->packed_sent = 0;
+    conn->relay_offset += consumed;
+    return 1;
+}
+
+/**
+ * Records bytes read from the origin: the first ones end the wait for the response and start
+ * its relay.
+ *
+ * @param conn: The connection, relaying a response.
+ * @param length: The number of bytes read.
+ */
+static void origin_read(connection* conn, size_t length)
+{
+    if (!conn->response_started)
+    {
+        unsigned long long now = metrics_clock_us();
+        metrics_observe(METRIC_PHASE_FIRST_BYTE, now - conn->ci->exchange_clock);
+        conn->ci->exchange_clock = now;
+    }
+
+    conn->response_started = 1;
+    conn->upstream_active = timer_wheel_clock_ms();
+    metrics_count(METRIC_BYTES_TO_CLIENT, length);
+    conn->ci->response_bytes += length;
+}
+
+/**
+ * Moves the exchange with the origin forward as far as the sockets allow: the request is
+ * written, then the response is read, framed, and written to the client. The origin is only
+ * read once everything read before reached the client, so a slow client slows the origin
+ * down instead of filling memory.
+ *
+ * @param conn: The connection, sending the request or relaying the response.
+ */
+static void relay_response(connection* conn)
+{
+    event_loop* loop = conn->loop;
+    http_response_framer* framer = conn->framer;
+
+    if (conn->state == CONN_SEND_REQUEST)
+    {
+        int result = write_request(conn);
+        if (result == 0)
+        {
+            watch(loop, &conn->upstream, EPOLLOUT);
+            return;
+        }
+        if (result == -1)
+        {
+            if (!retry_upstream(conn)) // The idle connection may have gone away
+            {
+                perror("error: write\n");
+                send_error(conn, ERROR_500_INTERNAL);
+            }
+            return;
+        }
+
+        if (conn->ci->body_mode != HTTP_BODY_NONE)
+        {
+            start_body(conn); // The response is read once the whole body was sent
+            return;
+        }
+
+        set_state(conn, CONN_RELAY);
+    }
+
+    while (1)
+    {
+        // The rewritten response head goes first
+        if (conn->output_sent < conn->output_length)
+        {
+            int result = write_some(conn->client.fd, conn->output, conn->output_length, &conn->output_sent);
+            if (result == 0)
+                goto wait_for_client;
+            if (result == -1)
+            {
+                close_connection(conn);
+                return;
+            }
+            continue;
+        }
+
+        // Then the chunks of a compressed body
+        if (conn->packed_sent < conn->packed_length)
+        {
+            int result = write_some(conn->client.fd, conn->packed, conn->packed_length, &conn->packed_sent);
+            if (result == 0)
+                goto wait_for_client;
+            if (result == -1)
+            {
+                close_connection(conn);
+                return;
+            }
+            continue;
+        }
+
+        // Then the body bytes that were framed, compressed first if the head announced it
+        if (conn->relay_offset < conn->relay_framed && conn->ci->compressor != NULL)
+        {
+            if (compress_relay(conn, 0) == -1)
+            {
+                close_connection(conn);
+                return;
+            }
+            continue;
+        }
+        if (conn->relay_offset < conn->relay_framed)
+        {
+            int result = write_some(conn->client.fd, conn->relay, conn->relay_framed, &conn->relay_offset);
+            if (result == 0)
+                goto wait_for_client;
+            if (result == -1)
+            {
+                close_connection(conn);
+                return;
+            }
+            continue;
+        }
+
+        // Then the body bytes spliced into the pipe
+        if (conn->pipe != NULL)
+        {
+            int result = relay_drain(conn->pipe, conn->client.fd);
+            if (result == 0)
+                goto wait_for_client;
+            if (result == -1)
+            {
+                close_connection(conn);
+                return;
+            }
+            release_pipe(conn); // Hold a pipe only while bytes are in flight
+            continue;
+        }
+
+        if (http_framer_done(framer) || conn->origin_closed)
+        {
+            // A compressed body still owes the gzip trailer and the last chunk
+            if (conn->ci->compressor != NULL && !conn->ci->compressor->finished)
+            {
+                if (compress_relay(conn, 1) == -1)
+                {
+                    close_connection(conn);
+                    return;
+                }
+                continue;
+            }
+
+            // Anything past the end of the response would be a protocol violation, do not relay it
+            metrics_observe(METRIC_PHASE_RELAY, metrics_clock_us() - conn->ci->exchange_clock);
+            finish_response(conn, !conn->origin_closed && http_framer_reusable(framer) &&
+                                  conn->relay_framed == conn->relay_length);
+            return;
+        }
+
+        // Frame the bytes read but not looked at yet
+        if (conn->relay_framed < conn->relay_length)
+        {
+            int in_head = framer->state == FRAMER_HEADERS;
+            size_t consumed = http_framer_feed(framer, conn->relay + conn->relay_framed, conn->relay_length - conn->relay_framed);
+            if (!in_head)
+                cache_response_body(conn->ci, conn->relay + conn->relay_framed, consumed);
+            conn->relay_framed += consumed;
+
+            if (in_head && framer->state != FRAMER_HEADERS && is_revalidated(conn->ci, framer))
+            {
+                // The stored response is still valid, the client gets it instead of the 304
+                release_upstream(conn, http_framer_done(framer) && http_framer_reusable(framer) &&
+                                       conn->relay_framed == conn->relay_length);
+                start_cached(conn);
+                return;
+            }
+
+            if (in_head)
+            {
+                conn->relay_offset = conn->relay_framed; // The head is sent rewritten, not as read
+                if (framer->state != FRAMER_HEADERS && prepare_head(conn) == -1)
+                {
+                    close_connection(conn);
+                    return;
+                }
+            }
+            continue;
+        }
+
+        // Everything read was relayed, read more
+        ssize_t bytes_read;
+        unsigned long long opaque_length = http_framer_opaque_length(framer);
+        if (config.splice && conn->ci->cache_store == NULL && conn->ci->compressor == NULL &&
+            opaque_length >= RELAY_SPLICE_MIN && take_pipe(conn) == 1)
+        {
+            // Large body runs go through a pipe and never reach the relay buffer, unless they are being stored or compressed
+            bytes_read = relay_fill(conn->pipe, conn->upstream.fd, opaque_length < SIZE_MAX ? (size_t)opaque_length : SIZE_MAX);
+            if (bytes_read > 0)
+            {
+                origin_read(conn, bytes_read);
+                http_framer_skip(framer, bytes_read);
+                continue;
+            }
+            release_pipe(conn);
+        }
+        else
+        {
+            bytes_read = read(conn->upstream.fd, conn->relay, config.relay_buffer_size);
+            if (bytes_read > 0)
+            {
+                origin_read(conn, bytes_read);
+                conn->relay_length = bytes_read;
+                conn->relay_offset = 0;
+                conn->relay_framed = 0;
+                continue;
+            }
+        }
+
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            watch(loop, &conn->client, 0);
+            watch(loop, &conn->upstream, EPOLLIN);
+            arm_deadline(conn); // The origin has its own deadline
+            return;
+        }
+
+        // The origin closed the connection or failed
+        if (retry_upstream(conn))
+            return; // The pooled connection went away before answering
+
+        if (bytes_read == 0 && framer->state == FRAMER_BODY && framer->mode == HTTP_BODY_UNTIL_CLOSE)
+        {
+            conn->origin_closed = 1; // The end of the stream ends the response
+            continue;
+        }
+
+        if (bytes_read < 0)
+            perror("error: read\n");
+
+        // Only a client that saw nothing yet can still be told about the failure
+        if (conn->output_length == 0 && framer->state == FRAMER_HEADERS)
+            send_error(conn, ERROR_500_INTERNAL);
+        else
+            close_connection(conn);
+        return;
+    }
+
+    wait_for_client:
+    watch(loop, &conn->upstream, 0);
+    wait_for_room(conn);
+}
+
+/**
+ * Writes the body bytes the ring holds to the origin, as far as its socket takes them.
+ *
+ * @param conn: The connection, streaming a request body.
+ * @return
+ *   - 1 if the ring is empty.
+ *   - 0 if the socket is full.
+ *   - -1 if the write failed.
+ */
+static int write_body(connection* conn)
+{
+    while (conn->body_length > 0)
+    {
+        // The bytes may wrap around the end of the ring
+        struct iovec segments[2];
+        size_t first = conn->body_capacity - conn->body_start;
+        if (first > conn->body_length)
+            first = conn->body_length;
+        segments[0].iov_base = conn->body + conn->body_start;
+        segments[0].iov_len = first;
+        segments[1].iov_base = conn->body;
+        segments[1].iov_len = conn->body_length - first;
+
+        ssize_t wrote_bytes = writev(conn->upstream.fd, segments, segments[1].iov_len > 0 ? 2 : 1);
+        if (wrote_bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        conn->body_start = (conn->body_start + wrote_bytes) % conn->body_capacity;
+        conn->body_length -= wrote_bytes;
+        metrics_count(METRIC_BYTES_TO_ORIGIN, wrote_bytes);
+    }
+
+    conn->body_start = 0; // An empty ring fills from its start, in one piece
+    return 1;
+}
+
+/**
+ * Moves the next bytes of the request body into the free space of the ring: those that
+ * arrived with the header block first, then what the client sends. Only body bytes stay in
+ * the ring, the bytes following the body go back to the input buffer for the next request.
+ *
+ * @param conn: The connection, streaming a request body.
+ * @return
+ *   - 1 if bytes were moved.
+ *   - 0 if the client has nothing more to read for now.
+ *   - -1 if the client closed or failed, or memory allocation fails.
+ *   - -2 if the body is malformed.
+ */
+static int fill_body(connection* conn)
+{
+    http_response_framer* framer = conn->body_framer;
+
+    // The free space up to the end of the ring, or up to the first unwritten byte
+    size_t tail = (conn->body_start + conn->body_length) % conn->body_capacity;
+    size_t space = tail < conn->body_start || conn->body_length == conn->body_capacity ?
+                   conn->body_start - tail : conn->body_capacity - tail;
+    if (space == 0)
+        return 0;
+
+    if (conn->input_length > 0)
+    {
+        size_t consumed = http_framer_feed(framer, (unsigned char*)conn->input, conn->input_length < space ? conn->input_length : space);
+        if (framer->mode == HTTP_BODY_UNTIL_CLOSE)
+            return -2;
+
+        memcpy(conn->body + tail, conn->input, consumed);
+        conn->body_length += consumed;
+        conn->input_length -= consumed;
+        memmove(conn->input, conn->input + consumed, conn->input_length);
+        return consumed > 0;
+    }
+
+    ssize_t bytes_read = read(conn->client.fd, conn->body + tail, space);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (bytes_read <= 0)
+    {
+        if (bytes_read < 0)
+            perror("error: read\n");
+        return -1;
+    }
+
+    size_t consumed = http_framer_feed(framer, conn->body + tail, bytes_read);
+    if (framer->mode == HTTP_BODY_UNTIL_CLOSE)
+        return -2;
+    conn->body_length += consumed;
+
+    // Bytes past the end of the body start the next request
+    size_t extra = bytes_read - consumed;
+    if (extra > conn->input_capacity)
+    {
+        char* input = realloc(conn->input, extra);
+        if (input == NULL)
+        {
+            fprintf(stderr, "Buffer reallocation failed\n");
+            return -1;
+        }
+        conn->input = input;
+        conn->input_capacity = extra;
+    }
+    memcpy(conn->input, conn->body + tail + consumed, extra);
+    conn->input_length = extra;
+
+    return 1;
+}
+
+/**
+ * Streams the request body from the client to the origin through the ring, reading the
+ * client while there is room and writing the origin while there are bytes, so a slow origin
+ * slows the client down and the connection never holds more than the ring. The response is
+ * relayed once the whole body was sent.
+ *
+ * @param conn: The connection, streaming a request body.
+ */
+static void send_body(connection* conn)
+{
+    http_response_framer* framer = conn->body_framer;
+
+    while (1)
+    {
+        size_t output_sent = conn->output_sent;
+        size_t body_length = conn->body_length;
+
+        // The interim answer to "Expect: 100-continue" goes to the client
+        if (write_some(conn->client.fd, conn->output, conn->output_length, &conn->output_sent) == -1)
+        {
+            close_connection(conn);
+            return;
+        }
+
+        if (write_body(conn) == -1)
+        {
+            perror("error: write\n");
+            send_error(conn, ERROR_500_INTERNAL);
+            return;
+        }
+
+        int progress = conn->output_sent != output_sent || conn->body_length != body_length;
+
+        if (http_framer_done(framer) && conn->body_length == 0 && conn->output_sent == conn->output_length)
+        {
+            // The whole request reached the origin, its response comes next
+            conn->output = NULL;
+            conn->output_length = 0;
+            conn->output_sent = 0;
+            set_state(conn, CONN_RELAY);
+            relay_response(conn);
+            return;
+        }
+
+        int result = http_framer_done(framer) ? 0 : fill_body(conn);
+        if (result == -1)
+        {
+            close_connection(conn); // Gone in the middle of its body, nobody to answer
+            return;
+        }
+        if (result == -2)
+        {
+            send_error(conn, ERROR_400_BAD_REQUEST);
+            return;
+        }
+
+        if (result == 0 && !progress)
+            break; // Both sockets would block
+        conn->last_active = timer_wheel_clock_ms();
+    }
+
+    // Wait for whichever socket lets the body go on
+    uint32_t client_events = 0;
+    if (!http_framer_done(framer) && conn->body_length < conn->body_capacity)
+        client_events |= EPOLLIN;
+    if (conn->output_sent < conn->output_length)
+        client_events |= EPOLLOUT;
+    watch(conn->loop, &conn->client, client_events);
+    watch(conn->loop, &conn->upstream, conn->body_length > 0 ? EPOLLOUT : 0);
+}
+
+/**
+ * Starts streaming the request body once the request head reached the origin.
+ *
+ * @param conn: The connection, with the request head sent.
+ */
+static void start_body(connection* conn)
+{
+    conn->body_framer = request_alloc(conn, sizeof(http_response_framer));
+    conn->body_capacity = config.body_buffer_size;
+    conn->body = request_alloc(conn, conn->body_capacity);
+    if (conn->body_framer == NULL || conn->body == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        send_error(conn, ERROR_500_INTERNAL);
+        return;
+    }
+
+    http_framer_init_body(conn->body_framer, conn->ci->body_mode, conn->ci->body_length);
+    conn->body_start = 0;
+    conn->body_length = 0;
+
+    // The client holds its body back until it is told to go on
+    if (expects_continue(conn->ci))
+    {
+        conn->output = request_alloc(conn, strlen(CONTINUE_RESPONSE));
+        if (conn->output == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            send_error(conn, ERROR_500_INTERNAL);
+            return;
+        }
+        memcpy(conn->output, CONTINUE_RESPONSE, strlen(CONTINUE_RESPONSE));
+        conn->output_length = strlen(CONTINUE_RESPONSE);
+        conn->output_sent = 0;
+    }
+
+    conn->last_active = timer_wheel_clock_ms();
+    set_state(conn, CONN_SEND_BODY);
+    send_body(conn);
+}
+
+/**
+ * Handles readiness of a client socket.
+ *
+ * @param conn: The connection.
+ * @param events: The epoll events reported.
+ */
+static void handle_client_event(connection* conn, uint32_t events)
+{
+    // A tunnel may still have bytes to pass on when the client hung up
+    if (events & EPOLLERR || (events & EPOLLHUP && conn->state != CONN_TUNNEL))
+    {
+        close_connection(conn);
+        return;
+    }
+
+    switch (conn->state)
+    {
+        case CONN_READ_REQUEST:
+            if (events & EPOLLIN)
+                read_request(conn);
+            break;
+
+        case CONN_RELAY:
+            if (events & EPOLLOUT)
+                relay_response(conn);
+            break;
+
+        case CONN_SEND_CACHED:
+            if (events & EPOLLOUT)
+                send_cached(conn);
+            break;
+
+        case CONN_FOLLOW:
+            if (events & EPOLLOUT)
+                follow_flight(conn);
+            break;
+
+        case CONN_TUNNEL:
+            pump_tunnel(conn);
+            break;
+
+        case CONN_SEND_BODY:
+            send_body(conn);
+            break;
+
+        case CONN_SEND_ERROR:
+            if (events & EPOLLOUT)
+            {
+                int result = write_some(conn->client.fd, conn->output, conn->output_length, &conn->output_sent);
+                if (result == 1)
+                    finish_response(conn, 0); // Closes the connection unless the error kept it alive
+                else if (result == -1)
+                    close_connection(conn);
+            }
+            break;
+
+        default:
+            break; // The client is not watched in the other states
+    }
+}
+
+/**
+ * Handles readiness of an origin socket.
+ *
+ * @param conn: The connection.
+ * @param events: The epoll events reported.
+ */
+static void handle_upstream_event(connection* conn, uint32_t events)
+{
+    switch (conn->state)
+    {
+        case CONN_TUNNEL:
+            if (events & EPOLLERR)
+                close_connection(conn); // The origin reset the tunnel
+            else
+                pump_tunnel(conn);
+            break;
+
+        case CONN_SEND_REQUEST:
+        case CONN_RELAY:
+            relay_response(conn);
+            break;
+
+        case CONN_SEND_BODY:
+            if (events & (EPOLLERR | EPOLLHUP))
+                send_error(conn, ERROR_500_INTERNAL); // The origin went away in the middle of the body
+            else
+                send_body(conn);
+            break;
+
+        default:
+            break; // A stale event of a descriptor that was released in this batch
+    }
+}
+
+/**
+ * Stops accepting new connections on a loop, for good.
+ *
+ * @param loop: The loop.
+ */
+static void stop_accepting(event_loop* loop)
+{
+    if (!loop->accepting)
+        return;
+
+    loop->accepting = 0;
+    if (loop->listener.registered)
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listener.fd, NULL);
+    loop->listener.registered = 0;
+}
+
+/**
+ * Accepts the pending connections of the listening socket, within the global accept limit.
+ *
+ * @param loop: The loop taking the connections.
+ */
+static void accept_connections(event_loop* loop)
+{
+    for (int i = 0; i < EVENTLOOP_MAX_EVENTS && loop->accepting; i++)
+    {
+        // Take a ticket first so the loops together never exceed the limit
+        if (atomic_fetch_add(&accepted, 1) >= accept_limit)
+        {
+            stop_accepting(loop);
+            return;
+        }
+
+        struct sockaddr_in6 address = {.sin6_family = 0}; // An IPv4 listener fills only the front
+        socklen_t address_length = sizeof(address);
+        int sd = accept4(loop->listener.fd, (struct sockaddr*)&address, &address_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sd < 0)
+        {
+            atomic_fetch_sub(&accepted, 1); // Give the ticket back
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+                perror("error: accept\n");
+            return;
+        }
+        tune_socket(sd);
+
+        connection* conn = calloc(1, sizeof(connection));
+        communication_info* ci = malloc(sizeof(communication_info));
+        if (conn == NULL || ci == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            free(conn);
+            free(ci);
+            close(sd);
+            continue;
+        }
+
+        init_communication_info(ci); // Initialize the communication info structure
+        ci->client_socket = sd;
+        ci->client_address = address;
+        metrics_count(METRIC_CONNECTIONS_ACCEPTED, 1);
+        ci->filter = filter_acquire_current(); // Borrow the current snapshot, no copy per connection
+
+        conn->loop = loop;
+        conn->ci = ci;
+        conn->client.type = HANDLE_CLIENT;
+        conn->client.conn = conn;
+        conn->client.fd = sd;
+        conn->upstream.type = HANDLE_UPSTREAM;
+        conn->upstream.conn = conn;
+        conn->upstream.fd = -1;
+        for (int j = 0; j < RESOLVER_MAX_ADDRESSES; j++)
+        {
+            conn->attempts[j].type = HANDLE_ATTEMPT;
+            conn->attempts[j].conn = conn;
+            conn->attempts[j].fd = -1;
+        }
+        conn->waiter.callback = resolution_completed;
+        conn->waiter.context = conn;
+        conn->flight_waiter.callback = flight_moved;
+        conn->flight_waiter.context = conn;
+        conn->deadline.context = conn;
+        conn->last_active = timer_wheel_clock_ms();
+        set_state(conn, CONN_READ_REQUEST);
+
+        conn->next = loop->connections;
+        if (loop->connections != NULL)
+            loop->connections->prev = conn;
+        loop->connections = conn;
+        loop->connection_count++;
+
+        // A client holding too many connections is answered before its request is read
+        ci->admitted = admission_enter(&address);
+        if (!ci->admitted)
+        {
+            metrics_count(METRIC_SHED_CLIENT_LIMIT, 1);
+            send_error(conn, ERROR_503_SERVICE_UNAVAILABLE);
+            continue;
+        }
+
+        watch(loop, &conn->client, EPOLLIN);
+    }
+}
+
+/**
+ * Continues the connections whose resolution completed.
+ *
+ * @param loop: The loop.
+ */
+static void handle_resolved(event_loop* loop)
+{
+    uint64_t count;
+    if (read(loop->wakeup.fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        perror("error: read\n");
+
+    pthread_mutex_lock(&loop->lock);
+    connection* conn = loop->resolved;
+    loop->resolved = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    while (conn != NULL)
+    {
+        connection* next = conn->next_resolved;
+
+        conn->resolving = 0;
+        loop->resolving_count--;
+
+        if (conn->orphaned)
+            free(conn); // Closed in an earlier batch, the resolver held the last reference
+        else if (!conn->closed && conn->state == CONN_RESOLVING)
+        {
+            // Unless the lookup timed out
+            conn->ci->host_addresses = conn->waiter.answer;
+            resolution_done(conn, conn->waiter.result);
+        }
+
+        conn = next;
+    }
+}
+
+/**
+ * Continues the connections whose flight moved on.
+ *
+ * @param loop: The loop.
+ */
+static void handle_flights(event_loop* loop)
+{
+    while (1)
+    {
+        // One at a time, the callback may queue a connection again while it is served
+        pthread_mutex_lock(&loop->lock);
+        connection* conn = loop->flights;
+        if (conn != NULL)
+        {
+            loop->flights = conn->next_flight;
+            conn->flight_queued = 0;
+        }
+        pthread_mutex_unlock(&loop->lock);
+
+        if (conn == NULL)
+            break;
+        if (conn->state == CONN_FOLLOW)
+            follow_flight(conn);
+    }
+}
+
+/**
+ * Handles the timer of a connection firing. A deadline that activity pushed back is scheduled
+ * again. A connection attempt to the origin that got no answer within the attempt delay lets the
+ * next address join the race. Otherwise a quiet client gets its connection closed, and an origin
+ * that did not answer in time gets the request answered with 504 Gateway Timeout, or cut short if
+ * the client saw part of the response already.
+ *
+ * @param timer: The deadline of the connection.
+ */
+static void deadline_expired(wheel_timer* timer)
+{
+    connection* conn = (connection*)timer->context;
+    unsigned long long now = timer_wheel_clock_ms();
+    unsigned long long deadline = connection_deadline(conn);
+
+    if (deadline > now)
+    {
+        arm_deadline(conn);
+        return;
+    }
+
+    int request_expired = config.request_timeout > 0 && conn->state != CONN_READ_REQUEST && conn->state != CONN_TUNNEL &&
+                          now >= conn->request_started + config.request_timeout * 1000ULL;
+
+    if (conn->state == CONN_READ_REQUEST)
+    {
+        // A connection that goes quiet between requests is not an error
+        if (conn->served == 0 || conn->input_length > 0)
+        {
+            printf("Read operation timed out\n");
+            send_error(conn, ERROR_500_INTERNAL);
+        }
+        else
+            close_connection(conn);
+    }
+    else if (conn->state == CONN_TUNNEL)
+        close_connection(conn);
+    else if (conn->state == CONN_CONNECTING && !request_expired &&
+             now < conn->phase_started + config.connect_timeout * 1000ULL)
+        start_attempt(conn); // No attempt answered within the attempt delay, the next address joins
+    else if (conn->state == CONN_SEND_BODY && !request_expired)
+    {
+        printf("Read operation timed out\n"); // The body stalled
+        send_error(conn, ERROR_500_INTERNAL);
+    }
+    else if (conn->client.events & EPOLLOUT && !request_expired)
+    {
+        printf("Write operation timed out\n"); // The client stopped reading its response
+        close_connection(conn);
+    }
+    else
+    {
+        printf("Destination timed out\n");
+        stop_following(conn);
+
+        // Only a client that saw nothing yet can still be told about it
+        if (conn->state != CONN_SEND_ERROR && conn->output_sent == 0 && conn->cached_sent == 0)
+            send_error(conn, ERROR_504_GATEWAY_TIMEOUT);
+        else
+            close_connection(conn);
+    }
+}
+
+/**
+ * Frees the connections closed during the last batch of events, unless the resolver
+ * still refers to them.
+ *
+ * @param loop: The loop.
+ */
+static void free_closed_connections(event_loop* loop)
+{
+    while (loop->closed != NULL)
+    {
+        connection* conn = loop->closed;
+        loop->closed = conn->next;
+
+        if (conn->resolving)
+            conn->orphaned = 1; // handle_resolved() frees it
+        else
+            free(conn);
+    }
+}
+
+/**
+ * Starts the drain of a loop: it stops accepting, closes the connections waiting for their next
+ * request and has the others closed once their current request is answered.
+ *
+ * @param loop: The loop.
+ */
+static void drain_loop(event_loop* loop)
+{
+    loop->draining = 1;
+    stop_accepting(loop);
+
+    for (connection* conn = loop->connections; conn != NULL;)
+    {
+        connection* next = conn->next; // Closing unlinks it
+
+        if (conn->state == CONN_READ_REQUEST && conn->input_length == 0 && conn->served > 0)
+            close_connection(conn);
+        else
+            conn->keep_alive = 0;
+
+        conn = next;
+    }
+}
+
+/**
+ * The body of an event loop thread.
+ *
+ * @param arg: The event_loop.
+ * @return NULL.
+ */
+static void* event_loop_thread(void* arg)
+{
+    event_loop* loop = (event_loop*)arg;
+    struct epoll_event events[EVENTLOOP_MAX_EVENTS];
+    unsigned long long last_second = timer_wheel_clock_ms() / 1000;
+
+    // Everything the loop allocates from now on comes from the memory of its unit
+    affinity_pin(loop->group);
+
+    // Run until the accept limit is reached and every connection is done
+    while (loop->accepting || loop->connection_count > 0 || loop->resolving_count > 0)
+    {
+        // Wake up every tick while deadlines are pending
+        int count = epoll_wait(loop->epoll_fd, events, EVENTLOOP_MAX_EVENTS, loop->timers.count > 0 ? TIMER_WHEEL_TICK_MS : 1000);
+        if (count < 0 && errno != EINTR)
+        {
+            perror("error: epoll_wait\n");
+            break;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            loop_handle* handle = (loop_handle*)events[i].data.ptr;
+
+            if (handle->type == HANDLE_LISTENER)
+                accept_connections(loop);
+            else if (handle->type == HANDLE_WAKEUP)
+            {
+                handle_resolved(loop);
+                handle_flights(loop);
+            }
+            else if (handle->conn->closed)
+                continue; // Closed while handling an earlier event of this batch
+            else if (handle->type == HANDLE_CLIENT)
+                handle_client_event(handle->conn, events[i].events);
+            else if (handle->type == HANDLE_ATTEMPT)
+                finish_attempt(handle->conn, handle);
+            else
+                handle_upstream_event(handle->conn, events[i].events);
+        }
+
+        // Fire the deadlines that passed
+        unsigned long long now = timer_wheel_clock_ms();
+        timer_wheel_advance(&loop->timers, now / TIMER_WHEEL_TICK_MS, deadline_expired);
+
+        // Once a second, notice that other loops used up the accept limit
+        if (now / 1000 != last_second)
+        {
+            last_second = now / 1000;
+            if (atomic_load(&accepted) >= accept_limit)
+                stop_accepting(loop);
+        }
+
+        // A drain closes what is left once its deadline passed
+        if (!loop->draining && lifecycle_draining())
+            drain_loop(loop);
+        if (loop->draining && now >= lifecycle_drain_deadline())
+            while (loop->connections != NULL)
+                close_connection(loop->connections);
+
+        free_closed_connections(loop);
+    }
+
+    // Connections left over after a failure are closed
+    while (loop->connections != NULL)
+        close_connection(loop->connections);
+    free_closed_connections(loop);
+
+    while (loop->free_pipes != NULL)
+    {
+        relay_pipe* pipe = loop->free_pipes;
+        loop->free_pipes = pipe->next;
+        relay_pipe_close(pipe);
+        free(pipe);
+    }
+
+    return NULL;
+}
+
+/**
+ * Creates the epoll instance of a loop and registers its listening socket and wakeup eventfd.
+ *
+ * @param loop: The loop, zeroed.
+ * @param ws: The listening socket of the loop.
+ * @return
+ *   - 1 on success.
+ *   - -1 on failure, nothing is left allocated.
+ */
+static int init_event_loop(event_loop* loop, int ws)
+{
+    timer_wheel_init(&loop->timers, timer_wheel_clock_ms() / TIMER_WHEEL_TICK_MS);
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1)
+    {
+        perror("error: epoll_create1\n");
+        return -1;
+    }
+
+    loop->wakeup.type = HANDLE_WAKEUP;
+    loop->wakeup.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wakeup.fd == -1)
+    {
+        perror("error: eventfd\n");
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    if (pthread_mutex_init(&loop->lock, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to initialize event loop mutex\n");
+        close(loop->wakeup.fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    watch(loop, &loop->wakeup, EPOLLIN);
+
+    // Loops sharing a listening socket are woken one at a time thanks to EPOLLEXCLUSIVE
+    loop->listener.type = HANDLE_LISTENER;
+    loop->listener.fd = ws;
+    watch(loop, &loop->listener, EPOLLIN | EPOLLEXCLUSIVE);
+    loop->accepting = 1;
+
+    return 1;
+}
+
+
+int run_event_loops(const int* listeners, int listener_count, int num_loops, size_t max_connections)
+{
+    if (num_loops < 1 || num_loops > MAXT_IN_POOL)
+    {
+        fprintf(stderr, "Event loop count must be between 1 and %d\n", MAXT_IN_POOL);
+        return -1;
+    }
+
+    // The loops only ever accept when epoll reports a listening socket readable
+    for (int i = 0; i < listener_count; i++)
+        if (fcntl(listeners[i], F_SETFL, fcntl(listeners[i], F_GETFL) | O_NONBLOCK) == -1)
+        {
+            perror("error: fcntl\n");
+            return -1;
+        }
+
+    accept_limit = max_connections;
+    atomic_store(&accepted, 0);
+
+    event_loop* loops = calloc(num_loops, sizeof(event_loop));
+    if (loops == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    int started = 0;
+    for (; started < num_loops; started++)
+    {
+        loops[started].group = started;
+        if (init_event_loop(&loops[started], listeners[started % listener_count]) == -1)
+            break;
+
+        if (pthread_create(&loops[started].thread, NULL, event_loop_thread, &loops[started]) != 0)
+        {
+            fprintf(stderr, "Failed to create event loop thread\n");
+            pthread_mutex_destroy(&loops[started].lock);
+            close(loops[started].wakeup.fd);
+            close(loops[started].epoll_fd);
+            break;
+        }
+    }
+
+    // Without every loop running, stop the ones that did start once they are idle
+    if (started < num_loops)
+        atomic_store(&accepted, accept_limit);
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(loops[i].thread, NULL);
+        pthread_mutex_destroy(&loops[i].lock);
+        close(loops[i].wakeup.fd);
+        close(loops[i].epoll_fd);
+    }
+
+    free(loops);
+    return started == num_loops ? 1 : -1;
+}
@@ -0,0 +1,182 @@
+#ifndef PROXYSERVER_EVENTLOOP_H
+#define PROXYSERVER_EVENTLOOP_H
+
+#include <pthread.h>
+#include "proxyServer.h"
+
+/**
+ * eventloop.h
+ *
+ * This file declares the event-driven connection engine. Each event loop thread
+ * owns an epoll instance and serves many connections with non-blocking sockets.
+ * Every client connection, together with its origin connection, is a state
+ * machine that moves from reading the request to filtering, resolving,
+ * connecting, sending the request and its body and relaying the response, and back to
+ * reading the next request while the client keeps the connection open. A
+ * CONNECT request turns the connection into a tunnel relaying both ways.
+ * Every connection has a single timer in the timer wheel of its loop, set to
+ * the deadline of the phase it is in.
+ */
+
+// maximum number of events handled per epoll_wait() call
+#define EVENTLOOP_MAX_EVENTS 256
+
+// largest request header block accepted from a client
+#define EVENTLOOP_MAX_REQUEST_SIZE 65536
+
+// maximum number of empty relay pipes a loop keeps for reuse
+#define EVENTLOOP_MAX_FREE_PIPES 64
+
+
+/**
+ * What a registered file descriptor is
+ */
+typedef enum {
+    HANDLE_LISTENER,   // the listening socket
+    HANDLE_WAKEUP,     // the eventfd other threads use to wake the loop
+    HANDLE_CLIENT,     // the client side of a connection
+    HANDLE_UPSTREAM,   // the origin side of a connection
+    HANDLE_ATTEMPT     // a connection attempt to one address of the origin
+} loop_handle_type;
+
+
+/**
+ * A file descriptor watched by an event loop. Its address is the epoll user data.
+ */
+typedef struct {
+    loop_handle_type type;          // what the descriptor is
+    struct connection_st* conn;     // the owning connection, NULL for the listener and wakeup handles
+    int fd;                         // the descriptor, -1 if none
+    int registered;                 // 1 if the descriptor is in the epoll set
+    uint32_t events;                // the registered epoll events
+} loop_handle;
+
+
+/**
+ * The states of a connection
+ */
+typedef enum {
+    CONN_READ_REQUEST,   // waiting for a complete request header block
+    CONN_RESOLVING,      // waiting for the address of the origin
+    CONN_CONNECTING,     // racing connections to the addresses of the origin until one is established
+    CONN_SEND_REQUEST,   // writing the request to the origin
+    CONN_SEND_BODY,      // streaming the request body from the client to the origin
+    CONN_RELAY,          // relaying the response to the client
+    CONN_SEND_CACHED,    // writing a stored response to the client
+    CONN_FOLLOW,         // streaming the response an identical request is fetching
+    CONN_TUNNEL,         // relaying the bytes of a CONNECT tunnel both ways
+    CONN_SEND_ERROR      // writing an error response, the connection closes afterwards
+} connection_state;
+
+
+/**
+ * A client connection and the origin connection serving its current request
+ */
+typedef struct connection_st {
+    struct connection_st* prev;           // previous connection of the loop
+    struct connection_st* next;           // next connection of the loop, or of the closed list
+    struct connection_st* next_resolved;  // next connection whose resolution completed
+    struct event_loop_st* loop;           // the loop serving the connection
+    connection_state state;               // current state
+    communication_info* ci;               // the request, shared with the helpers of the threaded engine
+    loop_handle client;                   // the client socket
+    loop_handle upstream;                 // the origin socket
+    loop_handle attempts[RESOLVER_MAX_ADDRESSES]; // connection attempts to the origin by address, fd -1 if none
+    int attempts_pending;                 // number of attempts in progress
+    int next_address;                     // index of the next address of the origin to try
+    unsigned long long next_attempt;      // monotonic millisecond the next address is tried if no attempt finished
+    int upstream_reused;                  // 1 if the origin connection came from the pool
+    int retried;                          // 1 once a dead pooled connection was replaced
+    char* input;                          // bytes received from the client and not consumed yet
+    size_t input_length;                  // bytes in input
+    size_t input_capacity;                // size of input
+    size_t request_sent;                  // bytes of the request written to the origin
+    http_response_framer* body_framer;    // follows the request body being streamed, NULL before it starts
+    unsigned char* body;                  // ring of body bytes read from the client
+    size_t body_capacity;                 // size of body
+    size_t body_start;                    // offset of the first byte of body not written to the origin
+    size_t body_length;                   // bytes of body not written to the origin
+    char* output;                         // response head or error message for the client
+    size_t output_length;                 // bytes in output
+    size_t output_sent;                   // bytes of output written
+    char* packed;                         // chunks of the compressed body for the client, NULL if not compressing
+    size_t packed_length;                 // bytes in packed
+    size_t packed_sent;                   // bytes of packed written
+    unsigned char* relay;                 // bytes read from the origin
+    size_t relay_length;                  // bytes in relay
+    size_t relay_offset;                  // start of the body bytes still to be written
+    size_t relay_framed;                  // end of the bytes fed to the framer
+    http_response_framer* framer;         // follows the response being relayed
+    relay_pipe* pipe;                     // body bytes spliced from the origin, NULL if none
+    int response_started;                 // 1 once the origin sent anything
+    int origin_closed;                    // 1 once the origin ended a body delimited by close
+    size_t cached_sent;                   // body bytes of the stored response written
+    cache_waiter flight_waiter;           // waits for the leader of the followed flight
+    struct connection_st* next_flight;    // next connection whose flight moved on
+    int flight_queued;                    // 1 while the connection is in the flights of its loop
+    relay_stream* tunnel;                 // client to origin and origin to client of a tunnel, NULL if none
+    int keep_alive;                       // 1 if the client connection stays open after the response
+    int served;                           // number of requests started on the connection
+    resolver_waiter waiter;               // the pending lookup of the origin
+    int resolving;                        // 1 while the resolver holds the waiter
+    int closed;                           // 1 once the connection was closed
+    int orphaned;                         // 1 if only the resolver still refers to a closed connection
+    unsigned long long last_active;       // monotonic millisecond of the last client activity
+    unsigned long long phase_started;     // monotonic millisecond the current state was entered
+    unsigned long long request_started;   // monotonic millisecond the current request head was complete
+    unsigned long long upstream_active;   // monotonic millisecond the origin last sent bytes, or was sent the request
+    unsigned long long request_arrived;   // monotonic microsecond the first byte of the request head arrived, 0 if none did
+    unsigned long long phase_clock;       // monotonic microsecond the current state was entered
+    unsigned long long filter_time;       // microseconds the current request spent in the filter so far
+    wheel_timer deadline;                 // fires when the current phase of the connection runs out of time
+} connection;
+
+
+/**
+ * One event loop thread and the connections it serves
+ */
+typedef struct event_loop_st {
+    pthread_t thread;                     // the loop thread
+    int group;                            // the worker group the loop thread is pinned as
+    int epoll_fd;                         // the epoll instance
+    loop_handle listener;                 // the listening socket of the loop
+    loop_handle wakeup;                   // eventfd written when a resolution completes
+    int accepting;                        // 1 while the loop accepts new connections
+    int draining;                         // 1 once the loop noticed the drain
+    connection* connections;              // connections being served
+    int connection_count;                 // number of connections being served
+    connection* closed;                   // connections closed during the current batch of events
+    int resolving_count;                  // closed or open connections the resolver still refers to
+    relay_pipe* free_pipes;               // empty pipes ready for the next spliced body
+    int free_pipe_count;                  // number of pipes in free_pipes
+    pthread_mutex_t lock;                 // protects resolved and flights
+    connection* resolved;                 // connections whose resolution completed, not handled yet
+    connection* flights;                  // connections whose flight moved on, not handled yet
+    timer_wheel timers;                   // the deadlines of the connections
+} event_loop;
+
+
+/**
+ * Serves client connections with event loops until a given number of connections has been
+ * accepted and all of them are closed, or until a drain, started by SIGTERM or an upgrade,
+ * is over. Loop i accepts on listening socket i modulo the number of sockets. With one
+ * SO_REUSEPORT socket per loop, the kernel spreads new connections across the loops. Loops
+ * that share a socket take turns. Loop i is pinned as worker group i, and serves every
+ * connection it accepts until it is closed.
+ *
+ * Once draining, a loop stops accepting, closes its connections waiting for their next request
+ * and closes the others after their current response. What is still open at the drain deadline
+ * is closed.
+ *
+ * @param listeners: The listening sockets.
+ * @param listener_count: The number of listening sockets, at least 1.
+ * @param num_loops: The number of event loop threads.
+ * @param max_connections: The number of connections to accept before shutting down, SIZE_MAX
+ *                         to serve until the drain.
+ * @return
+ *   - 1 once every connection was served.
+ *   - -1 if the loops could not be started.
+ */
+int run_event_loops(const int* listeners, int listener_count, int num_loops, size_t max_connections);
+
+#endif //PROXYSERVER_EVENTLOOP_H
@@ -0,0 +1,1006 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <poll.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include "filter.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+
+static _Atomic(filter_set*) current_filter = NULL; // the published snapshot
+static atomic_int acquiring_readers = 0;          // readers between loading current_filter and taking their reference
+
+static pthread_t reloader_thread;  // the background reload thread
+static int reloader_running = 0;   // 1 if reloader_thread was started
+static int reloader_stop_fd = -1;  // eventfd used to wake the reloader for shutdown
+
+
+/**
+ * Frees all the memory associated with a compiled filter.
+ *
+ * @param filter: The compiled filter, may be NULL.
+ */
+static void filter_destroy(filter_set* filter)
+{
+    if (filter == NULL)
+        return;
+
+    free(filter->text);
+    free(filter->hosts);
+    free(filter->nodes);
+    free(filter->ipv4_networks);
+    free(filter->ipv4_masks);
+    free(filter);
+}
+
+/**
+ * Adds a character of a hostname to its 32-bit FNV-1a hash, without regard to case.
+ *
+ * @param hash: The hash of the characters added so far.
+ * @param c: The character.
+ * @return The new hash value.
+ */
+static uint32_t hash_step(uint32_t hash, char c)
+{
+    return (hash ^ (unsigned char)tolower((unsigned char)c)) * FNV_PRIME;
+}
+
+/**
+ * Computes the hash of a hostname from its last character to its first, so the hash of every
+ * suffix of a name is found on the way while hashing the name.
+ *
+ * @param str: The name to hash.
+ * @param length: The number of characters to hash.
+ * @return The hash value.
+ */
+static uint32_t hash_name(const char* str, size_t length)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+
+    for (size_t i = length; i-- > 0;)
+        hash = hash_step(hash, str[i]);
+
+    return hash;
+}
+
+/**
+ * Returns a mask with the first "length" bits set.
+ *
+ * @param length: The number of leading bits to set (0 - 128).
+ * @return The mask.
+ */
+static filter_address prefix_mask(int length)
+{
+    return length == 0 ? 0 : ~(filter_address)0 << (128 - length);
+}
+
+/**
+ * Returns the bit of an address that follows its first "length" bits.
+ *
+ * @param ip: The address.
+ * @param length: The number of bits already consumed (0 - 127).
+ * @return 0 or 1.
+ */
+static int next_bit(filter_address ip, int length)
+{
+    return (int)((ip >> (127 - length)) & 1);
+}
+
+/**
+ * Counts the leading zero bits of an address.
+ *
+ * @param ip: The address.
+ * @return The number of leading zero bits (0 - 128).
+ */
+static int leading_zeros(filter_address ip)
+{
+    uint64_t high = (uint64_t)(ip >> 64);
+    uint64_t low = (uint64_t)ip;
+
+    if (high != 0)
+        return __builtin_clzll(high);
+    return low != 0 ? 64 + __builtin_clzll(low) : 128;
+}
+
+/**
+ * Maps an IPv4 address into the IPv6 space, as ::ffff:a.b.c.d.
+ *
+ * @param ip: The IPv4 address in host byte order.
+ * @return The IPv4-mapped address.
+ */
+static filter_address map_ipv4(uint32_t ip)
+{
+    return ((filter_address)0xFFFF << 32) | ip;
+}
+
+/**
+ * Appends a new node to the trie, growing the node array if needed.
+ *
+ * @param filter: The filter under construction.
+ * @param prefix: The prefix of the new node.
+ * @param length: The significant bits of the prefix.
+ * @param terminal: 1 if a rule ends at the new node.
+ * @return
+ *   - The index of the new node.
+ *   - -1 if a memory allocation fails.
+ */
+static int32_t new_node(filter_set* filter, filter_address prefix, int length, int terminal)
+{
+    if (filter->node_count == filter->node_capacity)
+    {
+        size_t new_capacity = filter->node_capacity * 2;
+        filter_trie_node* new_nodes = realloc(filter->nodes, new_capacity * sizeof(filter_trie_node));
+        if (new_nodes == NULL)
+            return -1;
+
+        filter->nodes = new_nodes;
+        filter->node_capacity = new_capacity;
+    }
+
+    filter_trie_node* node = &filter->nodes[filter->node_count];
+    node->prefix = prefix & prefix_mask(length);
+    node->length = (uint8_t)length;
+    node->terminal = (uint8_t)terminal;
+    node->child[0] = -1;
+    node->child[1] = -1;
+
+    return (int32_t)filter->node_count++;
+}
+
+/**
+ * Inserts a CIDR rule into the trie. Nodes are addressed by index because the node
+ * array may move while it grows.
+ *
+ * @param filter: The filter under construction.
+ * @param prefix: The network address.
+ * @param length: The mask size (0 - 128).
+ * @return
+ *   - 1 on success.
+ *   - -1 if a memory allocation fails.
+ */
+static int trie_insert(filter_set* filter, filter_address prefix, int length)
+{
+    prefix &= prefix_mask(length);
+    int32_t current = 0; // Start at the root, which covers the empty prefix
+
+    while (1)
+    {
+        filter_trie_node* node = &filter->nodes[current];
+
+        // The rule ends exactly at this node
+        if (node->length == length)
+        {
+            node->terminal = 1;
+            return 1;
+        }
+
+        int bit = next_bit(prefix, node->length);
+        int32_t child = node->child[bit];
+
+        // No subtree in that direction yet, hang a leaf for the rule
+        if (child == -1)
+        {
+            int32_t leaf = new_node(filter, prefix, length, 1);
+            if (leaf == -1)
+                return -1;
+
+            filter->nodes[current].child[bit] = leaf;
+            return 1;
+        }
+
+        // Find how many leading bits the rule shares with the child
+        filter_trie_node* child_node = &filter->nodes[child];
+        int common = leading_zeros(prefix ^ child_node->prefix);
+        if (common > length)
+            common = length;
+        if (common > child_node->length)
+            common = child_node->length;
+
+        // The child covers the rule, descend into it
+        if (common == child_node->length)
+        {
+            current = child;
+            continue;
+        }
+
+        // The rule diverges inside the child's prefix, split it with an intermediate node
+        int32_t middle = new_node(filter, prefix, common, common == length);
+        if (middle == -1)
+            return -1;
+
+        filter->nodes[middle].child[next_bit(filter->nodes[child].prefix, common)] = child;
+        filter->nodes[current].child[bit] = middle;
+
+        if (common < length)
+        {
+            int32_t leaf = new_node(filter, prefix, length, 1);
+            if (leaf == -1)
+                return -1;
+
+            filter->nodes[middle].child[next_bit(prefix, common)] = leaf;
+        }
+
+        return 1;
+    }
+}
+
+/**
+ * Converts the 16 bytes of an IPv6 address in network byte order to a trie address.
+ *
+ * @param bytes: The address.
+ * @return The trie address.
+ */
+static filter_address load_ipv6(const uint8_t bytes[16])
+{
+    filter_address ip = 0;
+    for (int i = 0; i < 16; i++)
+        ip = (ip << 8) | bytes[i];
+
+    return ip;
+}
+
+/**
+ * Parses an IP rule of the form "a.b.c.d", "a.b.c.d/mask", "x:y::z" or "x:y::z/mask". An IPv4
+ * rule is stored as the matching range of IPv4-mapped addresses.
+ *
+ * @param line: The rule text.
+ * @param prefix: Receives the address.
+ * @param length: Receives the mask size. A missing or invalid mask covers the whole address.
+ * @return
+ *   - 1 if the rule was parsed.
+ *   - 0 if the address part is not a valid IPv4 or IPv6 address.
+ */
+static int parse_ip_rule(const char* line, filter_address* prefix, int* length)
+{
+    char ip_part[INET6_ADDRSTRLEN]; // Buffer for the address part of the rule
+    const char* slash = strchr(line, '/');
+    size_t ip_length = slash != NULL ? (size_t)(slash - line) : strlen(line);
+
+    if (ip_length >= sizeof(ip_part))
+        return 0;
+
+    memcpy(ip_part, line, ip_length);
+    ip_part[ip_length] = '\0';
+
+    int bits; // Size of the address of the rule
+    struct in_addr ip_addr;
+    struct in6_addr ip6_addr;
+    if (memchr(ip_part, ':', ip_length) != NULL)
+    {
+        if (inet_pton(AF_INET6, ip_part, &ip6_addr) != 1)
+            return 0;
+        *prefix = load_ipv6(ip6_addr.s6_addr);
+        bits = 128;
+    }
+    else
+    {
+        if (inet_pton(AF_INET, ip_part, &ip_addr) != 1)
+            return 0;
+        *prefix = map_ipv4(ntohl(ip_addr.s_addr));
+        bits = 32;
+    }
+
+    *length = bits;
+
+    if (slash != NULL)
+    {
+        char* end_ptr;
+        long mask = strtol(slash + 1, &end_ptr, 10);
+        // Keep the default full mask for invalid or out-of-range masks
+        if (end_ptr != slash + 1 && *end_ptr == '\0' && mask >= 0 && mask <= bits)
+            *length = (int)mask;
+    }
+
+    *length += 128 - bits; // An IPv4 mask counts from the start of the mapped range
+
+    return 1;
+}
+
+/**
+ * Appends the networks of the IPv4-mapped range found under a trie node to the IPv4 arrays.
+ * A terminal node covers its whole subtree, so the networks come out disjoint, and the subtree
+ * of bit 0 before the one of bit 1, so they come out in ascending order.
+ *
+ * @param filter: The filter under construction, with the arrays allocated.
+ * @param index: The node.
+ */
+static void collect_ipv4(filter_set* filter, int32_t index)
+{
+    const filter_trie_node* node = &filter->nodes[index];
+    filter_address mapped = map_ipv4(0);
+    int shared = node->length < 96 ? node->length : 96;
+
+    // The node lies outside the mapped range
+    if (((node->prefix ^ mapped) & prefix_mask(shared)) != 0)
+        return;
+
+    if (node->terminal)
+    {
+        // A rule of 96 bits or less covers every IPv4 address
+        int length = node->length > 96 ? node->length - 96 : 0;
+        filter->ipv4_masks[filter->ipv4_count] = length == 0 ? 0 : ~0u << (32 - length);
+        filter->ipv4_networks[filter->ipv4_count] = (uint32_t)node->prefix & filter->ipv4_masks[filter->ipv4_count];
+        filter->ipv4_count++;
+        return;
+    }
+
+    for (int bit = 0; bit < 2; bit++)
+        if (node->child[bit] != -1)
+            collect_ipv4(filter, node->child[bit]);
+}
+
+/**
+ * Parses a hostname rule of the form "example.com", "*.example.com" or ".example.com" in place:
+ * the name is lowered and loses its wildcard and a trailing dot.
+ *
+ * @param line: The rule text, modified.
+ * @param name: Receives the start of the name inside line.
+ * @param flags: Receives FILTER_HOST_EXACT and FILTER_HOST_SUBDOMAINS as the rule matches them.
+ * @return
+ *   - 1 if the rule was parsed.
+ *   - 0 if the name is empty or longer than FILTER_MAX_HOST_LENGTH.
+ */
+static int parse_host_rule(char* line, char** name, int* flags)
+{
+    *flags = FILTER_HOST_EXACT;
+    if (strncmp(line, "*.", 2) == 0)
+    {
+        *flags = FILTER_HOST_SUBDOMAINS;
+        line += 2;
+    }
+    else if (*line == '.')
+    {
+        *flags = FILTER_HOST_EXACT | FILTER_HOST_SUBDOMAINS;
+        line++;
+    }
+
+    size_t length = strlen(line);
+    if (length > 0 && line[length - 1] == '.')
+        line[--length] = '\0';
+    if (length == 0 || length > FILTER_MAX_HOST_LENGTH)
+        return 0;
+
+    for (size_t i = 0; i < length; i++)
+        line[i] = (char)tolower((unsigned char)line[i]);
+
+    *name = line;
+    return 1;
+}
+
+/**
+ * Inserts a hostname rule into the hash table. The rules of a name already present add their
+ * flags to its slot. The table is sized at construction so it never fills up.
+ *
+ * @param filter: The filter under construction.
+ * @param name: The lowered hostname, must outlive the filter.
+ * @param flags: What the rule matches, FILTER_HOST_EXACT and FILTER_HOST_SUBDOMAINS.
+ */
+static void host_insert(filter_set* filter, const char* name, int flags)
+{
+    size_t length = strlen(name);
+    uint32_t hash = hash_name(name, length);
+    size_t mask = filter->host_capacity - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        filter_host_slot* slot = &filter->hosts[i];
+        if (slot->name == NULL)
+        {
+            slot->hash = hash;
+            slot->length = (uint16_t)length;
+            slot->flags = (uint16_t)flags;
+            slot->name = name;
+            filter->host_count++;
+            return;
+        }
+
+        if (slot->hash == hash && slot->length == length && memcmp(slot->name, name, length) == 0)
+        {
+            slot->flags |= (uint16_t)flags; // Already present
+            return;
+        }
+    }
+}
+
+/**
+ * Looks a hostname up in the hash table.
+ *
+ * @param filter: The compiled filter.
+ * @param hash: The hash of the name, from hash_name().
+ * @param name: The name, in any case, not null-terminated.
+ * @param length: The length of the name.
+ * @param flags: The kinds of rules that match, FILTER_HOST_EXACT or FILTER_HOST_SUBDOMAINS.
+ * @return
+ *   - 1 if a rule of one of those kinds names it.
+ *   - 0 otherwise.
+ */
+static int host_lookup(const filter_set* filter, uint32_t hash, const char* name, size_t length, int flags)
+{
+    size_t mask = filter->host_capacity - 1;
+
+    // Probe until an empty slot ends the cluster
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        const filter_host_slot* slot = &filter->hosts[i];
+        if (slot->name == NULL)
+            return 0;
+
+        if (slot->hash == hash && slot->length == length && (slot->flags & flags) != 0 &&
+            strncasecmp(slot->name, name, length) == 0)
+            return 1;
+    }
+}
+
+
+filter_set* filter_compile(const char* file_content)
+{
+    filter_set* filter = calloc(1, sizeof(filter_set));
+    if (filter == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+
+    atomic_init(&filter->refcount, 1); // The caller holds the first reference
+
+    // Keep a private copy of the text so hostnames can point into it
+    filter->text = strdup(file_content);
+    if (filter->text == NULL)
+        goto fail;
+
+    // Split the text into null-terminated lines and count them to size the hash table
+    size_t line_count = 0;
+    for (char* p = filter->text; *p != '\0'; p++)
+        if (*p == '\r' || *p == '\n')
+            *p = '\0';
+        else if (p == filter->text || p[-1] == '\0')
+            line_count++;
+
+    // Keep the load factor at or below one half
+    filter->host_capacity = 16;
+    while (filter->host_capacity < line_count * 2)
+        filter->host_capacity *= 2;
+
+    filter->hosts = calloc(filter->host_capacity, sizeof(filter_host_slot));
+    filter->node_capacity = 64;
+    filter->nodes = malloc(filter->node_capacity * sizeof(filter_trie_node));
+    if (filter->hosts == NULL || filter->nodes == NULL)
+        goto fail;
+
+    new_node(filter, 0, 0, 0); // The root covers the empty prefix
+
+    char* end = filter->text + strlen(file_content);
+    for (char* line = filter->text; line < end; line += strlen(line) + 1)
+    {
+        if (*line == '\0')
+            continue; // Skip empty lines
+
+        // Treat lines with a colon as IPv6 addresses and lines starting with a digit as IPv4 addresses
+        if (strchr(line, ':') != NULL || isdigit((unsigned char)line[0]))
+        {
+            filter_address prefix;
+            int length;
+            if (!parse_ip_rule(line, &prefix, &length))
+            {
+                fprintf(stderr, "Skipping invalid filter rule: %s\n", line);
+                continue;
+            }
+
+            if (trie_insert(filter, prefix, length) == -1)
+                goto fail;
+
+            filter->ip_rule_count++;
+        }
+        else
+        {
+            char* name;
+            int flags;
+            if (!parse_host_rule(line, &name, &flags))
+            {
+                fprintf(stderr, "Skipping invalid filter rule: %s\n", line);
+                continue;
+            }
+
+            host_insert(filter, name, flags);
+        }
+    }
+
+    // Flatten the IPv4 range of the trie for the batch matcher, a node holds one rule at least
+    filter->ipv4_networks = malloc((filter->ip_rule_count + 1) * sizeof(uint32_t));
+    filter->ipv4_masks = malloc((filter->ip_rule_count + 1) * sizeof(uint32_t));
+    if (filter->ipv4_networks == NULL || filter->ipv4_masks == NULL)
+        goto fail;
+
+    collect_ipv4(filter, 0);
+
+    return filter;
+
+    fail:
+    fprintf(stderr, "Memory allocation failed\n");
+    filter_destroy(filter);
+    return NULL;
+}
+
+
+int filter_match_host(const filter_set* filter, const char* host)
+{
+    const char* colon_pos = strchr(host, ':');
+    size_t length = colon_pos != NULL ? (size_t)(colon_pos - host) : strlen(host);
+    if (length > 0 && host[length - 1] == '.')
+        length--; // "example.com." is example.com
+    if (length == 0 || length > FILTER_MAX_HOST_LENGTH)
+        return 0;
+
+    // Walk the name from its end, the hash covers the suffix after the current character
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = length; i-- > 0;)
+    {
+        if (host[i] == '.' && host_lookup(filter, hash, host + i + 1, length - i - 1, FILTER_HOST_SUBDOMAINS))
+            return 1;
+
+        hash = hash_step(hash, host[i]);
+    }
+
+    return host_lookup(filter, hash, host, length, FILTER_HOST_EXACT);
+}
+
+
+/**
+ * Checks whether an address is covered by one of the CIDR rules of the compiled filter.
+ *
+ * @param filter: The compiled filter.
+ * @param ip: The address.
+ * @return
+ *   - 1 if the address is filtered.
+ *   - 0 otherwise.
+ */
+static int match_address(const filter_set* filter, filter_address ip)
+{
+    int32_t current = 0; // Start at the root
+
+    while (current != -1)
+    {
+        const filter_trie_node* node = &filter->nodes[current];
+
+        // The address left the subtree, nothing deeper can match
+        if (((ip ^ node->prefix) & prefix_mask(node->length)) != 0)
+            return 0;
+
+        if (node->terminal)
+            return 1; // A rule covers the address
+
+        if (node->length == 128)
+            return 0;
+
+        current = node->child[next_bit(ip, node->length)];
+    }
+
+    return 0;
+}
+
+
+int filter_match_ip(const filter_set* filter, uint32_t ip)
+{
+    return match_address(filter, map_ipv4(ip));
+}
+
+
+/**
+ * Finds the network covering an IPv4 address by a binary search of the IPv4 arrays. The
+ * networks are disjoint, so only the last one starting at or below the address can cover it.
+ *
+ * @param filter: The compiled filter.
+ * @param ip: The IPv4 address in host byte order.
+ * @return
+ *   - 1 if the address is filtered.
+ *   - 0 otherwise.
+ */
+static int search_ipv4(const filter_set* filter, uint32_t ip)
+{
+    const uint32_t* networks = filter->ipv4_networks;
+    size_t count = filter->ipv4_count;
+    if (count == 0)
+        return 0;
+
+    // Halve the range without branching, the compiler turns the choice into a conditional move
+    size_t base = 0;
+    while (count > 1)
+    {
+        size_t half = count / 2;
+        base = networks[base + half] <= ip ? base + half : base;
+        count -= half;
+    }
+
+    return (ip & filter->ipv4_masks[base]) == networks[base];
+}
+
+#if defined(__x86_64__)
+/**
+ * Compares the addresses eight at a time with every IPv4 network, with AVX2.
+ *
+ * @param filter: The compiled filter.
+ * @param ips: The IPv4 addresses in host byte order.
+ * @param count: The number of addresses.
+ * @param bitmap: Receives the matches, cleared by the caller.
+ * @return The number of addresses compared, a multiple of eight.
+ */
+__attribute__((target("avx2")))
+static size_t scan_ipv4_avx2(const filter_set* filter, const uint32_t* ips, size_t count, uint64_t* bitmap)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i addresses = _mm256_loadu_si256((const __m256i*)(ips + i));
+        __m256i hits = _mm256_setzero_si256();
+
+        for (size_t r = 0; r < filter->ipv4_count; r++)
+        {
+            __m256i masked = _mm256_and_si256(addresses, _mm256_set1_epi32((int)filter->ipv4_masks[r]));
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi32(masked, _mm256_set1_epi32((int)filter->ipv4_networks[r])));
+        }
+
+        bitmap[i / 64] |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(hits)) << (i % 64);
+    }
+
+    return i;
+}
+
+/**
+ * Compares the addresses four at a time with every IPv4 network, with SSE2.
+ *
+ * @param filter: The compiled filter.
+ * @param ips: The IPv4 addresses in host byte order.
+ * @param count: The number of addresses.
+ * @param bitmap: Receives the matches, cleared by the caller.
+ * @return The number of addresses compared, a multiple of four.
+ */
+static size_t scan_ipv4_sse2(const filter_set* filter, const uint32_t* ips, size_t count, uint64_t* bitmap)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i addresses = _mm_loadu_si128((const __m128i*)(ips + i));
+        __m128i hits = _mm_setzero_si128();
+
+        for (size_t r = 0; r < filter->ipv4_count; r++)
+        {
+            __m128i masked = _mm_and_si128(addresses, _mm_set1_epi32((int)filter->ipv4_masks[r]));
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi32(masked, _mm_set1_epi32((int)filter->ipv4_networks[r])));
+        }
+
+        bitmap[i / 64] |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(hits)) << (i % 64);
+    }
+
+    return i;
+}
+#elif defined(__aarch64__)
+/**
+ * Compares the addresses four at a time with every IPv4 network, with NEON.
+ *
+ * @param filter: The compiled filter.
+ * @param ips: The IPv4 addresses in host byte order.
+ * @param count: The number of addresses.
+ * @param bitmap: Receives the matches, cleared by the caller.
+ * @return The number of addresses compared, a multiple of four.
+ */
+static size_t scan_ipv4_neon(const filter_set* filter, const uint32_t* ips, size_t count, uint64_t* bitmap)
+{
+    static const uint32_t lane_bits[4] = {1, 2, 4, 8};
+    uint32x4_t weights = vld1q_u32(lane_bits);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        uint32x4_t addresses = vld1q_u32(ips + i);
+        uint32x4_t hits = vdupq_n_u32(0);
+
+        for (size_t r = 0; r < filter->ipv4_count; r++)
+        {
+            uint32x4_t masked = vandq_u32(addresses, vdupq_n_u32(filter->ipv4_masks[r]));
+            hits = vorrq_u32(hits, vceqq_u32(masked, vdupq_n_u32(filter->ipv4_networks[r])));
+        }
+
+        bitmap[i / 64] |= (uint64_t)vaddvq_u32(vandq_u32(hits, weights)) << (i % 64);
+    }
+
+    return i;
+}
+#endif
+
+
+void filter_match_ip_batch(const filter_set* filter, const uint32_t* ips, size_t count, uint64_t* bitmap)
+{
+    memset(bitmap, 0, (count + 63) / 64 * sizeof(uint64_t));
+
+    // Comparing with every network beats searching while they are few
+    size_t done = 0;
+    if (filter->ipv4_count <= FILTER_SCAN_MAX_RULES)
+    {
+#if defined(__x86_64__)
+        done = __builtin_cpu_supports("avx2") ? scan_ipv4_avx2(filter, ips, count, bitmap)
+                                              : scan_ipv4_sse2(filter, ips, count, bitmap);
+#elif defined(__aarch64__)
+        done = scan_ipv4_neon(filter, ips, count, bitmap);
+#endif
+    }
+
+    for (size_t i = done; i < count; i++)
+        bitmap[i / 64] |= (uint64_t)search_ipv4(filter, ips[i]) << (i % 64);
+}
+
+
+void filter_match_host_batch(const filter_set* filter, const char* const* hosts, size_t count, uint64_t* bitmap)
+{
+    memset(bitmap, 0, (count + 63) / 64 * sizeof(uint64_t));
+
+    for (size_t i = 0; i < count; i++)
+        bitmap[i / 64] |= (uint64_t)filter_match_host(filter, hosts[i]) << (i % 64);
+}
+
+
+int filter_match_ip6(const filter_set* filter, const uint8_t ip[16])
+{
+    return match_address(filter, load_ipv6(ip));
+}
+
+
+filter_set* filter_acquire(filter_set* filter)
+{
+    // Relaxed is enough, the caller already holds a reference that keeps the filter alive
+    atomic_fetch_add_explicit(&filter->refcount, 1, memory_order_relaxed);
+    return filter;
+}
+
+
+void filter_release(filter_set* filter)
+{
+    if (filter == NULL)
+        return;
+
+    // The last holder frees the snapshot, acquire-release orders all reads before the free
+    if (atomic_fetch_sub_explicit(&filter->refcount, 1, memory_order_acq_rel) == 1)
+        filter_destroy(filter);
+}
+
+
+filter_set* filter_load(const char* file_path)
+{
+    // Attempt to open the file for reading
+    FILE* file = fopen(file_path, "r");
+    if (!file)
+    {
+        fprintf(stderr, "Error opening file %s for reading.\n", file_path);
+        return NULL;
+    }
+
+    // Move to the end of the file to determine its size
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (file_size < 0)
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    // Allocate memory for the content, +1 for the null terminator
+    char* content = malloc(file_size + 1);
+    if (!content)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        fclose(file);
+        return NULL;
+    }
+
+    size_t length = fread(content, 1, file_size, file);
+    content[length] = '\0';
+    fclose(file);
+
+    filter_set* filter = filter_compile(content);
+    free(content);
+
+    return filter;
+}
+
+
+filter_set* filter_acquire_current(void)
+{
+    // Announce the reader so a concurrent publisher waits before dropping the old snapshot
+    atomic_fetch_add(&acquiring_readers, 1);
+    filter_set* filter = atomic_load(&current_filter);
+    if (filter != NULL)
+        filter_acquire(filter);
+    atomic_fetch_sub_explicit(&acquiring_readers, 1, memory_order_release);
+
+    return filter;
+}
+
+
+void filter_publish(filter_set* filter)
+{
+    filter_set* old = atomic_exchange(&current_filter, filter);
+
+    // Grace period: a reader that loaded the old pointer has not taken its reference yet
+    while (atomic_load(&acquiring_readers) != 0)
+        sched_yield();
+
+    filter_release(old); // Holders of the old snapshot keep it alive until they finish
+}
+
+
+/**
+ * Loads and compiles the filter file again and publishes the result. The current
+ * snapshot stays in place if the file cannot be read.
+ *
+ * @param file_path: The path of the filter file.
+ */
+static void reload_filter(const char* file_path)
+{
+    filter_set* filter = filter_load(file_path);
+    if (filter == NULL)
+    {
+        fprintf(stderr, "Filter reload failed, keeping the current filter\n");
+        return;
+    }
+
+    filter_publish(filter);
+    printf("Filter reloaded: %zu hosts, %zu IP rules\n", filter->host_count, filter->ip_rule_count);
+}
+
+/**
+ * The reload thread. It waits for SIGHUP through a signalfd and for changes of the
+ * filter file through an inotify watch on its directory, and reloads on either.
+ *
+ * @param arg: The path of the filter file.
+ * @return NULL always.
+ */
+static void* reloader_main(void* arg)
+{
+    char* file_path = (char*)arg;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (signal_fd == -1)
+        perror("error: signalfd\n");
+
+    // Watch the directory so editors that replace the file by renaming are noticed as well
+    char* path_copy = strdup(file_path);
+    char* name_copy = strdup(file_path);
+    const char* file_name = name_copy != NULL ? basename(name_copy) : NULL;
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd != -1 && (path_copy == NULL ||
+        inotify_add_watch(inotify_fd, dirname(path_copy), IN_CLOSE_WRITE | IN_MOVED_TO) == -1))
+    {
+        perror("error: inotify_add_watch\n");
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+
+    struct pollfd fds[3] = {
+        {reloader_stop_fd, POLLIN, 0},
+        {signal_fd, POLLIN, 0},
+        {inotify_fd, POLLIN, 0}
+    };
+
+    while (1)
+    {
+        if (poll(fds, 3, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("error: poll\n");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+            break; // Shutdown requested
+
+        int reload = 0;
+
+        if (fds[1].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+                reload = 1;
+        }
+
+        if (fds[2].revents & POLLIN)
+        {
+            // Drain all pending events and reload once if any of them names the filter file
+            char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t length = read(inotify_fd, events, sizeof(events));
+            for (char* p = events; length > 0 && p < events + length;)
+            {
+                struct inotify_event* event = (struct inotify_event*)p;
+                if (event->len > 0 && file_name != NULL && strcmp(event->name, file_name) == 0)
+                    reload = 1;
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+
+        if (reload)
+            reload_filter(file_path);
+    }
+
+    if (signal_fd != -1)
+        close(signal_fd);
+    if (inotify_fd != -1)
+        close(inotify_fd);
+    free(path_copy);
+    free(name_copy);
+    free(file_path);
+
+    return NULL;
+}
+
+
+int filter_start_reloader(const char* file_path)
+{
+    // Block SIGHUP in the calling thread, threads created afterwards inherit the mask
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+    {
+        fprintf(stderr, "Error blocking SIGHUP\n");
+        return -1;
+    }
+
+    reloader_stop_fd = eventfd(0, EFD_CLOEXEC);
+    char* path_copy = strdup(file_path);
+    if (reloader_stop_fd == -1 || path_copy == NULL)
+    {
+        fprintf(stderr, "Failed to initialize the filter reloader\n");
+        free(path_copy);
+        return -1;
+    }
+
+    if (pthread_create(&reloader_thread, NULL, reloader_main, path_copy) != 0)
+    {
+        fprintf(stderr, "Failed to create the filter reloader thread\n");
+        free(path_copy);
+        close(reloader_stop_fd);
+        reloader_stop_fd = -1;
+        return -1;
+    }
+
+    reloader_running = 1;
+    return 1;
+}
+
+
+void filter_stop_reloader(void)
+{
+    if (!reloader_running)
+        return;
+
+    uint64_t one = 1;
+    if (write(reloader_stop_fd, &one, sizeof(one)) != sizeof(one))
+        perror("error: write\n");
+
+    pthread_join(reloader_thread, NULL);
+    close(reloader_stop_fd);
+    reloader_stop_fd = -1;
+    reloader_running = 0;
+}
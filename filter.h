@@ -0,0 +1,228 @@
+#ifndef PROXYSERVER_FILTER_H
+#define PROXYSERVER_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/**
+ * filter.h
+ *
+ * This file declares the compiled representation of the filter file.
+ * The filter text is parsed once into an immutable structure that every
+ * worker thread can query concurrently without locking or allocating.
+ * A background thread recompiles the file on SIGHUP or when it changes
+ * and publishes the new snapshot without blocking readers.
+ */
+
+
+// longest hostname rule, as in DNS
+#define FILTER_MAX_HOST_LENGTH 253
+
+// most IPv4 rules the batch matcher compares every address with, more are binary searched
+#define FILTER_SCAN_MAX_RULES 64
+
+// what a hostname rule matches
+#define FILTER_HOST_EXACT 1        // the name itself
+#define FILTER_HOST_SUBDOMAINS 2   // every name ending in "." followed by the name
+
+
+/**
+ * A slot of the open-addressing hostname table.
+ * An empty slot is marked by a NULL name.
+ */
+typedef struct {
+    uint32_t hash;       // FNV-1a hash of the name, taken from its last character to its first
+    uint16_t length;     // length of the name, without the null terminator
+    uint16_t flags;      // FILTER_HOST_EXACT and FILTER_HOST_SUBDOMAINS of the rules naming it
+    const char* name;    // points into the filter_set text buffer, lower case
+} filter_host_slot;
+
+
+/**
+ * An address as the trie sees it: 128 bits with the first bit of the address most significant.
+ * IPv4 addresses are stored as IPv4-mapped IPv6 addresses (::ffff:a.b.c.d), so the rules of both
+ * families share one trie.
+ */
+typedef unsigned __int128 filter_address;
+
+
+/**
+ * A node of the path-compressed binary trie holding the CIDR rules.
+ * Every node covers the first "length" bits of "prefix".
+ */
+typedef struct {
+    filter_address prefix;   // network bits, bits past "length" are zero
+    uint8_t length;          // number of significant bits in prefix (0 - 128)
+    uint8_t terminal;        // 1 if a rule ends exactly at this node
+    int32_t child[2];        // indices of the children by the next bit, -1 if none
+} filter_trie_node;
+
+
+/**
+ * The compiled filter. It is immutable once compiled and shared between threads
+ * as a reference-counted snapshot.
+ */
+typedef struct {
+    atomic_int refcount;          // number of holders of the snapshot
+    char* text;                   // private copy of the filter text, lines are null-terminated in place
+    filter_host_slot* hosts;      // hostname hash table
+    size_t host_capacity;         // number of slots, always a power of two
+    size_t host_count;            // number of hostnames stored, a name with several rules counts once
+    filter_trie_node* nodes;      // trie nodes, nodes[0] is the root
+    size_t node_count;            // number of nodes in use
+    size_t node_capacity;         // number of nodes allocated
+    size_t ip_rule_count;         // number of CIDR rules inserted
+    uint32_t* ipv4_networks;      // the IPv4 range of the trie as disjoint networks in ascending order
+    uint32_t* ipv4_masks;         // the mask of each network
+    size_t ipv4_count;            // number of IPv4 networks
+} filter_set;
+
+
+/**
+ * Compiles the content of a filter file. Every non-empty line that contains a colon is treated as
+ * an IPv6 address with an optional "/mask" suffix (a missing or invalid mask means /128), and every
+ * other line that starts with a digit as an IPv4 address with an optional "/mask" suffix (a missing
+ * or invalid mask means /32). Every other line is a hostname rule, compared without regard to
+ * case: "*.example.com" matches the subdomains of example.com, ".example.com" matches
+ * example.com and its subdomains, and a plain name matches only itself. Lines that look like
+ * IP rules but cannot be parsed, and hostnames longer than FILTER_MAX_HOST_LENGTH, are skipped.
+ *
+ * @param file_content: The content of the filter file, lines separated by "\r\n" or "\n".
+ * @return
+ *   - A pointer to the compiled filter holding one reference. The caller releases it with filter_release().
+ *   - NULL if a memory allocation fails.
+ */
+filter_set* filter_compile(const char* file_content);
+
+/**
+ * Checks whether a hostname is matched by a hostname rule of the compiled filter. The name is
+ * hashed once from its end, and the hash of every suffix starting after a dot is probed on the
+ * way, so the lookup takes one probe per label whatever the number of rules, and does not
+ * allocate. Case, a trailing dot and a port after the hostname, as in a "host:port" CONNECT
+ * target, are not part of the name.
+ *
+ * @param filter: The compiled filter.
+ * @param host: The hostname to look up, optionally followed by ":port".
+ * @return
+ *   - 1 if the hostname is filtered.
+ *   - 0 otherwise.
+ */
+int filter_match_host(const filter_set* filter, const char* host);
+
+/**
+ * Checks whether an IPv4 address is covered by one of the CIDR rules of the compiled filter.
+ * The lookup walks at most 32 trie levels below the IPv4-mapped range and does not allocate.
+ *
+ * @param filter: The compiled filter.
+ * @param ip: The IPv4 address in host byte order.
+ * @return
+ *   - 1 if the address is filtered.
+ *   - 0 otherwise.
+ */
+int filter_match_ip(const filter_set* filter, uint32_t ip);
+
+/**
+ * Checks many IPv4 addresses at once against the CIDR rules of the compiled filter, for the
+ * same result as filter_match_ip() on each. Up to FILTER_SCAN_MAX_RULES networks, every address
+ * is compared with all of them, eight at a time with AVX2 and four with SSE2 or NEON; with more,
+ * each address is binary searched among the networks. Nothing is allocated.
+ *
+ * @param filter: The compiled filter.
+ * @param ips: The IPv4 addresses in host byte order.
+ * @param count: The number of addresses.
+ * @param bitmap: Receives bit i % 64 of word i / 64 set if address i is filtered, and cleared
+ *                otherwise. Holds (count + 63) / 64 words.
+ */
+void filter_match_ip_batch(const filter_set* filter, const uint32_t* ips, size_t count, uint64_t* bitmap);
+
+/**
+ * Checks many hostnames at once against the hostname rules of the compiled filter, for the same
+ * result as filter_match_host() on each.
+ *
+ * @param filter: The compiled filter.
+ * @param hosts: The hostnames, each optionally followed by ":port".
+ * @param count: The number of hostnames.
+ * @param bitmap: Receives bit i % 64 of word i / 64 set if hostname i is filtered, and cleared
+ *                otherwise. Holds (count + 63) / 64 words.
+ */
+void filter_match_host_batch(const filter_set* filter, const char* const* hosts, size_t count, uint64_t* bitmap);
+
+/**
+ * Checks whether an IPv6 address is covered by one of the CIDR rules of the compiled filter.
+ * An IPv4-mapped address is matched against the IPv4 rules. The lookup walks at most 128 trie
+ * levels and does not allocate.
+ *
+ * @param filter: The compiled filter.
+ * @param ip: The 16 bytes of the IPv6 address in network byte order.
+ * @return
+ *   - 1 if the address is filtered.
+ *   - 0 otherwise.
+ */
+int filter_match_ip6(const filter_set* filter, const uint8_t ip[16]);
+
+/**
+ * Takes an additional reference to a compiled filter. A worker holding a reference
+ * may read the filter for as long as it likes without copying it.
+ *
+ * @param filter: The compiled filter.
+ * @return The same filter, for convenience.
+ */
+filter_set* filter_acquire(filter_set* filter);
+
+/**
+ * Drops a reference to a compiled filter. The filter is freed when the last
+ * reference is released.
+ *
+ * @param filter: The compiled filter, may be NULL.
+ */
+void filter_release(filter_set* filter);
+
+/**
+ * Reads a filter file and compiles it. Both "\n" and "\r\n" line endings are accepted.
+ *
+ * @param file_path: The path of the filter file.
+ * @return
+ *   - A pointer to the compiled filter holding one reference.
+ *   - NULL if the file cannot be read or a memory allocation fails.
+ */
+filter_set* filter_load(const char* file_path);
+
+/**
+ * Publishes a compiled filter as the current snapshot, taking over the caller's reference.
+ * The previous snapshot is released once no reader is in the middle of acquiring it, and is
+ * freed when the last worker holding it releases its reference.
+ *
+ * @param filter: The new snapshot, or NULL to clear the current one.
+ */
+void filter_publish(filter_set* filter);
+
+/**
+ * Takes a reference to the current snapshot. This never takes a lock, so it is safe to call
+ * on the request path while a reload is being published.
+ *
+ * @return
+ *   - The current snapshot. The caller releases it with filter_release().
+ *   - NULL if no snapshot was published.
+ */
+filter_set* filter_acquire_current(void);
+
+/**
+ * Starts the background thread that reloads the filter file on SIGHUP and whenever the
+ * file is rewritten or replaced. SIGHUP is blocked in the calling thread, so this must be
+ * called before any other thread is created for the signal to reach the reloader.
+ *
+ * @param file_path: The path of the filter file.
+ * @return
+ *   - 1 on success.
+ *   - -1 if the thread or its resources cannot be created.
+ */
+int filter_start_reloader(const char* file_path);
+
+/**
+ * Stops the reload thread started by filter_start_reloader() and waits for it to exit.
+ * Does nothing if the thread is not running.
+ */
+void filter_stop_reloader(void);
+
+#endif //PROXYSERVER_FILTER_H
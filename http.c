@@ -0,0 +1,796 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "http.h"
+
+
+
+/**
+ * Switches the framer to relaying everything until the origin closes, for responses
+ * that cannot be framed.
+ *
+ * @param framer: The framer.
+ */
+static void fall_back_to_close(http_response_framer* framer)
+{
+    framer->mode = HTTP_BODY_UNTIL_CLOSE;
+    framer->keep_alive = 0;
+    framer->state = FRAMER_BODY;
+}
+
+/**
+ * Reads the value of a Content-Length header: digits only, or a comma-separated list of the
+ * same number repeated. A sign, trailing characters or differing numbers are refused rather
+ * than guessed at.
+ *
+ * @param value: The trimmed header value, not necessarily null-terminated.
+ * @param length: The length of the value.
+ * @param content_length: Receives the length.
+ * @return
+ *   - 1 if the value is a valid length.
+ *   - 0 otherwise.
+ */
+static int parse_content_length(const char* value, size_t length, unsigned long long* content_length)
+{
+    const char* end = value + length;
+    unsigned long long first = 0;
+    int found = 0;
+
+    for (const char* element = value; element <= end;)
+    {
+        const char* element_end = memchr(element, ',', end - element);
+        element_end = element_end != NULL ? element_end : end;
+
+        const char* digits = element;
+        const char* digits_end = element_end;
+        while (digits < digits_end && (*digits == ' ' || *digits == '\t'))
+            digits++;
+        while (digits_end > digits && (digits_end[-1] == ' ' || digits_end[-1] == '\t'))
+            digits_end--;
+        if (digits == digits_end || digits_end - digits > 18)
+            return 0;
+
+        unsigned long long number = 0;
+        for (const char* c = digits; c < digits_end; c++)
+        {
+            if (!isdigit((unsigned char)*c))
+                return 0;
+            number = number * 10 + (*c - '0');
+        }
+
+        if (found && number != first)
+            return 0;
+        first = number;
+        found = 1;
+
+        element = element_end + 1;
+    }
+
+    *content_length = first;
+    return found;
+}
+
+/**
+ * Parses the complete header block stored in the framer and decides how the body is framed.
+ *
+ * @param framer: The framer, holding the header block in head.
+ */
+static void parse_head(http_response_framer* framer)
+{
+    const char* head = framer->head;
+    const char* end = head + framer->head_length;
+
+    // Status line: "HTTP/1.x SSS reason"
+    if (framer->head_length < 12 || strncmp(head, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)head[9]))
+    {
+        fall_back_to_close(framer);
+        return;
+    }
+
+    framer->head_complete = 1;
+    int http_1_1 = head[7] != '0';
+    framer->status_code = atoi(head + 9);
+
+    int connection_close = 0, connection_keep_alive = 0, chunked = 0, has_coding = 0, has_length = 0;
+    int unframeable = 0; // 1 if the length of the body cannot be trusted
+    unsigned long long content_length = 0;
+
+    const char* line = memchr(head, '\n', framer->head_length);
+    while (line != NULL && ++line < end)
+    {
+        const char* line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL)
+            break;
+
+        const char* colon = memchr(line, ':', line_end - line);
+        if (colon != NULL)
+        {
+            size_t name_length = colon - line;
+            const char* value = colon + 1;
+            const char* value_end = line_end;
+
+            // Trim the value
+            while (value < value_end && (*value == ' ' || *value == '\t'))
+                value++;
+            while (value_end > value && isspace((unsigned char)value_end[-1]))
+                value_end--;
+
+            if (name_length == 14 && strncasecmp(line, "Content-Length", 14) == 0)
+            {
+                // A repeated header must agree with the first one
+                unsigned long long number = 0;
+                if (!parse_content_length(value, value_end - value, &number) || (has_length && number != content_length))
+                    unframeable = 1;
+                else
+                    content_length = number;
+                has_length = 1;
+            }
+            else if (name_length == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0)
+            {
+                chunked = http_has_token(value, value_end - value, "chunked");
+                has_coding = 1;
+            }
+            else if (name_length == 10 && strncasecmp(line, "Connection", 10) == 0)
+            {
+                connection_close |= http_has_token(value, value_end - value, "close");
+                connection_keep_alive |= http_has_token(value, value_end - value, "keep-alive");
+            }
+        }
+
+        line = line_end;
+    }
+
+    // Interim responses are followed by the real one, read its headers next
+    if (framer->status_code >= 100 && framer->status_code < 200 && framer->status_code != 101)
+    {
+        framer->head_length = 0;
+        framer->head_complete = 0;
+        return;
+    }
+
+    framer->keep_alive = !connection_close && (http_1_1 || connection_keep_alive);
+
+    // A length next to a transfer coding could be read differently by the next hop
+    if (has_length && has_coding)
+        unframeable = 1;
+
+    if (framer->head_request || framer->status_code == 204 || framer->status_code == 304 ||
+        (framer->status_code >= 100 && framer->status_code < 200))
+    {
+        framer->mode = HTTP_BODY_NONE;
+        framer->state = FRAMER_DONE;
+        if (unframeable)
+            framer->keep_alive = 0; // Bytes may follow that belong to no response
+    }
+    else if (unframeable)
+        fall_back_to_close(framer);
+    else if (chunked)
+    {
+        framer->mode = HTTP_BODY_CHUNKED;
+        framer->state = FRAMER_CHUNK_SIZE;
+        framer->remaining = 0;
+        framer->chunk_digits = 0;
+    }
+    else if (has_length)
+    {
+        framer->mode = HTTP_BODY_LENGTH;
+        framer->remaining = content_length;
+        framer->state = content_length == 0 ? FRAMER_DONE : FRAMER_BODY;
+    }
+    else
+        fall_back_to_close(framer);
+
+    if (framer->status_code == 101)
+        fall_back_to_close(framer); // A protocol switch never returns to HTTP
+}
+
+/**
+ * Returns the value of a hex digit.
+ *
+ * @param c: The character.
+ * @return The digit value, or -1 if c is not a hex digit.
+ */
+static int hex_value(unsigned char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+
+void http_framer_init(http_response_framer* framer, int head_request)
+{
+    framer->state = FRAMER_HEADERS;
+    framer->head_request = head_request;
+    framer->head_length = 0;
+    framer->head_complete = 0;
+    framer->status_code = 0;
+    framer->keep_alive = 0;
+    framer->mode = HTTP_BODY_UNTIL_CLOSE;
+    framer->remaining = 0;
+    framer->chunk_digits = 0;
+    framer->line_length = 0;
+}
+
+
+void http_framer_init_body(http_response_framer* framer, http_body_mode mode, unsigned long long length)
+{
+    http_framer_init(framer, 0);
+    framer->head_complete = 1;
+    framer->keep_alive = 1;
+    framer->mode = mode;
+    framer->remaining = length;
+
+    if (mode == HTTP_BODY_CHUNKED)
+        framer->state = FRAMER_CHUNK_SIZE;
+    else if (mode == HTTP_BODY_LENGTH && length > 0)
+        framer->state = FRAMER_BODY;
+    else
+        framer->state = FRAMER_DONE;
+}
+
+
+size_t http_framer_feed(http_response_framer* framer, const unsigned char* data, size_t length)
+{
+    size_t i = 0; // Bytes consumed so far
+
+    while (i < length && framer->state != FRAMER_DONE)
+    {
+        unsigned char c = data[i];
+
+        switch (framer->state)
+        {
+            case FRAMER_HEADERS:
+                if (framer->head_length == sizeof(framer->head))
+                {
+                    fall_back_to_close(framer); // Too large to frame
+                    return i;
+                }
+
+                framer->head[framer->head_length++] = (char)c;
+                i++;
+
+                // The header block ends with an empty line
+                if (c == '\n' && framer->head_length >= 2 &&
+                    (framer->head[framer->head_length - 2] == '\n' ||
+                     (framer->head_length >= 4 && memcmp(framer->head + framer->head_length - 4, "\r\n\r\n", 4) == 0)))
+                {
+                    parse_head(framer);
+                    if (framer->state != FRAMER_HEADERS)
+                        return i; // Let the caller send the head before the body
+                }
+                break;
+
+            case FRAMER_BODY:
+                if (framer->mode == HTTP_BODY_UNTIL_CLOSE)
+                    return length; // Everything belongs to the response
+                else
+                {
+                    size_t available = length - i;
+                    size_t take = framer->remaining < available ? (size_t)framer->remaining : available;
+                    i += take;
+                    framer->remaining -= take;
+                    if (framer->remaining == 0)
+                        framer->state = FRAMER_DONE;
+                }
+                break;
+
+            case FRAMER_CHUNK_SIZE:
+                i++;
+                if (hex_value(c) >= 0)
+                {
+                    if (framer->remaining >> 60) // The size would overflow
+                    {
+                        fall_back_to_close(framer);
+                        return length;
+                    }
+                    framer->remaining = framer->remaining * 16 + hex_value(c);
+                    framer->chunk_digits++;
+                }
+                else if (c == ';' || c == ' ' || c == '\t')
+                    framer->state = FRAMER_CHUNK_EXTENSION;
+                else if (c == '\r')
+                    framer->state = FRAMER_CHUNK_SIZE_LF;
+                else if (c == '\n')
+                    goto chunk_size_done;
+                else
+                {
+                    fall_back_to_close(framer);
+                    return length;
+                }
+                break;
+
+            case FRAMER_CHUNK_EXTENSION:
+                i++;
+                if (c == '\r')
+                    framer->state = FRAMER_CHUNK_SIZE_LF;
+                else if (c == '\n')
+                    goto chunk_size_done;
+                break;
+
+            case FRAMER_CHUNK_SIZE_LF:
+                i++;
+                if (c != '\n')
+                {
+                    fall_back_to_close(framer);
+                    return length;
+                }
+
+                chunk_size_done:
+                if (framer->chunk_digits == 0)
+                {
+                    fall_back_to_close(framer);
+                    return length;
+                }
+
+                if (framer->remaining == 0)
+                {
+                    // The last chunk, only the trailer follows
+                    framer->state = FRAMER_TRAILER;
+                    framer->line_length = 0;
+                }
+                else
+                    framer->state = FRAMER_CHUNK_DATA;
+                break;
+
+            case FRAMER_CHUNK_DATA:
+            {
+                size_t available = length - i;
+                size_t take = framer->remaining < available ? (size_t)framer->remaining : available;
+                i += take;
+                framer->remaining -= take;
+                if (framer->remaining == 0)
+                    framer->state = FRAMER_CHUNK_DATA_CR;
+                break;
+            }
+
+            case FRAMER_CHUNK_DATA_CR:
+                i++;
+                if (c == '\r')
+                    framer->state = FRAMER_CHUNK_DATA_LF;
+                else if (c == '\n')
+                {
+                    framer->state = FRAMER_CHUNK_SIZE;
+                    framer->chunk_digits = 0;
+                }
+                else
+                {
+                    fall_back_to_close(framer);
+                    return length;
+                }
+                break;
+
+            case FRAMER_CHUNK_DATA_LF:
+                i++;
+                if (c != '\n')
+                {
+                    fall_back_to_close(framer);
+                    return length;
+                }
+                framer->state = FRAMER_CHUNK_SIZE;
+                framer->chunk_digits = 0;
+                break;
+
+            case FRAMER_TRAILER:
+                i++;
+                if (c == '\n')
+                {
+                    // An empty line ends the trailer and the response
+                    if (framer->line_length == 0)
+                        framer->state = FRAMER_DONE;
+                    framer->line_length = 0;
+                }
+                else if (c != '\r')
+                    framer->line_length++;
+                break;
+
+            case FRAMER_DONE:
+                break;
+        }
+    }
+
+    return i;
+}
+
+
+unsigned long long http_framer_opaque_length(const http_response_framer* framer)
+{
+    if (framer->state == FRAMER_BODY)
+        return framer->mode == HTTP_BODY_UNTIL_CLOSE ? HTTP_UNBOUNDED : framer->remaining;
+
+    if (framer->state == FRAMER_CHUNK_DATA)
+        return framer->remaining; // The chunk size lines still go through the framer
+
+    return 0;
+}
+
+
+void http_framer_skip(http_response_framer* framer, size_t length)
+{
+    if (framer->state == FRAMER_BODY && framer->mode == HTTP_BODY_UNTIL_CLOSE)
+        return; // Only the end of the stream ends the body
+
+    framer->remaining -= length;
+    if (framer->remaining == 0)
+        framer->state = framer->state == FRAMER_BODY ? FRAMER_DONE : FRAMER_CHUNK_DATA_CR;
+}
+
+
+int http_framer_done(const http_response_framer* framer)
+{
+    return framer->state == FRAMER_DONE;
+}
+
+
+int http_framer_reusable(const http_response_framer* framer)
+{
+    return framer->state == FRAMER_DONE && framer->keep_alive && framer->mode != HTTP_BODY_UNTIL_CLOSE;
+}
+
+
+size_t http_build_response_head(const http_response_framer* framer, int keep_alive, char* out)
+{
+    if (!framer->head_complete)
+    {
+        memcpy(out, framer->head, framer->head_length);
+        return framer->head_length;
+    }
+
+    return http_rewrite_head(framer->head, framer->head_length, keep_alive, out);
+}
+
+
+size_t http_rewrite_head(const char* head, size_t head_length, int keep_alive, char* out)
+{
+    const char* end = head + head_length;
+    size_t length = 0;
+
+    // Copy every line but the hop-by-hop connection headers and the final empty line
+    for (const char* line = head; line < end;)
+    {
+        const char* line_end = memchr(line, '\n', end - line);
+        line_end = line_end != NULL ? line_end + 1 : end;
+
+        int empty = line[0] == '\n' || (line[0] == '\r' && line + 1 < end && line[1] == '\n');
+        if (!empty && line != head &&
+            (strncasecmp(line, "Connection:", 11) == 0 || strncasecmp(line, "Keep-Alive:", 11) == 0))
+        {
+            line = line_end;
+            continue;
+        }
+
+        if (empty)
+            break;
+
+        memcpy(out + length, line, line_end - line);
+        length += line_end - line;
+        line = line_end;
+    }
+
+    const char* connection = keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    memcpy(out + length, connection, strlen(connection));
+
+    return length + strlen(connection);
+}
+
+
+const char* http_head_header(const char* head, size_t head_length, const char* name, size_t* length)
+{
+    size_t name_length = strlen(name);
+    const char* end = head + head_length;
+
+    // Header lines follow the status line, names are case-insensitive
+    const char* line = memchr(head, '\n', head_length);
+    while (line != NULL && ++line < end)
+    {
+        const char* line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL)
+            break;
+
+        if ((size_t)(line_end - line) > name_length && line[name_length] == ':' && strncasecmp(line, name, name_length) == 0)
+        {
+            const char* value = line + name_length + 1;
+            const char* value_end = line_end;
+            while (value < value_end && (*value == ' ' || *value == '\t'))
+                value++;
+            while (value_end > value && isspace((unsigned char)value_end[-1]))
+                value_end--;
+
+            *length = value_end - value;
+            return value;
+        }
+
+        line = line_end;
+    }
+
+    return NULL;
+}
+
+
+int http_has_token(const char* value, size_t length, const char* token)
+{
+    size_t token_length = strlen(token);
+    const char* end = value + length;
+
+    while (value < end)
+    {
+        // Skip separators and whitespace before the element
+        while (value < end && (*value == ',' || *value == ' ' || *value == '\t'))
+            value++;
+
+        const char* element_end = value;
+        while (element_end < end && *element_end != ',')
+            element_end++;
+
+        // Compare the element without its trailing whitespace
+        const char* trimmed_end = element_end;
+        while (trimmed_end > value && (trimmed_end[-1] == ' ' || trimmed_end[-1] == '\t'))
+            trimmed_end--;
+
+        if ((size_t)(trimmed_end - value) == token_length && strncasecmp(value, token, token_length) == 0)
+            return 1;
+
+        value = element_end;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Moves past spaces and tabs.
+ *
+ * @param buffer: The buffer.
+ * @param position: The offset to start at.
+ * @param end: The offset where the scan stops.
+ * @return The offset of the first other byte, or end.
+ */
+static size_t skip_whitespace(const char* buffer, size_t position, size_t end)
+{
+    while (position < end && (buffer[position] == ' ' || buffer[position] == '\t'))
+        position++;
+
+    return position;
+}
+
+/**
+ * Splits the request line into its method, target and version.
+ *
+ * @param request: The request index.
+ * @param buffer: The buffer holding the request.
+ * @param start: The offset of the line.
+ * @param end: The offset of the CR ending the line.
+ */
+static void parse_request_line(http_request* request, const char* buffer, size_t start, size_t end)
+{
+    http_span* parts[3] = {&request->method, &request->target, &request->version};
+    size_t position = start;
+    int count = 0;
+
+    // Whitespace-separated words, anything but exactly three is malformed
+    while ((position = skip_whitespace(buffer, position, end)) < end)
+    {
+        size_t word = position;
+        while (position < end && buffer[position] != ' ' && buffer[position] != '\t')
+            position++;
+
+        if (count == 3)
+        {
+            count++;
+            break;
+        }
+        parts[count]->offset = word;
+        parts[count]->length = position - word;
+        count++;
+    }
+
+    if (count != 3)
+        request->malformed = 1;
+}
+
+/**
+ * Indexes a header line.
+ *
+ * @param request: The request index.
+ * @param buffer: The buffer holding the request.
+ * @param start: The offset of the line.
+ * @param end: The offset of the CR ending the line.
+ */
+static void parse_header_line(http_request* request, const char* buffer, size_t start, size_t end)
+{
+    // Folded continuation lines are obsolete, and a name cannot be followed by whitespace
+    const char* colon = memchr(buffer + start, ':', end - start);
+    if (colon == NULL || colon == buffer + start || buffer[start] == ' ' || buffer[start] == '\t' ||
+        colon[-1] == ' ' || colon[-1] == '\t')
+    {
+        request->malformed = 1;
+        return;
+    }
+
+    if (request->header_count == HTTP_MAX_REQUEST_HEADERS)
+    {
+        request->malformed = 1;
+        return;
+    }
+
+    http_header* header = &request->headers[request->header_count++];
+    size_t name_end = colon - buffer;
+    header->name.offset = start;
+    header->name.length = name_end - start;
+
+    // The value without its leading and trailing whitespace
+    size_t value = skip_whitespace(buffer, name_end + 1, end);
+    size_t value_end = end;
+    while (value_end > value && (buffer[value_end - 1] == ' ' || buffer[value_end - 1] == '\t'))
+        value_end--;
+    header->value.offset = value;
+    header->value.length = value_end - value;
+}
+
+
+void http_request_init(http_request* request)
+{
+    request->scanned = 0;
+    request->line_start = 0;
+    request->lines = 0;
+    request->malformed = 0;
+    request->method.offset = request->method.length = 0;
+    request->target.offset = request->target.length = 0;
+    request->version.offset = request->version.length = 0;
+    request->header_count = 0;
+    request->length = 0;
+}
+
+
+int http_request_parse(http_request* request, const char* buffer, size_t length)
+{
+    if (request->length > 0)
+        return 1; // Already complete
+
+    while (request->scanned < length)
+    {
+        // Only the bytes that arrived since the previous call are searched
+        const char* lf = memchr(buffer + request->scanned, '\n', length - request->scanned);
+        if (lf == NULL)
+        {
+            request->scanned = length;
+            return 0;
+        }
+
+        size_t start = request->line_start;
+        size_t end = lf - buffer;
+        request->scanned = request->line_start = end + 1;
+
+        if (end == start || buffer[end - 1] != '\r')
+        {
+            request->malformed = 1; // A bare LF ends the line
+            continue;
+        }
+        end--; // The line without its CR
+
+        if (end == start)
+        {
+            // The empty line ends the header block, a missing request line is malformed
+            if (request->lines++ > 0)
+            {
+                request->length = request->scanned;
+                return 1;
+            }
+            request->malformed = 1;
+            continue;
+        }
+
+        if (request->lines++ == 0)
+            parse_request_line(request, buffer, start, end);
+        else
+            parse_header_line(request, buffer, start, end);
+    }
+
+    return 0;
+}
+
+
+const http_header* http_request_find_header(const http_request* request, const char* buffer, const char* name)
+{
+    size_t name_length = strlen(name);
+
+    for (size_t i = 0; i < request->header_count; i++)
+    {
+        const http_header* header = &request->headers[i];
+        if (header->name.length == name_length && strncasecmp(buffer + header->name.offset, name, name_length) == 0)
+            return header;
+    }
+
+    return NULL;
+}
+
+
+const char* http_request_header(const http_request* request, const char* buffer, const char* name, size_t* length)
+{
+    const http_header* header = http_request_find_header(request, buffer, name);
+    if (header == NULL)
+        return NULL;
+
+    *length = header->value.length;
+    return buffer + header->value.offset;
+}
+
+
+void http_edits_init(http_edit_list* list)
+{
+    list->count = 0;
+    list->delta = 0;
+}
+
+
+int http_edits_add(http_edit_list* list, size_t offset, size_t removed, const char* text, size_t length)
+{
+    if (list->count == HTTP_MAX_REQUEST_EDITS)
+        return -1;
+
+    // Keep the list sorted, after the edits at the same offset
+    size_t position = list->count;
+    while (position > 0 && list->edits[position - 1].offset > offset)
+        position--;
+
+    // The replaced bytes must not overlap those of the neighbours
+    if (position > 0 && list->edits[position - 1].offset + list->edits[position - 1].removed > offset)
+        return -1;
+    if (position < list->count && offset + removed > list->edits[position].offset)
+        return -1;
+
+    memmove(&list->edits[position + 1], &list->edits[position], (list->count - position) * sizeof(http_edit));
+    list->edits[position].offset = offset;
+    list->edits[position].removed = removed;
+    list->edits[position].text = text;
+    list->edits[position].length = length;
+    list->count++;
+    list->delta += (ssize_t)length - (ssize_t)removed;
+
+    return 1;
+}
+
+
+int http_edits_segments(const http_edit_list* list, const char* buffer, size_t length, size_t skip, struct iovec* segments)
+{
+    int count = 0;
+    size_t position = 0; // Offset in the original request
+
+    for (size_t i = 0; i <= list->count; i++)
+    {
+        // The original bytes up to the next edit, then the text of the edit
+        size_t end = i < list->count ? list->edits[i].offset : length;
+        const char* parts[2] = {buffer + position, i < list->count ? list->edits[i].text : NULL};
+        size_t lengths[2] = {end - position, i < list->count ? list->edits[i].length : 0};
+
+        for (int j = 0; j < 2; j++)
+        {
+            if (lengths[j] <= skip)
+            {
+                skip -= lengths[j]; // Sent already, or empty
+                continue;
+            }
+
+            segments[count].iov_base = (void*)(parts[j] + skip);
+            segments[count].iov_len = lengths[j] - skip;
+            count++;
+            skip = 0;
+        }
+
+        if (i < list->count)
+            position = end + list->edits[i].removed;
+    }
+
+    return count;
+}
+
+
+int http_span_equals(const char* buffer, http_span span, const char* text)
+{
+    return strlen(text) == span.length && memcmp(buffer + span.offset, text, span.length) == 0;
+}
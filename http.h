@@ -0,0 +1,363 @@
+#ifndef PROXYSERVER_HTTP_H
+#define PROXYSERVER_HTTP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * http.h
+ *
+ * This file declares the HTTP message framing helpers. The response framer
+ * follows a response byte by byte as it is relayed and finds where its body
+ * ends (Content-Length, chunked encoding or end of stream), so a connection
+ * to the origin can be reused without waiting for the origin to close it.
+ * The request parser scans a client's request once as it arrives and indexes
+ * its request line and headers as spans of the receive buffer. Changes to the
+ * request are kept as a list of edits over that buffer and sent as iovec
+ * segments, so the request is never copied.
+ */
+
+// maximum size of a response header block that can be framed
+#define HTTP_MAX_HEADER_SIZE 16384
+
+// opaque length of a body that ends when the origin closes the connection
+#define HTTP_UNBOUNDED (~0ULL)
+
+// maximum number of headers indexed in a request, more make the request malformed
+#define HTTP_MAX_REQUEST_HEADERS 64
+
+// maximum number of edits applied to a request
+#define HTTP_MAX_REQUEST_EDITS 8
+
+// number of iovec segments that always hold an edited request
+#define HTTP_MAX_REQUEST_SEGMENTS (2 * HTTP_MAX_REQUEST_EDITS + 1)
+
+
+/**
+ * How the end of a response body is determined
+ */
+typedef enum {
+    HTTP_BODY_NONE,          // no body, the response ends with its headers
+    HTTP_BODY_LENGTH,        // the body is Content-Length bytes long
+    HTTP_BODY_CHUNKED,       // the body uses the chunked transfer coding
+    HTTP_BODY_UNTIL_CLOSE    // the body ends when the origin closes the connection
+} http_body_mode;
+
+
+/**
+ * The states of the response framer
+ */
+typedef enum {
+    FRAMER_HEADERS,          // reading the status line and headers
+    FRAMER_BODY,             // reading a Content-Length or until-close body
+    FRAMER_CHUNK_SIZE,       // reading the hex size of a chunk
+    FRAMER_CHUNK_EXTENSION,  // skipping a chunk extension
+    FRAMER_CHUNK_SIZE_LF,    // expecting the LF that ends a chunk size line
+    FRAMER_CHUNK_DATA,       // reading chunk data
+    FRAMER_CHUNK_DATA_CR,    // expecting the CR after chunk data
+    FRAMER_CHUNK_DATA_LF,    // expecting the LF after chunk data
+    FRAMER_TRAILER,          // reading trailer lines after the last chunk
+    FRAMER_DONE              // the response is complete
+} http_framer_state;
+
+
+/**
+ * Tracks one response as its bytes go by
+ */
+typedef struct {
+    http_framer_state state;           // current state
+    int head_request;                  // 1 if the request was HEAD, so the response has no body
+    char head[HTTP_MAX_HEADER_SIZE];   // copy of the header block being read
+    size_t head_length;                // bytes in head
+    int head_complete;                 // 1 if head holds a complete, well-formed header block
+    int status_code;                   // status code of the final response
+    int keep_alive;                    // 1 if the connection may carry another response
+    http_body_mode mode;               // how the body is delimited
+    unsigned long long remaining;      // bytes left in the body or current chunk
+    int chunk_digits;                  // hex digits read for the current chunk size
+    size_t line_length;                // length of the current trailer line
+} http_response_framer;
+
+
+/**
+ * A run of bytes of the buffer holding a request. Offsets, unlike pointers, stay valid
+ * when the buffer grows.
+ */
+typedef struct {
+    size_t offset;                     // start of the span in the buffer
+    size_t length;                     // length of the span
+} http_span;
+
+
+/**
+ * A request header, its value without the surrounding whitespace
+ */
+typedef struct {
+    http_span name;
+    http_span value;
+} http_header;
+
+
+/**
+ * The index of a request header block, built incrementally as its bytes arrive
+ */
+typedef struct {
+    size_t scanned;                    // bytes of the buffer already looked at
+    size_t line_start;                 // offset of the line being read
+    int lines;                         // complete lines read so far
+    int malformed;                     // 1 if a line breaks the request syntax
+    http_span method;                  // the method of the request line
+    http_span target;                  // the request target
+    http_span version;                 // the HTTP version
+    http_header headers[HTTP_MAX_REQUEST_HEADERS];
+    size_t header_count;               // number of headers indexed
+    size_t length;                     // length of the header block once complete, 0 before
+} http_request;
+
+
+/**
+ * A change to a request: bytes of the original buffer replaced by other bytes. An edit
+ * removing nothing inserts, one inserting nothing deletes.
+ */
+typedef struct {
+    size_t offset;                     // where the edit applies in the original request
+    size_t removed;                    // number of original bytes replaced
+    const char* text;                  // the bytes put in their place, kept alive by the caller
+    size_t length;                     // number of bytes in text
+} http_edit;
+
+
+/**
+ * The edits of a request, sorted by offset and never overlapping
+ */
+typedef struct {
+    http_edit edits[HTTP_MAX_REQUEST_EDITS];
+    size_t count;                      // number of edits
+    ssize_t delta;                     // change of the request length made by the edits
+} http_edit_list;
+
+
+/**
+ * Prepares the parser state for a new request.
+ *
+ * @param request: The request index to initialize.
+ */
+void http_request_init(http_request* request);
+
+/**
+ * Indexes the bytes of a request received since the previous call. Every byte is scanned
+ * once: lines are found with memchr() and split in place, and the index records spans of the
+ * buffer, so nothing is copied. Parsing stops at the empty line ending the header block.
+ * A request line without exactly a method, a target and a version, a line not ending with
+ * CRLF, a header line without a name and a colon, or too many headers mark the request as
+ * malformed without stopping the parse, so the whole block is still consumed.
+ *
+ * @param request: The request index, initialized before the first bytes.
+ * @param buffer: The bytes received so far, starting with the request.
+ * @param length: The number of bytes in buffer, the earlier bytes must not have changed.
+ * @return
+ *   - 1 once the header block is complete, its length is in request->length.
+ *   - 0 if more bytes are needed.
+ */
+int http_request_parse(http_request* request, const char* buffer, size_t length);
+
+/**
+ * Finds a header of an indexed request, matching its name case-insensitively.
+ *
+ * @param request: The complete request index.
+ * @param buffer: The buffer the request was indexed in.
+ * @param name: The header name, without the colon.
+ * @param length: Receives the length of the value.
+ * @return
+ *   - A pointer to the value of the first such header inside buffer.
+ *   - NULL if the header is not present.
+ */
+const char* http_request_header(const http_request* request, const char* buffer, const char* name, size_t* length);
+
+/**
+ * Finds the first header of an indexed request with a given name, matched case-insensitively.
+ *
+ * @param request: The complete request index.
+ * @param buffer: The buffer the request was indexed in.
+ * @param name: The header name, without the colon.
+ * @return
+ *   - The header.
+ *   - NULL if the header is not present.
+ */
+const http_header* http_request_find_header(const http_request* request, const char* buffer, const char* name);
+
+/**
+ * Empties an edit list.
+ *
+ * @param list: The edit list.
+ */
+void http_edits_init(http_edit_list* list);
+
+/**
+ * Adds an edit to a request. Edits at the same offset apply in the order they were added.
+ *
+ * @param list: The edit list.
+ * @param offset: Where the edit applies in the original request.
+ * @param removed: The number of original bytes replaced.
+ * @param text: The bytes put in their place, which must stay valid until the request is sent.
+ * @param length: The number of bytes in text.
+ * @return
+ *   - 1 on success.
+ *   - -1 if the list is full or the edit overlaps bytes another edit replaces.
+ */
+int http_edits_add(http_edit_list* list, size_t offset, size_t removed, const char* text, size_t length);
+
+/**
+ * Describes an edited request, or what is left of it after the bytes already sent, as
+ * iovec segments over the original buffer and the edit texts, ready for writev().
+ *
+ * @param list: The edit list.
+ * @param buffer: The original request.
+ * @param length: The length of the original request.
+ * @param skip: The number of edited bytes already sent.
+ * @param segments: Receives the segments, at least HTTP_MAX_REQUEST_SEGMENTS of them.
+ * @return The number of segments, 0 once everything was sent.
+ */
+int http_edits_segments(const http_edit_list* list, const char* buffer, size_t length, size_t skip, struct iovec* segments);
+
+/**
+ * Compares a span of a buffer with a string, case-sensitively.
+ *
+ * @param buffer: The buffer holding the span.
+ * @param span: The span.
+ * @param text: The null-terminated string.
+ * @return
+ *   - 1 if they are equal.
+ *   - 0 otherwise.
+ */
+int http_span_equals(const char* buffer, http_span span, const char* text);
+
+/**
+ * Prepares a framer for a new response.
+ *
+ * @param framer: The framer to initialize.
+ * @param head_request: 1 if the response answers a HEAD request, which never carries a body.
+ */
+void http_framer_init(http_response_framer* framer, int head_request);
+
+/**
+ * Prepares a framer for the body of a request whose header block was already parsed. The
+ * framer then follows the body like the body of a response. A malformed chunked body turns it
+ * into until-close mode, which the caller treats as an error since a request cannot be
+ * delimited by closing the connection.
+ *
+ * @param framer: The framer to initialize.
+ * @param mode: HTTP_BODY_NONE, HTTP_BODY_LENGTH or HTTP_BODY_CHUNKED.
+ * @param length: The Content-Length of an HTTP_BODY_LENGTH body.
+ */
+void http_framer_init_body(http_response_framer* framer, http_body_mode mode, unsigned long long length);
+
+/**
+ * Feeds relayed response bytes to the framer. The framer consumes bytes up to the end of the
+ * response and stops there. It also stops right after the header block, so the caller can
+ * send a rewritten head before relaying the body, and then feeds the rest again. A header
+ * block that is malformed or too large turns the framer into until-close mode, which relays
+ * everything and never reuses the connection.
+ *
+ * @param framer: The framer.
+ * @param data: The bytes read from the origin.
+ * @param length: The number of bytes read.
+ * @return The number of bytes consumed (at most length). Fewer than length are consumed
+ *         when the header block or the whole response ends inside the data.
+ */
+size_t http_framer_feed(http_response_framer* framer, const unsigned char* data, size_t length);
+
+/**
+ * Tells how many of the next response bytes belong to the body and can be relayed without
+ * being fed to the framer, e.g. moved between sockets with splice(). This is the rest of a
+ * Content-Length body or of the current chunk, or everything for a body delimited by close.
+ *
+ * @param framer: The framer.
+ * @return
+ *   - The number of bytes, HTTP_UNBOUNDED if the body ends when the origin closes.
+ *   - 0 if the framer has to see the next bytes.
+ */
+unsigned long long http_framer_opaque_length(const http_response_framer* framer);
+
+/**
+ * Accounts for body bytes that were relayed without being fed to the framer.
+ *
+ * @param framer: The framer.
+ * @param length: The number of bytes relayed, at most http_framer_opaque_length().
+ */
+void http_framer_skip(http_response_framer* framer, size_t length);
+
+/**
+ * Tells whether the response tracked by the framer is complete.
+ *
+ * @param framer: The framer.
+ * @return
+ *   - 1 if the whole response was seen.
+ *   - 0 otherwise.
+ */
+int http_framer_done(const http_response_framer* framer);
+
+/**
+ * Tells whether the origin connection can carry another request after the response ends.
+ * This requires a completed response with self-delimited framing and no "Connection: close".
+ *
+ * @param framer: The framer.
+ * @return
+ *   - 1 if the connection can be reused.
+ *   - 0 otherwise.
+ */
+int http_framer_reusable(const http_response_framer* framer);
+
+/**
+ * Builds the header block to send to the client once the framer has read it. The origin's
+ * Connection and Keep-Alive headers are replaced by a Connection header that reflects whether
+ * the proxy keeps the client connection open. A header block that could not be parsed is
+ * copied unchanged.
+ *
+ * @param framer: The framer, past its header block.
+ * @param keep_alive: 1 to announce "Connection: keep-alive", 0 for "Connection: close".
+ * @param out: Receives the header block, at least HTTP_MAX_HEADER_SIZE + 32 bytes long.
+ * @return The number of bytes written to out.
+ */
+size_t http_build_response_head(const http_response_framer* framer, int keep_alive, char* out);
+
+/**
+ * Rewrites a complete response header block for the client, like http_build_response_head(),
+ * for a head that is stored rather than held by a framer.
+ *
+ * @param head: The header block, with its final empty line.
+ * @param head_length: The length of the header block.
+ * @param keep_alive: 1 to announce "Connection: keep-alive", 0 for "Connection: close".
+ * @param out: Receives the header block, at least head_length + 32 bytes long.
+ * @return The number of bytes written to out.
+ */
+size_t http_rewrite_head(const char* head, size_t head_length, int keep_alive, char* out);
+
+/**
+ * Finds a header of a response header block, matching its name case-insensitively.
+ *
+ * @param head: The header block, starting with the status line.
+ * @param head_length: The length of the header block.
+ * @param name: The header name, without the colon.
+ * @param length: Receives the length of the value, without surrounding whitespace.
+ * @return
+ *   - A pointer to the value of the first such header inside head.
+ *   - NULL if the header is not present.
+ */
+const char* http_head_header(const char* head, size_t head_length, const char* name, size_t* length);
+
+/**
+ * Checks whether a comma-separated header value contains a token, ignoring case and
+ * surrounding whitespace, e.g. "close" in "Connection: keep-alive, close".
+ *
+ * @param value: The header value, not necessarily null-terminated.
+ * @param length: The length of the value.
+ * @param token: The null-terminated token to look for.
+ * @return
+ *   - 1 if the token is present.
+ *   - 0 otherwise.
+ */
+int http_has_token(const char* value, size_t length, const char* token);
+
+#endif //PROXYSERVER_HTTP_H
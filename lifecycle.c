@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include "lifecycle.h"
+#include "timerwheel.h"
+
+
+/**
+ * What precedes the descriptors on the upgrade socket
+ */
+typedef struct {
+    int listeners;   // number of listening sockets, sent first
+    int admin;       // 1 if the admin port socket follows them
+} handoff_header;
+
+
+static int inherit_fd = -1;                 // connection to the proxy the sockets came from, -1 if none
+static int stop_fd = -1;                    // eventfd written to stop the lifecycle thread
+static int signal_fd = -1;                  // signalfd reporting SIGTERM
+static int control_fd = -1;                 // the listening upgrade socket, -1 if none
+static const char* control_path = NULL;     // the path of the upgrade socket
+static const int* handoff_listeners = NULL; // the listening sockets handed over
+static int handoff_count = 0;               // number of listening sockets
+static int handoff_admin = -1;              // the admin port socket handed over, -1 if none
+static unsigned long long drain_timeout_ms;  // milliseconds the requests in flight get once draining
+static void (*drain_function)(void);        // starts the drain
+static atomic_ullong drain_deadline = ULLONG_MAX; // when the requests in flight are cut short, ULLONG_MAX until draining
+static int handed_over = 0;                 // 1 once a new proxy took the sockets, written by the lifecycle thread
+static int running = 0;                     // 1 while the lifecycle thread runs
+static pthread_t lifecycle_thread;          // the thread taking SIGTERM and serving the upgrade socket
+
+
+
+/**
+ * Fills the address of an upgrade socket.
+ *
+ * @param path: The path of the socket.
+ * @param address: Receives the address.
+ * @return
+ *   - 1 on success.
+ *   - -1 if the path is too long. A message is printed.
+ */
+static int fill_address(const char* path, struct sockaddr_un* address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path))
+    {
+        fprintf(stderr, "Upgrade socket path too long: %s\n", path);
+        return -1;
+    }
+
+    strcpy(address->sun_path, path);
+    return 1;
+}
+
+/**
+ * Closes the upgrade socket, and removes its path unless a new proxy serves it by now.
+ */
+static void close_upgrade_socket(void)
+{
+    if (control_fd == -1)
+        return;
+
+    close(control_fd);
+    control_fd = -1;
+    if (!handed_over)
+        unlink(control_path);
+}
+
+/**
+ * Sends the sockets to a new proxy and waits for its answer.
+ *
+ * @param sd: The connection of the new proxy.
+ * @return
+ *   - 1 if the new proxy listens on the sockets.
+ *   - 0 if it refused them, did not answer in time or the sockets could not be sent.
+ */
+static int hand_over(int sd)
+{
+    handoff_header header = {handoff_count, handoff_admin != -1};
+    int fds[LIFECYCLE_MAX_SOCKETS];
+    int count = handoff_count;
+    memcpy(fds, handoff_listeners, count * sizeof(int));
+    if (header.admin)
+        fds[count++] = handoff_admin;
+
+    char control[CMSG_SPACE(sizeof(int) * LIFECYCLE_MAX_SOCKETS)];
+    memset(control, 0, sizeof(control));
+    struct iovec part = {&header, sizeof(header)};
+    struct msghdr message = {0};
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    struct cmsghdr* rights = CMSG_FIRSTHDR(&message);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(rights), fds, sizeof(int) * count);
+
+    if (sendmsg(sd, &message, MSG_NOSIGNAL) != sizeof(header))
+    {
+        perror("error: sendmsg\n");
+        return 0;
+    }
+
+    // The new proxy refuses sockets that do not fit its settings
+    struct pollfd answer_ready = {sd, POLLIN, 0};
+    char answer = 0;
+    if (poll(&answer_ready, 1, LIFECYCLE_CONFIRM_TIMEOUT_MS) != 1 || read(sd, &answer, 1) != 1)
+        return 0;
+
+    return answer == 1;
+}
+
+/**
+ * The body of the lifecycle thread: waits for SIGTERM or a new proxy on the upgrade socket,
+ * and starts the drain after either.
+ *
+ * @param arg: Unused.
+ * @return NULL.
+ */
+static void* lifecycle_main(void* arg)
+{
+    (void)arg;
+
+    struct pollfd fds[3] = {
+        {stop_fd, POLLIN, 0},
+        {signal_fd, POLLIN, 0},
+        {control_fd, POLLIN, 0}   // Ignored by poll() without an upgrade socket
+    };
+
+    while (1)
+    {
+        if (poll(fds, 3, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("error: poll\n");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+            break; // Shutdown requested
+
+        int drain = 0;
+
+        if (fds[1].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+                drain = 1;
+        }
+
+        if (fds[2].revents & POLLIN)
+        {
+            int sd = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (sd >= 0)
+            {
+                if (hand_over(sd))
+                {
+                    handed_over = 1;
+                    drain = 1;
+                }
+                close(sd);
+            }
+        }
+
+        if (drain)
+        {
+            // A draining proxy has nothing left to hand over, a second SIGTERM changes nothing
+            printf(handed_over ? "Sockets handed over, draining\n" : "SIGTERM received, draining\n");
+            close_upgrade_socket();
+            atomic_store(&drain_deadline, timer_wheel_clock_ms() + drain_timeout_ms);
+            drain_function();
+            fds[1].fd = -1;
+            fds[2].fd = -1;
+        }
+    }
+
+    return NULL;
+}
+
+
+int lifecycle_block_signals(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+    {
+        fprintf(stderr, "Error blocking SIGTERM\n");
+        return -1;
+    }
+
+    return 1;
+}
+
+
+int lifecycle_inherit(const char* path, int* listeners, int* admin)
+{
+    *admin = -1;
+
+    struct sockaddr_un address;
+    if (fill_address(path, &address) == -1)
+        return -1;
+
+    int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd < 0)
+    {
+        perror("error: socket\n");
+        return -1;
+    }
+
+    if (connect(sd, (struct sockaddr*)&address, sizeof(address)) < 0)
+    {
+        int error = errno;
+        close(sd);
+
+        // No proxy ever served the path, or the one that did is gone
+        if (error == ENOENT || error == ECONNREFUSED)
+            return 0;
+
+        errno = error;
+        perror("error: connect\n");
+        return -1;
+    }
+
+    handoff_header header;
+    char control[CMSG_SPACE(sizeof(int) * LIFECYCLE_MAX_SOCKETS)];
+    struct iovec part = {&header, sizeof(header)};
+    struct msghdr message = {0};
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t received;
+    do {
+        received = recvmsg(sd, &message, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    int fds[LIFECYCLE_MAX_SOCKETS];
+    int count = 0;
+    for (struct cmsghdr* rights = received > 0 ? CMSG_FIRSTHDR(&message) : NULL; rights != NULL;
+         rights = CMSG_NXTHDR(&message, rights))
+        if (rights->cmsg_level == SOL_SOCKET && rights->cmsg_type == SCM_RIGHTS)
+        {
+            int more = (int)((rights->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            if (count + more > LIFECYCLE_MAX_SOCKETS)
+                more = LIFECYCLE_MAX_SOCKETS - count;
+            memcpy(&fds[count], CMSG_DATA(rights), more * sizeof(int));
+            count += more;
+        }
+
+    // The descriptors must be exactly the ones announced
+    if (received != sizeof(header) || (message.msg_flags & MSG_CTRUNC) || header.listeners < 1 ||
+        (header.admin != 0 && header.admin != 1) || header.listeners + header.admin != count)
+    {
+        fprintf(stderr, "Invalid sockets received on %s\n", path);
+        for (int i = 0; i < count; i++)
+            close(fds[i]);
+        close(sd);
+        return -1;
+    }
+
+    memcpy(listeners, fds, header.listeners * sizeof(int));
+    if (header.admin)
+        *admin = fds[header.listeners];
+
+    inherit_fd = sd;
+    return header.listeners;
+}
+
+
+void lifecycle_confirm(int taken)
+{
+    if (inherit_fd == -1)
+        return;
+
+    char answer = taken ? 1 : 0;
+    if (write(inherit_fd, &answer, 1) != 1)
+        perror("error: write\n");
+
+    close(inherit_fd);
+    inherit_fd = -1;
+}
+
+
+int lifecycle_start(const char* path, const int* listeners, int count, int admin,
+                    unsigned long long drain_timeout, void (*drain)(void))
+{
+    handoff_listeners = listeners;
+    handoff_count = count;
+    handoff_admin = admin;
+    drain_timeout_ms = drain_timeout;
+    drain_function = drain;
+    handed_over = 0;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (signal_fd == -1 || stop_fd == -1)
+    {
+        fprintf(stderr, "Failed to initialize the lifecycle thread\n");
+        lifecycle_stop();
+        return -1;
+    }
+
+    // Replace the socket of the proxy taken over, or a stale one
+    struct sockaddr_un address;
+    if (path != NULL)
+    {
+        if (fill_address(path, &address) == -1 ||
+            (control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0)
+        {
+            perror("error: socket\n");
+            lifecycle_stop();
+            return -1;
+        }
+
+        control_path = path;
+        unlink(path);
+        if (bind(control_fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(control_fd, 4) < 0)
+        {
+            perror("error: bind\n");
+            lifecycle_stop();
+            return -1;
+        }
+    }
+
+    if (pthread_create(&lifecycle_thread, NULL, lifecycle_main, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to create the lifecycle thread\n");
+        lifecycle_stop();
+        return -1;
+    }
+
+    running = 1;
+    return 1;
+}
+
+
+unsigned long long lifecycle_drain_deadline(void)
+{
+    return atomic_load_explicit(&drain_deadline, memory_order_relaxed);
+}
+
+
+int lifecycle_draining(void)
+{
+    return lifecycle_drain_deadline() != ULLONG_MAX;
+}
+
+
+void lifecycle_stop(void)
+{
+    if (running)
+    {
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) != sizeof(one))
+            perror("error: write\n");
+
+        pthread_join(lifecycle_thread, NULL);
+        running = 0;
+    }
+
+    close_upgrade_socket();
+    if (signal_fd != -1)
+        close(signal_fd);
+    if (stop_fd != -1)
+        close(stop_fd);
+    signal_fd = -1;
+    stop_fd = -1;
+}
@@ -0,0 +1,95 @@
+#ifndef PROXYSERVER_LIFECYCLE_H
+#define PROXYSERVER_LIFECYCLE_H
+
+#include "threadpool.h"
+
+/**
+ * lifecycle.h
+ *
+ * This file declares how a running proxy is stopped and replaced. A thread
+ * of its own takes SIGTERM and starts the drain: no connection is accepted
+ * anymore and the connections in flight finish their current request. The
+ * same thread serves the upgrade socket, a UNIX socket a new proxy connects
+ * to at startup to receive the listening sockets with SCM_RIGHTS. Once the
+ * new proxy confirms it listens on them, the old one drains, and since the
+ * sockets never close no connection is refused during the upgrade.
+ */
+
+// most sockets handed over: every listening socket and the admin port
+#define LIFECYCLE_MAX_SOCKETS (MAXT_IN_POOL + 1)
+
+// milliseconds a proxy handing its sockets over waits for the new one to confirm
+#define LIFECYCLE_CONFIRM_TIMEOUT_MS 5000
+
+
+/**
+ * Blocks SIGTERM in the calling thread, threads created afterwards inherit the mask. Must be
+ * called before any other thread is created, so only the lifecycle thread takes the signal.
+ *
+ * @return
+ *   - 1 on success.
+ *   - -1 if the signal cannot be blocked. A message is printed.
+ */
+int lifecycle_block_signals(void);
+
+/**
+ * Takes the sockets of the proxy serving an upgrade socket, if one does. The connection stays
+ * open until lifecycle_confirm() tells the proxy whether they were taken.
+ *
+ * @param path: The upgrade socket.
+ * @param listeners: Receives the listening sockets, LIFECYCLE_MAX_SOCKETS at most.
+ * @param admin: Receives the listening socket of the admin port, -1 if none was handed over.
+ * @return
+ *   - The number of listening sockets received, at least 1.
+ *   - 0 if no proxy serves the upgrade socket, nothing was received.
+ *   - -1 if the sockets cannot be received. A message is printed.
+ */
+int lifecycle_inherit(const char* path, int* listeners, int* admin);
+
+/**
+ * Answers the proxy the sockets came from, which drains if they were taken and keeps serving
+ * otherwise. Nothing is done if no socket was inherited.
+ *
+ * @param taken: 1 if the sockets are used, 0 if they are refused.
+ */
+void lifecycle_confirm(int taken);
+
+/**
+ * Starts the lifecycle thread. On SIGTERM, or once a new proxy took over the sockets, it sets
+ * the drain deadline and calls the drain function, once.
+ *
+ * @param path: The upgrade socket to serve, replacing a stale one, NULL for none.
+ * @param listeners: The listening sockets to hand over, must stay valid until lifecycle_stop().
+ * @param count: The number of listening sockets.
+ * @param admin: The listening socket of the admin port to hand over, -1 if none.
+ * @param drain_timeout: Milliseconds the requests in flight get to finish once the drain starts.
+ * @param drain: Called from the lifecycle thread to start the drain.
+ * @return
+ *   - 1 on success.
+ *   - -1 if the upgrade socket cannot be served or the thread cannot be created. A message is printed.
+ */
+int lifecycle_start(const char* path, const int* listeners, int count, int admin,
+                    unsigned long long drain_timeout, void (*drain)(void));
+
+/**
+ * Returns when the requests still in flight are cut short, a plain load cheap enough for every request.
+ *
+ * @return The monotonic millisecond of the drain deadline, ULLONG_MAX while no drain runs.
+ */
+unsigned long long lifecycle_drain_deadline(void);
+
+/**
+ * Tells whether the drain started: no connection is accepted anymore, and a connection is closed
+ * after its current request.
+ *
+ * @return 1 while draining, 0 otherwise.
+ */
+int lifecycle_draining(void);
+
+/**
+ * Stops the lifecycle thread, if it runs, and removes the upgrade socket unless a new proxy
+ * took it over.
+ */
+void lifecycle_stop(void);
+
+#endif //PROXYSERVER_LIFECYCLE_H
@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
+#include "metrics.h"
+
+
+// the status codes with an error counter, in the order of the METRIC_ERRORS_ counters
+static const int error_statuses[] = {400, 403, 404, 500, 501, 503, 504};
+
+// the names of the phases in the exposition, indexed by metrics_phase
+static const char* const phase_names[] = {"parse", "dns", "filter", "connect", "first_byte", "relay"};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER; // protects shards and pools
+static metrics_shard* shards = NULL;                              // the shards of every thread that recorded something
+static const threadpool* pools[MAXT_IN_POOL];                     // the pools whose queues are reported
+static int pool_count = 0;                                        // number of pools
+static _Thread_local metrics_shard* local_shard = NULL;           // the shard of the calling thread, NULL until it records something
+
+static int server_socket = -1;                                    // the listening socket of the admin port, -1 if none
+static int server_stop_fd = -1;                                   // eventfd written to stop the admin port thread
+static pthread_t server_thread;                                   // the thread answering scrapes
+
+
+/**
+ * A growing text buffer the exposition is written to
+ */
+typedef struct {
+    char* data;        // the text, NULL if memory ran out
+    size_t length;     // bytes of text
+    size_t capacity;   // size of data
+} text_buffer;
+
+
+
+/**
+ * Allocates the shard of the calling thread and adds it to the registry.
+ *
+ * @return The shard, or NULL if memory allocation fails.
+ */
+static metrics_shard* register_shard(void)
+{
+    // Aligned and sized to whole cache lines, no other thread writes next to it
+    metrics_shard* shard = aligned_alloc(METRICS_CACHE_LINE, sizeof(metrics_shard));
+    if (shard == NULL)
+        return NULL;
+    memset(shard, 0, sizeof(metrics_shard));
+
+    pthread_mutex_lock(&registry_lock);
+    shard->next = shards;
+    shards = shard;
+    pthread_mutex_unlock(&registry_lock);
+
+    return shard;
+}
+
+/**
+ * Returns the shard of the calling thread, registering it on first use.
+ *
+ * @return The shard, or NULL if it cannot be allocated, in which case nothing is recorded.
+ */
+static metrics_shard* thread_shard(void)
+{
+    if (local_shard == NULL)
+        local_shard = register_shard();
+    return local_shard;
+}
+
+/**
+ * Adds to a value only the calling thread writes. A relaxed load and store is enough, scrapes
+ * only read it, and costs no more than an ordinary increment.
+ *
+ * @param value: The value.
+ * @param amount: The amount to add.
+ */
+static void add(atomic_ullong* value, unsigned long long amount)
+{
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+/**
+ * Finds the histogram bucket of a latency.
+ *
+ * @param microseconds: The latency.
+ * @return The bucket index, or -1 if the latency is beyond the last bucket.
+ */
+static int bucket_of(unsigned long long microseconds)
+{
+    if (microseconds < METRICS_SUB_BUCKETS)
+        return (int)microseconds;
+
+    int octave = 63 - __builtin_clzll(microseconds); // Position of the highest bit set
+    if (octave >= METRICS_MAX_OCTAVE)
+        return -1;
+
+    // The bits below the highest one pick the sub-bucket
+    return (octave - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS +
+           (int)((microseconds >> (octave - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1));
+}
+
+/**
+ * Returns the largest latency a histogram bucket holds.
+ *
+ * @param bucket: The bucket index.
+ * @return The inclusive upper bound in microseconds.
+ */
+static unsigned long long bucket_upper(int bucket)
+{
+    if (bucket < METRICS_SUB_BUCKETS)
+        return (unsigned long long)bucket;
+
+    int octave = bucket / METRICS_SUB_BUCKETS + METRICS_SUB_BUCKET_BITS - 1;
+    unsigned long long next = METRICS_SUB_BUCKETS + bucket % METRICS_SUB_BUCKETS + 1;
+    return (next << (octave - METRICS_SUB_BUCKET_BITS)) - 1;
+}
+
+/**
+ * Appends formatted text to a buffer, growing it as needed.
+ *
+ * @param out: The buffer. Its data is freed and set to NULL if memory runs out.
+ * @param format: The printf() format.
+ */
+static void append(text_buffer* out, const char* format, ...)
+{
+    while (out->data != NULL)
+    {
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(out->data + out->length, out->capacity - out->length, format, args);
+        va_end(args);
+
+        if (length < 0)
+            return;
+        if ((size_t)length < out->capacity - out->length)
+        {
+            out->length += length;
+            return;
+        }
+
+        // Too short, double it and format again
+        char* data = realloc(out->data, out->capacity * 2);
+        if (data == NULL)
+            free(out->data);
+        out->data = data;
+        out->capacity *= 2;
+    }
+}
+
+/**
+ * Writes the HELP and TYPE lines of a metric family.
+ *
+ * @param out: The buffer.
+ * @param name: The name of the family.
+ * @param type: "counter", "gauge" or "histogram".
+ * @param help: What the family measures.
+ */
+static void append_family(text_buffer* out, const char* name, const char* type, const char* help)
+{
+    append(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Writes the exposition of every metric, the shards added up.
+ *
+ * @param out: The buffer, empty.
+ */
+static void render(text_buffer* out)
+{
+    // The totals are large and only the server thread renders, so they are not on its stack
+    static unsigned long long counters[METRIC_COUNTERS];
+    static unsigned long long buckets[METRIC_PHASES][METRICS_BUCKETS];
+    static unsigned long long overflow[METRIC_PHASES];
+    static unsigned long long sums[METRIC_PHASES];
+    long long queued = 0;
+
+    memset(counters, 0, sizeof(counters));
+    memset(buckets, 0, sizeof(buckets));
+    memset(overflow, 0, sizeof(overflow));
+    memset(sums, 0, sizeof(sums));
+
+    pthread_mutex_lock(&registry_lock);
+    for (const metrics_shard* shard = shards; shard != NULL; shard = shard->next)
+    {
+        for (int i = 0; i < METRIC_COUNTERS; i++)
+            counters[i] += atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+
+        for (int p = 0; p < METRIC_PHASES; p++)
+        {
+            const metrics_histogram* histogram = &shard->phases[p];
+            for (int b = 0; b < METRICS_BUCKETS; b++)
+                buckets[p][b] += atomic_load_explicit(&histogram->buckets[b], memory_order_relaxed);
+            overflow[p] += atomic_load_explicit(&histogram->overflow, memory_order_relaxed);
+            sums[p] += atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+        }
+    }
+    for (int i = 0; i < pool_count; i++)
+        queued += atomic_load_explicit(&pools[i]->qsize, memory_order_relaxed);
+    pthread_mutex_unlock(&registry_lock);
+
+    append_family(out, "proxy_connections_accepted_total", "counter", "Client connections accepted.");
+    append(out, "proxy_connections_accepted_total %llu\n", counters[METRIC_CONNECTIONS_ACCEPTED]);
+
+    // Accepted and closed come from different shards, a connection closing during the scrape may be seen once
+    unsigned long long closed = counters[METRIC_CONNECTIONS_CLOSED];
+    unsigned long long accepted = counters[METRIC_CONNECTIONS_ACCEPTED];
+    append_family(out, "proxy_connections_open", "gauge", "Client connections being served.");
+    append(out, "proxy_connections_open %llu\n", accepted > closed ? accepted - closed : 0);
+
+    append_family(out, "proxy_requests_total", "counter", "Request heads received from clients.");
+    append(out, "proxy_requests_total %llu\n", counters[METRIC_REQUESTS]);
+
+    append_family(out, "proxy_relayed_bytes_total", "counter", "Bytes relayed between clients and origins.");
+    append(out, "proxy_relayed_bytes_total{direction=\"to_client\"} %llu\n", counters[METRIC_BYTES_TO_CLIENT]);
+    append(out, "proxy_relayed_bytes_total{direction=\"to_origin\"} %llu\n", counters[METRIC_BYTES_TO_ORIGIN]);
+
+    append_family(out, "proxy_filter_hits_total", "counter", "Requests refused by the filter.");
+    append(out, "proxy_filter_hits_total{match=\"host\"} %llu\n", counters[METRIC_FILTER_HOST_HITS]);
+    append(out, "proxy_filter_hits_total{match=\"address\"} %llu\n", counters[METRIC_FILTER_ADDRESS_HITS]);
+
+    append_family(out, "proxy_error_responses_total", "counter", "Error responses sent to clients by status code.");
+    for (size_t i = 0; i < sizeof(error_statuses) / sizeof(error_statuses[0]); i++)
+        append(out, "proxy_error_responses_total{status=\"%d\"} %llu\n", error_statuses[i], counters[METRIC_ERRORS_400 + i]);
+
+    append_family(out, "proxy_access_log_dropped_total", "counter", "Access log records dropped because the writer fell behind.");
+    append(out, "proxy_access_log_dropped_total %llu\n", counters[METRIC_ACCESS_LOG_DROPPED]);
+
+    append_family(out, "proxy_shed_total", "counter", "Connections answered with 503 to shed load, by reason.");
+    append(out, "proxy_shed_total{reason=\"queue_full\"} %llu\n", counters[METRIC_SHED_QUEUE_FULL]);
+    append(out, "proxy_shed_total{reason=\"queue_delay\"} %llu\n", counters[METRIC_SHED_QUEUE_DELAY]);
+    append(out, "proxy_shed_total{reason=\"client_limit\"} %llu\n", counters[METRIC_SHED_CLIENT_LIMIT]);
+
+    append_family(out, "proxy_queue_depth", "gauge", "Connections waiting in the thread pool queues.");
+    append(out, "proxy_queue_depth %lld\n", queued > 0 ? queued : 0);
+
+    append_family(out, "proxy_phase_duration_seconds", "histogram", "Latency of the phases of a request.");
+    for (int p = 0; p < METRIC_PHASES; p++)
+    {
+        unsigned long long count = 0;
+        for (int b = 0; b < METRICS_BUCKETS; b++)
+        {
+            count += buckets[p][b];
+            unsigned long long upper = bucket_upper(b);
+            append(out, "proxy_phase_duration_seconds_bucket{phase=\"%s\",le=\"%llu.%06llu\"} %llu\n",
+                   phase_names[p], upper / 1000000, upper % 1000000, count);
+        }
+        count += overflow[p];
+        append(out, "proxy_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", phase_names[p], count);
+        append(out, "proxy_phase_duration_seconds_sum{phase=\"%s\"} %llu.%06llu\n",
+               phase_names[p], sums[p] / 1000000, sums[p] % 1000000);
+        append(out, "proxy_phase_duration_seconds_count{phase=\"%s\"} %llu\n", phase_names[p], count);
+    }
+}
+
+/**
+ * Writes a whole buffer to a socket.
+ *
+ * @param sd: The socket.
+ * @param data: The bytes.
+ * @param length: The number of bytes.
+ * @return
+ *   - 1 if everything was written.
+ *   - -1 otherwise.
+ */
+static int write_all(int sd, const char* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(sd, data, length);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        data += written;
+        length -= written;
+    }
+
+    return 1;
+}
+
+/**
+ * Answers one scrape: "GET /metrics" gets the exposition, anything else a 404.
+ *
+ * @param sd: The accepted socket, closed by the caller.
+ */
+static void serve_scrape(int sd)
+{
+    // A scraper that stalls must not hold the admin port for long
+    struct timeval timeout = {.tv_sec = 5, .tv_usec = 0};
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Only the request line matters, read until the header block ends
+    char request[2048];
+    size_t length = 0;
+    while (length < sizeof(request) - 1)
+    {
+        ssize_t received = read(sd, request + length, sizeof(request) - 1 - length);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return;
+        length += received;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+            break;
+    }
+    request[length] = '\0';
+
+    const char* path = "GET /metrics";
+    size_t path_length = strlen(path);
+    if (strncmp(request, path, path_length) != 0 || (request[path_length] != ' ' && request[path_length] != '?'))
+    {
+        const char* missing = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        write_all(sd, missing, strlen(missing));
+        return;
+    }
+
+    text_buffer body = {malloc(65536), 0, 65536};
+    if (body.data != NULL)
+        render(&body);
+    if (body.data == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        const char* failed = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        write_all(sd, failed, strlen(failed));
+        return;
+    }
+
+    char head[256];
+    int head_length = snprintf(head, sizeof(head),
+                               "HTTP/1.1 200 OK\r\n"
+                               "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                               "Content-Length: %zu\r\n"
+                               "Connection: close\r\n\r\n", body.length);
+
+    if (write_all(sd, head, head_length) == 1)
+        write_all(sd, body.data, body.length);
+    free(body.data);
+}
+
+/**
+ * The body of the admin port thread: answers scrapes one at a time until metrics_stop_server() wakes it.
+ *
+ * @param arg: Unused.
+ * @return NULL.
+ */
+static void* server_function(void* arg)
+{
+    (void)arg;
+
+    // The socket may be shared with a proxy taking over, so it is never shut down to stop the thread
+    struct pollfd fds[2] = {{server_socket, POLLIN, 0}, {server_stop_fd, POLLIN, 0}};
+
+    while (1)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("error: poll\n");
+            return NULL;
+        }
+
+        if (fds[1].revents & POLLIN)
+            return NULL; // Stopped by metrics_stop_server()
+
+        int sd = accept4(server_socket, NULL, NULL, SOCK_CLOEXEC);
+        if (sd < 0)
+        {
+            // Another process sharing the socket may have taken the connection
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+            perror("error: accept\n");
+            return NULL;
+        }
+
+        serve_scrape(sd);
+        close(sd);
+    }
+}
+
+
+unsigned long long metrics_clock_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+void metrics_count(metrics_counter counter, unsigned long long amount)
+{
+    metrics_shard* shard = thread_shard();
+    if (shard != NULL)
+        add(&shard->counters[counter], amount);
+}
+
+
+void metrics_count_error(int status)
+{
+    for (size_t i = 0; i < sizeof(error_statuses) / sizeof(error_statuses[0]); i++)
+        if (error_statuses[i] == status)
+        {
+            metrics_count(METRIC_ERRORS_400 + i, 1);
+            return;
+        }
+}
+
+
+void metrics_observe(metrics_phase phase, unsigned long long microseconds)
+{
+    metrics_shard* shard = thread_shard();
+    if (shard == NULL)
+        return;
+
+    metrics_histogram* histogram = &shard->phases[phase];
+    int bucket = bucket_of(microseconds);
+    add(bucket == -1 ? &histogram->overflow : &histogram->buckets[bucket], 1);
+    add(&histogram->sum, microseconds);
+}
+
+
+int metrics_watch_pool(const threadpool* pool)
+{
+    int result = -1;
+
+    pthread_mutex_lock(&registry_lock);
+    if (pool_count < MAXT_IN_POOL)
+    {
+        pools[pool_count++] = pool;
+        result = 1;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    return result;
+}
+
+
+void metrics_unwatch_pool(const threadpool* pool)
+{
+    pthread_mutex_lock(&registry_lock);
+    for (int i = 0; i < pool_count; i++)
+        if (pools[i] == pool)
+        {
+            pools[i] = pools[--pool_count]; // Fill the gap with the last one
+            break;
+        }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+
+int metrics_start_server(int sd)
+{
+    server_socket = sd;
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK); // accept() only follows a poll() reporting a connection
+    server_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (server_stop_fd == -1 || pthread_create(&server_thread, NULL, server_function, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to create the metrics thread\n");
+        if (server_stop_fd != -1)
+            close(server_stop_fd);
+        close(sd);
+        server_stop_fd = -1;
+        server_socket = -1;
+        return -1;
+    }
+
+    return 1;
+}
+
+
+void metrics_stop_server(void)
+{
+    if (server_socket == -1)
+        return;
+
+    uint64_t one = 1;
+    if (write(server_stop_fd, &one, sizeof(one)) != sizeof(one))
+        perror("error: write\n");
+
+    pthread_join(server_thread, NULL);
+    close(server_stop_fd);
+    close(server_socket);
+    server_stop_fd = -1;
+    server_socket = -1;
+}
+
+
+int metrics_server_socket(void)
+{
+    return server_socket;
+}
+
+
+void metrics_shutdown(void)
+{
+    pthread_mutex_lock(&registry_lock);
+    while (shards != NULL)
+    {
+        metrics_shard* next = shards->next;
+        free(shards);
+        shards = next;
+    }
+    pool_count = 0;
+    pthread_mutex_unlock(&registry_lock);
+
+    local_shard = NULL;
+}
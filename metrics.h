@@ -0,0 +1,170 @@
+#ifndef PROXYSERVER_METRICS_H
+#define PROXYSERVER_METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include "threadpool.h"
+
+/**
+ * metrics.h
+ *
+ * This file declares the live metrics of the proxy. Every thread that counts
+ * something gets a shard of its own, padded to whole cache lines, that only
+ * it writes: an update is a plain load and store, with no lock and no
+ * read-modify-write shared with another thread. A scrape of the admin port
+ * adds the shards up and answers in the Prometheus text format.
+ */
+
+// size of a cache line, shards never share one
+#define METRICS_CACHE_LINE 64
+
+// log2 of the number of buckets per power of two of a latency histogram
+#define METRICS_SUB_BUCKET_BITS 2
+
+// number of buckets per power of two
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+
+// latencies from 2^METRICS_MAX_OCTAVE microseconds on (134 seconds) only count towards +Inf
+#define METRICS_MAX_OCTAVE 27
+
+// number of buckets of a latency histogram: values below METRICS_SUB_BUCKETS get one each, then
+// every power of two up to METRICS_MAX_OCTAVE is split into METRICS_SUB_BUCKETS
+#define METRICS_BUCKETS ((METRICS_MAX_OCTAVE - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS)
+
+
+/**
+ * The counters
+ */
+typedef enum {
+    METRIC_CONNECTIONS_ACCEPTED,   // client connections accepted
+    METRIC_CONNECTIONS_CLOSED,     // client connections closed
+    METRIC_REQUESTS,               // request heads received
+    METRIC_BYTES_TO_CLIENT,        // bytes relayed from origins to clients
+    METRIC_BYTES_TO_ORIGIN,        // bytes relayed from clients to origins
+    METRIC_FILTER_HOST_HITS,       // requests refused for a listed hostname
+    METRIC_FILTER_ADDRESS_HITS,    // requests refused for an address of a listed network
+    METRIC_ERRORS_400,             // error responses by status code
+    METRIC_ERRORS_403,
+    METRIC_ERRORS_404,
+    METRIC_ERRORS_500,
+    METRIC_ERRORS_501,
+    METRIC_ERRORS_503,
+    METRIC_ERRORS_504,
+    METRIC_ACCESS_LOG_DROPPED,     // access log records dropped because a ring was full
+    METRIC_SHED_QUEUE_FULL,        // connections refused because the queue of a pool reached its watermark
+    METRIC_SHED_QUEUE_DELAY,       // connections refused because they queued too long
+    METRIC_SHED_CLIENT_LIMIT,      // connections refused because their client held too many
+    METRIC_COUNTERS                // number of counters
+} metrics_counter;
+
+
+/**
+ * The phases of a request whose latency is recorded
+ */
+typedef enum {
+    METRIC_PHASE_PARSE,        // from the first byte of the request head to its end
+    METRIC_PHASE_DNS,          // resolving the origin
+    METRIC_PHASE_FILTER,       // matching the hostname and the addresses against the filter
+    METRIC_PHASE_CONNECT,      // establishing a new connection to the origin
+    METRIC_PHASE_FIRST_BYTE,   // from sending the request to the first byte of the response
+    METRIC_PHASE_RELAY,        // from the first byte of the response to its end
+    METRIC_PHASES              // number of phases
+} metrics_phase;
+
+
+/**
+ * A latency histogram with logarithmic buckets: bucket boundaries grow by a quarter of the
+ * power of two they are in, so every value is known within 25% from a microsecond to minutes
+ */
+typedef struct {
+    atomic_ullong buckets[METRICS_BUCKETS];   // number of values by bucket
+    atomic_ullong overflow;                   // number of values beyond the last bucket
+    atomic_ullong sum;                        // sum of the values in microseconds
+} metrics_histogram;
+
+
+/**
+ * The metrics one thread recorded, written by that thread only
+ */
+typedef struct metrics_shard_st {
+    _Alignas(METRICS_CACHE_LINE) atomic_ullong counters[METRIC_COUNTERS]; // indexed by metrics_counter
+    metrics_histogram phases[METRIC_PHASES];                              // indexed by metrics_phase
+    struct metrics_shard_st* next;                                        // next shard of the registry
+} metrics_shard;
+
+
+/**
+ * Returns the monotonic time latencies are measured with.
+ *
+ * @return The monotonic time in microseconds.
+ */
+unsigned long long metrics_clock_us(void);
+
+/**
+ * Adds to a counter of the calling thread.
+ *
+ * @param counter: The counter.
+ * @param amount: The amount to add.
+ */
+void metrics_count(metrics_counter counter, unsigned long long amount);
+
+/**
+ * Counts an error response sent to a client.
+ *
+ * @param status: The status code of the response, an ErrorType value. Unknown codes are ignored.
+ */
+void metrics_count_error(int status);
+
+/**
+ * Records the latency of a phase of a request in the histogram of the calling thread.
+ *
+ * @param phase: The phase.
+ * @param microseconds: How long it took.
+ */
+void metrics_observe(metrics_phase phase, unsigned long long microseconds);
+
+/**
+ * Adds the queue of a thread pool to the queue depth reported by a scrape.
+ *
+ * @param pool: The pool, watched until metrics_unwatch_pool() is called.
+ * @return
+ *   - 1 on success.
+ *   - -1 if too many pools are watched.
+ */
+int metrics_watch_pool(const threadpool* pool);
+
+/**
+ * Stops reporting the queue of a thread pool, before the pool is destroyed.
+ *
+ * @param pool: The pool.
+ */
+void metrics_unwatch_pool(const threadpool* pool);
+
+/**
+ * Starts the thread serving "GET /metrics" on the admin port, one scrape at a time.
+ *
+ * @param sd: The listening socket of the admin port, closed by metrics_stop_server().
+ * @return
+ *   - 1 on success.
+ *   - -1 if the thread cannot be created.
+ */
+int metrics_start_server(int sd);
+
+/**
+ * Stops the admin port thread, if it runs, and closes its socket.
+ */
+void metrics_stop_server(void);
+
+/**
+ * Returns the listening socket of the admin port, to hand it over to a new proxy.
+ *
+ * @return The socket, -1 if the admin port thread does not run.
+ */
+int metrics_server_socket(void);
+
+/**
+ * Frees every shard, once no other thread records metrics anymore.
+ */
+void metrics_shutdown(void);
+
+#endif //PROXYSERVER_METRICS_H
@@ -1,74 +1,75 @@
+#define _GNU_SOURCE
 #include "proxyServer.h"
+#include "eventloop.h"
 
 
-int set_connection_close(communication_info* ci)
+static atomic_size_t accepted_connections = 0; // connections taken by the acceptors of the threaded engine
+static size_t max_connections = 0;             // connections to accept before shutting down
+static acceptor* acceptors = NULL;             // the acceptors of the threaded engine
+static int acceptor_count = 0;                 // number of acceptors
+static timer_wheel deadlines;                  // the deadlines of the requests served by the pool threads
+static pthread_mutex_t deadline_lock = PTHREAD_MUTEX_INITIALIZER; // protects deadlines and the deadline fields of every request
+static pthread_t deadline_thread;              // the thread firing the deadlines
+static atomic_int deadline_running = 0;        // 1 while the deadline thread runs
+static int acceptors_stop_fd = -1;             // eventfd written to stop every acceptor
+static int drain_fd = -1;                      // eventfd written once the drain starts, wakes idle pool threads
+
+static const char* find_clean_host(const char* host, size_t* length);
+
+
+int set_request_header(communication_info* ci, const char* name, const char* value)
 {
-    // Check if the request is NULL
-    if (ci->request == NULL)
+    // Check if the request is NULL or was not parsed
+    if (ci->request == NULL || ci->parsed.length == 0)
         return -1; // Return -1 indicating failure
 
-    char* request = ci->request; // Alias for readability
-    char* modified_request = NULL; // To hold the modified request
-    char* connection_header = NULL; // To search for the Connection header in the request
-    char* end_of_headers = strstr(request, "\r\n\r\n"); // Find the end of the HTTP headers
+    // Look the header up by its whole name, so that "Connection" does not match "Proxy-Connection:"
+    const http_header* header = http_request_find_header(&ci->parsed, ci->request, name);
 
-    // Attempt to find "Connection:" header in a case-insensitive manner
-    const char* connection_patterns[] = {"Connection:", "connection:"};
-    for (int i = 0; i < 2; ++i)
+    if (header != NULL)
     {
-        connection_header = strstr(request, connection_patterns[i]);
-        if (connection_header != NULL)
-            break; // Stop if found
+        // Replace the value of the header, the rest of the request is sent from the client's buffer
+        const char* text = arena_strndup(ci->arena, value, strlen(value));
+        if (text == NULL)
+            return -1; // Return -1 if allocation fails
+        return http_edits_add(&ci->edits, header->value.offset, header->value.length, text, strlen(text));
     }
 
-    // If Connection header is found and there are headers in the request
-    if (connection_header != NULL && end_of_headers != NULL)
-    {
-        // Replace the Connection header's value with "close"
-        char* start_of_next_header = strstr(connection_header, "\r\n");
-        if (start_of_next_header != NULL)
-        {
-            // Calculate parts lengths for memory allocation
-            size_t header_part_len = connection_header - request;
-            size_t end_part_len = strlen(start_of_next_header);
-            // Allocate memory for the modified request
-            modified_request = malloc(header_part_len + strlen("Connection: close") + end_part_len + 1);
-            if (!modified_request)
-            {
-                fprintf(stderr, "Memory allocation failed\n");
-                return -1; // Return -1 if allocation fails
-            }
-            // Construct the modified request
-            strncpy(modified_request, request, header_part_len);
-            strcpy(modified_request + header_part_len, "Connection: close");
-            strcpy(modified_request + header_part_len + strlen("Connection: close"), start_of_next_header);
-        }
-    }
-    else if (end_of_headers != NULL)
+    // If the header is not found, insert a whole header line in front of the empty line ending the headers
+    size_t line_length = strlen(name) + strlen(value) + 4; // "Name: value\r\n"
+    char* line = arena_alloc(ci->arena, line_length + 1);
+    if (line == NULL)
+        return -1; // Return -1 if allocation fails
+    snprintf(line, line_length + 1, "%s: %s\r\n", name, value);
+
+    return http_edits_add(&ci->edits, ci->parsed.length - 2, 0, line, line_length);
+}
+
+
+int send_request(int sd, const communication_info* ci)
+{
+    size_t request_length = ci->parsed.length + ci->edits.delta; // Length of the edited request
+    size_t sent = 0; // Bytes of the edited request written so far
+    struct iovec segments[HTTP_MAX_REQUEST_SEGMENTS];
+
+    while (sent < request_length)
     {
-        // If Connection header is not found, prepare to add it before the end of headers marker "\r\n\r\n"
-        size_t headers_len = end_of_headers - request;
-        // Allocate memory for the modified request including space for "\r\nConnection: close\r\n\r\n"
-        modified_request = malloc(headers_len + strlen("\r\nConnection: close\r\n\r\n") + 1);
-        if (!modified_request)
+        // Send the original bytes and the edits together, resuming after a partial write
+        int count = http_edits_segments(&ci->edits, ci->request, ci->parsed.length, sent, segments);
+        ssize_t wrote_bytes = writev(sd, segments, count);
+        if (wrote_bytes < 0)
         {
-            fprintf(stderr, "Memory allocation failed\n");
-            return -1; // Return -1 if allocation fails
+            if (errno == EINTR)
+                continue;
+            perror("error: writev\n"); // Report error
+            return -1;
         }
-        // Copy the part of the request up to the end of headers marker into the modified request buffer
-        strncpy(modified_request, request, headers_len);
-        // Append "\r\nConnection: close\r\n\r\n" after the copied part, effectively replacing "\r\n\r\n" with it
-        strcpy(modified_request + headers_len, "\r\nConnection: close\r\n\r\n");
-    }
-    else
-        // Malformed request (no end of headers found)
-        return -1; // Return -1 indicating failure
 
-    // Replace the original request with the modified one
-    free(ci->request);
-    ci->request = modified_request;
+        sent += wrote_bytes;
+    }
 
-    return 1; // Return 1 indicating success
+    metrics_count(METRIC_BYTES_TO_ORIGIN, request_length);
+    return 1;
 }
 
 void init_communication_info(communication_info* ci)
@@ -76,191 +77,456 @@ void init_communication_info(communication_info* ci)
     ci->host_name = NULL;          // Set host name to NULL indicating no host name is set
     ci->clean_host_name = NULL;    // Set clean host name to NULL indicating no processed host name is set
     ci->request = NULL;            // Set request to NULL indicating no HTTP request is currently stored
-    ci->filter_content = NULL;     // Set filter content to NULL indicating no filter content is available at the moment
+    ci->filter = NULL;             // Set filter to NULL indicating no compiled filter is attached at the moment
     ci->client_socket = -1;        // Initialize client socket to -1, marking it as invalid or not yet assigned
     ci->host_port = -1;            // Initialize host port to -1, indicating that it is not yet specified
+    ci->host_addresses.count = 0;  // Initialize to no addresses, the host is not resolved yet
+    ci->pending = NULL;            // No bytes of a following request are buffered yet
+    ci->pending_length = 0;
+    ci->pending_capacity = 0;
+    ci->arena = NULL;              // The arena is taken when the first request starts
+    http_request_init(&ci->parsed); // Nothing of the first request was parsed yet
+    http_edits_init(&ci->edits);   // The request is sent as it arrived unless edited
+    ci->cache_key = NULL;          // No request was looked up in the cache yet
+    ci->cache_key_length = 0;
+    ci->cached = NULL;
+    ci->cache_store = NULL;
+    ci->flight = NULL;             // The request shares no fetch with others yet
+    ci->flight_leader = 0;
+    ci->tunnel = 0;                // The request is not a CONNECT until it is checked
+    ci->body_mode = HTTP_BODY_NONE; // Nor known to carry a body
+    ci->body_length = 0;
+    memset(&ci->deadline, 0, sizeof(wheel_timer)); // No deadline runs until the origin is contacted
+    ci->deadline.context = ci;
+    ci->deadline_sd = -1;
+    ci->phase = PHASE_CONNECT;
+    ci->phase_started = 0;
+    ci->request_started = 0;
+    atomic_init(&ci->progress, 0);
+    ci->exchange_clock = 0;        // Microsecond the request went to the origin, then its response started
+    ci->timed_out = 0;
+    ci->responded = 0;
+    memset(&ci->client_address, 0, sizeof(ci->client_address)); // Unknown until the connection is accepted
+    ci->status = 0;                // Nothing was sent to the client yet
+    ci->response_bytes = 0;
+    ci->arrived = 0;
+    ci->admitted = 0;              // Not counted against the limit of its client yet
+    ci->compressor = NULL;         // Bodies are relayed as they are unless a response gets compressed
+}
+
+
+/**
+ * Ends the cache use of a request: a completely stored response is published and one stored
+ * halfway is dropped, a led flight ends with it, and the references on the cache are dropped.
+ *
+ * @param ci: The communication_info of the request.
+ */
+static void finish_caching(communication_info* ci)
+{
+    cache_object* stored = ci->cache_store;
+    int committed = cache_store_end(stored);
+
+    // The flight still refers to the stored object, followers are served from it
+    if (ci->flight != NULL && ci->flight_leader)
+        cache_flight_finish(ci->flight, committed ? stored : NULL);
+    cache_flight_leave(ci->flight);
+    cache_release(ci->cached);
+
+    ci->cache_store = NULL;
+    ci->flight = NULL;
+    ci->flight_leader = 0;
+    ci->cached = NULL;
+    ci->cache_key = NULL;
+    ci->cache_key_length = 0;
+}
+
+
+/**
+ * Writes the current request to the access log, if a request head arrived or the client was
+ * answered anyway, e.g. with an error for a head that could not be read.
+ *
+ * @param ci: The communication_info of the request, its arena not released yet.
+ */
+static void log_request(communication_info* ci)
+{
+    if (ci->request == NULL && ci->status == 0)
+        return;
+
+    access_log_entry entry;
+    entry.client = ci->client_address;
+    entry.method = ci->request != NULL ? ci->request + ci->parsed.method.offset : "";
+    entry.method_length = ci->request != NULL ? ci->parsed.method.length : 0;
+    entry.target = ci->request != NULL ? ci->request + ci->parsed.target.offset : "";
+    entry.target_length = ci->request != NULL ? ci->parsed.target.length : 0;
+    entry.status = ci->status;
+    entry.bytes = ci->response_bytes;
+    entry.started = ci->arrived;
+    access_log_record(&entry);
+}
+
+
+void reset_request_info(communication_info* ci)
+{
+    log_request(ci); // The request is over, whatever its outcome
+
+    // Publish or drop the stored response and the references of the request on the cache
+    finish_caching(ci);
+
+    // Free the per-request data in one step, the connection itself stays open
+    arena_release(ci->arena);
+    ci->arena = NULL;
+
+    ci->host_name = NULL;
+    ci->clean_host_name = NULL;
+    ci->request = NULL;
+    ci->host_port = -1;
+    ci->host_addresses.count = 0;
+    ci->tunnel = 0;
+    ci->body_mode = HTTP_BODY_NONE;
+    ci->body_length = 0;
+    ci->timed_out = 0;
+    ci->responded = 0;
+    ci->status = 0;
+    ci->response_bytes = 0;
+    ci->arrived = 0;
+    ci->compressor = NULL; // Freed with the arena
+    http_request_init(&ci->parsed); // The next request is parsed from scratch
+    http_edits_init(&ci->edits);
 }
 
 
 void destroy_communication_info(communication_info* ci)
 {
-    if (ci->host_name != NULL)
-        free(ci->host_name); // Free the memory allocated for host name, if any
+    log_request(ci); // A request cut short by the connection closing is logged too
 
-    if (ci->clean_host_name != NULL)
-        free(ci->clean_host_name); // Free the memory allocated for cleaned host name, if any
+    finish_caching(ci); // Drop the response being stored and the references on the cache, if any
 
-    if (ci->request != NULL)
-        free(ci->request); // Free the memory allocated for the HTTP request, if any
+    arena_release(ci->arena); // Free the host names and the HTTP request of the current request, if any
 
     if (ci->client_socket != -1)
+    {
         close(ci->client_socket); // Close the client socket if it is open
+        metrics_count(METRIC_CONNECTIONS_CLOSED, 1);
+    }
+
+    filter_release(ci->filter); // Drop the reference on the filter snapshot, if any
 
-    if (ci->filter_content != NULL)
-        free(ci->filter_content);
+    if (ci->admitted)
+        admission_leave(&ci->client_address); // The client may open another connection
+
+    free(ci->pending); // Drop the bytes of a pipelined request that will not be served
 
     free (ci);
 }
 
 
-int set_my_server_configuration(struct sockaddr_in server_info)
+int set_my_server_configuration(in_port_t port, int reuse_port)
 {
     int ws; // welcome socket descriptor
+    int on = 1; // Value enabling boolean socket options
+    int off = 0; // Value disabling boolean socket options
+    struct sockaddr_storage server_info; // The address to listen on, every address of the server
+    socklen_t server_info_length = 0;
+    memset(&server_info, 0, sizeof(server_info));
+
+    // Create a TCP socket taking both IPv6 and IPv4 clients, or an IPv4 one on systems without IPv6
+    if ((ws = socket(PF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0)
+    {
+        struct sockaddr_in6* address = (struct sockaddr_in6*)&server_info;
+        address->sin6_family = AF_INET6;
+        address->sin6_port = htons(port);
+        address->sin6_addr = in6addr_any;
+        server_info_length = sizeof(struct sockaddr_in6);
+
+        // IPv4 clients arrive as IPv4-mapped addresses, whatever the system default is
+        if (setsockopt(ws, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0)
+            perror("error: setsockopt\n");
+    }
+    else if (errno == EAFNOSUPPORT && (ws = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0)
+    {
+        struct sockaddr_in* address = (struct sockaddr_in*)&server_info;
+        address->sin_family = AF_INET;
+        address->sin_port = htons(port);
+        address->sin_addr.s_addr = htonl(INADDR_ANY);
+        server_info_length = sizeof(struct sockaddr_in);
+    }
 
-    // Create a TCP socket using IPv4
-    if((ws = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+    if (ws < 0)
     {
         perror("error: socket\n"); // Log error if socket creation fails
-        return 0; // Return 0 to indicate failure
+        return -1; // Return -1 to indicate failure
+    }
+
+    // A restart may bind the port while connections the server closed linger in TIME_WAIT
+    if (setsockopt(ws, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+        perror("error: setsockopt\n");
+
+    // Let every acceptor bind its own socket to the port, the kernel spreads connections across them
+    if (reuse_port && setsockopt(ws, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    {
+        perror("error: setsockopt\n");
+        close(ws);
+        return -1;
     }
 
+    tune_socket(ws); // Accepted sockets start with the buffer sizes of the listening one
+
     // Bind the socket to the provided address and port
-    if(bind(ws, (struct sockaddr*) &server_info, sizeof(struct sockaddr_in)) < 0)
+    if(bind(ws, (struct sockaddr*) &server_info, server_info_length) < 0)
     {
         perror("error: bind\n"); // Log error if bind operation fails
         close(ws); // Close the socket to release resources
-        return 0; // Return 0 to indicate failure
+        return -1; // Return -1 to indicate failure
     }
 
-    // Set the socket to listen for incoming connections, with a backlog queue of 5 connections
-    if(listen(ws, 5) < 0)
+    // Only wake the acceptor once the request arrived, an optimization the proxy can do without
+    if (config.defer_accept > 0 &&
+        setsockopt(ws, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.defer_accept, sizeof(config.defer_accept)) < 0)
+        perror("error: setsockopt\n");
+
+    // Set the socket to listen for incoming connections, with the configured backlog queue
+    if(listen(ws, config.listen_backlog) < 0)
     {
         perror("error: listen\n"); // Log error if listen operation fails
         close(ws); // Close the socket to release resources
-        return 0; // Return 0 to indicate failure
+        return -1; // Return -1 to indicate failure
     }
 
     return ws; // Return the welcome socket descriptor on success
 }
 
 
-void send_error_message(ErrorType error, int sd)
+int error_keeps_alive(const communication_info* ci, ErrorType error, int keep_alive)
 {
-    char header[BUFFER_SIZE]; // Buffer for HTTP response headers
-    char body[BUFFER_SIZE]; // Buffer for the HTML body of the error message
-    time_t now = time(NULL); // Current time for the Date header
-    struct tm* gmt = gmtime(&now); // Convert time to GMT
-    char date[100]; // Buffer for formatted date string
-    // Format the date according to the HTTP date standard
-    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmt);
+    // A body the request may carry was not read, the next request would start inside it
+    return config.error_keep_alive && keep_alive && ci->request != NULL && ci->body_mode == HTTP_BODY_NONE &&
+           (error == ERROR_403_FORBIDDEN || error == ERROR_404_NOT_FOUND);
+}
 
-    const char* title; // Variable for storing the status line text
-    const char* description; // Variable for storing the error description
 
-    // Switch to set the title and description based on the ErrorType
-    switch (error) {
-        case ERROR_500_INTERNAL:
-            title = "500 Internal Server Error";
-            description = "Some server side error.";
-            break;
-        case ERROR_400_BAD_REQUEST:
-            title = "400 Bad Request";
-            description = "Bad Request.";
-            break;
-        case ERROR_404_NOT_FOUND:
-            title = "404 Not Found";
-            description = "File not found.";
-            break;
-        case ERROR_501_NOT_IMPLEMENTED:
-            title = "501 Not supported";
-            description = "Method is not supported.";
-            break;
-        case ERROR_403_FORBIDDEN:
-            title = "403 Forbidden";
-            description = "Access denied.";
+size_t send_error_message(ErrorType error, int sd, int keep_alive)
+{
+    char date[RESPONSES_DATE_LENGTH];
+    struct iovec parts[RESPONSES_ERROR_PARTS];
+
+    size_t length = responses_error(error, keep_alive, date, parts);
+    if (length == 0)
+        return 0; // Exit the function if the error type is unknown
+
+    // Send the complete HTTP response to the client, continuing after a partial write
+    size_t written = 0;
+    struct iovec* part = parts;
+    int part_count = RESPONSES_ERROR_PARTS;
+    while (written < length)
+    {
+        ssize_t result = writev(sd, part, part_count);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+        {
+            perror("error: writev\n");
             break;
-        default:
-            return; // Exit the function if the error type is unknown
-    }
+        }
 
-    // Construct the HTML body with the error title and description
-    snprintf(body, sizeof(body), "<HTML><HEAD><TITLE>%s</TITLE></HEAD>\r\n"
-                                 "<BODY><H4>%s</H4>\r\n"
-                                 "%s\r\n"
-                                 "</BODY></HTML>", title, title, description);
+        written += result;
+        while (part_count > 0 && (size_t)result >= part->iov_len)
+        {
+            result -= part->iov_len;
+            part++;
+            part_count--;
+        }
+        if (part_count > 0)
+        {
+            part->iov_base = (char*)part->iov_base + result;
+            part->iov_len -= result;
+        }
+    }
 
-    size_t body_length = strlen(body); // Calculate the content length
+    metrics_count_error(error);
+    return written == length ? length : 0;
+}
 
-    // Construct the HTTP response headers
-    snprintf(header, sizeof(header),
-             "HTTP/1.1 %s\r\n"
-             "Server: webserver/1.0\r\n"
-             "Date: %s\r\n"
-             "Content-Type: text/html\r\n"
-             "Content-Length: %zu\r\n"
-             "Connection: close\r\n\r\n",
-             title, date, body_length);
 
-    // Combine the headers and the body into a full HTTP response message
-    char full_message[BUFFER_SIZE * 2]; // Ensure enough space for headers and body
-    snprintf(full_message, sizeof(full_message), "%s%s", header, body);
+/**
+ * Answers the client of a request with an error, and keeps its status for the access log.
+ *
+ * @param ci: The communication_info of the request.
+ * @param error: The error to answer with.
+ * @param keep_alive: In: 1 if the client connection would stay open after a response, NULL if it
+ *                    closes anyway. Out: set to whether it stays open after the error.
+ */
+static void send_error_response(communication_info* ci, ErrorType error, int* keep_alive)
+{
+    int stays_open = keep_alive != NULL && error_keeps_alive(ci, error, *keep_alive);
+    if (keep_alive != NULL)
+        *keep_alive = stays_open;
 
-    // Send the complete HTTP response to the client
-    write_to_socket(sd, full_message, strlen(full_message));
+    ci->status = error;
+    ci->response_bytes += send_error_message(error, ci->client_socket, stays_open);
 }
 
 
 
-int is_legal_request_format(const char* str)
+int is_legal_request_format(const communication_info* ci)
 {
-    const char* end_of_first_line = strstr(str, "\r\n");
-    if (end_of_first_line == NULL)  // Malformed request: no end of line
-        return 0;
-
-    // Calculate the length of the first line and create a buffer for it
-    size_t first_line_length = end_of_first_line - str;
-    char first_line[first_line_length + 1]; // +1 for null terminator
+    // The parser flags the request line unless it has three words, and any malformed header line
+    return ci->parsed.length > 0 && !ci->parsed.malformed;
+}
 
-    // Copy the first line into the buffer and null-terminate it
-    strncpy(first_line, str, first_line_length);
-    first_line[first_line_length] = '\0';
 
-    char method[64]; // Buffer for the HTTP method
-    char path[1024]; // Buffer for the PATH
-    char version[64]; // Buffer for the HTTP version
+/**
+ * Copies the "host:port" target of a CONNECT request into the arena of the request.
+ *
+ * @param ci: The communication_info of the CONNECT request.
+ * @return
+ *   - The target, null-terminated.
+ *   - NULL if the target has no port or is not a bare authority.
+ */
+static char* get_tunnel_target(const communication_info* ci)
+{
+    const char* target = ci->request + ci->parsed.target.offset;
+    size_t length = ci->parsed.target.length;
 
-    // Attempt to read the three elements from the first line of str
-    int result = sscanf(first_line, "%63s %1023s %63s", method, path, version);
+    // The port is mandatory, there is no default one to tunnel to
+    const char* colon_pos = memchr(target, ':', length);
+    if (colon_pos == NULL || colon_pos == target || colon_pos + 1 == target + length || memchr(target, '/', length) != NULL)
+        return NULL;
 
-    return result == 3;
+    return arena_strndup(ci->arena, target, length);
 }
 
 
-int is_legal_request(communication_info* ci)
+/**
+ * Finds how the body of a request is delimited, from its Content-Length and Transfer-Encoding
+ * headers. Requests the proxy and the origin could split differently are refused.
+ *
+ * @param ci: The communication_info of the request.
+ * @return
+ *   - 0 if the body is understood, ci->body_mode and ci->body_length describe it.
+ *   - The ErrorType to answer with otherwise.
+ */
+static int check_request_body(communication_info* ci)
 {
-    // Extract the host name from the request
-    ci->host_name = get_host_name(ci->request);
+    const http_header* content_length = NULL;
+    const http_header* coding = NULL;
+
+    for (size_t i = 0; i < ci->parsed.header_count; i++)
+    {
+        const http_header* header = &ci->parsed.headers[i];
+        const char* name = ci->request + header->name.offset;
 
-    // Validate presence of host, HTTP version, and request format
-    if (ci->host_name == NULL || !is_legal_http_version(ci->request) || !is_legal_request_format(ci->request))
+        // A repeated header could be read differently by the origin
+        if (header->name.length == 14 && strncasecmp(name, "Content-Length", 14) == 0)
+        {
+            if (content_length != NULL)
+                return ERROR_400_BAD_REQUEST;
+            content_length = header;
+        }
+        else if (header->name.length == 17 && strncasecmp(name, "Transfer-Encoding", 17) == 0)
+        {
+            if (coding != NULL)
+                return ERROR_400_BAD_REQUEST;
+            coding = header;
+        }
+    }
+
+    if (coding != NULL)
     {
-        // If any check fails, send a 400 Bad Request error and return 0
-        send_error_message(ERROR_400_BAD_REQUEST, ci->client_socket);
+        // Only the chunked coding alone is relayed, it must not come with a length
+        if (content_length != NULL)
+            return ERROR_400_BAD_REQUEST;
+        if (coding->value.length != 7 || strncasecmp(ci->request + coding->value.offset, "chunked", 7) != 0)
+            return ERROR_501_NOT_IMPLEMENTED;
+
+        ci->body_mode = HTTP_BODY_CHUNKED;
         return 0;
     }
 
-    // Ensure the request uses the GET method
-    if (strncmp(ci->request, "GET ", 4) != 0)
+    if (content_length != NULL)
+    {
+        // Digits only, a sign or trailing characters are refused rather than guessed at
+        const char* value = ci->request + content_length->value.offset;
+        size_t length = content_length->value.length;
+        if (length == 0 || length > 18)
+            return ERROR_400_BAD_REQUEST;
+
+        unsigned long long body_length = 0;
+        for (size_t i = 0; i < length; i++)
+        {
+            if (!isdigit((unsigned char)value[i]))
+                return ERROR_400_BAD_REQUEST;
+            body_length = body_length * 10 + (value[i] - '0');
+        }
+
+        ci->body_mode = body_length > 0 ? HTTP_BODY_LENGTH : HTTP_BODY_NONE;
+        ci->body_length = body_length;
+    }
+
+    return 0;
+}
+
+
+int check_request(communication_info* ci)
+{
+    // Validate the request format before trusting the spans of the index
+    if (!is_legal_request_format(ci))
+        return ERROR_400_BAD_REQUEST;
+
+    // Extract the host name from the request, a CONNECT request names it in its target
+    ci->tunnel = http_span_equals(ci->request, ci->parsed.method, "CONNECT");
+    ci->host_name = ci->tunnel ? get_tunnel_target(ci) : get_host_name(ci);
+
+    // Validate presence of host and HTTP version
+    if (ci->host_name == NULL || !is_legal_http_version(ci))
+        return ERROR_400_BAD_REQUEST;
+
+    // A tunnel carries no body, its bytes are relayed as they are
+    if (ci->tunnel)
+        return 0;
+
+    // Ensure the request uses a supported method
+    static const char* const methods[] = {"GET", "POST", "PUT", "PATCH", NULL};
+    int supported = 0;
+    for (int i = 0; methods[i] != NULL && !supported; i++)
+        supported = http_span_equals(ci->request, ci->parsed.method, methods[i]);
+    if (!supported)
+        return ERROR_501_NOT_IMPLEMENTED;
+
+    // Find where the request ends, the body is streamed to the origin
+    int error = check_request_body(ci);
+    if (error != 0)
+        return error;
+
+    return 0; // The request can be served
+}
+
+
+int is_legal_request(communication_info* ci, int* keep_alive)
+{
+    // Validate the request line and headers
+    int error = check_request(ci);
+    if (error != 0)
     {
-        // If not a GET request, send a 501 Not Implemented error and return 0
-        send_error_message(ERROR_501_NOT_IMPLEMENTED, ci->client_socket);
+        // If any check fails, send the matching error and return 0
+        send_error_response(ci, error, keep_alive);
         return 0;
     }
 
     // Check if the host is filtered or blocked
-    int is_filtered = is_filtered_host(ci->filter_content, ci->host_name);
+    int is_filtered = is_filtered_host(ci->filter, ci->host_name, &ci->host_addresses);
 
     if (is_filtered == -1)
     {
         // If the host's IP could not be found, send a 404 Not Found error and return 0
-        send_error_message(ERROR_404_NOT_FOUND, ci->client_socket);
+        send_error_response(ci, ERROR_404_NOT_FOUND, keep_alive);
         return 0;
     }
 
     if (is_filtered == 1)
     {
         // If the host is filtered or blocked, send a 403 Forbidden error and return 0
-        send_error_message(ERROR_403_FORBIDDEN, ci->client_socket);
+        metrics_count(ci->host_addresses.count == 0 ? METRIC_FILTER_HOST_HITS : METRIC_FILTER_ADDRESS_HITS, 1); // Listed hosts are not resolved
+        send_error_response(ci, ERROR_403_FORBIDDEN, keep_alive);
         return 0;
     }
 
@@ -269,193 +535,260 @@ int is_legal_request(communication_info* ci)
 }
 
 
-int compare_binary_ips(const char* binary_ip1, const char* binary_ip2, int mask_size)
+/**
+ * Makes the request conditional on the stale response in ci->cached, which is dropped if it
+ * has no validator.
+ *
+ * @param ci: The communication_info of the request.
+ */
+static void add_validators(communication_info* ci)
 {
-    // Loop through each bit up to mask_size to compare the two binary IP strings
-    for (int i = 0; i < mask_size; ++i)
-        // If at any point the bits differ, return 0 indicating IPs are different in the compared bits
-        if (binary_ip1[i] != binary_ip2[i])
-            return 0;
-
-    // If the loop completes without finding any differing bits, return 1 indicating IPs are the same within the mask
-    return 1;
+    size_t length;
+
+    // Ask the origin whether the stored response is still valid, a 304 for either validator serves it
+    int conditional = 0;
+    const char* value = cache_header(ci->cached, "ETag", &length);
+    const char* tag = value == NULL ? NULL : arena_strndup(ci->arena, value, length);
+    if (tag != NULL && set_request_header(ci, "If-None-Match", tag) == 1)
+        conditional = 1;
+    value = cache_header(ci->cached, "Last-Modified", &length);
+    const char* date = value == NULL ? NULL : arena_strndup(ci->arena, value, length);
+    if (date != NULL && set_request_header(ci, "If-Modified-Since", date) == 1)
+        conditional = 1;
+
+    // Without a validator the stored response is simply replaced
+    if (!conditional)
+    {
+        cache_release(ci->cached);
+        ci->cached = NULL;
+    }
 }
 
 
-char* ip_to_binary(const char* ip_with_mask)
+/**
+ * Tells whether the client of a request may get a compressed body: compression is on, the
+ * client speaks HTTP/1.1, which chunked bodies need, and accepts gzip.
+ *
+ * @param ci: The communication_info of the request.
+ * @return
+ *   - 1 if the response may be compressed.
+ *   - 0 otherwise.
+ */
+static int client_accepts_gzip(const communication_info* ci)
 {
-    struct in_addr ip_addr; // Structure to store the converted IP address
-    long mask; // To store the subnet mask size
-    char* binary_masked; // Pointer for the binary representation of the IP
-    char ip_part[16], mask_str[5]; // Buffers to store the separated IP and mask from the input
-    char* end_ptr; // For error checking in strtol
-    char modified_ip_with_mask[100]; // Buffer to potentially modify the input IP with a default mask
-
-    // Initialize mask_str with default "/32"
-    strcpy(mask_str, "/32");
-
-    // Check if the input already contains a mask
-    if (strchr(ip_with_mask, '/') == NULL)
-        // If no mask is present, append "/32" to the input IP address
-        snprintf(modified_ip_with_mask, sizeof(modified_ip_with_mask), "%s%s", ip_with_mask, mask_str);
-    else
-    {
-        // If a mask is present, use the input as is
-        strncpy(modified_ip_with_mask, ip_with_mask, sizeof(modified_ip_with_mask) - 1);
-        modified_ip_with_mask[sizeof(modified_ip_with_mask) - 1] = '\0'; // Ensure null-termination
-    }
+    if (!config.compress || !http_span_equals(ci->request, ci->parsed.version, "HTTP/1.1"))
+        return 0;
 
-    // Extract IP address and mask size from the potentially modified input string
-    sscanf(modified_ip_with_mask, "%15[^/]/%4s", ip_part, mask_str);
+    size_t length;
+    const char* value = get_header_value(ci, "Accept-Encoding", &length);
+    return value != NULL && compress_accepts(value, length);
+}
 
-    // Convert the mask from string to long
-    mask = strtol(mask_str, &end_ptr, 10);
+/**
+ * Compresses the fresh stored response of a request into a variant of its own in the cache.
+ * The variant expires with the response it was made from.
+ *
+ * @param ci: The communication_info of the request, holding the stored response.
+ * @param key: The key of the variant.
+ * @param key_length: The length of the key.
+ * @return
+ *   - The variant, referenced.
+ *   - NULL if compressing saves nothing, or the variant cannot be stored.
+ */
+static cache_object* store_compressed_variant(communication_info* ci, const char* key, size_t key_length)
+{
+    size_t head_length;
+    const char* head = cache_head(ci->cached, &head_length);
+    size_t body_length = cache_body_length(ci->cached);
+    long lifetime = (long)(atomic_load(&ci->cached->stored) + atomic_load(&ci->cached->lifetime) - time(NULL));
+
+    size_t compressed_length;
+    unsigned char* body = compress_body(ci->arena, config.compress_level, cache_body(ci->cached), body_length, &compressed_length);
+    char* variant_head = arena_alloc(ci->arena, head_length + COMPRESS_HEAD_EXTRA);
+    if (body == NULL || variant_head == NULL || compressed_length >= body_length || lifetime <= 0)
+        return NULL;
 
-    // Validate mask size and set to 32 if out of valid range
-    if (end_ptr == mask_str || *end_ptr != '\0' || mask < 0 || mask > 32)
-        mask = 32; // Correct invalid or out-of-range mask to 32
+    size_t variant_head_length = compress_rewrite_head(head, head_length, (long long)compressed_length, variant_head,
+                                                       head_length + COMPRESS_HEAD_EXTRA);
+    if (variant_head_length == 0)
+        return NULL;
 
-    // Convert the IP address to binary form
-    if (!inet_pton(AF_INET, ip_part, &ip_addr))
-    {
-        fprintf(stderr, "Invalid IP address format.\n");
+    cache_object* variant = cache_store_begin(key, key_length, variant_head, variant_head_length, compressed_length, lifetime);
+    cache_store_append(variant, body, compressed_length);
+    if (!cache_store_end(variant))
         return NULL;
-    }
 
-    unsigned long ip_binary = ntohl(ip_addr.s_addr); // Network to host long order conversion
+    return cache_lookup(key, key_length); // The index took the reference of the writer
+}
 
-    // Allocate memory for the binary representation
-    binary_masked = (char*)malloc(mask + 1); // +1 for null terminator
-    if (!binary_masked)
+/**
+ * Serves a fresh stored response compressed to a client that takes gzip: the compressed
+ * variant replaces it in ci->cached, compressed now if no variant as recent is stored.
+ *
+ * @param ci: The communication_info of the request, holding a fresh stored response.
+ */
+static void use_compressed_variant(communication_info* ci)
+{
+    size_t head_length;
+    const char* head = cache_head(ci->cached, &head_length);
+    if (cache_body_length(ci->cached) < (size_t)config.compress_min_size || !compress_eligible(head, head_length) ||
+        !client_accepts_gzip(ci))
+        return;
+
+    size_t suffix_length = strlen(COMPRESS_VARIANT_SUFFIX);
+    size_t key_length = ci->cache_key_length + suffix_length;
+    char* key = arena_alloc(ci->arena, key_length);
+    if (key == NULL)
+        return;
+    memcpy(key, ci->cache_key, ci->cache_key_length);
+    memcpy(key + ci->cache_key_length, COMPRESS_VARIANT_SUFFIX, suffix_length);
+
+    // A variant older than the response was made from an earlier version of it
+    cache_object* variant = cache_lookup(key, key_length);
+    if (variant != NULL && (!cache_is_fresh(variant, time(NULL)) || atomic_load(&variant->stored) < atomic_load(&ci->cached->stored)))
     {
-        fprintf(stderr, "Memory allocation failed.\n");
-        return NULL;
+        cache_release(variant);
+        variant = NULL;
     }
 
-    // Generate the binary string based on the mask size
-    for (int i = 0; i < mask; i++)
-    {
-        unsigned long bit = (ip_binary >> (31 - i)) & 1; // Extract each bit based on the mask
-        binary_masked[i] = bit ? '1' : '0';
-    }
-    binary_masked[mask] = '\0'; // Null-terminate the binary string
+    if (variant == NULL)
+        variant = store_compressed_variant(ci, key, key_length);
+    if (variant == NULL)
+        return; // The client gets the response as it is
 
-    return binary_masked;
+    cache_release(ci->cached);
+    ci->cached = variant;
 }
 
 
-char* get_host_IP(const char* host)
+int check_cache(communication_info* ci)
 {
-    struct hostent* he; // Structure to store host information
-
-    // Clean the hostname to ensure uniformity, e.g., remove "www."
-    char* clean_host = get_clean_host(host);
-    if (clean_host == NULL)
-        return NULL; // Failed to clean host name
+    // Only plain GET requests share stored responses
+    if (!cache_enabled() || !http_span_equals(ci->request, ci->parsed.method, "GET"))
+        return 0;
 
-    // Resolve the cleaned hostname to an IP address
-    if ((he = gethostbyname(clean_host)) == NULL)
-    {
-        herror("error: gethostbyname"); // Log error if hostname resolution fails
-        free(clean_host); // Clean up allocated memory for cleaned host
-        return NULL;
-    }
+    // Credentials, ranges and the client's own conditionals are answered by the origin
+    static const char* const bypass[] = {"Authorization", "Range", "If-None-Match", "If-Modified-Since",
+                                         "If-Match", "If-Unmodified-Since", "If-Range", NULL};
+    size_t length;
+    for (int i = 0; bypass[i] != NULL; i++)
+        if (get_header_value(ci, bypass[i], &length) != NULL)
+            return 0;
 
-    free(clean_host); // Free the cleaned hostname after use
+    const char* value = get_header_value(ci, "Cache-Control", &length);
+    if (value != NULL && http_has_token(value, length, "no-store"))
+        return 0;
+    int no_cache = value != NULL && http_has_token(value, length, "no-cache");
+    value = get_header_value(ci, "Pragma", &length);
+    if (value != NULL && http_has_token(value, length, "no-cache"))
+        no_cache = 1; // HTTP/1.0 clients ask for an end-to-end reload this way
+
+    // Key the response by the host and the request target
+    http_span target = ci->parsed.target;
+    size_t host_length = strlen(ci->host_name);
+    ci->cache_key_length = host_length + 1 + target.length;
+    if (ci->cache_key_length > CACHE_MAX_KEY)
+        return 0;
+    ci->cache_key = arena_alloc(ci->arena, ci->cache_key_length);
+    if (ci->cache_key == NULL)
+        return 0;
+    memcpy(ci->cache_key, ci->host_name, host_length);
+    ci->cache_key[host_length] = ' ';
+    memcpy(ci->cache_key + host_length + 1, ci->request + target.offset, target.length);
 
-    // Correctly access the first IP address from h_addr_list and convert to string
-    struct in_addr* first_ip_address = (struct in_addr*)he->h_addr_list[0];
-    const char* ip_str = inet_ntoa(*first_ip_address);
-    if (ip_str == NULL)
+    ci->cached = cache_lookup(ci->cache_key, ci->cache_key_length);
+    if (ci->cached != NULL && !no_cache && cache_is_fresh(ci->cached, time(NULL)))
     {
-        fprintf(stderr, "Error converting IP to string.\n");
-        return NULL;
+        use_compressed_variant(ci);
+        return 1; // A hit, the origin is not contacted
     }
 
-    // Allocate memory for the IP string with added "/32" subnet mask
-    char* ip_with_mask = (char*)malloc(strlen(ip_str) + 4); // +3 for "/32" and +1 for null terminator
-    if (ip_with_mask == NULL)
-    {
-        fprintf(stderr, "Memory allocation failed.\n");
-        return NULL;
-    }
+    if (ci->cached != NULL)
+        add_validators(ci);
 
-    // Format the IP string with the "/32" mask
-    sprintf(ip_with_mask, "%s/32", ip_str);
+    // Identical requests going to the origin at the same time share one fetch
+    int leader;
+    ci->flight = cache_flight_join(ci->cache_key, ci->cache_key_length, &leader);
+    ci->flight_leader = leader;
 
-    return ip_with_mask; // Return the formatted IP address with mask
+    return ci->flight != NULL && !leader ? 2 : 0;
 }
 
-
-int is_filtered_host(const char* file_content, const char* host)
+int get_host_IP(const char* host, resolver_answer* answer)
 {
-    char* host_ip = get_host_IP(host); // Includes /32 mask
-    if (host_ip == NULL)
-        return -1; // Failed to resolve IP
+    // Clean the hostname to ensure uniformity, e.g., remove "www."
+    size_t length;
+    const char* start = find_clean_host(host, &length);
+    char clean_host[NI_MAXHOST]; // Host names are short, no allocation is needed
+    if (length >= sizeof(clean_host))
+        return -1; // Failed to clean host name
 
-    char* binary_host_ip = ip_to_binary(host_ip); // Convert IP to binary
-    if (binary_host_ip == NULL)
-    {
-        free(host_ip);
-        return -1; // Failed to convert IP to binary
-    }
+    memcpy(clean_host, start, length);
+    clean_host[length] = '\0';
 
-    free(host_ip); // Free resolved IP string after conversion
+    // Resolve through the shared cache, concurrent lookups of the same name share one query
+    return resolver_resolve(clean_host, answer);
+}
 
-    // Duplicate file_content to avoid modifying the original string with strtok
-    char* content_copy = strdup(file_content);
-    if (!content_copy)
-    {
-        free(binary_host_ip);
-        fprintf(stderr, "Memory allocation failed for duplicating file content.\n");
-        return -1; // Failed to duplicate file content
-    }
 
-    int result = 0; // Default to no match
-    char* line = strtok(content_copy, "\r\n"); // Start tokenizing the file content
+int is_filtered_host(const filter_set* filter, const char* host, resolver_answer* answer)
+{
+    unsigned long long started = metrics_clock_us();
 
-    while (line != NULL)
+    // Direct hostname comparison, no resolution is needed for listed hosts
+    if (filter_match_host(filter, host))
     {
-        if (isdigit(line[0])) { // Treat lines starting with a digit as IP addresses
-            char* binary_line_ip = ip_to_binary(line); // Convert line IP to binary
-            if (!binary_line_ip)
-            {
-                line = strtok(NULL, "\r\n"); // Move to next line
-                continue; // Skip invalid IPs
-            }
+        metrics_observe(METRIC_PHASE_FILTER, metrics_clock_us() - started);
+        return 1;
+    }
 
-            int mask_size = 32; // Default mask size
-            char* slash = strchr(line, '/');
-            if (slash)
-            {
-                long mask = strtol(slash + 1, NULL, 10);
-                mask_size = (mask >= 0 && mask <= 32) ? (int)mask : 32;
-            }
+    // Resolve once, the caller reuses the addresses for the connect step
+    unsigned long long resolving = metrics_clock_us();
+    int resolved = get_host_IP(host, answer);
+    unsigned long long resolved_at = metrics_clock_us();
+    metrics_observe(METRIC_PHASE_DNS, resolved_at - resolving);
+    if (resolved == -1)
+        return -1; // Failed to resolve IP
 
-            if (compare_binary_ips(binary_host_ip, binary_line_ip, mask_size))
-            {
-                result = 1; // Match found
-                free(binary_line_ip);
-                break;
-            }
+    int filtered = is_filtered_address(filter, answer); // Match the addresses against the CIDR rules
+    metrics_observe(METRIC_PHASE_FILTER, (resolving - started) + (metrics_clock_us() - resolved_at));
+    return filtered;
+}
 
-            free(binary_line_ip);
-        } else if (strcmp(host, line) == 0)
-        { // Direct hostname comparison
-            result = 1; // Match found
-            break;
-        }
 
-        line = strtok(NULL, "\r\n"); // Move to next line
+int is_filtered_address(const filter_set* filter, const resolver_answer* answer)
+{
+    // The IPv4 addresses are matched together, the IPv6 ones walk the trie
+    uint32_t ipv4[RESOLVER_MAX_ADDRESSES];
+    int ipv4_count = 0;
+    for (int i = 0; i < answer->count; i++)
+    {
+        const resolver_address* address = &answer->list[i];
+        uint32_t ip;
+        memcpy(&ip, address->bytes, sizeof(ip));
+
+        if (address->family == AF_INET)
+            ipv4[ipv4_count++] = ntohl(ip);
+        else if (filter_match_ip6(filter, address->bytes))
+            return 1;
     }
 
-    free(binary_host_ip); // Free binary host IP
-    free(content_copy); // Free the duplicated file content
-    return result; // Return comparison result
+    // An answer without IPv4 addresses leaves no bitmap word to read
+    uint64_t matched = 0;
+    if (ipv4_count > 0)
+        filter_match_ip_batch(filter, ipv4, ipv4_count, &matched);
+    return matched != 0;
 }
 
 
-char* get_clean_host(const char* host)
+/**
+ * Finds the hostname inside a host string, without its "http://" or "www." prefix and its port.
+ *
+ * @param host: A string containing the original hostname.
+ * @param length: Receives the length of the clean hostname.
+ * @return A pointer to the start of the clean hostname inside host.
+ */
+static const char* find_clean_host(const char* host, size_t* length)
 {
     const char* start = host; // Start with the original host string
 
@@ -467,73 +800,99 @@ char* get_clean_host(const char* host)
     if (strncmp(start, "www.", 4) == 0)
         start += 4; // Advance past the "www."
 
+    // An IPv6 literal is enclosed in brackets, its port follows the closing one
+    const char* bracket_pos = *start == '[' ? strchr(start, ']') : NULL;
+    if (bracket_pos != NULL)
+    {
+        *length = bracket_pos - start - 1;
+        return start + 1;
+    }
+
     // Look for a colon which indicates a port number and isolate the hostname part
     const char* colon_pos = strchr(start, ':');
-    size_t length; // To hold the length of the clean host string
+    if (colon_pos != NULL && strchr(colon_pos + 1, ':') != NULL)
+        colon_pos = NULL; // An IPv6 address without brackets has no port
     if (colon_pos != NULL)
         // If a colon is found, calculate length up to the colon to exclude the port number
-        length = colon_pos - start;
+        *length = colon_pos - start;
 
     else
         // If no colon is found, the entire remaining string is part of the hostname
-        length = strlen(start);
-
+        *length = strlen(start);
 
-    // Allocate memory for the clean host string, including space for a null terminator
-    char* clean_host = (char*)malloc(length + 1);
-    if (!clean_host)
-    {
-        fprintf(stderr, "Memory allocation failed.\n");
-        return NULL; // Return NULL on allocation failure
-    }
+    return start;
+}
 
-    // Copy the clean host part of the string into the newly allocated memory
-    strncpy(clean_host, start, length);
-    clean_host[length] = '\0'; // Ensure the string is null-terminated
 
+char* get_clean_host(arena* a, const char* host)
+{
+    size_t length; // To hold the length of the clean host string
+    const char* start = find_clean_host(host, &length);
 
-    return clean_host; // Return the clean host string
+    // Copy the clean host part of the string into the arena, including a null terminator
+    return arena_strndup(a, start, length);
 }
 
 
-char* get_host_name(const char* str)
+char* get_host_name(const communication_info* ci)
 {
-    if (str == NULL)
+    if (ci->request == NULL)
         return NULL; // Check for a NULL request string and return NULL if true
 
-    // Search for the "Host: " header within the request string
-    const char* host_start = strstr(str, "Host: ");
-    if (host_start != NULL)
-    {
-        host_start += 6; // Skip over the "Host: " part to get to the start of the hostname
-        // Look for the end of the line, marked by "\r\n", to find the end of the hostname
-        const char* host_end = strstr(host_start, "\r\n");
-        if (host_end != NULL)
-        {
-            // Calculate the length of the hostname by subtracting pointers
-            size_t host_length = host_end - host_start;
-            // Allocate memory for the hostname plus a null terminator
-            char *host_name = (char*)malloc(host_length + 1);
-            if (!host_name)
-                return NULL; // Ensure memory allocation was successful
+    // Look up the "Host" header in the index, its value comes without surrounding whitespace
+    size_t host_length;
+    const char* host_start = get_header_value(ci, "Host", &host_length);
+    if (host_start == NULL || host_length == 0)
+        return NULL; // Return NULL if "Host" is not found or empty
 
-            // Copy the hostname into the newly allocated buffer
-            strncpy(host_name, host_start, host_length);
-            host_name[host_length] = '\0'; // Null-terminate the hostname string
+    // Copy the hostname into the arena of the request, null-terminated
+    return arena_strndup(ci->arena, host_start, host_length);
+}
 
-            return host_name; // Return the extracted hostname
-        }
-    }
 
-    return NULL; // Return NULL if "Host: " is not found or the hostname cannot be extracted
+const char* get_header_value(const communication_info* ci, const char* name, size_t* length)
+{
+    // Header names are case-insensitive, the index is searched instead of the request
+    return http_request_header(&ci->parsed, ci->request, name, length);
+}
+
+
+int is_client_keep_alive(const communication_info* ci)
+{
+    // HTTP/1.1 connections are persistent by default, HTTP/1.0 ones only on request
+    int keep_alive = http_span_equals(ci->request, ci->parsed.version, "HTTP/1.1");
+
+    size_t length;
+    const char* value = get_header_value(ci, "Connection", &length);
+    if (value == NULL)
+        value = get_header_value(ci, "Proxy-Connection", &length); // Sent by some clients talking to a proxy
+
+    if (value != NULL && http_has_token(value, length, "close"))
+        keep_alive = 0;
+    else if (value != NULL && http_has_token(value, length, "keep-alive"))
+        keep_alive = 1;
+
+    return keep_alive;
+}
+
+
+int expects_continue(const communication_info* ci)
+{
+    // HTTP/1.0 clients do not know the interim answer and send their body anyway
+    if (ci->body_mode == HTTP_BODY_NONE || !http_span_equals(ci->request, ci->parsed.version, "HTTP/1.1"))
+        return 0;
+
+    size_t length;
+    const char* value = get_header_value(ci, "Expect", &length);
+    return value != NULL && http_has_token(value, length, "100-continue");
 }
 
 
-int is_legal_http_version(const char* str)
+int is_legal_http_version(const communication_info* ci)
 {
-    // Look for "HTTP/" followed by "1.0" or "1.1"
-    const char *pos = strstr(str, "HTTP/");
-    if (pos != NULL && (strncmp(pos + 5, "1.0", 3) == 0 || strncmp(pos + 5, "1.1", 3) == 0))
+    // Only "HTTP/1.0" and "HTTP/1.1" are served
+    if (http_span_equals(ci->request, ci->parsed.version, "HTTP/1.0") ||
+        http_span_equals(ci->request, ci->parsed.version, "HTTP/1.1"))
         return 1;
 
     return 0;
@@ -541,234 +900,1314 @@ int is_legal_http_version(const char* str)
 
 
 
-char* read_from_client_socket(int sd)
+char* read_from_client_socket(communication_info* ci)
 {
+    int sd = ci->client_socket; // Alias for readability
     int buffer_size = BUFFER_SIZE; // Initial buffer size
     ssize_t total_bytes_read = 0; // Total number of bytes read
     ssize_t bytes_read; // Number of bytes read in the last read operation
-    struct timeval tv = {5, 0}; // Timeout for read operation
+    struct timeval tv = {config.client_idle_timeout, 0}; // Timeout for read operation
+
+    // Make room for bytes of this request that were received with the previous one
+    while ((size_t)buffer_size <= ci->pending_length)
+        buffer_size *= 2;
 
-    // Allocate initial buffer
-    char* buffer = (char*)malloc(buffer_size);
+    // Allocate initial buffer from the arena of the request, which stays with the request
+    ci->arena = arena_acquire();
+    char* buffer = ci->arena == NULL ? NULL : (char*)arena_alloc(ci->arena, buffer_size);
     if (!buffer)
-    {
-        fprintf(stderr, "Memory allocation failed\n");
         return NULL; // Return NULL on allocation failure
+
+    // Start with the pipelined bytes, if any
+    if (ci->pending_length > 0)
+    {
+        memcpy(buffer, ci->pending, ci->pending_length);
+        total_bytes_read = (ssize_t)ci->pending_length;
+        ci->pending_length = 0;
     }
+    buffer[total_bytes_read] = '\0';
+    unsigned long long arrived = total_bytes_read > 0 ? metrics_clock_us() : 0; // When the first byte of the head was there
+    http_request* parsed = &ci->parsed; // Indexes the request as its bytes arrive
+    http_request_init(parsed);
+    int complete = http_request_parse(parsed, buffer, total_bytes_read);
 
     // Set socket read timeout
     if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(struct timeval)) == -1)
     {
         perror("error: setsockopt\n");
-        free(buffer);
         return NULL; // Return NULL if setting the socket option fails
     }
 
-    while (1)
+    while (!complete)
     {
         // Expand buffer if needed
         if (total_bytes_read >= buffer_size - 1)
         {
-            buffer_size *= 2; // Double the buffer size
-            char* new_buffer = (char*)realloc(buffer, buffer_size);
+            // Double the buffer size, in place when nothing else was allocated after it
+            char* new_buffer = (char*)arena_grow(ci->arena, buffer, buffer_size, buffer_size * 2);
             if (!new_buffer)
-            {
-                fprintf(stderr, "Buffer reallocation failed\n");
-                free(buffer);
                 return NULL; // Return NULL on reallocation failure
-            }
             buffer = new_buffer;
+            buffer_size *= 2;
         }
 
         // Read data from socket
         bytes_read = read(sd, buffer + total_bytes_read, buffer_size - total_bytes_read - 1);
+        if (bytes_read == 0 && total_bytes_read == 0)
+        {
+            // The client closed the connection between requests
+            return NULL;
+        }
+
         if (bytes_read <= 0) // Check for read errors or timeout
         {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
                 printf("Read operation timed out\n");
-            else
+            else if (bytes_read < 0)
                 perror("error: read\n");
 
-            free(buffer);
             return NULL; // Return NULL on read error or timeout
         }
 
         total_bytes_read += bytes_read; // Update total bytes read
         buffer[total_bytes_read] = '\0'; // Null-terminate the buffer
+        if (arrived == 0)
+            arrived = metrics_clock_us();
 
-        // Check if the end of headers has been reached
-        if (strstr(buffer, "\r\n\r\n") != NULL)
-            break; // End of headers found
+        // Parse the new bytes only, and check if the end of headers has been reached
+        complete = http_request_parse(parsed, buffer, total_bytes_read);
+    }
+
+    metrics_count(METRIC_REQUESTS, 1);
+    metrics_observe(METRIC_PHASE_PARSE, metrics_clock_us() - arrived);
+    ci->arrived = arrived;
+
+    // Keep whatever follows the headers for the next request on this connection
+    size_t request_length = parsed->length;
+    if ((size_t)total_bytes_read > request_length)
+    {
+        // The request's arena is released before the next request, the buffer for these bytes lives with the connection
+        size_t pending_length = total_bytes_read - request_length;
+        if (pending_length > ci->pending_capacity)
+        {
+            char* pending = realloc(ci->pending, pending_length);
+            if (pending == NULL)
+            {
+                fprintf(stderr, "Memory allocation failed\n");
+                return NULL;
+            }
+            ci->pending = pending;
+            ci->pending_capacity = pending_length;
+        }
+        ci->pending_length = pending_length;
+        memcpy(ci->pending, buffer + request_length, ci->pending_length);
+        buffer[request_length] = '\0';
     }
 
     return buffer; // Return the buffer containing the headers
 }
 
 
-int set_destination_server_connection(const char* host, int port)
+/**
+ * Computes when the phase a pool thread waits in runs out of time: connecting has the connect
+ * timeout, the first byte of the response the first byte timeout, and a transfer the origin
+ * idle timeout from the last bytes moved. The request timeout bounds all of them.
+ *
+ * @param ci: The communication_info of the request, deadline_lock held.
+ * @return The monotonic millisecond the request expires at.
+ */
+static unsigned long long request_deadline(const communication_info* ci)
 {
-    int sd; // Socket descriptor
-    struct hostent* server_info; // Information about the host
-    struct sockaddr_in socket_info; // Socket address information
-
-    // Attempt to create a socket with IPv4 and TCP
-    if ((sd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("error: socket");
-        return -1; // Indicate failure
-    }
+    unsigned long long deadline;
+    if (ci->phase == PHASE_CONNECT)
+        deadline = ci->phase_started + config.connect_timeout * 1000ULL;
+    else if (ci->phase == PHASE_FIRST_BYTE)
+        deadline = ci->phase_started + config.first_byte_timeout * 1000ULL;
+    else
+        deadline = atomic_load_explicit(&ci->progress, memory_order_relaxed) + config.origin_idle_timeout * 1000ULL;
 
-    // Initialize socket address structure
-    memset(&socket_info, 0, sizeof(struct sockaddr_in));
-    socket_info.sin_family = AF_INET; // Use IPv4 address family
+    if (config.request_timeout > 0 && ci->request_started + config.request_timeout * 1000ULL < deadline)
+        deadline = ci->request_started + config.request_timeout * 1000ULL;
 
-    // Resolve hostname to IP address
-    server_info = gethostbyname(host);
-    if (server_info == NULL) {
-        herror("error: gethostbyname");
-        close(sd); // Clean up the socket
-        return -1; // Indicate failure
-    }
+    // A drain bounds every request in flight
+    unsigned long long drain_deadline = lifecycle_drain_deadline();
+    if (drain_deadline < deadline)
+        deadline = drain_deadline;
 
-    // Correctly set the server's IP address in the socket structure using the first IP address in the list
-    socket_info.sin_addr = *(struct in_addr *)server_info->h_addr;
+    return deadline;
+}
 
-    // Set the server port, converting from host byte order to network byte order
-    socket_info.sin_port = htons(port);
+/**
+ * Handles the deadline of a request firing, deadline_lock held. A deadline that progress pushed
+ * back is scheduled again. Otherwise the origin socket is shut down, which fails the blocked
+ * connect(), read() or write() of the pool thread, so the thread is free for the next connection.
+ *
+ * @param timer: The deadline of the request.
+ */
+static void request_expired(wheel_timer* timer)
+{
+    communication_info* ci = (communication_info*)timer->context;
+    unsigned long long deadline = request_deadline(ci);
 
-    // Attempt to connect to the server
-    if (connect(sd, (struct sockaddr*)&socket_info, sizeof(socket_info)) == -1) {
-        perror("error: connect");
-        close(sd); // Clean up the socket
-        return -1; // Indicate failure
+    if (deadline > timer_wheel_clock_ms())
+    {
+        timer_wheel_schedule(&deadlines, timer, timer_wheel_tick(deadline));
+        return;
     }
 
-    return sd; // Return the socket descriptor for the successful connection
+    ci->timed_out = 1;
+    shutdown(ci->deadline_sd, SHUT_RDWR);
 }
 
+/**
+ * Starts a phase of a request, bounded by its deadline.
+ *
+ * @param ci: The communication_info of the request.
+ * @param sd: The origin socket the phase waits for.
+ * @param phase: The phase.
+ */
+static void set_deadline(communication_info* ci, int sd, request_phase phase)
+{
+    unsigned long long now = timer_wheel_clock_ms();
+    atomic_store_explicit(&ci->progress, now, memory_order_relaxed);
+
+    pthread_mutex_lock(&deadline_lock);
+    ci->deadline_sd = sd;
+    ci->phase = phase;
+    ci->phase_started = now;
+    timer_wheel_schedule(&deadlines, &ci->deadline, timer_wheel_tick(request_deadline(ci)));
+    pthread_mutex_unlock(&deadline_lock);
+}
 
-int get_port(const char* str)
+/**
+ * Stops the deadline of a request. This must come before its origin socket is closed, the
+ * deadline thread would otherwise shut down whatever socket reuses the descriptor.
+ *
+ * @param ci: The communication_info of the request.
+ * @return
+ *   - 1 if the deadline fired, the origin socket was shut down.
+ *   - 0 otherwise.
+ */
+static int clear_deadline(communication_info* ci)
 {
-    if (str == NULL)
-        return -1; // Return error if input string is NULL
+    pthread_mutex_lock(&deadline_lock);
+    timer_wheel_cancel(&deadlines, &ci->deadline);
+    ci->deadline_sd = -1;
+    int timed_out = ci->timed_out;
+    pthread_mutex_unlock(&deadline_lock);
 
-    // Attempt to find a colon which separates the host/IP from the port number
-    const char* colon_pos = strchr(str, ':');
-    if (colon_pos == NULL)
-        return 80; // Return default HTTP port if no colon/port is specified
+    return timed_out;
+}
 
-    char* end_ptr;
-    // Convert the string portion after the colon to a long integer, representing the port
-    long port_number = strtol(colon_pos + 1, &end_ptr, 10); // Parse the port number
+/**
+ * Records that bytes moved between the origin and the client, which pushes the deadline of a
+ * transfer back. It is a plain store, the deadline thread looks at it when the timer fires.
+ *
+ * @param ci: The communication_info of the request.
+ */
+static void note_progress(communication_info* ci)
+{
+    atomic_store_explicit(&ci->progress, timer_wheel_clock_ms(), memory_order_relaxed);
+}
 
-    // Check if conversion resulted in a valid number
-    if ((colon_pos + 1) == end_ptr)
-        return 80; // Return default port if conversion fails
+/**
+ * The body of the deadline thread: advances the wheel every tick and fires the deadlines passed.
+ *
+ * @param arg: Unused.
+ * @return NULL.
+ */
+static void* deadline_function(void* arg)
+{
+    (void)arg;
+    struct timespec tick = {.tv_sec = 0, .tv_nsec = TIMER_WHEEL_TICK_MS * 1000000L};
+    int drain_expired = 0;
 
-    // Check for out-of-range values
-    if (errno == ERANGE && (port_number == LONG_MAX || port_number == LONG_MIN))
+    while (atomic_load(&deadline_running))
     {
-        fprintf(stderr, "Port number out of range.\n");
-        return -1; // Return error for out-of-range port numbers
-    }
+        nanosleep(&tick, NULL);
+        unsigned long long now = timer_wheel_clock_ms();
 
-    // Validate port number is within the valid TCP/UDP port range
+        pthread_mutex_lock(&deadline_lock);
+        timer_wheel_advance(&deadlines, now / TIMER_WHEEL_TICK_MS, request_expired);
+
+        // Deadlines scheduled before the drain started sit further out on the wheel
+        if (!drain_expired && now >= lifecycle_drain_deadline())
+        {
+            drain_expired = 1;
+            timer_wheel_expire_all(&deadlines, request_expired);
+        }
+        pthread_mutex_unlock(&deadline_lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the thread firing the deadlines of the threaded engine.
+ *
+ * @return
+ *   - 1 on success.
+ *   - -1 if the thread cannot be created.
+ */
+static int start_deadline_thread(void)
+{
+    timer_wheel_init(&deadlines, timer_wheel_clock_ms() / TIMER_WHEEL_TICK_MS);
+
+    atomic_store(&deadline_running, 1);
+    if (pthread_create(&deadline_thread, NULL, deadline_function, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to create the deadline thread\n");
+        atomic_store(&deadline_running, 0);
+        return -1;
+    }
+
+    return 1;
+}
+
+/**
+ * Stops the deadline thread, once no pool thread runs a request anymore.
+ */
+static void stop_deadline_thread(void)
+{
+    if (!atomic_load(&deadline_running))
+        return;
+
+    atomic_store(&deadline_running, 0);
+    pthread_join(deadline_thread, NULL);
+}
+
+
+int set_destination_server_connection(communication_info* ci)
+{
+    struct pollfd attempts[RESOLVER_MAX_ADDRESSES]; // Connection attempts in progress
+    int attempt_addresses[RESOLVER_MAX_ADDRESSES];  // Index of the address of each attempt
+    int attempt_count = 0;
+    int next_address = 0;                           // Next address to join the race
+    unsigned long long next_attempt = 0;            // When it joins if no attempt answered by then
+    int winner = -1;                                // Index of the attempt that connected
+
+    unsigned long long connect_started = metrics_clock_us();
+
+    // No single socket can be shut down for the deadline of the race, so it is checked here
+    set_deadline(ci, -1, PHASE_CONNECT);
+    unsigned long long deadline = request_deadline(ci);
+
+    while (winner == -1)
+    {
+        unsigned long long now = timer_wheel_clock_ms();
+        if (now >= deadline)
+            break;
+
+        // Start the next address once every attempt failed or the attempt delay passed
+        if (next_address < ci->host_addresses.count && (attempt_count == 0 || now >= next_attempt))
+        {
+            int connected;
+            int sd = start_connect_attempt(&ci->host_addresses.list[next_address], ci->host_port, &connected);
+            next_address++;
+            if (sd == -1)
+                continue; // Failed right away, the next address goes at once
+
+            attempts[attempt_count].fd = sd;
+            attempts[attempt_count].events = POLLOUT; // Completion is reported as writability
+            attempts[attempt_count].revents = 0;
+            attempt_addresses[attempt_count] = next_address - 1;
+            attempt_count++;
+            next_attempt = now + config.connect_attempt_delay;
+
+            if (connected)
+                winner = attempt_count - 1;
+            continue;
+        }
+
+        if (attempt_count == 0)
+            break; // Every address failed
+
+        // Wait for an attempt to complete, for the next address to be due, or for the deadline
+        unsigned long long wake = deadline;
+        if (next_address < ci->host_addresses.count && next_attempt < wake)
+            wake = next_attempt;
+
+        if (poll(attempts, attempt_count, (int)(wake - now)) < 0 && errno != EINTR)
+        {
+            perror("error: poll\n");
+            break;
+        }
+
+        for (int i = 0; i < attempt_count && winner == -1;)
+        {
+            if (attempts[i].revents == 0)
+            {
+                i++;
+                continue;
+            }
+
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1)
+                error = errno;
+
+            if (error == 0)
+            {
+                winner = i;
+                break;
+            }
+
+            errno = error;
+            perror("error: connect");
+            close(attempts[i].fd);
+
+            // Fill the gap with the last attempt, which is looked at next
+            attempt_count--;
+            attempts[i] = attempts[attempt_count];
+            attempt_addresses[i] = attempt_addresses[attempt_count];
+            next_attempt = now; // A failure lets the next address go right away
+        }
+    }
+
+    // The losers of the race are dropped
+    for (int i = 0; i < attempt_count; i++)
+        if (i != winner)
+            close(attempts[i].fd);
+
+    if (winner == -1)
+    {
+        if (timer_wheel_clock_ms() >= deadline)
+        {
+            pthread_mutex_lock(&deadline_lock);
+            ci->timed_out = 1;
+            pthread_mutex_unlock(&deadline_lock);
+        }
+
+        if (clear_deadline(ci))
+            printf("Connect operation timed out\n");
+        else
+            fprintf(stderr, "error: could not connect to %s\n", ci->clean_host_name);
+        return -1; // Indicate failure
+    }
+
+    metrics_observe(METRIC_PHASE_CONNECT, metrics_clock_us() - connect_started);
+    int sd = attempts[winner].fd;
+    ci->host_address = ci->host_addresses.list[attempt_addresses[winner]];
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) & ~O_NONBLOCK); // The pool thread uses blocking I/O
+
+    pthread_mutex_lock(&deadline_lock);
+    ci->deadline_sd = sd;
+    pthread_mutex_unlock(&deadline_lock);
+
+    return sd; // Return the socket descriptor for the successful connection, its deadline still running
+}
+
+
+int start_connect_attempt(const resolver_address* address, int port, int* connected)
+{
+    int sd = socket(address->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sd == -1)
+    {
+        perror("error: socket\n");
+        return -1;
+    }
+
+    tune_socket(sd); // Before connecting, the receive buffer sizes the window offered
+
+    struct sockaddr_storage socket_info;
+    socklen_t length = resolver_socket_address(address, port, &socket_info);
+
+    *connected = connect(sd, (struct sockaddr*)&socket_info, length) == 0;
+    if (!*connected && errno != EINPROGRESS)
+    {
+        perror("error: connect\n");
+        close(sd);
+        return -1;
+    }
+
+    return sd;
+}
+
+
+int acquire_pooled_connection(communication_info* ci)
+{
+    for (int i = 0; i < ci->host_addresses.count; i++)
+    {
+        int sd = upstream_acquire(&ci->host_addresses.list[i], ci->host_port);
+        if (sd != -1)
+        {
+            ci->host_address = ci->host_addresses.list[i];
+            return sd;
+        }
+    }
+
+    return -1;
+}
+
+
+void tune_socket(int sd)
+{
+    int on = 1;
+
+    // Small writes such as a response head go out right away instead of waiting for an acknowledgement
+    if (config.tcp_nodelay && setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+        perror("error: setsockopt\n");
+
+    if (config.socket_send_buffer > 0 &&
+        setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &config.socket_send_buffer, sizeof(config.socket_send_buffer)) < 0)
+        perror("error: setsockopt\n");
+
+    if (config.socket_receive_buffer > 0 &&
+        setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &config.socket_receive_buffer, sizeof(config.socket_receive_buffer)) < 0)
+        perror("error: setsockopt\n");
+
+    // The socket only turns writable once its unsent bytes drop under the watermark
+    if (config.notsent_lowat > 0 &&
+        setsockopt(sd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &config.notsent_lowat, sizeof(config.notsent_lowat)) < 0)
+        perror("error: setsockopt\n");
+}
+
+
+int get_port(const char* str)
+{
+    if (str == NULL)
+        return -1; // Return error if input string is NULL
+
+    // Attempt to find a colon which separates the host/IP from the port number
+    const char* bracket_pos = *str == '[' ? strchr(str, ']') : NULL;
+    const char* colon_pos = strchr(bracket_pos != NULL ? bracket_pos : str, ':');
+    if (bracket_pos == NULL && colon_pos != NULL && strchr(colon_pos + 1, ':') != NULL)
+        return 80; // An IPv6 address without brackets has no port
+    if (colon_pos == NULL)
+        return 80; // Return default HTTP port if no colon/port is specified
+
+    char* end_ptr;
+    // Convert the string portion after the colon to a long integer, representing the port
+    long port_number = strtol(colon_pos + 1, &end_ptr, 10); // Parse the port number
+
+    // Check if conversion resulted in a valid number
+    if ((colon_pos + 1) == end_ptr)
+        return 80; // Return default port if conversion fails
+
+    // Check for out-of-range values
+    if (errno == ERANGE && (port_number == LONG_MAX || port_number == LONG_MIN))
+    {
+        fprintf(stderr, "Port number out of range.\n");
+        return -1; // Return error for out-of-range port numbers
+    }
+
+    // Validate port number is within the valid TCP/UDP port range
     if (port_number < 0 || port_number > 65535)
     {
-        fprintf(stderr, "Invalid port number. Port number should be between 0 and 65535.\n");
-        return -1; // Return error for invalid port numbers
+        fprintf(stderr, "Invalid port number. Port number should be between 0 and 65535.\n");
+        return -1; // Return error for invalid port numbers
+    }
+
+    return (int)port_number; // Return the valid, extracted port number
+}
+
+
+int send_cached_response(int sd, const cache_object* object, int keep_alive)
+{
+    char head[HTTP_MAX_HEADER_SIZE + 64]; // The stored head with its Connection header and an Age header
+    size_t head_length = cache_build_head(object, keep_alive, head, sizeof(head));
+    if (head_length == 0 || write_to_socket(sd, head, head_length) != head_length)
+        return -1;
+
+    // The body goes from the cache file to the socket without passing through the process
+    size_t sent = 0;
+    return cache_send_body(object, sd, &sent, cache_body_length(object)) == 1 ? 1 : -1;
+}
+
+
+int is_revalidated(communication_info* ci, const http_response_framer* framer)
+{
+    if (ci->cached == NULL || !framer->head_complete || framer->status_code != 304)
+        return 0;
+
+    // The stored response is still valid, the client and the followers get it instead of the 304
+    cache_refresh(ci->cached, framer->head, framer->head_length);
+    if (ci->flight != NULL && ci->flight_leader)
+        cache_flight_finish(ci->flight, ci->cached);
+
+    return 1;
+}
+
+
+void cache_response_head(communication_info* ci, const http_response_framer* framer)
+{
+    // Only complete responses of a known length are stored, alongside relaying them
+    if (ci->cache_key != NULL && framer->head_complete && framer->status_code == 200 && framer->mode == HTTP_BODY_LENGTH)
+    {
+        long lifetime = cache_response_lifetime(framer->head, framer->head_length, time(NULL));
+        if (lifetime >= 0)
+            ci->cache_store = cache_store_begin(ci->cache_key, ci->cache_key_length, framer->head,
+                                                framer->head_length, framer->remaining, lifetime);
+    }
+
+    // Followers stream the response being stored, or fetch their own if there is none
+    if (ci->flight != NULL && ci->flight_leader)
+        cache_flight_start(ci->flight, ci->cache_store);
+}
+
+
+void cache_response_body(communication_info* ci, const void* data, size_t length)
+{
+    if (ci->cache_store == NULL)
+        return;
+
+    cache_store_append(ci->cache_store, data, length);
+    if (ci->flight != NULL && ci->flight_leader)
+        cache_flight_progress(ci->flight); // Followers send the new bytes too
+}
+
+
+size_t build_response_head(communication_info* ci, const http_response_framer* framer, int keep_alive, char* out)
+{
+    int compressible = framer->head_complete && framer->status_code == 200 && !framer->head_request &&
+                       (framer->mode == HTTP_BODY_UNTIL_CLOSE ||
+                        (framer->mode == HTTP_BODY_LENGTH && framer->remaining >= (unsigned long long)config.compress_min_size)) &&
+                       client_accepts_gzip(ci) && compress_eligible(framer->head, framer->head_length);
+
+    if (compressible)
+    {
+        char head[HTTP_MAX_HEADER_SIZE + COMPRESS_HEAD_EXTRA];
+        size_t length = compress_rewrite_head(framer->head, framer->head_length, -1, head, sizeof(head));
+        compressor* c = arena_alloc(ci->arena, sizeof(compressor));
+        if (length > 0 && c != NULL && compressor_init(c, ci->arena, config.compress_level) == 1)
+        {
+            ci->compressor = c;
+            return http_rewrite_head(head, length, keep_alive, out);
+        }
+    }
+
+    return http_build_response_head(framer, keep_alive, out);
+}
+
+
+/**
+ * Passes the header block of a response on to the client, once it is complete. A 304 answering
+ * the revalidation of a stored response refreshes it and sends it instead. A response that may
+ * be stored starts being copied to the cache.
+ *
+ * @param ci: The communication_info of the request.
+ * @param framer: The framer of the response, its header block complete.
+ * @param client_keep_alive: In: 1 if the client connection should stay open after the response.
+ *                           Out: cleared if the response can only be delimited by closing it.
+ * @return
+ *   - 1 if the head, or the whole stored response, was sent.
+ *   - -1 if writing to the client failed.
+ */
+static int send_response_head(communication_info* ci, const http_response_framer* framer, int* client_keep_alive)
+{
+    ci->responded = 1; // Whatever happens next, the client cannot be sent an error anymore
+
+    if (is_revalidated(ci, framer))
+    {
+        ci->status = 200; // The client gets the stored response in full
+        return send_cached_response(ci->client_socket, ci->cached, *client_keep_alive);
+    }
+    ci->status = framer->status_code;
+
+    // A body delimited by close ends the client connection too
+    if (framer->mode == HTTP_BODY_UNTIL_CLOSE)
+        *client_keep_alive = 0;
+
+    cache_response_head(ci, framer);
+
+    char head[RESPONSE_HEAD_SIZE];
+    size_t head_length = build_response_head(ci, framer, *client_keep_alive, head);
+    if (write_to_socket(ci->client_socket, head, head_length) != head_length)
+        return -1;
+
+    return 1;
+}
+
+
+/**
+ * Waits until the client socket takes more bytes. With TCP_NOTSENT_LOWAT set, that is once
+ * its unsent bytes dropped under the watermark, so the origin is not read any further ahead
+ * of a slow client, and the worker sleeps here rather than inside a write() with no timeout.
+ *
+ * @param sd: The client socket.
+ * @return
+ *   - 1 if the socket is writable.
+ *   - -1 if the client took nothing for the send timeout, or failed.
+ */
+static int wait_for_client(int sd)
+{
+    struct pollfd client = {.fd = sd, .events = POLLOUT};
+
+    while (1)
+    {
+        int ready = poll(&client, 1, config.send_timeout * 1000);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready == 0)
+        {
+            printf("Write operation timed out\n");
+            return -1;
+        }
+        if (ready < 0)
+        {
+            perror("error: poll\n");
+            return -1;
+        }
+
+        return client.revents & POLLOUT ? 1 : -1; // Anything else is an error or a hang-up
+    }
+}
+
+
+/**
+ * Compresses body bytes of a response into chunks and writes them to the client.
+ *
+ * @param ci: The communication_info of the request, compressing.
+ * @param data: The body bytes.
+ * @param length: The number of bytes.
+ * @param finish: 1 once the body is over, the stream is then ended.
+ * @param out: The buffer the chunks are built in.
+ * @param size: The size of out.
+ * @return
+ *   - 1 on success.
+ *   - -1 if writing to the client failed.
+ */
+static int send_compressed(communication_info* ci, const unsigned char* data, size_t length, int finish,
+                           char* out, size_t size)
+{
+    do {
+        size_t consumed;
+        size_t produced = compressor_chunk(ci->compressor, data, length, &consumed, finish, out, size);
+        if (produced > 0 && write_to_socket(ci->client_socket, out, produced) != produced)
+            return -1;
+
+        data += consumed;
+        length -= consumed;
+    } while (length > 0 || (finish && !ci->compressor->finished));
+
+    return 1;
+}
+
+
+int get_response_from_destination(int server_socket, communication_info* ci, int* client_keep_alive)
+{
+    size_t total_read_bytes = 0; // Track the total number of bytes forwarded
+    http_response_framer framer; // Finds where the response ends
+    int head_sent = 0; // 1 once the header block was passed on to the client
+    int client_socket = ci->client_socket;
+
+    // The relay buffer lives with the request, its size is a setting
+    unsigned char* buffer = arena_alloc(ci->arena, config.relay_buffer_size);
+    char* packed = NULL; // the chunks of a compressed body, allocated once the head asks for compression
+    size_t packed_size = config.relay_buffer_size + COMPRESS_CHUNK_OVERHEAD;
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    http_framer_init(&framer, http_span_equals(ci->request, ci->parsed.method, "HEAD"));
+
+    // Stop as soon as the response is complete instead of waiting for the origin to close
+    while (!http_framer_done(&framer))
+    {
+        // Read no more from the origin than the client keeps up with
+        if (head_sent && wait_for_client(client_socket) == -1)
+            return -1;
+
+        // Large body runs go through the worker's pipe and never reach this buffer, unless they are being stored
+        unsigned long long opaque_length = http_framer_opaque_length(&framer);
+        relay_pipe* pipe = NULL;
+        if (head_sent && config.splice && ci->cache_store == NULL && ci->compressor == NULL && opaque_length >= RELAY_SPLICE_MIN)
+            pipe = relay_thread_pipe();
+
+        if (pipe != NULL)
+        {
+            ssize_t moved = relay_fill(pipe, server_socket, opaque_length < SIZE_MAX ? (size_t)opaque_length : SIZE_MAX);
+            if (moved > 0 && relay_drain(pipe, client_socket) == 1)
+            {
+                http_framer_skip(&framer, moved);
+                total_read_bytes += moved;
+                note_progress(ci);
+                metrics_count(METRIC_BYTES_TO_CLIENT, moved);
+                ci->response_bytes += moved;
+                continue;
+            }
+
+            if (moved == 0)
+            {
+                // End of data stream, the origin closed the connection
+                if (framer.mode != HTTP_BODY_UNTIL_CLOSE)
+                    return -1; // The body was cut short
+                return 0;
+            }
+
+            perror("error: splice\n");
+            relay_pipe_close(pipe); // Drop what it may still hold, it is reopened on next use
+            return -1;
+        }
+
+        // Attempt to read data from the server socket
+        ssize_t read_bytes = read(server_socket, buffer, config.relay_buffer_size);
+        if (read_bytes < 0)
+        {
+            if (total_read_bytes == 0 && errno == ECONNRESET)
+                return -2; // The origin dropped the connection before answering
+            perror("error: read\n");
+            return -1; // Return error if read operation fails
+        }
+
+        if (read_bytes == 0)
+        {
+            // End of data stream, the origin closed the connection
+            if (total_read_bytes == 0)
+                return -2;
+            if (!head_sent)
+                return -1; // Not even a complete header block arrived
+            if (framer.mode != HTTP_BODY_UNTIL_CLOSE)
+                return -1; // The body was cut short
+            if (ci->compressor != NULL && send_compressed(ci, NULL, 0, 1, packed, packed_size) == -1)
+                return -1; // The compressed body still needs its end
+            return 0;
+        }
+
+        // The response started, from now on the origin only has to keep the bytes coming
+        if (total_read_bytes == 0)
+        {
+            set_deadline(ci, server_socket, PHASE_TRANSFER);
+            unsigned long long now = metrics_clock_us();
+            metrics_observe(METRIC_PHASE_FIRST_BYTE, now - ci->exchange_clock);
+            ci->exchange_clock = now; // The relay phase starts
+        }
+        else
+            note_progress(ci);
+        metrics_count(METRIC_BYTES_TO_CLIENT, read_bytes);
+        ci->response_bytes += read_bytes;
+
+        total_read_bytes += read_bytes; // Accumulate the count of bytes forwarded
+
+        size_t offset = 0;
+        while (offset < (size_t)read_bytes && !http_framer_done(&framer))
+        {
+            int in_head = !head_sent;
+            size_t consumed = http_framer_feed(&framer, buffer + offset, read_bytes - offset);
+
+            if (in_head && framer.state != FRAMER_HEADERS)
+            {
+                // The header block is complete
+                if (send_response_head(ci, &framer, client_keep_alive) != 1)
+                    return -1;
+                head_sent = 1;
+
+                if (ci->compressor != NULL && (packed = arena_alloc(ci->arena, packed_size)) == NULL)
+                {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    return -1;
+                }
+            }
+            else if (!in_head)
+            {
+                // Return error if not all data could be written to the client socket
+                if (ci->compressor != NULL ? send_compressed(ci, buffer + offset, consumed, 0, packed, packed_size) == -1
+                                           : write_to_socket_unsigned(client_socket, buffer + offset, consumed) != consumed)
+                    return -1;
+                cache_response_body(ci, buffer + offset, consumed);
+            }
+
+            offset += consumed;
+        }
+
+        // Anything past the end of the response would be a protocol violation, do not relay it
+        if (offset < (size_t)read_bytes)
+            framer.keep_alive = 0;
+    }
+
+    // A head that was complete together with its response is still owed to the client
+    if (!head_sent && send_response_head(ci, &framer, client_keep_alive) != 1)
+        return -1;
+
+    // A compressed body ends with the gzip trailer and the last chunk
+    if (ci->compressor != NULL && send_compressed(ci, NULL, 0, 1, packed, packed_size) == -1)
+        return -1;
+
+    return http_framer_reusable(&framer); // The response is complete
+}
+
+
+/**
+ * Keeps bytes that follow the body of the current request for the next one.
+ *
+ * @param ci: The communication_info of the client connection, with no pending bytes.
+ * @param data: The bytes.
+ * @param length: The number of bytes.
+ * @return
+ *   - 1 on success.
+ *   - -1 if memory allocation fails.
+ */
+static int keep_pending(communication_info* ci, const unsigned char* data, size_t length)
+{
+    if (length > ci->pending_capacity)
+    {
+        char* pending = realloc(ci->pending, length);
+        if (pending == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            return -1;
+        }
+        ci->pending = pending;
+        ci->pending_capacity = length;
+    }
+
+    memcpy(ci->pending, data, length);
+    ci->pending_length = length;
+    return 1;
+}
+
+
+/**
+ * Streams the body of the client's request to the origin through a fixed buffer, so an upload
+ * of any size takes the same memory, and the origin reading slowly slows the client down.
+ * The bytes that arrived with the header block go first. The body is framed as it goes by,
+ * and the bytes following it are kept for the next request.
+ *
+ * @param sd: The socket connected to the origin, the request head already sent.
+ * @param ci: The communication_info of the request.
+ * @return
+ *   - 1 if the whole body was sent, or the request has none.
+ *   - -1 if the client or the origin failed, or the body is malformed.
+ */
+static int send_request_body(int sd, communication_info* ci)
+{
+    if (ci->body_mode == HTTP_BODY_NONE)
+        return 1;
+
+    http_response_framer* framer = arena_alloc(ci->arena, sizeof(http_response_framer));
+    if (framer == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    http_framer_init_body(framer, ci->body_mode, ci->body_length);
+    set_deadline(ci, sd, PHASE_TRANSFER); // The body may take as long as it keeps moving
+
+    // The client holds its body back until it is told to go on
+    if (expects_continue(ci) && write_to_socket(ci->client_socket, CONTINUE_RESPONSE, strlen(CONTINUE_RESPONSE)) != strlen(CONTINUE_RESPONSE))
+        return -1;
+
+    unsigned char* buffer = arena_alloc(ci->arena, config.body_buffer_size);
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    while (!http_framer_done(framer))
+    {
+        size_t consumed;
+        const unsigned char* data = buffer;
+
+        if (ci->pending_length > 0)
+        {
+            // Bytes received with the header block come first
+            data = (const unsigned char*)ci->pending;
+            consumed = http_framer_feed(framer, data, ci->pending_length);
+        }
+        else
+        {
+            ssize_t bytes_read = read(ci->client_socket, buffer, config.body_buffer_size);
+            if (bytes_read < 0 && errno == EINTR)
+                continue;
+            if (bytes_read <= 0) // The client went away or timed out in the middle of its body
+            {
+                if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    printf("Read operation timed out\n");
+                else if (bytes_read < 0)
+                    perror("error: read\n");
+                return -1;
+            }
+
+            consumed = http_framer_feed(framer, data, bytes_read);
+
+            // Bytes past the end of the body start the next request
+            if (consumed < (size_t)bytes_read && keep_pending(ci, data + consumed, bytes_read - consumed) == -1)
+                return -1;
+        }
+
+        if (framer->mode == HTTP_BODY_UNTIL_CLOSE)
+        {
+            fprintf(stderr, "Malformed chunked request body\n");
+            return -1;
+        }
+
+        if (write_to_socket_unsigned(sd, (unsigned char*)data, consumed) != consumed)
+            return -1;
+        note_progress(ci);
+        metrics_count(METRIC_BYTES_TO_ORIGIN, consumed);
+
+        // Drop the pending bytes that were sent
+        if (data != buffer)
+        {
+            ci->pending_length -= consumed;
+            memmove(ci->pending, ci->pending + consumed, ci->pending_length);
+        }
+    }
+
+    set_deadline(ci, sd, PHASE_FIRST_BYTE); // The origin answers once it has the whole body
+    return 1;
+}
+
+
+/**
+ * Sends the client's request to its origin and relays the response back, reusing an idle
+ * pooled connection when one is available. A pooled connection that turns out to be closed
+ * by the origin before answering is replaced by a fresh one, once, unless the request body
+ * was already streamed to it.
+ *
+ * @param ci: The communication_info of the request, with the host resolved.
+ * @param client_keep_alive: In: 1 if the client connection should stay open. Out: cleared if
+ *                           the response can only be delimited by closing it.
+ * @return
+ *   - 1 if the response was relayed.
+ *   - 0 if the origin could not be reached.
+ *   - -1 if the exchange failed.
+ */
+static int forward_request(communication_info* ci, int* client_keep_alive)
+{
+    ci->request_started = timer_wheel_clock_ms(); // The request timeout runs from here, across a retry too
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        // Prefer a warm connection, otherwise connect to the destination server
+        int destination_server_sd = acquire_pooled_connection(ci);
+        int reused = destination_server_sd != -1;
+        if (!reused)
+            destination_server_sd = set_destination_server_connection(ci);
+        if (destination_server_sd == -1)
+            return 0;
+
+        // Forward the request to the destination server and get the response
+        int result = -1;
+        int replayable = 1;
+        set_deadline(ci, destination_server_sd, PHASE_FIRST_BYTE);
+        ci->exchange_clock = metrics_clock_us();
+        if (send_request(destination_server_sd, ci) == 1)
+        {
+            // Once its body was read from the client, the request cannot be sent again
+            replayable = ci->body_mode == HTTP_BODY_NONE;
+            if (send_request_body(destination_server_sd, ci) == 1)
+                result = get_response_from_destination(destination_server_sd, ci, client_keep_alive);
+        }
+        else if (reused)
+            result = -2; // The idle connection went away, retry on a new one
+
+        // A deadline firing after the response was relayed still shut the socket down
+        int timed_out = clear_deadline(ci);
+        if (result >= 0)
+        {
+            metrics_observe(METRIC_PHASE_RELAY, metrics_clock_us() - ci->exchange_clock);
+            upstream_release(&ci->host_address, ci->host_port, destination_server_sd, result == 1 && !timed_out);
+            return 1;
+        }
+
+        close(destination_server_sd); // Close the connection to the destination server
+
+        if (result == -1 || !reused || !replayable || timed_out)
+            return -1;
     }
 
-    return (int)port_number; // Return the valid, extracted port number
+    return -1;
 }
 
 
-int get_response_from_destination(int server_socket, int client_socket)
+/**
+ * Relays the bytes of a tunnel both ways until both sides ended their stream, one of them
+ * failed, or nothing moved for the tunnel idle timeout. Each direction is spliced through a
+ * pipe of its own, and poll() waits for whichever socket lets a direction go on.
+ *
+ * @param ci: The communication_info of the CONNECT request, its client socket one end of the tunnel.
+ * @param server_sd: The socket connected to the origin.
+ * @return
+ *   - 1 once the tunnel ended.
+ *   - -1 if it failed.
+ */
+static int relay_tunnel(communication_info* ci, int server_sd)
 {
-    unsigned char buffer[BUFFER_SIZE]; // Buffer for temporary data storage
-    size_t total_read_bytes = 0; // Track the total number of bytes forwarded
+    int client_sd = ci->client_socket;
 
+    relay_stream streams[2]; // Client to origin, and origin to client
+    if (relay_stream_open(&streams[0], client_sd, server_sd) == -1)
+        return -1;
+    if (relay_stream_open(&streams[1], server_sd, client_sd) == -1)
+    {
+        relay_stream_close(&streams[0]);
+        return -1;
+    }
+
+    // Both directions go on at once, so neither socket may block anymore
+    fcntl(client_sd, F_SETFL, fcntl(client_sd, F_GETFL) | O_NONBLOCK);
+    fcntl(server_sd, F_SETFL, fcntl(server_sd, F_GETFL) | O_NONBLOCK);
+
+    int result = 1;
     while (1)
     {
-        // Attempt to read data from the server socket
-        ssize_t read_bytes = read(server_socket, buffer, sizeof(buffer));
-        if (read_bytes < 0)
+        if (relay_stream_pump(&streams[0]) == -1 || relay_stream_pump(&streams[1]) == -1)
         {
-            perror("error: read\n");
-            return -1; // Return error if read operation fails
+            result = -1;
+            break;
         }
+        if (streams[0].shut && streams[1].shut)
+            break;
 
-        if (read_bytes == 0)
-            break; // Break the loop if end of data stream is reached (no more data)
-
-        // Attempt to write the read data to the client socket
-        if (write_to_socket_unsigned(client_socket, buffer, read_bytes) < read_bytes)
+        struct pollfd fds[2] = {{client_sd, 0, 0}, {server_sd, 0, 0}};
+        if (relay_stream_wants_read(&streams[0]))
+            fds[0].events |= POLLIN;
+        if (relay_stream_wants_write(&streams[1]))
+            fds[0].events |= POLLOUT;
+        if (relay_stream_wants_read(&streams[1]))
+            fds[1].events |= POLLIN;
+        if (relay_stream_wants_write(&streams[0]))
+            fds[1].events |= POLLOUT;
+
+        // A socket nothing is expected from anymore would keep reporting its hang-up
+        for (int i = 0; i < 2; i++)
+            if (fds[i].events == 0)
+                fds[i].fd = -1;
+
+        int ready = poll(fds, 2, config.tunnel_idle_timeout * 1000);
+        if (ready == 0)
+            break; // Idle for too long
+        if (ready < 0 && errno != EINTR)
         {
-            // Return error if not all data could be written to the client socket
-            return -1;
+            perror("error: poll\n");
+            result = -1;
+            break;
         }
+    }
 
-        total_read_bytes += read_bytes; // Accumulate the count of bytes forwarded
+    metrics_count(METRIC_BYTES_TO_ORIGIN, streams[0].relayed);
+    metrics_count(METRIC_BYTES_TO_CLIENT, streams[1].relayed);
+    ci->response_bytes += streams[1].relayed;
+    relay_stream_close(&streams[0]);
+    relay_stream_close(&streams[1]);
+    return result;
+}
+
+
+/**
+ * Serves a CONNECT request: connects to the origin, tells the client the tunnel is open
+ * and relays bytes both ways until the tunnel ends. Tunnels never use pooled connections.
+ *
+ * @param ci: The communication_info of the request, with the host resolved.
+ * @return
+ *   - 1 if the tunnel was served.
+ *   - 0 if the origin could not be reached, nothing was sent to the client.
+ *   - -1 if the tunnel failed.
+ */
+static int tunnel_request(communication_info* ci)
+{
+    int destination_server_sd = set_destination_server_connection(ci);
+    if (destination_server_sd == -1)
+        return 0;
+    clear_deadline(ci); // The tunnel has its idle timeout instead
+
+    // Bytes the client sent past the CONNECT head already belong to the tunnel
+    int result = -1;
+    if (write_to_socket(ci->client_socket, TUNNEL_ESTABLISHED, strlen(TUNNEL_ESTABLISHED)) == strlen(TUNNEL_ESTABLISHED) &&
+        (ci->pending_length == 0 || write_to_socket(destination_server_sd, ci->pending, ci->pending_length) == ci->pending_length))
+    {
+        ci->pending_length = 0;
+        ci->status = 200;
+        ci->response_bytes = strlen(TUNNEL_ESTABLISHED);
+        result = relay_tunnel(ci, destination_server_sd);
     }
 
-    return 1; // Return success after all data has been forwarded
+    close(destination_server_sd); // Close the connection to the destination server
+    return result;
 }
 
 
+/**
+ * Serves a request from the fetch an identical request leads: the response is streamed to
+ * the client while the leader stores it.
+ *
+ * @param ci: The communication_info of the request, following ci->flight.
+ * @param keep_alive: 1 if the client connection stays open after the response.
+ * @return
+ *   - 1 if the response was sent.
+ *   - 0 if the leader had nothing to share, nothing was sent.
+ *   - -1 if the response could not be sent completely.
+ */
+static int follow_flight(communication_info* ci, int keep_alive)
+{
+    int head_sent = 0; // 1 once the stored head was sent
+    size_t sent = 0; // Body bytes sent so far
+
+    while (1)
+    {
+        // Block until the leader got further than this request
+        cache_flight_wait(ci->flight, sent, NULL);
 
-int thread_function(void* arg)
+        cache_object* object;
+        size_t filled;
+        cache_flight_state state = cache_flight_status(ci->flight, &object, &filled);
+        if (state == CACHE_FLIGHT_FAILED)
+            return head_sent ? -1 : 0;
+
+        if (!head_sent)
+        {
+            char head[HTTP_MAX_HEADER_SIZE + 64];
+            size_t head_length = cache_build_head(object, keep_alive, head, sizeof(head));
+            if (head_length == 0 || write_to_socket(ci->client_socket, head, head_length) != head_length)
+                return -1;
+            head_sent = 1;
+            ci->status = 200;
+        }
+
+        // Send what the leader stored so far
+        int result = cache_send_body(object, ci->client_socket, &sent, filled);
+        ci->response_bytes = sent;
+        if (result != 1)
+            return -1;
+
+        if (state == CACHE_FLIGHT_DONE)
+            return 1;
+    }
+}
+
+
+/**
+ * Serves one request of a client connection: reads it, validates and filters it, forwards it
+ * and relays the response.
+ *
+ * @param ci: The communication_info of the client connection.
+ * @param served: The number of requests already served on this connection.
+ * @return
+ *   - 1 if the connection can carry another request.
+ *   - 0 if it must be closed.
+ */
+static int handle_request(communication_info* ci, int served)
 {
-    communication_info* ci = (communication_info*) arg; // Cast argument to communication_info structure
+    // Long-lived connections pick up a reloaded filter on their next request
+    if (served > 0)
+    {
+        filter_release(ci->filter);
+        ci->filter = filter_acquire_current();
+    }
+
     // Read the request from the client socket
-    ci->request = read_from_client_socket(ci->client_socket);
+    ci->request = read_from_client_socket(ci);
     if (ci->request == NULL) // Check for read failure
     {
-        send_error_message(ERROR_500_INTERNAL, ci->client_socket); // Send error response to client
-        goto finish; // Skip to clean up and exit
+        // A connection that goes quiet or closes between requests is not an error
+        if (served == 0)
+            send_error_response(ci, ERROR_500_INTERNAL, NULL); // Send error response to client
+        return 0;
     }
 
-    // Ensure the connection will be closed after the request
-    if (set_connection_close(ci) != 1)
+    // Decide whether the client connection stays open once this request is answered
+    int keep_alive = is_client_keep_alive(ci) && served + 1 < config.max_requests_per_connection;
+
+    // Ask the origin to keep the connection open so it can go back to the pool
+    if (set_request_header(ci, "Connection", "keep-alive") != 1)
     {
-        send_error_message(ERROR_500_INTERNAL, ci->client_socket); // Send error response to client
-        goto finish; // Skip to clean up and exit
+        send_error_response(ci, ERROR_500_INTERNAL, NULL); // Send error response to client
+        return 0;
     }
 
-
     // Validate the request format and headers
-    if (!is_legal_request(ci))
-        goto finish; // Skip to clean up and exit if request is illegal
+    if (!is_legal_request(ci, &keep_alive))
+        return keep_alive; // Closed unless the refusal leaves it usable for the next request
 
     // Resolve and clean the host name from the request
-    ci->clean_host_name = get_clean_host(ci->host_name);
+    ci->clean_host_name = get_clean_host(ci->arena, ci->host_name);
     if (ci->clean_host_name == NULL)
     {
-        send_error_message(ERROR_500_INTERNAL, ci->client_socket); // Send error response to client
-        goto finish; // Skip to clean up and exit
+        send_error_response(ci, ERROR_500_INTERNAL, NULL); // Send error response to client
+        return 0;
     }
 
     // Get the port from the host header
     ci->host_port = get_port(ci->host_name);
     if (ci->host_port == -1)
     {
-        send_error_message(ERROR_500_INTERNAL, ci->client_socket); // Send error response to client
-        goto finish; // Skip to clean up and exit
+        send_error_response(ci, ERROR_500_INTERNAL, NULL); // Send error response to client
+        return 0;
+    }
+
+    // A CONNECT request turns the client connection into a tunnel, it is closed afterwards
+    if (ci->tunnel)
+    {
+        if (tunnel_request(ci) == 0)
+            send_error_response(ci, ci->timed_out ? ERROR_504_GATEWAY_TIMEOUT : ERROR_500_INTERNAL, NULL); // Send error response to client
+        return 0;
     }
 
-    // Connect to the destination server
-    int destination_server_sd = set_destination_server_connection(ci->clean_host_name, ci->host_port);
-    if (destination_server_sd != -1) // Check if connection was successful
+    // Serve a fresh stored response without contacting the origin
+    int cached = check_cache(ci);
+    if (cached == 1)
     {
-        // Forward the request to the destination server and get the response
-        if (write_to_socket(destination_server_sd, ci->request, strlen(ci->request)) == -1 ||
-            get_response_from_destination(destination_server_sd, ci->client_socket) == -1)
-        {
-            send_error_message(ERROR_500_INTERNAL, ci->client_socket); // Send error response to client
-        }
+        ci->status = 200;
+        ci->response_bytes = cache_body_length(ci->cached);
+        return send_cached_response(ci->client_socket, ci->cached, keep_alive) == 1 && keep_alive;
+    }
 
-        close(destination_server_sd); // Close the connection to the destination server
+    // Share the fetch of an identical request in flight
+    if (cached == 2)
+    {
+        int followed = follow_flight(ci, keep_alive);
+        if (followed != 0)
+            return followed == 1 && keep_alive;
+
+        // The leader got nothing to share, fetch the response separately
+        cache_flight_leave(ci->flight);
+        ci->flight = NULL;
+    }
+
+    // Connect to the destination server, forward the request and relay the response
+    int result = forward_request(ci, &keep_alive);
+    if (result != 1 && ci->timed_out && !ci->responded)
+        send_error_response(ci, ERROR_504_GATEWAY_TIMEOUT, NULL); // The origin did not answer in time
+    else if (result != 1 && !ci->responded)
+        send_error_response(ci, ERROR_500_INTERNAL, NULL); // The origin is unreachable or the exchange failed, as with event loops
+
+    return result == 1 && keep_alive;
+}
+
+
+/**
+ * Waits for the next request of a kept-alive connection, the drain cutting the wait short.
+ *
+ * @param ci: The communication_info of the connection.
+ * @return
+ *   - 1 if the client sent something or closed the connection, it is read next.
+ *   - 0 if the client stayed quiet for the idle timeout, or the drain started first.
+ */
+static int wait_for_next_request(const communication_info* ci)
+{
+    if (ci->pending_length > 0)
+        return 1; // Pipelined already
+
+    struct pollfd ready[2] = {{ci->client_socket, POLLIN, 0}, {drain_fd, POLLIN, 0}};
+    int count;
+    do {
+        count = poll(ready, 2, config.client_idle_timeout * 1000);
+    } while (count < 0 && errno == EINTR);
+
+    return count > 0 && ready[0].revents != 0;
+}
+
+
+int thread_function(void* arg)
+{
+    communication_info* ci = (communication_info*) arg; // Cast argument to communication_info structure
+
+    // Serve sequential and pipelined requests until the connection has to be closed
+    for (int served = 0; served < config.max_requests_per_connection; served++)
+    {
+        if (served > 0 && !wait_for_next_request(ci))
+            break;
+
+        int keep_alive = handle_request(ci, served);
+        reset_request_info(ci); // Free the per-request data before the next request
+        if (!keep_alive || lifecycle_draining())
+            break;
     }
 
-    finish:
     destroy_communication_info(ci); // Clean up the communication_info structure
     return 1; // Indicate successful completion
 }
@@ -821,157 +2260,653 @@ size_t write_to_socket(int sd, char* request, size_t data_length)
 }
 
 
-char* read_file_content(const char* file_path)
+/**
+ * Writes an eventfd, which stays readable for every thread polling it.
+ *
+ * @param fd: The eventfd, nothing is done for -1.
+ */
+static void signal_eventfd(int fd)
 {
-    // Attempt to open the file for reading
-    FILE* file = fopen(file_path, "r");
-    if (!file)
+    uint64_t one = 1;
+    if (fd != -1 && write(fd, &one, sizeof(one)) != sizeof(one))
+        perror("error: write\n");
+}
+
+/**
+ * Stops every acceptor of the threaded engine, so they notice the end of the connection budget
+ * or the drain. The listening sockets are left alone, a proxy taking over may be using them.
+ */
+static void stop_acceptors(void)
+{
+    signal_eventfd(acceptors_stop_fd);
+}
+
+/**
+ * Starts the drain, called from the lifecycle thread: the acceptors stop and the pool threads
+ * waiting for the next request of a connection close it. The event loops notice the drain on
+ * their own.
+ */
+static void start_drain(void)
+{
+    signal_eventfd(drain_fd);
+    stop_acceptors();
+}
+
+
+/**
+ * Answers a connection the proxy has no room for with a 503 and closes it, without serving
+ * its request. What the client already sent is read first, so closing the socket does not
+ * reset the connection before the answer is received.
+ *
+ * @param ci: The communication_info of the connection, destroyed.
+ * @param reason: The counter of the refusal.
+ */
+static void refuse_connection(communication_info* ci, metrics_counter reason)
+{
+    metrics_count(reason, 1);
+    send_error_response(ci, ERROR_503_SERVICE_UNAVAILABLE, NULL);
+
+    char discard[4096];
+    for (int i = 0; i < 16 && recv(ci->client_socket, discard, sizeof(discard), MSG_DONTWAIT) > 0; i++)
+        ;
+
+    destroy_communication_info(ci);
+}
+
+/**
+ * Refuses a connection that waited in the queue of a pool for too long, run by the pool
+ * instead of thread_function().
+ *
+ * @param arg: The communication_info of the connection.
+ * @return 1 always.
+ */
+static int shed_connection(void* arg)
+{
+    refuse_connection((communication_info*)arg, METRIC_SHED_QUEUE_DELAY);
+    return 1;
+}
+
+/**
+ * Accepts connections on the listening socket of an acceptor and dispatches them to the
+ * acceptor's own thread pool, until the connections accepted by all acceptors together
+ * reach the maximum number of requests. A connection is refused with a 503 right away if
+ * its client holds too many, or if the queue of the pool reached its high watermark.
+ *
+ * @param arg: The acceptor.
+ * @return NULL.
+ */
+static void* acceptor_function(void* arg)
+{
+    acceptor* self = (acceptor*)arg;
+    struct pollfd ready[2] = {{self->ws, POLLIN, 0}, {acceptors_stop_fd, POLLIN, 0}};
+
+    while (1)
     {
-        fprintf(stderr, "Error opening file %s for reading.\n", file_path);
-        return NULL;
+        // Wait for a connection, unless the acceptors are stopped
+        if (poll(ready, 2, -1) < 0 && errno != EINTR)
+        {
+            perror("error: poll\n");
+            break;
+        }
+        if (ready[1].revents & POLLIN)
+            return NULL; // Another acceptor used up the budget, or the drain started
+        if (!(ready[0].revents & POLLIN))
+            continue;
+
+        communication_info* ci = (communication_info*)malloc(sizeof(communication_info));
+        if (ci == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            break; // Exit loop on memory allocation failure
+        }
+
+        init_communication_info(ci); // Initialize the communication info structure
+
+        // Accept a connection
+        socklen_t address_length = sizeof(ci->client_address);
+        ci->client_socket = accept4(self->ws, (struct sockaddr*)&ci->client_address, &address_length, SOCK_CLOEXEC);
+        if (ci->client_socket < 0)
+        {
+            int error = errno;
+            free(ci); // Ensure allocated memory is freed on failure
+
+            // The connection was gone before it could be accepted, or another process sharing
+            // the socket took it
+            if (error == EINTR || error == ECONNABORTED || error == EAGAIN || error == EWOULDBLOCK)
+                continue;
+
+            errno = error;
+            perror("error: accept\n");
+            break; // Exit loop on accept failure
+        }
+
+        tune_socket(ci->client_socket);
+        metrics_count(METRIC_CONNECTIONS_ACCEPTED, 1);
+
+        // A write to a client that stopped reading gives up after the send timeout
+        struct timeval send_timeout = {.tv_sec = config.send_timeout, .tv_usec = 0};
+        if (setsockopt(ci->client_socket, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout)) == -1)
+            perror("error: setsockopt\n");
+
+        // Count after accepting, an acceptor blocked in accept() must not hold part of the budget
+        size_t ticket = atomic_fetch_add(&accepted_connections, 1);
+        if (ticket >= max_connections)
+        {
+            destroy_communication_info(ci); // Raced with the last connection of the budget
+            break;
+        }
+
+        ci->filter = filter_acquire_current(); // Borrow the current snapshot, no copy per connection
+
+        // Dispatch the connection to a thread of this acceptor, unless there is no room for it
+        ci->admitted = admission_enter(&ci->client_address);
+        if (!ci->admitted)
+            refuse_connection(ci, METRIC_SHED_CLIENT_LIMIT);
+        else if (!try_dispatch(self->tp, thread_function, (void*)ci))
+            refuse_connection(ci, METRIC_SHED_QUEUE_FULL);
+
+        if (ticket + 1 == max_connections)
+            break; // That was the last one
     }
 
-    // Move to the end of the file to determine its size
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file); // Get the file size
-    fseek(file, 0, SEEK_SET); // Reset the file pointer to the beginning
+    stop_acceptors(); // Wake the acceptors still waiting for a connection
+    return NULL;
+}
+
+
+/**
+ * Asks the kernel to hand a listening socket the connections whose packets arrive on the CPU
+ * of its worker group, so they are served where they were received. Nothing is done unless
+ * every group is pinned to a single CPU.
+ *
+ * @param ws: The listening socket.
+ * @param group: The worker group accepting on it.
+ */
+static void steer_listener(int ws, int group)
+{
+    int cpu = affinity_cpu(group);
+    if (cpu >= 0 && setsockopt(ws, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0)
+        perror("error: setsockopt\n");
+}
+
+/**
+ * Returns the port a listening socket is bound to.
+ *
+ * @param sd: The socket.
+ * @return The port, -1 if the socket has no address.
+ */
+static int sock_port(int sd)
+{
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if (getsockname(sd, (struct sockaddr*)&address, &length) == -1)
+        return -1;
+
+    if (address.ss_family == AF_INET6)
+        return ntohs(((struct sockaddr_in6*)&address)->sin6_port);
+    if (address.ss_family == AF_INET)
+        return ntohs(((struct sockaddr_in*)&address)->sin_port);
+    return -1;
+}
 
-    // Allocate memory for the content, +1 for the null terminator
-    char* content = malloc(file_size + 1);
-    if (!content)
+/**
+ * Checks that the listening sockets suit the settings, which only sockets taken over from an
+ * older proxy may not: they must listen on the port given, and each needs a worker.
+ *
+ * @param listeners: The listening sockets.
+ * @param count: The number of listening sockets.
+ * @param port: The port of the proxy.
+ * @param pool_size: The number of workers.
+ * @return
+ *   - 1 if the sockets can be used.
+ *   - 0 otherwise. A message is printed.
+ */
+static int listeners_fit(const int* listeners, int count, in_port_t port, int pool_size)
+{
+    if (count > pool_size)
     {
-        fprintf(stderr, "Memory allocation failed\n");
-        fclose(file);
-        return NULL;
+        fprintf(stderr, "%d listening sockets received but only %d workers to serve them\n", count, pool_size);
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++)
+        if (sock_port(listeners[i]) != port)
+        {
+            fprintf(stderr, "The listening sockets received are not on port %d\n", port);
+            return 0;
+        }
+
+    return 1;
+}
+
+/**
+ * Opens the admin port, or takes over the one of the proxy being upgraded, and starts the
+ * thread answering its scrapes.
+ *
+ * @param inherited: The admin port socket received from the older proxy, -1 if none.
+ * @return
+ *   - 1 on success.
+ *   - -1 if the port cannot be opened or the thread cannot be started. A message is printed.
+ */
+static int open_metrics_port(int inherited)
+{
+    int sd = inherited != -1 ? inherited : set_my_server_configuration((in_port_t)config.metrics_port, 0);
+    if (sd == -1 || metrics_start_server(sd) == -1)
+    {
+        fprintf(stderr, "Failed to set up the metrics port\n");
+        return -1;
     }
 
-    ssize_t read;
-    size_t len = 0; // getline will allocate memory for the line
-    char* line = NULL; // Pointer to the line read by getline
-    long total_length = 0; // Track the total length of content read
+    return 1;
+}
+
 
-    // Read the file line by line
-    while ((read = getline(&line, &len, file)) != -1)
+/**
+ * Matches one batch of hosts of a log and prints the filtered ones in the order of the log.
+ * IPv4 literals are matched together against the CIDR rules, and hostnames against the
+ * hostname rules; hostnames are not resolved.
+ *
+ * @param filter: The compiled filter.
+ * @param hosts: The hosts, null-terminated, each optionally followed by ":port".
+ * @param count: The number of hosts, CHECK_BATCH_SIZE at most.
+ * @return The number of filtered hosts.
+ */
+static size_t check_batch(const filter_set* filter, const char* const* hosts, size_t count)
+{
+    static uint32_t ipv4[CHECK_BATCH_SIZE];          // the IPv4 literals of the batch
+    static size_t ipv4_index[CHECK_BATCH_SIZE];      // where each of them is in the batch
+    static const char* names[CHECK_BATCH_SIZE];      // the hostnames of the batch
+    static size_t name_index[CHECK_BATCH_SIZE];      // where each of them is in the batch
+    static uint64_t matched[CHECK_BATCH_SIZE / 64];  // the filtered hosts of the batch
+    static uint64_t found[CHECK_BATCH_SIZE / 64];    // the result of one batch call
+    size_t ipv4_count = 0, name_count = 0;
+
+    memset(matched, 0, sizeof(matched));
+    for (size_t i = 0; i < count; i++)
     {
-        // Replace the last newline character with "\r\n"
-        if (line[read - 1] == '\n')
+        size_t length;
+        const char* start = find_clean_host(hosts[i], &length);
+        char literal[INET6_ADDRSTRLEN];
+        struct in_addr ip4;
+        struct in6_addr ip6;
+
+        if (length >= sizeof(literal))
+            length = sizeof(literal) - 1; // Too long for an address, the parse fails
+        memcpy(literal, start, length);
+        literal[length] = '\0';
+
+        if (inet_pton(AF_INET, literal, &ip4) == 1)
+        {
+            ipv4_index[ipv4_count] = i;
+            ipv4[ipv4_count++] = ntohl(ip4.s_addr);
+        }
+        else if (inet_pton(AF_INET6, literal, &ip6) == 1)
+            matched[i / 64] |= (uint64_t)filter_match_ip6(filter, ip6.s6_addr) << (i % 64);
+        else
         {
-            line[read - 1] = '\r'; // Carriage return
-            line[read] = '\n'; // New line
-            line[read + 1] = '\0'; // Null-terminate the modified line
-            read++; // Account for the added character
+            name_index[name_count] = i;
+            names[name_count++] = hosts[i];
         }
+    }
 
-        // Check if the current content buffer size is sufficient
-        if (total_length + read >= file_size)
+    filter_match_ip_batch(filter, ipv4, ipv4_count, found);
+    for (size_t i = 0; i < ipv4_count; i++)
+        matched[ipv4_index[i] / 64] |= (found[i / 64] >> (i % 64) & 1) << (ipv4_index[i] % 64);
+
+    filter_match_host_batch(filter, names, name_count, found);
+    for (size_t i = 0; i < name_count; i++)
+        matched[name_index[i] / 64] |= (found[i / 64] >> (i % 64) & 1) << (name_index[i] % 64);
+
+    size_t filtered = 0;
+    for (size_t i = 0; i < count; i++)
+        if (matched[i / 64] >> (i % 64) & 1)
         {
-            file_size = total_length + read + 1; // Update the expected file size
-            char* temp_content = realloc(content, file_size); // Attempt to reallocate memory
-            if (!temp_content)
-            {
-                fprintf(stderr, "Memory reallocation failed\n");
-                free(content); // Avoid memory leak
-                free(line); // getline allocates memory for line
-                fclose(file);
-                return NULL;
-            }
-            content = temp_content; // Update the content pointer after successful reallocation
+            puts(hosts[i]);
+            filtered++;
         }
 
-        // Copy the current line into the content buffer
-        memcpy(content + total_length, line, read);
-        total_length += read; // Update the total length of content
+    return filtered;
+}
+
+/**
+ * The --check mode: matches a log of hosts against a filter file offline and prints the
+ * filtered ones. The first field of every line is a host, optionally followed by ":port".
+ *
+ * @param filter_path: The filter file.
+ * @param log_path: The log of hosts.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if a file cannot be read. A message is printed.
+ */
+static int check_hosts(const char* filter_path, const char* log_path)
+{
+    filter_set* filter = filter_load(filter_path);
+    if (filter == NULL)
+        return EXIT_FAILURE;
+
+    int fd = open(log_path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1)
+    {
+        perror("error: open\n");
+        if (fd != -1)
+            close(fd);
+        filter_release(filter);
+        return EXIT_FAILURE;
+    }
+
+    // A private writable mapping lets the hosts be terminated in place
+    size_t size = (size_t)info.st_size;
+    char* text = size > 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (text == MAP_FAILED)
+    {
+        perror("error: mmap\n");
+        filter_release(filter);
+        return EXIT_FAILURE;
     }
+    if (size > 0)
+        madvise(text, size, MADV_SEQUENTIAL);
+
+    static const char* hosts[CHECK_BATCH_SIZE];
+    size_t count = 0, total = 0, filtered = 0;
+    char* copied = NULL; // the last host, copied if the file does not end with a newline
+    char* end = text + size;
+    for (char* line = text; line < end;)
+    {
+        char* next = memchr(line, '\n', end - line);
+        next = next != NULL ? next : end;
+
+        // The host is the first field, the rest of the line is left alone
+        while (line < next && isspace((unsigned char)*line))
+            line++;
+        char* field = line;
+        while (line < next && !isspace((unsigned char)*line))
+            line++;
+
+        // The last line of a file without a newline cannot be terminated in place
+        if (line == end && line > field)
+        {
+            copied = strndup(field, line - field);
+            if (copied != NULL)
+                hosts[count++] = copied;
+        }
+        else if (line > field)
+        {
+            *line = '\0';
+            hosts[count++] = field;
+        }
+
+        if (count == CHECK_BATCH_SIZE)
+        {
+            filtered += check_batch(filter, hosts, count);
+            total += count;
+            count = 0;
+        }
 
-    content[total_length] = '\0'; // Ensure the content is null-terminated
+        line = next + 1;
+    }
 
-    // Cleanup
-    free(line); // Free the memory allocated by getline
-    fclose(file); // Close the file
+    filtered += check_batch(filter, hosts, count);
+    total += count;
+    free(copied);
 
-    return content; // Return the dynamically allocated content
+    fprintf(stderr, "%zu of %zu hosts filtered\n", filtered, total);
+    if (text != NULL)
+        munmap(text, size);
+    filter_release(filter);
+    return EXIT_SUCCESS;
 }
 
+
 int main(int argc, char* argv[])
 {
+    // Match a log of hosts offline instead of serving
+    if (argc == 4 && strcmp(argv[1], "--check") == 0)
+        return check_hosts(argv[2], argv[3]);
+
     // Check command line arguments for correct usage
-    if (argc != 5)
+    if (argc < 5)
     {
-        printf("Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter>\n");
+        printf("Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter> [--option=value ...]\n");
+        printf("       proxyServer --check <filter> <log-of-hosts>\n");
+        config_print_options(stdout);
         exit(EXIT_FAILURE); // Exit if the number of arguments is incorrect
     }
 
-    // Initialize server address structure
-    struct sockaddr_in server_info;
+    // Apply the optional settings that follow the positional arguments
+    for (int i = 5; i < argc; i++)
+        if (config_parse_option(argv[i]) == -1)
+            exit(EXIT_FAILURE);
+
     // Convert command line arguments to appropriate types
     long temp_port = (long) strtoul(argv[1], NULL, 10); // Server port
     size_t pool_size = strtoul(argv[2], NULL, 10); // Thread pool size
     size_t max_tasks = strtoul(argv[3], NULL, 10); // Maximum number of tasks
     char* filter = argv[4]; // Path to filter file
 
-    if (temp_port < 0 || temp_port > 65535 || max_tasks < 1)
+    if (temp_port < 0 || temp_port > 65535 || (max_tasks == 0 && strcmp(argv[3], "0") != 0))
     {
-        printf("Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter>\n");
+        printf("Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter> [--option=value ...]\n");
         exit(EXIT_FAILURE); // Exit if the number of arguments is incorrect
     }
     in_port_t port = (in_port_t)temp_port;
 
-    // Create a thread pool for handling connections
-    threadpool* tp = create_threadpool((int)pool_size);
-    if (tp == NULL)
-        exit(EXIT_FAILURE); // Exit if thread pool creation fails
+    // A maximum of 0 serves until SIGTERM or an upgrade
+    if (max_tasks == 0)
+        max_tasks = SIZE_MAX;
+
+    // Compile the filter once, every worker shares the published snapshot read-only
+    filter_set* compiled_filter = filter_load(filter);
+    if (compiled_filter == NULL)
+        exit(EXIT_FAILURE);
+
+    filter_publish(compiled_filter);
 
-    char* filter_content = read_file_content(filter);
-    if (filter_content == NULL)
+    // Block SIGTERM and start the reloader before any other thread, so both signals stay blocked everywhere else
+    if (lifecycle_block_signals() == -1 || filter_start_reloader(filter) == -1)
     {
-        destroy_threadpool(tp);
+        filter_publish(NULL);
         exit(EXIT_FAILURE);
     }
 
-    // Zero out the server address structure
-    memset(&server_info, 0, sizeof(struct sockaddr_in));
+    // A client or origin closing early must fail the write, not kill the process
+    signal(SIGPIPE, SIG_IGN);
 
-    // Configure the server address
-    server_info.sin_family = AF_INET; // Use IPv4 addresses
-    server_info.sin_port = htons(port); // Set the port number, converting to network byte order
-    server_info.sin_addr.s_addr = htonl(INADDR_ANY); // Accept connections to any of the server's IP addresses
+    // Split the CPUs into the units workers are pinned to, a failure leaves every thread unpinned
+    affinity_init(config.affinity);
+
+    // Set up the shared DNS cache, the pool of origin connections and the counts of clients
+    if (resolver_init() == -1 || upstream_init() == -1 || admission_init(config.max_client_connections) == -1)
+    {
+        filter_stop_reloader();
+        filter_publish(NULL);
+        exit(EXIT_FAILURE);
+    }
+
+    // Map the response cache, whatever a previous run stored in it is served again
+    if (config.cache_file != NULL && cache_init(config.cache_file, config.cache_size) == -1)
+    {
+        upstream_shutdown();
+        resolver_shutdown();
+        filter_stop_reloader();
+        filter_publish(NULL);
+        exit(EXIT_FAILURE);
+    }
+
+    if (pool_size < 1 || pool_size > MAXT_IN_POOL)
+    {
+        printf("Invalid amount of threads. Maximum is %d\n", MAXT_IN_POOL);
+        cache_shutdown();
+        upstream_shutdown();
+        resolver_shutdown();
+        filter_stop_reloader();
+        filter_publish(NULL);
+        exit(EXIT_FAILURE);
+    }
+
+    // Error responses take their date from the clock thread, or format it themselves without one
+    responses_start_clock();
+
+    // One listening socket per event loop by default, a single acceptor for the threaded engine
+    // unless its workers are pinned, then one per unit
+    int listener_count = config.acceptors;
+    if (listener_count == 0)
+        listener_count = config.engine == ENGINE_EPOLL ? (int)pool_size : affinity_units();
+    if (listener_count > (int)pool_size)
+        listener_count = (int)pool_size; // Every acceptor needs at least one worker
+
+    // Take the listening sockets of the proxy being upgraded, if one serves the upgrade socket
+    int listeners[LIFECYCLE_MAX_SOCKETS];
+    int admin = -1;
+    int opened = 0;
+    if (config.upgrade_socket != NULL)
+    {
+        opened = lifecycle_inherit(config.upgrade_socket, listeners, &admin);
+        if (opened > 0)
+            listener_count = opened;
+    }
 
     // Set up the server configuration (socket creation, binding, and listening)
-    int ws = set_my_server_configuration(server_info);
-    if (ws == -1)
+    while (opened >= 0 && opened < listener_count &&
+           (listeners[opened] = set_my_server_configuration(port, listener_count > 1)) != -1)
+        opened++;
+
+    int status = opened == listener_count ? EXIT_SUCCESS : EXIT_FAILURE; // Exit if server setup fails
+    if (opened < 0)
+        opened = 0;
+
+    if (status == EXIT_FAILURE)
+        fprintf(stderr, "Failed to set up the listening sockets\n");
+    else if (!listeners_fit(listeners, listener_count, port, (int)pool_size))
+        status = EXIT_FAILURE;
+
+    // A socket feeding a single group takes the connections whose packets its CPU receives
+    for (int i = 0; status == EXIT_SUCCESS && i < listener_count; i++)
+        if (config.engine == ENGINE_THREADS || listener_count == (int)pool_size)
+            steer_listener(listeners[i], i);
+
+    // The admin port of the old proxy is only kept if it is the one configured
+    if (admin != -1 && sock_port(admin) != config.metrics_port)
     {
-        free (filter_content);
-        exit(EXIT_FAILURE); // Exit if server setup fails
+        close(admin);
+        admin = -1;
     }
 
-    // Main loop to accept connections and dispatch them to the thread pool
-    for (size_t i = 0; i < max_tasks; i++)
+    if (status == EXIT_FAILURE)
+        ; // Reported already
+    else if (config.metrics_port != 0 && open_metrics_port(admin) == -1)
+        status = EXIT_FAILURE;
+    else if (config.access_log != NULL &&
+             access_log_start(config.access_log, config.access_log_sample, (size_t)config.access_log_buffer * 1024) == -1)
+        status = EXIT_FAILURE;
+    else if ((acceptors_stop_fd = eventfd(0, EFD_CLOEXEC)) == -1 || (drain_fd = eventfd(0, EFD_CLOEXEC)) == -1)
     {
-        communication_info* ci = (communication_info*)malloc(sizeof(communication_info));
-        if (ci == NULL)
+        perror("error: eventfd\n");
+        status = EXIT_FAILURE;
+    }
+    else if (lifecycle_start(config.upgrade_socket, listeners, listener_count, metrics_server_socket(),
+                             (unsigned long long)config.drain_timeout * 1000, start_drain) == -1)
+        status = EXIT_FAILURE;
+
+    // The old proxy drains once told its sockets are served here, and keeps serving otherwise
+    lifecycle_confirm(status == EXIT_SUCCESS);
+
+    if (status == EXIT_FAILURE)
+        ; // Nothing runs
+    else if (config.engine == ENGINE_EPOLL)
+    {
+        // Each of the pool-size threads runs an event loop serving many connections
+        if (run_event_loops(listeners, listener_count, (int)pool_size, max_tasks) == -1)
+            status = EXIT_FAILURE;
+    }
+    else
+    {
+        // Each acceptor feeds its own group of pool threads, waiting for connections with poll()
+        max_connections = max_tasks;
+        acceptors = calloc(listener_count, sizeof(acceptor));
+        if (acceptors == NULL)
         {
             fprintf(stderr, "Memory allocation failed\n");
-            break; // Exit loop on memory allocation failure
+            status = EXIT_FAILURE;
         }
 
-        init_communication_info(ci); // Initialize the communication info structure
+        // The pool threads inherit the unit the main thread is pinned to while it creates them
+        for (int i = 0; acceptors != NULL && i < listener_count; i++)
+        {
+            if (fcntl(listeners[i], F_SETFL, fcntl(listeners[i], F_GETFL) | O_NONBLOCK) == -1)
+            {
+                perror("error: fcntl\n");
+                status = EXIT_FAILURE;
+                break;
+            }
 
-        // Accept a connection
-        ci->client_socket = accept(ws, NULL, NULL);
-        if (ci->client_socket < 0)
+            acceptors[i].ws = listeners[i];
+            affinity_pin(i);
+            acceptors[i].tp = create_threadpool((int)pool_size / listener_count + (i < (int)pool_size % listener_count));
+            if (acceptors[i].tp == NULL)
+            {
+                status = EXIT_FAILURE;
+                break;
+            }
+            acceptor_count = i + 1;
+            threadpool_set_admission(acceptors[i].tp, config.queue_limit,
+                                     config.queue_delay_target > 0 ? shed_connection : NULL,
+                                     (unsigned long long)config.queue_delay_target * 1000,
+                                     (unsigned long long)config.queue_delay_interval * 1000);
+            metrics_watch_pool(acceptors[i].tp); // Its queue counts towards the reported depth
+        }
+        affinity_unpin();
+
+        // Blocked pool threads are freed by the deadlines of their requests
+        if (status == EXIT_SUCCESS && start_deadline_thread() == -1)
+            status = EXIT_FAILURE;
+
+        // Start the acceptors, stopping the ones already running if one cannot start
+        // Each acceptor runs on the unit of its pool
+        int started = 0;
+        for (; status == EXIT_SUCCESS && started < acceptor_count; started++)
         {
-            perror("error: accept\n");
-            free(ci); // Ensure allocated memory is freed on failure
-            break; // Exit loop on accept failure
+            affinity_pin(started);
+            if (pthread_create(&acceptors[started].thread, NULL, acceptor_function, &acceptors[started]) != 0)
+            {
+                fprintf(stderr, "Failed to create acceptor thread\n");
+                atomic_store(&accepted_connections, max_tasks);
+                stop_acceptors();
+                status = EXIT_FAILURE;
+                break;
+            }
         }
+        affinity_unpin();
 
-        ci->filter_content = strdup(filter_content);
-        dispatch(tp, thread_function, (void*)ci); // Dispatch the connection to a thread in the pool
-    }
+        for (int i = 0; i < started; i++)
+            pthread_join(acceptors[i].thread, NULL);
 
-    close(ws); // Close the server socket
-    destroy_threadpool(tp); // Clean up the thread pool
-    free(filter_content);
+        for (int i = 0; i < acceptor_count; i++)
+        {
+            metrics_unwatch_pool(acceptors[i].tp);
+            destroy_threadpool(acceptors[i].tp); // Let every pool drain its connections
+        }
+        free(acceptors);
+        stop_deadline_thread();
+    }
 
-    exit(EXIT_SUCCESS);
+    lifecycle_stop(); // Nothing is handed over anymore, the upgrade socket goes unless a new proxy serves it
+    for (int i = 0; i < opened; i++)
+        close(listeners[i]); // Close the server sockets
+    if (acceptors_stop_fd != -1)
+        close(acceptors_stop_fd);
+    if (drain_fd != -1)
+        close(drain_fd);
+    access_log_stop(); // Write the records left in the rings, every connection is closed
+    responses_stop_clock(); // No response is sent anymore
+    metrics_stop_server(); // Stop answering scrapes, no thread records metrics anymore
+
+    cache_shutdown(); // Unmap the response cache, every connection is closed
+    upstream_shutdown(); // Close the idle origin connections
+    admission_shutdown(); // Forget the clients, every connection is closed
+    resolver_shutdown(); // Wait for DNS queries in flight and free the cache
+    filter_stop_reloader(); // Stop watching the filter file
+    filter_publish(NULL); // Release the current snapshot
+    metrics_shutdown(); // Free the metrics of every thread
+
+    exit(status);
 }
\ No newline at end of file
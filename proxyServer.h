@@ -10,144 +10,323 @@
 #include <unistd.h>
 #include <errno.h>
 #include <limits.h>
+#include <strings.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "threadpool.h"
+#include "filter.h"
+#include "resolver.h"
+#include "http.h"
+#include "upstream.h"
+#include "config.h"
+#include "relay.h"
+#include "arena.h"
+#include "cache.h"
+#include "timerwheel.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "responses.h"
+#include "affinity.h"
+#include "admission.h"
+#include "lifecycle.h"
+#include "compress.h"
 
 #define BUFFER_SIZE 4096
 
+// answer to a CONNECT request once the tunnel to the origin is open
+#define TUNNEL_ESTABLISHED "HTTP/1.1 200 Connection Established\r\n\r\n"
+
+// room for a response head sent to a client, rewritten and possibly announcing a compressed body
+#define RESPONSE_HEAD_SIZE (HTTP_MAX_HEADER_SIZE + COMPRESS_HEAD_EXTRA + 32)
+
+// hosts of a log matched together by the --check mode
+#define CHECK_BATCH_SIZE 4096
+
+// interim answer telling a client that sent "Expect: 100-continue" to send its body
+#define CONTINUE_RESPONSE "HTTP/1.1 100 Continue\r\n\r\n"
+
 // Enumeration for error types
 typedef enum {
     ERROR_400_BAD_REQUEST = 400,
     ERROR_404_NOT_FOUND = 404,
     ERROR_501_NOT_IMPLEMENTED = 501,
     ERROR_403_FORBIDDEN = 403,
-    ERROR_500_INTERNAL = 500
+    ERROR_500_INTERNAL = 500,
+    ERROR_503_SERVICE_UNAVAILABLE = 503,
+    ERROR_504_GATEWAY_TIMEOUT = 504
 } ErrorType;
 
+// the phases of a request the threaded engine bounds with a deadline
+typedef enum {
+    PHASE_CONNECT,      // connecting to the origin
+    PHASE_FIRST_BYTE,   // waiting for the origin to start its response
+    PHASE_TRANSFER      // streaming the request body or the response, bounded between bytes
+} request_phase;
+
 typedef struct{
     char* host_name;
     char* clean_host_name;
     char* request;
+    filter_set* filter;
     int client_socket;
     int host_port;
+    resolver_answer host_addresses;
+    resolver_address host_address;
+    char* pending;
+    size_t pending_length;
+    size_t pending_capacity;
+    http_request parsed;
+    http_edit_list edits;
+    arena* arena;
+    char* cache_key;
+    size_t cache_key_length;
+    cache_object* cached;
+    cache_object* cache_store;
+    cache_flight* flight;
+    int flight_leader;
+    int tunnel;
+    http_body_mode body_mode;
+    unsigned long long body_length;
+    wheel_timer deadline;
+    int deadline_sd;
+    request_phase phase;
+    unsigned long long phase_started;
+    unsigned long long request_started;
+    atomic_ullong progress;
+    unsigned long long exchange_clock;
+    int timed_out;
+    int responded;
+    struct sockaddr_in6 client_address;
+    int status;
+    unsigned long long response_bytes;
+    unsigned long long arrived;
+    int admitted;
+    compressor* compressor;
 } communication_info;
 
 
+/**
+ * An acceptor of the threaded engine: a listening socket, the thread accepting on it and
+ * the thread pool it dispatches its connections to
+ */
+typedef struct {
+    pthread_t thread;    // the accepting thread
+    int ws;              // the listening socket
+    threadpool* tp;      // the workers serving the connections of this acceptor
+} acceptor;
+
+
 
 /**
- * Forwards data read from a server socket to a client socket. This function reads chunks of data from
- * the server socket and immediately writes those chunks to the client socket. It continues this process
- * until there is no more data to read from the server socket, indicating the end of the response. This
- * function is typically used in proxy or forwarding scenarios where data needs to be relayed between a
- * client and a server transparently.
+ * Forwards a response read from a server socket to a client socket. This function reads chunks of data
+ * from the server socket and immediately writes those chunks to the client socket. The response is
+ * framed as it goes by (Content-Length, chunked encoding, or end of stream), so forwarding stops as
+ * soon as the response is complete and the origin connection can be reused for another request.
+ * The response head is rewritten to tell the client whether its connection stays open.
+ * The first byte timeout of the request bounds the wait for the response, and once its first
+ * bytes arrived, the origin idle timeout bounds the wait between bytes.
+ *
+ * A cacheable response is stored while it is relayed. A 304 answering a revalidation of the
+ * stored response refreshes it, and the stored response is sent to the client instead.
  *
  * @param server_socket: The socket descriptor for the connection to the destination server.
- * @param client_socket: The socket descriptor for the connection to the client.
+ * @param ci: The communication_info of the request, holding the client socket and its cache state.
+ * @param client_keep_alive: In: 1 if the client connection should stay open after the response.
+ *                           Out: cleared if the response can only be delimited by closing it.
  * @return
- *   - 1 on successful completion of data forwarding.
- *   - -1 if an error occurs during reading from the server or writing to the client.
+ *   - 1 if the response was forwarded and the origin connection can be reused.
+ *   - 0 if the response was forwarded but the origin connection must be closed.
+ *   - -1 if an error occurs during reading from the server or writing to the client, or the
+ *     origin closed the connection in the middle of a body of known length.
+ *   - -2 if the origin closed the connection before sending anything.
  */
-int get_response_from_destination(int server_socket, int client_socket);
+int get_response_from_destination(int server_socket, communication_info* ci, int* client_keep_alive);
+
+/**
+ * Builds the head of a response for the client from the origin's head. The body is compressed
+ * when the client takes gzip over HTTP/1.1 and the response is a 200 of a compressible type, of
+ * at least --compress-min-size bytes or delimited by the origin closing: the head then announces
+ * a chunked gzip body, and ci->compressor is set to compress it.
+ *
+ * @param ci: The communication_info of the request.
+ * @param framer: The framer of the response, its header block read.
+ * @param keep_alive: 1 to announce "Connection: keep-alive", 0 for "Connection: close".
+ * @param out: Receives the head, RESPONSE_HEAD_SIZE bytes.
+ * @return The length of the head.
+ */
+size_t build_response_head(communication_info* ci, const http_response_framer* framer, int keep_alive, char* out);
+
+/**
+ * Sends a stored response to a blocking client socket, the body straight from the cache file.
+ *
+ * @param sd: The client socket.
+ * @param object: The stored response.
+ * @param keep_alive: 1 if the client connection stays open after the response.
+ * @return
+ *   - 1 if the response was sent.
+ *   - -1 on error.
+ */
+int send_cached_response(int sd, const cache_object* object, int keep_alive);
 
 /**
  * Configures and initializes the server socket for listening to incoming connections.
- * This function creates a TCP socket using the IPv4 protocol, binds it to the specified
- * address and port in the provided sockaddr_in structure, and sets it to listen for
- * incoming connections with a specified backlog queue.
+ * This function creates a dual-stack TCP socket that accepts both IPv6 and IPv4 clients,
+ * falling back to an IPv4 socket on systems without IPv6, binds it to the specified port
+ * on every address of the server, and sets it to listen for
+ * incoming connections with the configured backlog queue. With reuse_port, several
+ * sockets can be bound to the same port and the kernel balances new connections
+ * across them. TCP_DEFER_ACCEPT is enabled when configured. The socket is tuned with
+ * tune_socket() before it listens, so the buffer sizes apply to the window every
+ * accepted connection starts with.
  *
- * @param server_info: A struct sockaddr_in that contains the IP address and port number
- *                     on which the server should listen for incoming connections.
+ * @param port: The port on which the server should listen for incoming connections.
+ * @param reuse_port: 1 to set SO_REUSEPORT before binding.
  * @return
- *   - The socket descriptor (a positive integer) of the successfully configured and
- *     listening socket, ready to accept incoming connections.
- *   - 0 if an error occurs during socket creation, binding, or setting it to listen.
+ *   - The socket descriptor of the successfully configured and listening socket, ready
+ *     to accept incoming connections.
+ *   - -1 if an error occurs during socket creation, binding, or setting it to listen.
  */
-int set_my_server_configuration(struct sockaddr_in server_info);
+int set_my_server_configuration(in_port_t port, int reuse_port);
 
 /**
- * Establishes a TCP connection to a specified host and port, preparing a socket for communication.
- * This function attempts to resolve the hostname to an IP address and then creates a socket that
- * connects to the given port at the resolved IP address. It is used to connect to a destination
- * server in a client-server architecture, enabling the client to communicate with the server
- * over the established connection.
+ * Establishes a TCP connection to the destination server of a request, preparing a socket for communication.
+ * The addresses are the ones resolved while the request was validated, so the host is not resolved a
+ * second time. Connections to them are raced the happy eyeballs way (RFC 8305): the next address
+ * is tried whenever an attempt fails or the connect attempt delay passes without an answer, and the
+ * first connection established wins while the others are dropped. The whole race runs under the
+ * connect deadline of the request, which keeps running on the returned socket until the caller
+ * moves the request to its next phase or clears it.
  *
- * @param host: The hostname or IP address of the destination server.
- * @param port: The port number on the destination server to connect to.
+ * @param ci: The communication_info of the request, with host_addresses and host_port set.
  * @return
- *   - The socket descriptor for the established connection, if successful.
+ *   - The blocking socket descriptor for the established connection, if successful. The
+ *     address it connected to is stored in host_address.
  *   - -1 to indicate a failure in any step of the connection setup, including socket creation,
- *     hostname resolution, or the connection attempt itself.
+ *     every address refusing the connection, or the connect timeout. The deadline is cleared then.
  */
-int set_destination_server_connection(const char* host, int port);
+int set_destination_server_connection(communication_info* ci);
 
 /**
- * Validates the HTTP version in a request string to ensure it is either HTTP/1.0 or HTTP/1.1.
- * This function searches the given string for the "HTTP/" prefix and checks the version
- * number immediately following this prefix. It is designed to ensure that requests adhere to
- * expected HTTP standards, specifically targeting versions 1.0 and 1.1, which are the most
- * commonly supported versions in HTTP-based applications.
+ * Opens a non-blocking, tuned socket for one address of an origin and starts connecting it.
  *
- * @param str: A string containing the HTTP request line to be checked.
+ * @param address: The address of the origin.
+ * @param port: The port of the origin.
+ * @param connected: Set to 1 if the connection was established right away, 0 if it is in progress.
+ * @return
+ *   - The socket descriptor, reporting the outcome of the attempt as writability.
+ *   - -1 if the socket cannot be created or the attempt failed right away, as an address
+ *     of a family the system has no route for does.
+ */
+int start_connect_attempt(const resolver_address* address, int port, int* connected);
+
+/**
+ * Takes an idle pooled connection to the origin of a request, trying its addresses in order.
+ *
+ * @param ci: The communication_info of the request, with host_addresses and host_port set.
+ * @return
+ *   - The socket descriptor of the pooled connection. The address it is connected to is
+ *     stored in host_address.
+ *   - -1 if the pool has no connection to any of the addresses.
+ */
+int acquire_pooled_connection(communication_info* ci);
+
+/**
+ * Applies the configured TCP tuning to a client or origin socket: TCP_NODELAY, the SO_SNDBUF
+ * and SO_RCVBUF sizes, and the TCP_NOTSENT_LOWAT watermark under which the socket reports
+ * itself writable. Settings left at 0 keep the kernel's choice. A setting the kernel refuses
+ * is reported and skipped, the socket stays usable.
+ *
+ * @param sd: The socket, before it connects or listens for the buffer sizes to size its window.
+ */
+void tune_socket(int sd);
+
+/**
+ * Validates the HTTP version of a request to ensure it is either HTTP/1.0 or HTTP/1.1.
+ * This function checks the version word of the indexed request line. It is designed to
+ * ensure that requests adhere to expected HTTP standards, specifically targeting versions
+ * 1.0 and 1.1, which are the most commonly supported versions in HTTP-based applications.
+ *
+ * @param ci: A pointer to a communication_info structure holding the parsed request.
  * @return
  *   - 1 if the HTTP version is either 1.0 or 1.1.
- *   - 0 if the HTTP version is not 1.0 or 1.1, or if the "HTTP/" prefix is not found.
+ *   - 0 if the HTTP version is anything else.
+ */
+int is_legal_http_version(const communication_info* ci);
+
+/**
+ * Validates the format of an HTTP request. This function checks that the parser found a request line
+ * made of three parts: an HTTP method, a path, and an HTTP version, separated by spaces, and header
+ * lines of the form "Name: value", each ending with "\r\n". The validation ensures that the request
+ * starts with a valid request line, which is crucial for further processing of the request.
+ *
+ * @param ci: A pointer to a communication_info structure holding the parsed request.
+ * @return
+ *   - 1 (true) if the request is in the correct format, indicating a method, path, and version.
+ *   - 0 (false) if a line does not conform to the expected format, indicating a malformed request.
  */
-int is_legal_http_version(const char* str);
+int is_legal_request_format(const communication_info* ci);
 
 /**
- * Validates the format of the first line of an HTTP request string. This function checks if the request line
- * conforms to the expected format by containing three parts: an HTTP method, a path, and an HTTP version,
- * separated by spaces. The validation ensures that the request starts with a valid request line,
- * which is crucial for further processing of the request.
+ * Extracts the hostname from an HTTP request. This function looks up the "Host" header in the
+ * header index of the parsed request and copies its value, without surrounding whitespace.
+ * This is useful in HTTP request parsing to identify the target host for the request.
  *
- * @param str: The HTTP request string to be validated.
+ * @param ci: A pointer to a communication_info structure holding the parsed request.
  * @return
- *   - 1 (true) if the first line of the request is in the correct format, indicating a method, path, and version.
- *   - 0 (false) if the first line does not conform to the expected format or if no end-of-line marker is found,
- *     indicating a malformed request.
+ *   - A string containing the hostname extracted from the HTTP request, allocated from the arena
+ *     of the request and freed with it.
+ *   - NULL if the request is NULL, the "Host" header is not found or empty, or memory allocation fails.
  */
-int is_legal_request_format(const char* str);
+char* get_host_name(const communication_info* ci);
 
 /**
- * Extracts the hostname from an HTTP request string. This function searches the request string
- * for the "Host: " header and extracts the hostname specified immediately after this header,
- * stopping at the first occurrence of a carriage return and newline sequence ("\r\n") that
- * denotes the end of the host line. This is useful in HTTP request parsing to identify the
- * target host for the request.
+ * Decides whether a client connection stays open after an error response. Only refusals of a
+ * complete request without a body, the filter's 403 and the 404 of a host that does not
+ * resolve, leave the connection in a state where the next request can be read, and only
+ * with --error-keep-alive.
  *
- * @param str: A string containing the full HTTP request.
+ * @param ci: The communication_info of the request.
+ * @param error: The error the request is answered with.
+ * @param keep_alive: 1 if the connection would stay open after a successful response.
  * @return
- *   - A dynamically allocated string containing the hostname extracted from the HTTP request.
- *     The caller is responsible for freeing this memory.
- *   - NULL if the request is NULL, the "Host: " header is not found, or the hostname cannot be extracted.
+ *   - 1 if the connection stays open.
+ *   - 0 if it is closed once the error is sent.
  */
-char* get_host_name(const char* str);
+int error_keeps_alive(const communication_info* ci, ErrorType error, int keep_alive);
 
 /**
- * Constructs and sends an HTTP error response based on a specified error type. The function
- * builds a complete HTTP response, including the appropriate status line, headers, and a
- * body that describes the error. It formats the response with the current date, the server
- * identifier, and sets the connection to close after sending the message. The content length
- * is calculated dynamically based on the error description to ensure the HTTP header correctly
- * reflects the response size.
+ * Sends an HTTP error response based on a specified error type. The responses are built once,
+ * with the status line, the server identifier, a page describing the error and its content
+ * length, and the current date is kept by a clock thread, so nothing is formatted here: the
+ * response goes out in a single writev() of the prebuilt bytes and the date.
  *
  * @param error: An ErrorType enumeration value that specifies the type of error to respond with.
  * @param sd: The socket descriptor to which the error message is sent.
+ * @param keep_alive: 1 to tell the client the connection stays open, 0 to tell it it closes.
+ * @return The number of bytes written, 0 if the error type is unknown or nothing could be sent.
  */
-void send_error_message(ErrorType error, int sd);
+size_t send_error_message(ErrorType error, int sd, int keep_alive);
 
 /**
  * Extracts the hostname from a given string, omitting any "www." prefix and port numbers.
  * This function aims to standardize hostnames by removing common prefixes and stripping
- * port information if present. The cleaned hostname can then be used for consistent
+ * port information if present. An IPv6 literal such as "[::1]:8080" loses its brackets. The cleaned hostname can then be used for consistent
  * processing or comparison against other hostnames within networking applications.
  *
+ * @param a: The arena the cleaned hostname is allocated from.
  * @param host: A string containing the original hostname, possibly with "www." prefix and/or port number.
  * @return
- *   - A dynamically allocated string containing the cleaned hostname without the "www." prefix and port.
- *     The caller is responsible for freeing this memory.
+ *   - A string containing the cleaned hostname without the "www." prefix and port, freed with the arena.
  *   - NULL if memory allocation fails.
  */
-char* get_clean_host(const char* host);
+char* get_clean_host(arena* a, const char* host);
 
 /**
  * Extracts the port number from a given string that contains a hostname or IP address followed
@@ -155,7 +334,7 @@ char* get_clean_host(const char* host);
  * of 80 is returned, assuming HTTP traffic. The function validates the extracted port number
  * to ensure it falls within the valid range for TCP/UDP ports (0 to 65535). If the port number
  * is invalid, not specified, or the input string is NULL, appropriate default or error values
- * are returned.
+ * are returned. The port of an IPv6 literal follows its closing bracket, as in "[::1]:8080".
  *
  * @param str: A string containing the hostname or IP address, optionally followed by a colon and the port number.
  * @return
@@ -166,118 +345,194 @@ char* get_clean_host(const char* host);
 int get_port(const char* str);
 
 /**
- * Checks if a given host is filtered based on a list stored in a file. The function first resolves
- * the host to its IP address, then converts this IP to its binary representation. It reads each line
- * of the specified file, treating lines that start with a digit as IP addresses (with optional subnet masks)
- * and compares these against the host's IP. Lines not starting with a digit are treated as hostnames and
- * directly compared to the given host. The host is considered filtered if a match is found in the file,
- * either by IP (considering subnet masks) or hostname.
+ * Checks if a given host is filtered by the compiled filter. The hostname is first looked up
+ * among the hostname rules. If it is not listed, the host is resolved once through the shared
+ * resolver and its addresses are matched against the CIDR rules. The resolved addresses are
+ * handed back so the caller can connect to them without resolving again.
  *
- * @param file_content: The content of the filter file.
+ * @param filter: The compiled filter shared by all worker threads.
  * @param host: The hostname to check against the filter list.
+ * @param answer: Receives the resolved addresses, if the host was resolved.
  * @return
  *   - 1 if the host is found in the filter list and is considered filtered.
  *   - 0 if the host is not found in the filter list.
- *   - -1 if there's an error resolving the host's IP or converting it to binary.
+ *   - -1 if there's an error resolving the host's IP.
  */
-int is_filtered_host(const char* file_content, const char* host);
+int is_filtered_host(const filter_set* filter, const char* host, resolver_answer* answer);
 
 /**
- * Retrieves the IP address for a given hostname and appends a "/32" subnet mask to it,
- * indicating a single host. This function first cleans the hostname by removing any
- * leading "www." prefix. It then uses the gethostbyname() system call to resolve the
- * hostname to an IP address. The resolved IP address is converted to a string and
- * concatenated with "/32" to denote a full, single-host mask.
+ * Checks the resolved addresses of a host against the CIDR rules of the compiled filter. The
+ * host is filtered if any of its addresses is, since failing over may reach any of them.
  *
- * @param host: A string containing the hostname to be resolved.
+ * @param filter: The compiled filter shared by all worker threads.
+ * @param answer: The resolved addresses of the host.
  * @return
- *   - A dynamically allocated string containing the IP address of the host with a "/32" mask.
- *     The caller is responsible for freeing this memory.
- *   - NULL if the hostname cannot be cleaned, resolved, or if memory allocation fails.
+ *   - 1 if one of the addresses is filtered.
+ *   - 0 otherwise.
  */
-char* get_host_IP(const char* host);
+int is_filtered_address(const filter_set* filter, const resolver_answer* answer);
 
 /**
- * Converts an IP address with a subnet mask (in CIDR notation) to its binary representation,
- * limited to the number of bits specified by the mask. This function parses the input string
- * to extract the IP address and mask, then uses network utilities to convert the IP to binary
- * format. The binary representation is truncated or padded to match the mask size, providing
- * a string that represents the binary form of the IP address up to the specified subnet mask.
+ * Retrieves the IPv6 and IPv4 addresses of a given hostname. This function first cleans the
+ * hostname by removing any leading "www." prefix, port and IPv6 literal brackets. It then resolves
+ * it through the shared resolver, which is thread-safe and caches answers across requests.
  *
- * @param ip_with_mask: A string containing the IP address and mask in CIDR notation (e.g., "192.168.1.1/24").
+ * @param host: A string containing the hostname to be resolved.
+ * @param answer: Receives the resolved addresses.
  * @return
- *   - A dynamically allocated string containing the binary representation of the IP address up to the mask.
- *     The caller is responsible for freeing this memory.
- *   - NULL if there's an error in conversion or memory allocation.
+ *   - 1 on success.
+ *   - -1 if the hostname cannot be cleaned or resolved.
  */
-char* ip_to_binary(const char* ip_with_mask);
+int get_host_IP(const char* host, resolver_answer* answer);
 
 /**
- * Compares two binary IP addresses up to a specified number of bits (mask size) to determine
- * if they are equivalent in the specified subnet mask. This is useful for operations such
- * as subnet filtering or matching IP addresses within the same subnet.
+ * Checks the parts of the HTTP request that need neither the filter nor the network: the
+ * presence of a host line, the HTTP version (1.0 or 1.1), the format of the request line
+ * and the method, GET, POST, PUT, PATCH or CONNECT. The host name is extracted into the
+ * communication_info on the way; a CONNECT request names it in its "host:port" target instead
+ * of a host line, and sets ci->tunnel. How the request body is delimited is recorded in
+ * ci->body_mode and ci->body_length: a valid Content-Length or "Transfer-Encoding: chunked",
+ * never both. Nothing is sent to the client.
  *
- * @param binary_ip1: A string representing the first binary IP address to compare.
- * @param binary_ip2: A string representing the second binary IP address to compare.
- * @param mask_size: An integer specifying the number of bits to compare in the binary IP addresses.
+ * @param ci: A pointer to a communication_info structure containing the HTTP request.
  * @return
- *   - 1 if the specified bits of the IP addresses are the same, indicating they are within the same subnet.
- *   - 0 if the specified bits of the IP addresses differ, indicating they are in different subnets.
+ *   - 0 if the request passes these checks.
+ *   - The ErrorType to answer with otherwise.
  */
-int compare_binary_ips(const char* binary_ip1, const char* binary_ip2, int mask_size);
+int check_request(communication_info* ci);
 
 /**
  * Validates the HTTP request stored within the communication_info structure.
  * It checks for the presence of a host line, the HTTP version (1.0 or 1.1), and the
  * correct format of the request line (method, path, and version). It also validates
- * that the request uses the GET method. Additionally, this function checks whether
+ * that the request uses the GET, POST, PUT, PATCH or CONNECT method, and that its body is
+ * delimited in a way the proxy understands. Additionally, this function checks whether
  * the requested host is filtered or blocked based on a predefined list.
  *
  * If any of these validations fail, an appropriate error message is sent to the client,
- * and the function returns 0 or -2 for specific failure cases.
+ * and the function returns 0.
  *
  * @param ci: A pointer to a communication_info structure containing the HTTP request
  *            and other relevant connection information.
+ * @param keep_alive: In: 1 if the client connection would stay open after a response. Out: set
+ *                    to whether it stays open after the error response, if one was sent.
  * @return
  *   - 1 if the request passes all checks and is considered legal.
  *   - 0 if any of the basic checks fail, or if the host is filtered or not found.
- *   - -2 if there is a problem with opening the filter file.
  */
-int is_legal_request(communication_info* ci);
+int is_legal_request(communication_info* ci, int* keep_alive);
+
+/**
+ * Looks a validated request up in the response cache. Only GET requests without credentials,
+ * ranges or conditionals of their own are cached, keyed by host and target. A fresh stored
+ * response is kept in ci->cached to be served. A stale one with a validator is kept too, and
+ * If-None-Match or If-Modified-Since is added to the request to revalidate it with the origin.
+ * Requests going to the origin join the flight of their key in ci->flight: the first one
+ * leads it and fetches the response, identical requests arriving meanwhile follow it.
+ *
+ * @param ci: The communication_info of the request, with its host name set.
+ * @return
+ *   - 1 if ci->cached can be served without contacting the origin.
+ *   - 2 if the request follows ci->flight, led by an identical request.
+ *   - 0 if the request goes to the origin, ci->cache_key is set if its response may be stored.
+ */
+int check_cache(communication_info* ci);
+
+/**
+ * Tells whether a response head is the 304 answering the revalidation of ci->cached. If it
+ * is, the stored response is refreshed and a led flight ends with it.
+ *
+ * @param ci: The communication_info of the request.
+ * @param framer: The framer of the response, past its header block.
+ * @return
+ *   - 1 if ci->cached is to be served instead of the response.
+ *   - 0 otherwise.
+ */
+int is_revalidated(communication_info* ci, const http_response_framer* framer);
+
+/**
+ * Starts storing a response whose header block arrived, if it may be stored, and tells the
+ * followers of a led flight whether there is a response to stream.
+ *
+ * @param ci: The communication_info of the request.
+ * @param framer: The framer of the response, past its header block.
+ */
+void cache_response_head(communication_info* ci, const http_response_framer* framer);
+
+/**
+ * Stores body bytes of a response as they are relayed, if it is being stored.
+ *
+ * @param ci: The communication_info of the request.
+ * @param data: The body bytes.
+ * @param length: The number of bytes.
+ */
+void cache_response_body(communication_info* ci, const void* data, size_t length);
 
 /**
  * Reads data from a client socket until the end of the HTTP headers is detected (indicated by "\r\n\r\n").
  * This function is designed to handle variable length reads by dynamically resizing the buffer as needed.
- * It also sets a read timeout to prevent indefinitely blocking on the socket read operation. If the read
- * operation times out or encounters an error, or if memory allocation fails, the function returns NULL.
+ * The request is parsed as it arrives, each read only scanning the new bytes, and its index is left in
+ * the parsed field of the communication_info.
+ * Bytes received past the end of the headers belong to the next pipelined request; they are kept in the
+ * communication_info and consumed by the next call. It also sets a read timeout, the client idle timeout,
+ * to prevent indefinitely blocking on the socket read operation. If the read operation times out or
+ * encounters an error, if the client closes the connection, or if memory allocation fails, the function
+ * returns NULL. The buffer is allocated from a fresh arena, stored in the communication_info, which every later
+ * allocation of the request uses too.
+ *
+ * @param ci: The communication_info of the client connection.
+ * @return
+ *   - A string containing the data read from the socket up to the end of the HTTP headers, freed with
+ *     the arena of the request.
+ *   - NULL if a read error occurs, memory allocation fails, the client closed the connection, or the read
+ *     operation times out.
+ */
+char* read_from_client_socket(communication_info* ci);
+
+/**
+ * Finds the value of a request header in the header index. Header names are matched
+ * case-insensitively, and the surrounding whitespace of the value is left out.
  *
- * @param sd: The socket descriptor from which to read data.
+ * @param ci: A pointer to a communication_info structure holding the parsed request.
+ * @param name: The header name, without the colon.
+ * @param length: Receives the length of the value.
  * @return
- *   - A dynamically allocated string containing the data read from the socket up to the end of the HTTP headers.
- *     The caller is responsible for freeing this memory.
- *   - NULL if a read error occurs, memory allocation fails, or the read operation times out.
+ *   - A pointer to the start of the value inside the request.
+ *   - NULL if the header is not present.
  */
-char* read_from_client_socket(int sd);
+const char* get_header_value(const communication_info* ci, const char* name, size_t* length);
 
+/**
+ * Decides whether the client wants its connection kept open after the request is answered.
+ * HTTP/1.1 connections are persistent unless "Connection: close" is sent, HTTP/1.0 ones only
+ * with "Connection: keep-alive". "Proxy-Connection" is honored when "Connection" is absent.
+ *
+ * @param ci: A pointer to a communication_info structure holding the parsed request.
+ * @return
+ *   - 1 if the client connection should stay open.
+ *   - 0 otherwise.
+ */
+int is_client_keep_alive(const communication_info* ci);
 
 /**
- * Reads the entire content of a file specified by its file path and returns it as a single string.
- * Each line in the returned string is guaranteed to end with "\r\n", even if the original file does not
- * use this line ending convention. This is particularly useful for processing files in environments
- * that expect Windows-style line endings.
+ * Tells whether the client waits for a "100 Continue" answer before it sends the body of its
+ * request, i.e. an HTTP/1.1 request with a body and "Expect: 100-continue".
  *
- * @param file_path A string representing the path to the file to be read.
- * @return A pointer to a dynamically allocated string containing the file's content, with each
- *         line ending in "\r\n". The caller is responsible for freeing this memory. Returns NULL
- *         if the file cannot be opened or if a memory allocation fails.
+ * @param ci: A pointer to a communication_info structure holding the checked request.
+ * @return
+ *   - 1 if the client has to be told to continue.
+ *   - 0 otherwise.
  */
-char* read_file_content(const char* file_path);
+int expects_continue(const communication_info* ci);
+
 
 /**
- * Handles a single client request in a threaded server environment. This function performs multiple steps:
- * reading the request from the client socket, ensuring the "Connection: close" header is set, validating the
- * request, resolving the host, connecting to the destination server, forwarding the request, receiving the
- * response, and sending the response back to the client. It encapsulates the entire lifecycle of a proxy
+ * Handles a client connection in a threaded server environment. Sequential and pipelined requests are
+ * served on the same connection until the client asks to close it, the client idle timeout expires, the
+ * per-connection request limit is reached, or an error occurs. For each request this function performs
+ * multiple steps: reading the request from the client socket, asking the origin to keep its connection alive, validating the
+ * request, resolving the host, taking a pooled connection to the destination server or opening one, forwarding
+ * the request, receiving the response, and sending the response back to the client. It encapsulates the entire lifecycle of a proxy
  * server's handling of a client request, including error handling and resource cleanup.
  *
  * @param arg: A void pointer to a communication_info structure containing all necessary information
@@ -319,16 +574,27 @@ size_t write_to_socket_unsigned(int sd, unsigned char* request, size_t data_leng
 
 /**
  * Cleans up and deallocates resources associated with a communication_info structure.
- * This includes freeing any dynamically allocated memory for the host name, cleaned host name,
- * and the HTTP request. Additionally, if a client socket is open (indicated by a descriptor
+ * This includes releasing the arena holding the host name, cleaned host name, and the HTTP request,
+ * freeing the buffer of pipelined bytes, and releasing the reference held on the compiled filter. Additionally, if a client socket is open (indicated by a descriptor
  * not equal to -1), it is closed. This function ensures that all resources acquired during
  * the lifetime of the communication_info instance are properly released to avoid memory leaks
- * and to cleanly close any network connections.
+ * and to cleanly close any network connections. A request still in progress is written
+ * to the access log first.
  *
  * @param ci: A pointer to a communication_info structure whose resources are to be released.
  */
 void destroy_communication_info(communication_info* ci);
 
+/**
+ * Frees the per-request data of a communication_info structure (host names, request and anything
+ * else allocated from its arena) in one step, by releasing the arena, so the client connection
+ * can serve another request. The socket, the filter reference and any bytes of
+ * a pipelined request are kept. The request is written to the access log first.
+ *
+ * @param ci: A pointer to a communication_info structure.
+ */
+void reset_request_info(communication_info* ci);
+
 /**
  * Initializes a communication_info structure by setting its fields to default values.
  * This includes setting string pointers to NULL, the client socket to -1 indicating
@@ -339,15 +605,34 @@ void destroy_communication_info(communication_info* ci);
 void init_communication_info(communication_info* ci);
 
 /**
- * Modifies the HTTP request stored in a communication_info structure to ensure the
- * "Connection: close" header is present. This is to guarantee that the connection
- * will be closed after the request is completed.
+ * Modifies the HTTP request stored in a communication_info structure so that a header
+ * carries the given value, replacing the value of the client's header if one is present
+ * and adding one otherwise. The request itself is left untouched: the change is recorded
+ * in the edit list of the request and applied by send_request(). The header is found
+ * through the header index, by its whole name, so that e.g. "Connection" leaves a
+ * "Proxy-Connection" header alone. Each header can be set once per request.
  *
  * @param ci: A pointer to a communication_info structure containing the HTTP request.
+ * @param name: The header name, e.g. "Connection".
+ * @param value: The header value to set, e.g. "keep-alive" or "close".
+ * @return
+ *   - 1 if the edit is recorded.
+ *   - -1 if the request is NULL, the edit list is full, or memory allocation fails.
+ */
+int set_request_header(communication_info* ci, const char* name, const char* value);
+
+/**
+ * Sends the request stored in a communication_info structure to a socket with its edits
+ * applied. The bytes of the client's buffer and the replacement strings are written
+ * together with writev(), so the edited request is never built in memory. Partial writes
+ * are resumed until the whole request is sent.
+ *
+ * @param sd: The socket descriptor to which the request is written.
+ * @param ci: A pointer to a communication_info structure containing the HTTP request and its edits.
  * @return
- *   - 1 if the request is successfully modified to include "Connection: close".
- *   - -1 if the request is NULL or if any error occurs during the modification process.
+ *   - 1 if the whole request was written.
+ *   - -1 if an error occurs during the write operation.
  */
-int set_connection_close(communication_info* ci);
+int send_request(int sd, const communication_info* ci);
 
 #endif
\ No newline at end of file
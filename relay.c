@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "relay.h"
+
+
+static pthread_key_t thread_pipe_key;                     // the relay_pipe of each thread
+static pthread_once_t thread_pipe_once = PTHREAD_ONCE_INIT;
+
+
+
+/**
+ * Closes and frees the pipe of an exiting thread.
+ *
+ * @param value: The relay_pipe of the thread.
+ */
+static void destroy_thread_pipe(void* value)
+{
+    relay_pipe_close((relay_pipe*)value);
+    free(value);
+}
+
+/**
+ * Creates the key holding the pipe of each thread.
+ */
+static void create_thread_pipe_key(void)
+{
+    if (pthread_key_create(&thread_pipe_key, destroy_thread_pipe) != 0)
+        fprintf(stderr, "Failed to create the relay pipe key\n");
+}
+
+
+int relay_pipe_open(relay_pipe* pipe)
+{
+    int ends[2];
+
+    if (pipe2(ends, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        perror("error: pipe2\n");
+        pipe->read_end = pipe->write_end = -1;
+        return -1;
+    }
+
+    pipe->next = NULL;
+    pipe->read_end = ends[0];
+    pipe->write_end = ends[1];
+    pipe->buffered = 0;
+
+    int capacity = fcntl(ends[1], F_GETPIPE_SZ);
+    pipe->capacity = capacity > 0 ? (size_t)capacity : 65536;
+
+    return 1;
+}
+
+
+void relay_pipe_close(relay_pipe* pipe)
+{
+    if (pipe->read_end != -1)
+    {
+        close(pipe->read_end);
+        close(pipe->write_end);
+    }
+
+    pipe->read_end = pipe->write_end = -1;
+    pipe->buffered = 0;
+}
+
+
+relay_pipe* relay_thread_pipe(void)
+{
+    pthread_once(&thread_pipe_once, create_thread_pipe_key);
+
+    relay_pipe* pipe = pthread_getspecific(thread_pipe_key);
+    if (pipe == NULL)
+    {
+        pipe = malloc(sizeof(relay_pipe));
+        if (pipe == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            return NULL;
+        }
+        pipe->read_end = pipe->write_end = -1;
+        pthread_setspecific(thread_pipe_key, pipe);
+    }
+
+    // A pipe left dirty by a failed relay was closed, open it again
+    if (pipe->read_end == -1 && relay_pipe_open(pipe) == -1)
+        return NULL;
+
+    return pipe;
+}
+
+
+ssize_t relay_fill(relay_pipe* pipe, int sd, size_t max)
+{
+    size_t space = pipe->capacity - pipe->buffered;
+    if (max > space)
+        max = space;
+
+    ssize_t moved;
+    do {
+        moved = splice(sd, NULL, pipe->write_end, NULL, max, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (moved < 0 && errno == EINTR);
+
+    if (moved > 0)
+        pipe->buffered += moved;
+
+    return moved;
+}
+
+
+int relay_drain(relay_pipe* pipe, int sd)
+{
+    while (pipe->buffered > 0)
+    {
+        ssize_t moved = splice(pipe->read_end, NULL, sd, NULL, pipe->buffered, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        pipe->buffered -= moved;
+    }
+
+    return 1;
+}
+
+
+int relay_stream_open(relay_stream* stream, int from, int to)
+{
+    stream->from = from;
+    stream->to = to;
+    stream->ended = 0;
+    stream->shut = 0;
+    stream->relayed = 0;
+
+    return relay_pipe_open(&stream->pipe);
+}
+
+
+void relay_stream_close(relay_stream* stream)
+{
+    relay_pipe_close(&stream->pipe);
+}
+
+
+int relay_stream_pump(relay_stream* stream)
+{
+    while (!stream->shut)
+    {
+        // Write what the pipe holds first
+        size_t buffered = stream->pipe.buffered;
+        int drained = relay_drain(&stream->pipe, stream->to);
+        stream->relayed += buffered - stream->pipe.buffered;
+        if (drained != 1)
+            return drained;
+
+        if (stream->ended)
+        {
+            // Pass the end of stream on, the destination may still answer the other way
+            if (shutdown(stream->to, SHUT_WR) == -1 && errno != ENOTCONN)
+                return -1;
+            stream->shut = 1;
+            break;
+        }
+
+        // Then read the next run into the empty pipe
+        ssize_t moved = relay_fill(&stream->pipe, stream->from, stream->pipe.capacity);
+        if (moved == 0)
+            stream->ended = 1;
+        else if (moved < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+
+    return 1;
+}
+
+
+int relay_stream_wants_read(const relay_stream* stream)
+{
+    return !stream->ended && stream->pipe.buffered == 0;
+}
+
+
+int relay_stream_wants_write(const relay_stream* stream)
+{
+    return stream->pipe.buffered > 0;
+}
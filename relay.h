@@ -0,0 +1,149 @@
+#ifndef PROXYSERVER_RELAY_H
+#define PROXYSERVER_RELAY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * relay.h
+ *
+ * This file declares the zero-copy relay helpers. Body bytes that need no
+ * inspection are moved from the origin socket into a pipe and from the pipe
+ * into the client socket with splice(), so they never enter user space.
+ * CONNECT tunnels relay both directions the same way, one pipe each.
+ */
+
+// smallest body run worth the extra splice() calls, shorter ones are copied
+#define RELAY_SPLICE_MIN 16384
+
+
+/**
+ * A pipe carrying body bytes between two sockets
+ */
+typedef struct relay_pipe_st {
+    struct relay_pipe_st* next;   // next pipe of a free list
+    int read_end;                 // the end spliced into the client socket, -1 if closed
+    int write_end;                // the end the origin socket is spliced into
+    size_t capacity;              // size of the pipe buffer
+    size_t buffered;              // bytes in the pipe not yet moved to the client
+} relay_pipe;
+
+
+/**
+ * One direction of a tunnel: the bytes one socket sends are spliced through a pipe into the
+ * other socket, and its end of stream is passed on with shutdown()
+ */
+typedef struct {
+    relay_pipe pipe;              // bytes read from the source and not written yet
+    int from;                     // the non-blocking socket read
+    int to;                       // the non-blocking socket written
+    int ended;                    // 1 once the source reached end of stream
+    int shut;                     // 1 once everything was written and the destination was shut down for writing
+    unsigned long long relayed;   // bytes written to the destination so far
+} relay_stream;
+
+
+/**
+ * Opens a non-blocking pipe.
+ *
+ * @param pipe: The pipe to open.
+ * @return
+ *   - 1 on success.
+ *   - -1 if the pipe cannot be created.
+ */
+int relay_pipe_open(relay_pipe* pipe);
+
+/**
+ * Closes a pipe, dropping whatever it still holds.
+ *
+ * @param pipe: The pipe.
+ */
+void relay_pipe_close(relay_pipe* pipe);
+
+/**
+ * Returns the pipe of the calling thread, opening it on first use. It is closed when the
+ * thread exits.
+ *
+ * @return
+ *   - The empty pipe of the thread.
+ *   - NULL if it cannot be created.
+ */
+relay_pipe* relay_thread_pipe(void);
+
+/**
+ * Moves bytes from a socket into the free space of a pipe. The call blocks only if the
+ * socket is blocking and has nothing to read.
+ *
+ * @param pipe: The pipe.
+ * @param sd: The socket to read from.
+ * @param max: The largest number of bytes to move.
+ * @return
+ *   - The number of bytes moved.
+ *   - 0 if the socket reached end of stream.
+ *   - -1 on error, errno is EAGAIN if a non-blocking socket has nothing to read.
+ */
+ssize_t relay_fill(relay_pipe* pipe, int sd, size_t max);
+
+/**
+ * Moves the bytes held by a pipe into a socket. The call blocks until everything was moved
+ * if the socket is blocking.
+ *
+ * @param pipe: The pipe.
+ * @param sd: The socket to write to.
+ * @return
+ *   - 1 if the pipe is empty.
+ *   - 0 if a non-blocking socket is full, the pipe still holds bytes.
+ *   - -1 on error.
+ */
+int relay_drain(relay_pipe* pipe, int sd);
+
+/**
+ * Opens one direction of a tunnel.
+ *
+ * @param stream: The direction to open.
+ * @param from: The socket to read from, non-blocking.
+ * @param to: The socket to write to, non-blocking.
+ * @return
+ *   - 1 on success.
+ *   - -1 if its pipe cannot be created.
+ */
+int relay_stream_open(relay_stream* stream, int from, int to);
+
+/**
+ * Closes the pipe of a tunnel direction. The sockets are left open.
+ *
+ * @param stream: The direction.
+ */
+void relay_stream_close(relay_stream* stream);
+
+/**
+ * Moves bytes of a tunnel direction as far as both sockets allow without blocking. Like a
+ * response body, the source is only read once everything read before was written, so a slow
+ * destination slows the source down. At the end of the source, the destination is shut down
+ * for writing once the pipe is empty, and the other direction can go on.
+ *
+ * @param stream: The direction.
+ * @return
+ *   - 1 once the direction is shut.
+ *   - 0 if a socket would block, relay_stream_wants_read() and relay_stream_wants_write() tell which.
+ *   - -1 on error.
+ */
+int relay_stream_pump(relay_stream* stream);
+
+/**
+ * Tells whether a tunnel direction waits for its source to become readable.
+ *
+ * @param stream: The direction.
+ * @return 1 if it does, 0 otherwise.
+ */
+int relay_stream_wants_read(const relay_stream* stream);
+
+/**
+ * Tells whether a tunnel direction waits for its destination to become writable.
+ *
+ * @param stream: The direction.
+ * @return 1 if it does, 0 otherwise.
+ */
+int relay_stream_wants_write(const relay_stream* stream);
+
+#endif //PROXYSERVER_RELAY_H
@@ -0,0 +1,492 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include "resolver.h"
+#include "config.h"
+
+
+/**
+ * An asynchronous query in flight. It lives until its completion callback ran.
+ */
+typedef struct {
+    struct gaicb request;      // the getaddrinfo_a() control block
+    struct addrinfo hints;     // hints referenced by the control block
+    resolver_entry* entry;     // the pending entry to fill
+    resolver_shard* shard;     // the shard owning the entry
+} resolver_query;
+
+
+static resolver_shard shards[RESOLVER_SHARDS]; // the cache
+
+static pthread_mutex_t queries_lock = PTHREAD_MUTEX_INITIALIZER; // protects queries_in_flight
+static pthread_cond_t queries_done = PTHREAD_COND_INITIALIZER;   // broadcast when queries_in_flight drops to 0
+static int queries_in_flight = 0;                                // number of started but not completed queries
+
+
+
+/**
+ * Returns the current monotonic time in seconds.
+ *
+ * @return The monotonic second.
+ */
+static time_t now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Computes the 32-bit FNV-1a hash of a string.
+ *
+ * @param str: The null-terminated string to hash.
+ * @return The hash value.
+ */
+static uint32_t hash_host(const char* str)
+{
+    uint32_t hash = 2166136261u; // FNV offset basis
+
+    for (; *str != '\0'; str++)
+    {
+        hash ^= (unsigned char)*str;
+        hash *= 16777619u; // FNV prime
+    }
+
+    return hash;
+}
+
+/**
+ * Finds the entry of a name in a shard. The shard lock must be held.
+ *
+ * @param shard: The shard to search.
+ * @param host: The hostname.
+ * @param hash: The hash of the hostname.
+ * @return The entry, or NULL if the name is not cached.
+ */
+static resolver_entry* find_entry(resolver_shard* shard, const char* host, uint32_t hash)
+{
+    resolver_entry* entry = shard->buckets[(hash / RESOLVER_SHARDS) % RESOLVER_BUCKETS_PER_SHARD];
+
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->name, host) != 0))
+        entry = entry->next;
+
+    return entry;
+}
+
+/**
+ * Makes room for a new entry when the shard is full. Expired answers are evicted first,
+ * then any settled answer. Pending entries are never evicted. The shard lock must be held.
+ *
+ * @param shard: The shard to trim.
+ */
+static void evict_entries(resolver_shard* shard)
+{
+    time_t now = now_seconds();
+
+    for (int pass = 0; pass < 2 && shard->count >= RESOLVER_MAX_ENTRIES_PER_SHARD; pass++)
+        for (int i = 0; i < RESOLVER_BUCKETS_PER_SHARD && shard->count >= RESOLVER_MAX_ENTRIES_PER_SHARD; i++)
+        {
+            resolver_entry** link = &shard->buckets[i];
+            while (*link != NULL)
+            {
+                resolver_entry* entry = *link;
+                // The first pass only takes stale answers, the second takes any settled one
+                if (entry->state != RESOLVER_PENDING && (pass == 1 || entry->expires <= now))
+                {
+                    *link = entry->next;
+                    free(entry);
+                    shard->count--;
+                    break; // One per bucket keeps the eviction spread out
+                }
+                link = &entry->next;
+            }
+        }
+}
+
+/**
+ * Orders the addresses of a lookup for happy eyeballs (RFC 8305): the first address getaddrinfo()
+ * returned, which follows the system's preference, keeps its family first, and the families
+ * alternate from there so a broken family costs a single attempt delay.
+ *
+ * @param result: The addresses returned by getaddrinfo().
+ * @param answer: Receives at most RESOLVER_MAX_ADDRESSES of them.
+ */
+static void store_addresses(const struct addrinfo* result, resolver_answer* answer)
+{
+    resolver_address by_family[2][RESOLVER_MAX_ADDRESSES]; // the preferred family, then the other one
+    int counts[2] = {0, 0};
+    int preferred = -1;
+
+    for (const struct addrinfo* info = result; info != NULL; info = info->ai_next)
+    {
+        if (info->ai_family != AF_INET && info->ai_family != AF_INET6)
+            continue;
+        if (preferred == -1)
+            preferred = info->ai_family;
+
+        int index = info->ai_family == preferred ? 0 : 1;
+        if (counts[index] == RESOLVER_MAX_ADDRESSES)
+            continue;
+
+        resolver_address* address = &by_family[index][counts[index]++];
+        memset(address, 0, sizeof(resolver_address));
+        address->family = info->ai_family;
+        if (info->ai_family == AF_INET)
+            memcpy(address->bytes, &((struct sockaddr_in*)info->ai_addr)->sin_addr, 4);
+        else
+            memcpy(address->bytes, &((struct sockaddr_in6*)info->ai_addr)->sin6_addr, 16);
+    }
+
+    answer->count = 0;
+    for (int i = 0; answer->count < RESOLVER_MAX_ADDRESSES && (i < counts[0] || i < counts[1]); i++)
+        for (int index = 0; index < 2; index++)
+            if (i < counts[index] && answer->count < RESOLVER_MAX_ADDRESSES)
+                answer->list[answer->count++] = by_family[index][i];
+}
+
+/**
+ * Parses a numeric IPv4 or IPv6 address, which needs neither the cache nor a query.
+ *
+ * @param host: The hostname.
+ * @param answer: Receives the address if host is numeric.
+ * @return
+ *   - 1 if host is a numeric address.
+ *   - 0 otherwise.
+ */
+static int parse_numeric(const char* host, resolver_answer* answer)
+{
+    resolver_address* address = &answer->list[0];
+    memset(address, 0, sizeof(resolver_address));
+
+    if (inet_pton(AF_INET, host, address->bytes) == 1)
+        address->family = AF_INET;
+    else if (inet_pton(AF_INET6, host, address->bytes) == 1)
+        address->family = AF_INET6;
+    else
+        return 0;
+
+    answer->count = 1;
+    return 1;
+}
+
+/**
+ * Completion callback of getaddrinfo_a(). It runs on a thread created by the C library,
+ * stores the answer in the entry and wakes every waiter of the shard.
+ *
+ * @param value: The resolver_query that completed.
+ */
+static void query_completed(union sigval value)
+{
+    resolver_query* query = (resolver_query*)value.sival_ptr;
+    resolver_shard* shard = query->shard;
+    resolver_entry* entry = query->entry;
+    struct addrinfo* result = query->request.ar_result;
+
+    pthread_mutex_lock(&shard->lock);
+
+    resolver_waiter* waiters = entry->waiters; // Detach the asynchronous waiters, they are called unlocked
+    entry->waiters = NULL;
+
+    if (gai_error(&query->request) == 0 && result != NULL)
+        store_addresses(result, &entry->answer);
+    else
+        entry->answer.count = 0;
+
+    if (entry->answer.count > 0)
+    {
+        entry->state = RESOLVER_POSITIVE;
+        entry->expires = now_seconds() + RESOLVER_POSITIVE_TTL;
+    }
+    else
+    {
+        entry->state = RESOLVER_NEGATIVE;
+        entry->expires = now_seconds() + RESOLVER_NEGATIVE_TTL;
+    }
+
+    int result_code = entry->state == RESOLVER_POSITIVE ? 1 : -1;
+    resolver_answer answer = entry->answer;
+
+    pthread_cond_broadcast(&shard->resolved);
+    pthread_mutex_unlock(&shard->lock);
+
+    while (waiters != NULL)
+    {
+        resolver_waiter* next = waiters->next; // The callback may release the waiter's storage
+        waiters->result = result_code;
+        waiters->answer = answer;
+        waiters->callback(waiters);
+        waiters = next;
+    }
+
+    if (result != NULL)
+        freeaddrinfo(result);
+    free(query);
+
+    pthread_mutex_lock(&queries_lock);
+    if (--queries_in_flight == 0)
+        pthread_cond_broadcast(&queries_done);
+    pthread_mutex_unlock(&queries_lock);
+}
+
+/**
+ * Starts an asynchronous query for a pending entry. The shard lock must be held.
+ *
+ * @param shard: The shard owning the entry.
+ * @param entry: The pending entry.
+ * @return
+ *   - 1 if the query was started.
+ *   - -1 if it could not be started, the entry is then marked negative.
+ */
+static int start_query(resolver_shard* shard, resolver_entry* entry)
+{
+    resolver_query* query = calloc(1, sizeof(resolver_query));
+    if (query == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        goto fail;
+    }
+
+    query->entry = entry;
+    query->shard = shard;
+    query->hints.ai_family = AF_UNSPEC;       // IPv6 and IPv4, the connect step races them
+    query->hints.ai_socktype = SOCK_STREAM;
+    query->hints.ai_flags = AI_ADDRCONFIG;    // Only the families the system can reach
+    query->request.ar_name = entry->name;     // The entry outlives the query since pending entries are kept
+    query->request.ar_request = &query->hints;
+
+    struct sigevent notification;
+    memset(&notification, 0, sizeof(notification));
+    notification.sigev_notify = SIGEV_THREAD;
+    notification.sigev_notify_function = query_completed;
+    notification.sigev_value.sival_ptr = query;
+
+    pthread_mutex_lock(&queries_lock);
+    queries_in_flight++;
+    pthread_mutex_unlock(&queries_lock);
+
+    struct gaicb* list[1] = {&query->request};
+    int result = getaddrinfo_a(GAI_NOWAIT, list, 1, &notification);
+    if (result != 0)
+    {
+        fprintf(stderr, "error: getaddrinfo_a: %s\n", gai_strerror(result));
+        free(query);
+
+        pthread_mutex_lock(&queries_lock);
+        if (--queries_in_flight == 0)
+            pthread_cond_broadcast(&queries_done);
+        pthread_mutex_unlock(&queries_lock);
+        goto fail;
+    }
+
+    return 1;
+
+    fail:
+    entry->state = RESOLVER_NEGATIVE;
+    entry->expires = now_seconds() + RESOLVER_NEGATIVE_TTL;
+    return -1;
+}
+
+
+int resolver_init(void)
+{
+    for (int i = 0; i < RESOLVER_SHARDS; i++)
+    {
+        if (pthread_mutex_init(&shards[i].lock, NULL) != 0 ||
+            pthread_cond_init(&shards[i].resolved, NULL) != 0)
+        {
+            fprintf(stderr, "Failed to initialize resolver mutex or condition variable\n");
+            return -1;
+        }
+
+        memset(shards[i].buckets, 0, sizeof(shards[i].buckets));
+        shards[i].count = 0;
+    }
+
+    return 1;
+}
+
+
+/**
+ * Finds the entry of a name, creating it and starting its query if the name is not cached,
+ * and refreshing it if its answer went stale. The shard lock must be held.
+ *
+ * @param shard: The shard of the name.
+ * @param host: The hostname.
+ * @param hash: The hash of the hostname.
+ * @return
+ *   - The entry, possibly pending.
+ *   - NULL if a memory allocation fails.
+ */
+static resolver_entry* lookup_entry(resolver_shard* shard, const char* host, uint32_t hash)
+{
+    resolver_entry* entry = find_entry(shard, host, hash);
+
+    // Refresh stale answers, waiters of a pending query are joined instead
+    if (entry != NULL && entry->state != RESOLVER_PENDING && entry->expires <= now_seconds())
+    {
+        entry->state = RESOLVER_PENDING;
+        start_query(shard, entry);
+    }
+
+    if (entry == NULL)
+    {
+        if (shard->count >= RESOLVER_MAX_ENTRIES_PER_SHARD)
+            evict_entries(shard);
+
+        entry = malloc(sizeof(resolver_entry) + strlen(host) + 1);
+        if (entry == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            return NULL;
+        }
+
+        strcpy(entry->name, host);
+        entry->hash = hash;
+        entry->state = RESOLVER_PENDING;
+        entry->waiters = NULL;
+        entry->answer.count = 0;
+        entry->expires = 0;
+
+        resolver_entry** bucket = &shard->buckets[(hash / RESOLVER_SHARDS) % RESOLVER_BUCKETS_PER_SHARD];
+        entry->next = *bucket;
+        *bucket = entry;
+        shard->count++;
+
+        start_query(shard, entry); // This caller leads, later callers wait for the same query
+    }
+
+    return entry;
+}
+
+
+int resolver_resolve(const char* host, resolver_answer* answer)
+{
+    if (parse_numeric(host, answer))
+        return 1;
+
+    uint32_t hash = hash_host(host);
+    resolver_shard* shard = &shards[hash % RESOLVER_SHARDS];
+
+    // The wait deadline, in the clock the condition variable uses
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += config.dns_timeout;
+
+    pthread_mutex_lock(&shard->lock);
+
+    resolver_entry* entry = lookup_entry(shard, host, hash);
+    if (entry == NULL)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+
+    // Wait for the query in flight, whoever started it
+    while (entry->state == RESOLVER_PENDING)
+        if (pthread_cond_timedwait(&shard->resolved, &shard->lock, &deadline) == ETIMEDOUT)
+            break;
+
+    int result = -1;
+    if (entry->state == RESOLVER_POSITIVE)
+    {
+        *answer = entry->answer;
+        result = 1;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (result == -1)
+        fprintf(stderr, "error: could not resolve %s\n", host);
+
+    return result;
+}
+
+
+int resolver_resolve_async(const char* host, resolver_answer* answer, resolver_waiter* waiter)
+{
+    if (parse_numeric(host, answer))
+        return 1;
+
+    uint32_t hash = hash_host(host);
+    resolver_shard* shard = &shards[hash % RESOLVER_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+
+    resolver_entry* entry = lookup_entry(shard, host, hash);
+    int result = -1;
+
+    if (entry != NULL && entry->state == RESOLVER_PENDING)
+    {
+        // Queue behind the query in flight, the completion callback will report back
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+        result = 0;
+    }
+    else if (entry != NULL && entry->state == RESOLVER_POSITIVE)
+    {
+        *answer = entry->answer;
+        result = 1;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (result == -1)
+        fprintf(stderr, "error: could not resolve %s\n", host);
+
+    return result;
+}
+
+
+socklen_t resolver_socket_address(const resolver_address* address, int port, struct sockaddr_storage* out)
+{
+    memset(out, 0, sizeof(struct sockaddr_storage));
+
+    if (address->family == AF_INET6)
+    {
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*)out;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons((uint16_t)port);
+        memcpy(&in6->sin6_addr, address->bytes, 16);
+        return sizeof(struct sockaddr_in6);
+    }
+
+    struct sockaddr_in* in = (struct sockaddr_in*)out;
+    in->sin_family = AF_INET;
+    in->sin_port = htons((uint16_t)port);
+    memcpy(&in->sin_addr, address->bytes, 4);
+    return sizeof(struct sockaddr_in);
+}
+
+
+void resolver_shutdown(void)
+{
+    // Completion callbacks touch the cache, so let them all run first
+    pthread_mutex_lock(&queries_lock);
+    while (queries_in_flight > 0)
+        pthread_cond_wait(&queries_done, &queries_lock);
+    pthread_mutex_unlock(&queries_lock);
+
+    for (int i = 0; i < RESOLVER_SHARDS; i++)
+    {
+        for (int j = 0; j < RESOLVER_BUCKETS_PER_SHARD; j++)
+        {
+            resolver_entry* entry = shards[i].buckets[j];
+            while (entry != NULL)
+            {
+                resolver_entry* next = entry->next;
+                free(entry);
+                entry = next;
+            }
+            shards[i].buckets[j] = NULL;
+        }
+
+        shards[i].count = 0;
+        pthread_mutex_destroy(&shards[i].lock);
+        pthread_cond_destroy(&shards[i].resolved);
+    }
+}
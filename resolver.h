@@ -0,0 +1,163 @@
+#ifndef PROXYSERVER_RESOLVER_H
+#define PROXYSERVER_RESOLVER_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+/**
+ * resolver.h
+ *
+ * This file declares the shared DNS resolver. Lookups go through a sharded
+ * cache of positive and negative answers. Concurrent lookups of the same name
+ * are coalesced into a single asynchronous getaddrinfo_a() query, and callers
+ * wait for it with a bounded timeout. A name resolves to its IPv6 and IPv4
+ * addresses together, ordered the way happy eyeballs tries them.
+ */
+
+// number of independently locked cache shards
+#define RESOLVER_SHARDS 16
+
+// maximum number of cached names per shard
+#define RESOLVER_MAX_ENTRIES_PER_SHARD 1024
+
+// number of hash buckets per shard
+#define RESOLVER_BUCKETS_PER_SHARD 256
+
+// seconds a successful answer is reused
+#define RESOLVER_POSITIVE_TTL 60
+
+// seconds a failed lookup is remembered
+#define RESOLVER_NEGATIVE_TTL 5
+
+// maximum number of addresses kept per name
+#define RESOLVER_MAX_ADDRESSES 8
+
+
+/**
+ * An address of a host, IPv6 or IPv4
+ */
+typedef struct {
+    int family;          // AF_INET6 or AF_INET
+    uint8_t bytes[16];   // the address in network byte order, an IPv4 address takes the first 4 bytes
+} resolver_address;
+
+
+/**
+ * The addresses of a host, in the order connections to it are attempted: the family the
+ * system prefers first, then alternating between the families
+ */
+typedef struct {
+    resolver_address list[RESOLVER_MAX_ADDRESSES]; // the addresses
+    int count;                                     // number of addresses, at least 1 once resolved
+} resolver_answer;
+
+
+/**
+ * The state of a cache entry
+ */
+typedef enum {
+    RESOLVER_PENDING,    // a query is in flight
+    RESOLVER_POSITIVE,   // the name resolved to "answer"
+    RESOLVER_NEGATIVE    // the name could not be resolved
+} resolver_state;
+
+
+/**
+ * An asynchronous lookup waiting for a query in flight. The storage belongs to
+ * the caller and must stay valid until the callback ran.
+ */
+typedef struct resolver_waiter_st {
+    struct resolver_waiter_st* next;                     // next waiter of the same entry
+    void (*callback)(struct resolver_waiter_st* waiter); // called once the answer is known
+    void* context;                                       // free for the caller's use
+    int result;                                          // 1 if resolved, -1 otherwise
+    resolver_answer answer;                              // resolved addresses, valid if result is 1
+} resolver_waiter;
+
+
+/**
+ * A cached name. Entries that are pending are never evicted, so waiters
+ * may keep pointing at them.
+ */
+typedef struct resolver_entry_st {
+    struct resolver_entry_st* next;  // next entry in the same bucket
+    resolver_waiter* waiters;        // asynchronous lookups waiting for the query in flight
+    resolver_state state;            // current state of the entry
+    resolver_answer answer;          // resolved addresses, valid if positive
+    time_t expires;                  // monotonic second at which the answer goes stale
+    uint32_t hash;                   // hash of the name
+    char name[];                     // the hostname, null-terminated
+} resolver_entry;
+
+
+/**
+ * A cache shard, holding the entries whose hash maps to it
+ */
+typedef struct {
+    pthread_mutex_t lock;                                // protects everything below
+    pthread_cond_t resolved;                             // broadcast when a query of this shard completes
+    resolver_entry* buckets[RESOLVER_BUCKETS_PER_SHARD]; // hash chains
+    int count;                                           // number of entries in the shard
+} resolver_shard;
+
+
+/**
+ * Initializes the resolver cache. Must be called before any lookup.
+ *
+ * @return
+ *   - 1 on success.
+ *   - -1 if a mutex or condition variable cannot be initialized.
+ */
+int resolver_init(void);
+
+/**
+ * Resolves a hostname to its IPv6 and IPv4 addresses. Numeric addresses are parsed directly.
+ * Only the families the system has an address of are asked for.
+ * Fresh cached answers, positive or negative, are returned without a query. Otherwise the
+ * first caller starts an asynchronous query and every caller for the same name waits for
+ * that single query, for at most the DNS timeout of the settings. This function is
+ * thread-safe.
+ *
+ * @param host: The hostname to resolve, without port or brackets.
+ * @param answer: Receives the addresses.
+ * @return
+ *   - 1 on success.
+ *   - -1 if the name cannot be resolved or the lookup timed out.
+ */
+int resolver_resolve(const char* host, resolver_answer* answer);
+
+/**
+ * Resolves a hostname without blocking. Answers that are already known (numeric addresses,
+ * fresh cached answers) are returned right away. Otherwise the waiter is queued on the query in
+ * flight for the name, starting one if needed, and its callback is invoked from a resolver
+ * thread once the answer arrives. The caller bounds the wait itself.
+ *
+ * @param host: The hostname to resolve, without port or brackets.
+ * @param answer: Receives the addresses when the answer is known right away.
+ * @param waiter: Caller-owned storage with callback and context set, used if the answer is pending.
+ * @return
+ *   - 1 if the host was resolved right away.
+ *   - 0 if the lookup is pending, the callback will report the result.
+ *   - -1 if the name is known not to resolve.
+ */
+int resolver_resolve_async(const char* host, resolver_answer* answer, resolver_waiter* waiter);
+
+/**
+ * Builds the socket address to connect to for an address and a port.
+ *
+ * @param address: The address.
+ * @param port: The port.
+ * @param out: Receives the socket address.
+ * @return The length of the socket address.
+ */
+socklen_t resolver_socket_address(const resolver_address* address, int port, struct sockaddr_storage* out);
+
+/**
+ * Waits for the queries in flight to complete and frees the cache.
+ * No lookup may be started after this call.
+ */
+void resolver_shutdown(void);
+
+#endif //PROXYSERVER_RESOLVER_H
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include "responses.h"
+
+
+// size of the buffers a prebuilt response is kept in
+#define RESPONSES_PART_SIZE 512
+
+// number of 8-byte words the shared date is kept in
+#define RESPONSES_DATE_WORDS ((RESPONSES_DATE_LENGTH + 7) / 8)
+
+
+/**
+ * The text of an error response
+ */
+typedef struct {
+    int status;                 // the status code
+    const char* title;          // the status line text, also the title of the page
+    const char* description;    // the sentence of the page
+} error_page;
+
+
+/**
+ * An error response built once: the bytes before the date, and the bytes after it for a
+ * closing and a keep-alive connection
+ */
+typedef struct {
+    char head[RESPONSES_PART_SIZE];         // the status line and headers up to "Date: "
+    size_t head_length;                     // bytes of head
+    char tail[2][RESPONSES_PART_SIZE];      // the rest of the headers and the page, indexed by keep-alive
+    size_t tail_length[2];                  // bytes of tail
+} error_response;
+
+
+static const error_page pages[] = {
+    {400, "400 Bad Request", "Bad Request."},
+    {403, "403 Forbidden", "Access denied."},
+    {404, "404 Not Found", "File not found."},
+    {500, "500 Internal Server Error", "Some server side error."},
+    {501, "501 Not supported", "Method is not supported."},
+    {503, "503 Service Unavailable", "The proxy is overloaded, try again later."},
+    {504, "504 Gateway Timeout", "The destination server did not answer in time."},
+};
+
+#define ERROR_PAGES (sizeof(pages) / sizeof(pages[0]))
+
+static error_response responses[ERROR_PAGES];                // indexed like pages, immutable once built
+static pthread_once_t responses_built = PTHREAD_ONCE_INIT;   // builds responses on first use
+
+// The date is published with a sequence lock: odd while the clock thread rewrites it
+static atomic_uint date_sequence = 0;
+static atomic_ullong date_words[RESPONSES_DATE_WORDS];
+
+static pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER; // protects clock_stopping
+static pthread_cond_t clock_wake = PTHREAD_COND_INITIALIZER;    // signaled to stop the clock thread
+static int clock_stopping = 0;                                  // 1 once the clock thread has to finish
+static atomic_int clock_running = 0;                            // 1 while the clock thread keeps the date
+static pthread_t clock_thread;                                  // the thread refreshing the date
+
+
+
+/**
+ * Builds every error response. Runs once, before any of them is used.
+ */
+static void build_responses(void)
+{
+    for (size_t i = 0; i < ERROR_PAGES; i++)
+    {
+        const error_page* page = &pages[i];
+        error_response* response = &responses[i];
+
+        char body[RESPONSES_PART_SIZE];
+        int body_length = snprintf(body, sizeof(body), "<HTML><HEAD><TITLE>%s</TITLE></HEAD>\r\n"
+                                                       "<BODY><H4>%s</H4>\r\n"
+                                                       "%s\r\n"
+                                                       "</BODY></HTML>", page->title, page->title, page->description);
+
+        response->head_length = (size_t)snprintf(response->head, sizeof(response->head),
+                                                 "HTTP/1.1 %s\r\nServer: webserver/1.0\r\nDate: ", page->title);
+
+        for (int keep_alive = 0; keep_alive < 2; keep_alive++)
+            response->tail_length[keep_alive] = (size_t)snprintf(response->tail[keep_alive], sizeof(response->tail[keep_alive]),
+                                                                 "\r\nContent-Type: text/html\r\n"
+                                                                 "Content-Length: %d\r\n"
+                                                                 "Connection: %s\r\n\r\n"
+                                                                 "%s",
+                                                                 body_length, keep_alive ? "keep-alive" : "close", body);
+    }
+}
+
+/**
+ * Formats the current time as an HTTP date.
+ *
+ * @param out: Receives the date, at least RESPONSES_DATE_WORDS * 8 bytes, null-terminated.
+ */
+static void format_date(char* out)
+{
+    // time() may read a coarse clock still in the previous second when the clock thread wakes up
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct tm gmt;
+    gmtime_r(&now.tv_sec, &gmt);
+    strftime(out, RESPONSES_DATE_WORDS * 8, "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+}
+
+/**
+ * Formats the current date and publishes it to the readers of date_words.
+ */
+static void publish_date(void)
+{
+    unsigned long long words[RESPONSES_DATE_WORDS];
+    format_date((char*)words);
+
+    unsigned int sequence = atomic_load_explicit(&date_sequence, memory_order_relaxed);
+    atomic_store_explicit(&date_sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); // The odd sequence is seen before any new word
+    for (int i = 0; i < RESPONSES_DATE_WORDS; i++)
+        atomic_store_explicit(&date_words[i], words[i], memory_order_relaxed);
+    atomic_store_explicit(&date_sequence, sequence + 2, memory_order_release);
+}
+
+/**
+ * The body of the clock thread: publishes the date at the start of every second until stopped.
+ *
+ * @param arg: Unused.
+ * @return NULL.
+ */
+static void* clock_function(void* arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&clock_lock);
+    while (!clock_stopping)
+    {
+        publish_date();
+
+        // Wake up right after the next second starts
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += 1;
+        until.tv_nsec = 1000000;
+        pthread_cond_timedwait(&clock_wake, &clock_lock, &until);
+    }
+    pthread_mutex_unlock(&clock_lock);
+
+    return NULL;
+}
+
+
+int responses_start_clock(void)
+{
+    publish_date(); // The date is valid before the first response
+
+    clock_stopping = 0;
+    if (pthread_create(&clock_thread, NULL, clock_function, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to create the clock thread\n");
+        return -1;
+    }
+
+    atomic_store(&clock_running, 1);
+    return 1;
+}
+
+
+void responses_stop_clock(void)
+{
+    if (!atomic_load(&clock_running))
+        return;
+
+    pthread_mutex_lock(&clock_lock);
+    clock_stopping = 1;
+    pthread_cond_signal(&clock_wake);
+    pthread_mutex_unlock(&clock_lock);
+    pthread_join(clock_thread, NULL);
+    atomic_store(&clock_running, 0);
+}
+
+
+void responses_date(char* out)
+{
+    unsigned long long words[RESPONSES_DATE_WORDS];
+
+    if (!atomic_load_explicit(&clock_running, memory_order_acquire))
+    {
+        format_date((char*)words);
+        memcpy(out, words, RESPONSES_DATE_LENGTH);
+        return;
+    }
+
+    // Read the words again if the clock thread rewrote them meanwhile
+    unsigned int before, after;
+    do {
+        before = atomic_load_explicit(&date_sequence, memory_order_acquire);
+        for (int i = 0; i < RESPONSES_DATE_WORDS; i++)
+            words[i] = atomic_load_explicit(&date_words[i], memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire); // The words are read before the sequence again
+        after = atomic_load_explicit(&date_sequence, memory_order_relaxed);
+    } while (before != after || (before & 1));
+
+    memcpy(out, words, RESPONSES_DATE_LENGTH);
+}
+
+
+size_t responses_error(int status, int keep_alive, char* date, struct iovec* parts)
+{
+    pthread_once(&responses_built, build_responses);
+
+    for (size_t i = 0; i < ERROR_PAGES; i++)
+        if (pages[i].status == status)
+        {
+            const error_response* response = &responses[i];
+            keep_alive = keep_alive != 0;
+            responses_date(date);
+
+            parts[0].iov_base = (void*)response->head;
+            parts[0].iov_len = response->head_length;
+            parts[1].iov_base = date;
+            parts[1].iov_len = RESPONSES_DATE_LENGTH;
+            parts[2].iov_base = (void*)response->tail[keep_alive];
+            parts[2].iov_len = response->tail_length[keep_alive];
+            return response->head_length + RESPONSES_DATE_LENGTH + response->tail_length[keep_alive];
+        }
+
+    return 0;
+}
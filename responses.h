@@ -0,0 +1,58 @@
+#ifndef PROXYSERVER_RESPONSES_H
+#define PROXYSERVER_RESPONSES_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/**
+ * responses.h
+ *
+ * This file declares the error responses of the proxy. Each one is built
+ * once, as the bytes before its Date header and the bytes after it, for
+ * both a closing and a keep-alive connection. A clock thread formats the
+ * date once a second, so sending an error is a writev() of three buffers
+ * with nothing formatted on the way.
+ */
+
+// length of an HTTP date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+#define RESPONSES_DATE_LENGTH 29
+
+// number of buffers an error response is sent from: the head up to the date, the date, and the rest
+#define RESPONSES_ERROR_PARTS 3
+
+
+/**
+ * Starts the thread refreshing the date of the responses once a second.
+ *
+ * @return
+ *   - 1 on success.
+ *   - -1 if the thread cannot be created. The date is then formatted for every response.
+ */
+int responses_start_clock(void);
+
+/**
+ * Stops the clock thread, if it runs.
+ */
+void responses_stop_clock(void);
+
+/**
+ * Copies the current HTTP date, as the clock thread last formatted it, or formatted now if
+ * the clock thread does not run.
+ *
+ * @param out: Receives RESPONSES_DATE_LENGTH bytes, not null-terminated.
+ */
+void responses_date(char* out);
+
+/**
+ * Points buffers at the error response for a status code. The head and the rest are shared
+ * and never change, the date is copied into a buffer of the caller.
+ *
+ * @param status: The status code: 400, 403, 404, 500, 501, 503 or 504.
+ * @param keep_alive: 1 for "Connection: keep-alive", 0 for "Connection: close".
+ * @param date: Receives the date, RESPONSES_DATE_LENGTH bytes that must outlive the buffers' use.
+ * @param parts: Receives the RESPONSES_ERROR_PARTS buffers to write in order.
+ * @return The total length of the response, or 0 if the status code has no error response.
+ */
+size_t responses_error(int status, int keep_alive, char* date, struct iovec* parts);
+
+#endif //PROXYSERVER_RESPONSES_H
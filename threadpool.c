@@ -1,77 +1,92 @@
 #include <stdio.h>
 #include <pthread.h>
+#include <sched.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <limits.h>
+#include <time.h>
 #include "threadpool.h"
 
 
 
 /**
- * Dequeues a work item from the thread pool's queue.
+ * Returns the current monotonic time in microseconds.
  *
- * @param tp: A pointer to the threadpool structure from which to dequeue a work item.
- * @return
- *   - A pointer to the dequeued work_t structure if the queue is not empty.
- *   - NULL if the queue is empty or if the threadpool pointer is NULL.
+ * @return The monotonic microsecond.
  */
-work_t* dequeue(threadpool* tp)
+static unsigned long long now_us(void)
 {
-    if (tp == NULL)
-        return NULL;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + (unsigned long long)ts.tv_nsec / 1000;
+}
 
-    // Check if the queue is empty.
-    if (tp->qhead == NULL)
-    {
-        int lock_result = pthread_mutex_unlock(&tp->qlock); // Unlock the queue before returning.
-        if (lock_result != 0)
+/**
+ * Waits on a semaphore, retrying when a signal interrupts the wait.
+ *
+ * @param sem: The semaphore.
+ */
+static void wait_semaphore(sem_t* sem)
+{
+    while (sem_wait(sem) == -1)
+        if (errno != EINTR)
         {
-            fprintf(stderr, "Error unlocking mutex: %d\n", lock_result);
+            perror("error: sem_wait\n");
             pthread_exit(NULL);
         }
+}
 
-        return NULL; // Return NULL if the queue is empty.
-    }
-
-    // Get the first work_t item from the queue.
-    work_t* work = tp->qhead;
-    tp->qhead = work->next; // Update the head of the queue to the next element.
-
-    if (tp->qhead == NULL)
-        tp->qtail = NULL; // If the queue is now empty, also update the tail to NULL.
-
+/**
+ * Dequeues a work item from the thread pool's queue. The caller must have taken a job from
+ * q_items, so a job is queued or about to be: the slot of the ticket is only waited for while
+ * its producer finishes writing it.
+ *
+ * @param tp: A pointer to the threadpool structure from which to dequeue a work item.
+ * @param work: Receives a copy of the dequeued work item.
+ */
+void dequeue(threadpool* tp, work_t* work)
+{
+    size_t ticket = atomic_fetch_add_explicit(&tp->qhead, 1, memory_order_relaxed);
+    work_t* slot = &tp->slots[ticket & (tp->capacity - 1)];
 
-    tp->qsize--; // Decrement the size of the queue.
+    // The slot is full once its producer published it with sequence ticket + 1
+    while (atomic_load_explicit(&slot->sequence, memory_order_acquire) != ticket + 1)
+        sched_yield();
 
-    work->next = NULL; // Clear the next pointer of the dequeued work_t item.
+    work->routine = slot->routine;
+    work->arg = slot->arg;
+    work->enqueued = slot->enqueued;
 
-    return work; // Return the dequeued work_t item.
+    // Free the slot for the producer one lap ahead
+    atomic_store_explicit(&slot->sequence, ticket + tp->capacity, memory_order_release);
+    atomic_fetch_sub_explicit(&tp->qsize, 1, memory_order_relaxed);
 }
 
 /**
- * Enqueues a work item to the thread pool's queue.
+ * Enqueues a work item to the thread pool's queue. The caller must have taken a free slot
+ * from q_slots: the slot of the ticket is only waited for while its previous consumer
+ * finishes reading it.
  *
  * @param tp: A pointer to the threadpool structure to which a work item is enqueued.
- * @param work: A pointer to the work_t structure to be enqueued.
+ * @param routine: The routine of the work item, NULL for a stop job.
+ * @param arg: The argument of the routine.
  */
-void enqueue(threadpool* tp, work_t* work)
+void enqueue(threadpool* tp, dispatch_fn routine, void* arg)
 {
-    if (tp == NULL || work == NULL)
-        return;
+    size_t ticket = atomic_fetch_add_explicit(&tp->qtail, 1, memory_order_relaxed);
+    work_t* slot = &tp->slots[ticket & (tp->capacity - 1)];
 
+    // The slot is free once the consumer of the previous lap released it with sequence ticket
+    while (atomic_load_explicit(&slot->sequence, memory_order_acquire) != ticket)
+        sched_yield();
 
-    work->next = NULL; // Ensure the next pointer is null since it's going to be the new tail.
+    slot->routine = routine;
+    slot->arg = arg;
+    slot->enqueued = tp->shed != NULL ? now_us() : 0; // Only a pool that sheds reads the clock
 
-    if (tp->qtail == NULL)
-        // The queue is empty, so this work item will be both the head and tail.
-        tp->qhead = tp->qtail = work;
-    else
-    {
-        // The queue is not empty, append the work item to the end and update the tail.
-        tp->qtail->next = work;
-        tp->qtail = work;
-    }
-
-    tp->qsize++; // Increment the queue size.
+    atomic_fetch_add_explicit(&tp->qsize, 1, memory_order_relaxed);
+    atomic_store_explicit(&slot->sequence, ticket + 1, memory_order_release); // Publish the slot
 }
 
 /**
@@ -83,33 +98,83 @@ void enqueue(threadpool* tp, work_t* work)
  */
 void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg)
 {
-    int lock_result = pthread_mutex_lock(&from_me->qlock);
-    if (lock_result != 0)
-        fprintf(stderr, "Error locking mutex: %d\n", lock_result);
-
-    if (from_me->dont_accept)
+    if (atomic_load(&from_me->dont_accept) || dispatch_to_here == NULL)
         return;
 
+    wait_semaphore(&from_me->q_slots); // Wait while the queue is full
+
+    enqueue(from_me, dispatch_to_here, arg);
 
+    if (sem_post(&from_me->q_items) != 0)
+        perror("error: sem_post\n");
+}
 
-    work_t* work = malloc(sizeof(work_t));
-    if (work == NULL)
+int try_dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg)
+{
+    if (atomic_load(&from_me->dont_accept) || dispatch_to_here == NULL)
+        return 0;
+
+    if (from_me->high_watermark == 0)
     {
-        printf("failed");
-        return;
+        dispatch(from_me, dispatch_to_here, arg);
+        return 1;
     }
 
-    work->routine = dispatch_to_here;
-    work->arg = arg;
+    // Refuse above the watermark, and when the ring itself is full
+    if (atomic_load_explicit(&from_me->qsize, memory_order_relaxed) >= from_me->high_watermark ||
+        sem_trywait(&from_me->q_slots) != 0)
+        return 0;
+
+    enqueue(from_me, dispatch_to_here, arg);
+
+    if (sem_post(&from_me->q_items) != 0)
+        perror("error: sem_post\n");
+    return 1;
+}
+
+
+void threadpool_set_admission(threadpool* tp, int high_watermark, dispatch_fn shed,
+                              unsigned long long target_us, unsigned long long interval_us)
+{
+    tp->high_watermark = high_watermark;
+    tp->shed_target = target_us;
+    tp->shed_interval = interval_us;
+    atomic_store(&tp->window_end, now_us() + interval_us);
+    atomic_store(&tp->window_min, ULLONG_MAX);
+    atomic_store(&tp->overloaded, 0);
+    tp->shed = shed;
+}
+
+/**
+ * Decides whether a job that waited in the queue is shed. A window closes every shed_interval:
+ * if even the shortest wait of its jobs exceeded shed_target, a queue stood the whole window
+ * and the pool is overloaded until a window sees a short wait again. The workers share the
+ * window through atomics, the one that closes it decides for the next one.
+ *
+ * @param tp: The pool.
+ * @param enqueued: Monotonic microsecond the job was queued.
+ * @return
+ *   - 1 if the job is shed.
+ *   - 0 if it runs.
+ */
+static int should_shed(threadpool* tp, unsigned long long enqueued)
+{
+    unsigned long long now = now_us();
+    unsigned long long waited = now > enqueued ? now - enqueued : 0;
+    unsigned long long end = atomic_load_explicit(&tp->window_end, memory_order_relaxed);
+    if (now >= end && atomic_compare_exchange_strong(&tp->window_end, &end, now + tp->shed_interval))
+    {
+        unsigned long long shortest = atomic_exchange(&tp->window_min, ULLONG_MAX);
+        atomic_store_explicit(&tp->overloaded, shortest != ULLONG_MAX && shortest > tp->shed_target, memory_order_relaxed);
+    }
 
-    enqueue(from_me, work);
-    lock_result = pthread_mutex_unlock(&from_me->qlock);
-    if (lock_result != 0)
-        fprintf(stderr, "Error unlocking mutex: %d\n", lock_result);
+    unsigned long long shortest = atomic_load_explicit(&tp->window_min, memory_order_relaxed);
+    while (waited < shortest && !atomic_compare_exchange_weak(&tp->window_min, &shortest, waited))
+        ;
 
-    int cond_result = pthread_cond_signal(&from_me->q_not_empty);
-    if (cond_result != 0)
-        fprintf(stderr, "Error signaling condition variable: %d\n", cond_result);
+    // The client of a job queued past the limit has likely given up, a fast refusal frees the worker
+    unsigned long long limit = atomic_load_explicit(&tp->overloaded, memory_order_relaxed) ? tp->shed_target : tp->shed_interval;
+    return waited > limit;
 }
 
 /**
@@ -125,61 +190,22 @@ void* do_work(void* p)
 
     while(1)
     {
-        int lock_result = pthread_mutex_lock(&tp->qlock);
-        if (lock_result != 0)
-        {
-            fprintf(stderr, "Error locking mutex: %d\n", lock_result);
-            pthread_exit(NULL);
-        }
+        // Wait for work to be available, the stop jobs arrive through the queue too
+        wait_semaphore(&tp->q_items);
 
+        work_t work;
+        dequeue(tp, &work);
 
-        // Wait for work to be available or for shutdown signal.
-        while (tp->qsize == 0 && !tp->shutdown)
-        {
-            int cond_result = pthread_cond_wait(&tp->q_not_empty, &tp->qlock);
-            if (cond_result != 0)
-            {
-                fprintf(stderr, "Error waiting condition variable: %d\n", cond_result);
-                pthread_exit(NULL);
-            }
-        }
-
-
-        if (tp->shutdown)
-        {
-            lock_result = pthread_mutex_unlock(&tp->qlock);
-            if (lock_result != 0)
-                fprintf(stderr, "Error unlocking mutex: %d\n", lock_result);
-
-            pthread_exit(NULL);
-        }
-
-        work_t* work = dequeue(tp);
-
-        // Signal if the pool is being destroyed and no more tasks are pending.
-        if (tp->dont_accept && tp->qsize == 0)
-        {
-            int cond_result = pthread_cond_signal(&tp->q_empty);
-            if (cond_result != 0)
-            {
-                fprintf(stderr, "Error signaling condition variable: %d\n", cond_result);
-                pthread_exit(NULL);
-            }
-        }
-
-        lock_result = pthread_mutex_unlock(&tp->qlock);
-        if (lock_result != 0)
-        {
-            fprintf(stderr, "Error unlocking mutex: %d\n", lock_result);
-            pthread_exit(NULL);
-        }
+        if (sem_post(&tp->q_slots) != 0)
+            perror("error: sem_post\n");
 
+        if (work.routine == NULL)
+            pthread_exit(NULL); // A stop job, every job queued before it was taken
 
-        if(work != NULL)
-        {
-            work->routine(work->arg);
-            free(work);
-        }
+        if (tp->shed != NULL && should_shed(tp, work.enqueued))
+            tp->shed(work.arg);
+        else
+            work.routine(work.arg);
     }
 }
 
@@ -191,26 +217,23 @@ void* do_work(void* p)
  */
 void destroy_threadpool(threadpool* destroyme)
 {
-    int lock_result = pthread_mutex_lock(&destroyme->qlock);
-    if (lock_result != 0)
-        fprintf(stderr, "Error locking mutex: %d\n", lock_result);
-
-    destroyme->dont_accept = 1;
-
-    if(destroyme->qsize > 0)
-        pthread_cond_wait(&destroyme->q_empty, &destroyme->qlock);
+    atomic_store(&destroyme->dont_accept, 1);
 
-    destroyme->shutdown = 1;
-    pthread_mutex_unlock(&destroyme->qlock);
-    pthread_cond_broadcast(&destroyme->q_not_empty);
+    // Queue one stop job per thread behind the pending work, the queue is FIFO
+    for (int i = 0 ; i < destroyme->num_threads ; i++)
+    {
+        wait_semaphore(&destroyme->q_slots);
+        enqueue(destroyme, NULL, NULL);
+        sem_post(&destroyme->q_items);
+    }
 
     for (int i = 0 ; i < destroyme->num_threads ; i++)
         pthread_join(destroyme->threads[i], NULL);
 
     free (destroyme->threads);
-    pthread_mutex_destroy(&destroyme->qlock);
-    pthread_cond_destroy(&destroyme->q_not_empty);
-    pthread_cond_destroy(&destroyme->q_empty);
+    free(destroyme->slots);
+    sem_destroy(&destroyme->q_items);
+    sem_destroy(&destroyme->q_slots);
     free(destroyme);
 }
 
@@ -239,7 +262,7 @@ threadpool* create_threadpool(int num_threads_in_pool)
     }
 
     tp->num_threads = num_threads_in_pool;
-    tp->qsize = 0;
+    atomic_init(&tp->qsize, 0);
     tp->threads = (pthread_t*) malloc(num_threads_in_pool * sizeof(pthread_t));
     if (tp->threads == NULL)
     {
@@ -248,20 +271,40 @@ threadpool* create_threadpool(int num_threads_in_pool)
         exit(EXIT_FAILURE);
     }
 
-    tp->qhead = NULL;
-    tp->qtail = NULL;
-    if (pthread_mutex_init(&tp->qlock, NULL) != 0 ||
-        pthread_cond_init(&tp->q_empty, NULL) != 0 ||
-        pthread_cond_init(&tp->q_not_empty, NULL) != 0)
+    // Every slot is allocated once, dispatch never allocates
+    tp->capacity = THREADPOOL_QUEUE_SIZE;
+    tp->slots = malloc(tp->capacity * sizeof(work_t));
+    if (tp->slots == NULL)
+    {
+        free(tp->threads);
+        free(tp);
+        printf("Failed to allocate the work queue\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < tp->capacity; i++)
+        atomic_init(&tp->slots[i].sequence, i); // Slot i takes the enqueue ticket i first
+
+    atomic_init(&tp->qhead, 0);
+    atomic_init(&tp->qtail, 0);
+    if (sem_init(&tp->q_items, 0, 0) != 0 ||
+        sem_init(&tp->q_slots, 0, (unsigned int)tp->capacity) != 0)
     {
         // Clean up in case of failure
+        free(tp->slots);
         free(tp->threads);
         free(tp);
-        printf("Failed to initialize mutex or condition variable\n");
+        printf("Failed to initialize semaphores\n");
         exit(EXIT_FAILURE);
     }
-    tp->shutdown = 0;
-    tp->dont_accept = 0;
+    atomic_init(&tp->dont_accept, 0);
+    tp->high_watermark = 0; // Nothing is refused or shed unless asked for
+    tp->shed = NULL;
+    tp->shed_target = 0;
+    tp->shed_interval = 0;
+    atomic_init(&tp->window_end, 0);
+    atomic_init(&tp->window_min, ULLONG_MAX);
+    atomic_init(&tp->overloaded, 0);
 
     for (int i = 0 ; i < num_threads_in_pool ; i++)
         if (pthread_create(&tp->threads[i], NULL, do_work, (void*)tp) != 0)
@@ -273,6 +316,7 @@ threadpool* create_threadpool(int num_threads_in_pool)
                 pthread_join(tp->threads[j], NULL);
             }
 
+            free(tp->slots);
             free(tp->threads);
             free(tp);
             printf("Failed to create all threads\n");
@@ -281,5 +325,3 @@ threadpool* create_threadpool(int num_threads_in_pool)
 
     return tp;
 }
-
-
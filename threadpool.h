@@ -2,6 +2,9 @@
 #define THREADPOOL_THREADPOOL_H
 
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
 
 /**
  * threadpool.h
@@ -13,14 +16,18 @@
 // maximum number of threads allowed in a pool
 #define MAXT_IN_POOL 200
 
+// number of slots of the work queue, a power of two
+#define THREADPOOL_QUEUE_SIZE 1024
+
 
 /**
- * the pool holds a queue of this structure
+ * the pool holds a ring of this structure, allocated once
  */
 typedef struct work_st{
-    int (*routine) (void*);  //the threads process function
+    int (*routine) (void*);  //the threads process function, NULL asks the thread to exit
     void * arg;  //argument to the function
-    struct work_st* next;
+    unsigned long long enqueued;  //monotonic microsecond the job was queued
+    atomic_size_t sequence;  //ticket of the next enqueue (free) or dequeue (full) allowed on the slot
 } work_t;
 
 
@@ -29,15 +36,22 @@ typedef struct work_st{
  */
 typedef struct _threadpool_st {
     int num_threads;	//number of active threads
-    int qsize;	        //number in the queue
+    atomic_int qsize;	//number in the queue
     pthread_t *threads;	//pointer to threads
-    work_t* qhead;		//queue head pointer
-    work_t* qtail;		//queue tail pointer
-    pthread_mutex_t qlock;		//lock on the queue list
-    pthread_cond_t q_not_empty;	//non empty and empty condidtion vairiables
-    pthread_cond_t q_empty;
-    int shutdown;            //1 if the pool is in distruction process
-    int dont_accept;       //1 if destroy function has begun
+    work_t* slots;		//the ring of work slots
+    size_t capacity;		//number of slots, a power of two
+    atomic_size_t qhead;	//ticket of the next dequeue
+    atomic_size_t qtail;	//ticket of the next enqueue
+    sem_t q_items;		//counts the queued jobs, workers wait on it when the queue is empty
+    sem_t q_slots;		//counts the free slots, dispatch waits on it when the queue is full
+    atomic_int dont_accept;       //1 if destroy function has begun
+    int high_watermark;		//queued jobs at which try_dispatch refuses more, 0 to wait for a slot
+    int (*shed) (void*);	//run instead of a job that waited too long, NULL never sheds
+    unsigned long long shed_target;	//microseconds of queueing tolerated while the pool is overloaded
+    unsigned long long shed_interval;	//microseconds of queueing tolerated otherwise, also the length of a window
+    atomic_ullong window_end;	//monotonic microsecond the current window closes
+    atomic_ullong window_min;	//shortest wait of a job dequeued in the current window
+    atomic_int overloaded;	//1 if no job of the last window waited less than shed_target
 } threadpool;
 
 
@@ -67,22 +81,43 @@ threadpool* create_threadpool(int num_threads_in_pool);
  * when an available thread takes a job from the queue, it will
  * call the function "dispatch_to_here" with argument "arg".
  * this function should:
- * 1. create and init work_t element
- * 2. lock the mutex
- * 3. add the work_t element to the queue
- * 4. unlock mutex
+ * 1. wait for a free slot if the queue is full
+ * 2. take the next enqueue ticket and fill its slot, no lock and no allocation
+ * 3. publish the slot and wake a waiting thread
  *
  */
 void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
 
+/**
+ * try_dispatch is dispatch for a producer that would rather refuse
+ * a job than wait: the job is only queued while fewer jobs than the
+ * high watermark wait. Without a watermark it waits like dispatch.
+ * returns 1 if the job was queued, 0 if it was refused and still
+ * belongs to the caller.
+ */
+int try_dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * threadpool_set_admission bounds how much work the pool takes on,
+ * before any job is dispatched.
+ * high_watermark: queued jobs at which try_dispatch refuses more, 0 for none.
+ * shed: run instead of a job that queued too long, with its argument, NULL to never shed.
+ * target_us and interval_us: shedding follows CoDel, the pool is overloaded
+ * when no job of a window of interval_us waited less than target_us. While it
+ * is, jobs that waited longer than target_us are shed, otherwise only jobs
+ * that waited longer than interval_us are.
+ */
+void threadpool_set_admission(threadpool* tp, int high_watermark, dispatch_fn shed,
+                              unsigned long long target_us, unsigned long long interval_us);
+
 /**
  * The work function of the thread
  * this function should:
- * 1. lock mutex
- * 2. if the queue is empty, wait
- * 3. take the first element from the queue (work_t)
- * 4. unlock mutex
- * 5. call the thread routine
+ * 1. if the queue is empty, wait
+ * 2. take the next dequeue ticket and empty its slot
+ * 3. hand the slot back to the producers
+ * 4. call the thread routine, the shed routine if the job queued
+ *    for too long, or exit on a stop job
  *
  */
 void* do_work(void* p);
@@ -92,6 +127,8 @@ void* do_work(void* p);
  * destroy_threadpool kills the threadpool, causing
  * all threads in it to commit suicide, and then
  * frees all the memory associated with the threadpool.
+ * The jobs already queued are run first: one stop job per
+ * thread is queued behind them.
  */
 void destroy_threadpool(threadpool* destroyme);
 
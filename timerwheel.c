@@ -0,0 +1,168 @@
+#include <string.h>
+#include <time.h>
+#include "timerwheel.h"
+
+
+
+/**
+ * Takes a timer out of its slot.
+ *
+ * @param wheel: The wheel.
+ * @param timer: The scheduled timer.
+ */
+static void unlink_timer(timer_wheel* wheel, wheel_timer* timer)
+{
+    if (timer->prev != NULL)
+        timer->prev->next = timer->next;
+    else
+        *timer->slot = timer->next;
+    if (timer->next != NULL)
+        timer->next->prev = timer->prev;
+
+    timer->slot = NULL;
+    wheel->count--;
+}
+
+/**
+ * Puts a timer into the slot its expiry falls into: the lowest level on which the expiry is
+ * less than a full turn of slots ahead. The slot is reached as the wheel gets to the start of
+ * the expiry's span on that level, and the timer is spread over the levels below from there.
+ *
+ * @param wheel: The wheel.
+ * @param timer: The timer, not scheduled.
+ * @param earliest: The first tick the timer may still fire at.
+ */
+static void place_timer(timer_wheel* wheel, wheel_timer* timer, unsigned long long earliest)
+{
+    if (timer->expires < earliest)
+        timer->expires = earliest;
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS &&
+           (timer->expires >> (level * TIMER_WHEEL_SLOT_BITS)) - (wheel->now >> (level * TIMER_WHEEL_SLOT_BITS)) >= TIMER_WHEEL_SLOTS)
+        level++;
+
+    size_t index;
+    if (level == TIMER_WHEEL_LEVELS)
+    {
+        // Beyond the span of the wheel, park it in the top slot reached last and place it again from there
+        level = TIMER_WHEEL_LEVELS - 1;
+        index = ((wheel->now >> (level * TIMER_WHEEL_SLOT_BITS)) - 1) & (TIMER_WHEEL_SLOTS - 1);
+    }
+    else
+        index = (timer->expires >> (level * TIMER_WHEEL_SLOT_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+
+    wheel_timer** slot = &wheel->slots[level][index];
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL)
+        (*slot)->prev = timer;
+    *slot = timer;
+    timer->slot = slot;
+    wheel->count++;
+}
+
+
+unsigned long long timer_wheel_clock_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+unsigned long long timer_wheel_tick(unsigned long long ms)
+{
+    return (ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+}
+
+
+void timer_wheel_init(timer_wheel* wheel, unsigned long long now)
+{
+    memset(wheel, 0, sizeof(timer_wheel));
+    wheel->now = now;
+}
+
+
+void timer_wheel_schedule(timer_wheel* wheel, wheel_timer* timer, unsigned long long expires)
+{
+    if (timer->slot != NULL)
+        unlink_timer(wheel, timer);
+
+    // The slot of the current tick was already visited
+    timer->expires = expires;
+    place_timer(wheel, timer, wheel->now + 1);
+}
+
+
+void timer_wheel_cancel(timer_wheel* wheel, wheel_timer* timer)
+{
+    if (timer->slot != NULL)
+        unlink_timer(wheel, timer);
+}
+
+
+void timer_wheel_advance(timer_wheel* wheel, unsigned long long now, void (*expire)(wheel_timer* timer))
+{
+    while (wheel->now < now)
+    {
+        // Nothing can fire on the way, skip to the end
+        if (wheel->count == 0)
+        {
+            wheel->now = now;
+            return;
+        }
+
+        wheel->now++;
+
+        // The levels whose lower digits all wrapped around reached their next slot
+        int top = 0;
+        while (top < TIMER_WHEEL_LEVELS - 1 &&
+               (wheel->now & ((1ULL << ((top + 1) * TIMER_WHEEL_SLOT_BITS)) - 1)) == 0)
+            top++;
+
+        // Spread them over the levels below, highest first, as a lower slot may receive timers from above
+        for (int level = top; level > 0; level--)
+        {
+            wheel_timer** slot = &wheel->slots[level][(wheel->now >> (level * TIMER_WHEEL_SLOT_BITS)) & (TIMER_WHEEL_SLOTS - 1)];
+            while (*slot != NULL)
+            {
+                wheel_timer* timer = *slot;
+                unlink_timer(wheel, timer);
+                place_timer(wheel, timer, wheel->now);
+            }
+        }
+
+        // Fire the timers of this tick one by one, a callback may cancel the others
+        wheel_timer** slot = &wheel->slots[0][wheel->now & (TIMER_WHEEL_SLOTS - 1)];
+        while (*slot != NULL)
+        {
+            wheel_timer* timer = *slot;
+            unlink_timer(wheel, timer);
+            expire(timer);
+        }
+    }
+}
+
+
+void timer_wheel_expire_all(timer_wheel* wheel, void (*expire)(wheel_timer* timer))
+{
+    // Take every timer out first, so a timer scheduled again by its callback does not fire twice
+    wheel_timer* fired = NULL;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        for (int index = 0; index < TIMER_WHEEL_SLOTS; index++)
+            while (wheel->slots[level][index] != NULL)
+            {
+                wheel_timer* timer = wheel->slots[level][index];
+                unlink_timer(wheel, timer);
+                timer->next = fired;
+                fired = timer;
+            }
+
+    while (fired != NULL)
+    {
+        wheel_timer* timer = fired;
+        fired = timer->next;
+        expire(timer);
+    }
+}
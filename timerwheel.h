@@ -0,0 +1,115 @@
+#ifndef PROXYSERVER_TIMERWHEEL_H
+#define PROXYSERVER_TIMERWHEEL_H
+
+#include <stddef.h>
+
+/**
+ * timerwheel.h
+ *
+ * This file declares the hierarchical timer wheel holding the deadlines of
+ * connections. Scheduling and cancelling a timer are constant time, and
+ * advancing the wheel only visits the slot of each tick, so thousands of
+ * connections with a deadline each cost nothing until one of them expires.
+ * A wheel is not thread-safe, its owner serializes the calls.
+ */
+
+// milliseconds per tick, the resolution of every deadline
+#define TIMER_WHEEL_TICK_MS 100
+
+// number of levels, each one covering TIMER_WHEEL_SLOTS times the span of the one below
+#define TIMER_WHEEL_LEVELS 4
+
+// log2 of the number of slots per level
+#define TIMER_WHEEL_SLOT_BITS 6
+
+// number of slots per level
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+
+/**
+ * A timer. The storage belongs to its owner and must stay valid while the timer is scheduled.
+ */
+typedef struct wheel_timer_st {
+    struct wheel_timer_st* next;     // next timer of the same slot
+    struct wheel_timer_st* prev;     // previous timer of the same slot, NULL if first
+    struct wheel_timer_st** slot;    // head of the slot holding the timer, NULL if not scheduled
+    unsigned long long expires;      // tick at which the timer fires
+    void* context;                   // free for the owner's use
+} wheel_timer;
+
+
+/**
+ * A timer wheel. Level 0 holds the timers of the next TIMER_WHEEL_SLOTS ticks one tick per slot,
+ * every level above it holds TIMER_WHEEL_SLOTS times longer spans, which are spread over the
+ * level below once the wheel reaches them.
+ */
+typedef struct {
+    unsigned long long now;                                  // the last tick the wheel advanced to
+    wheel_timer* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // timers by level and slot
+    size_t count;                                            // number of scheduled timers
+} timer_wheel;
+
+
+/**
+ * Returns the monotonic time deadlines are measured with.
+ *
+ * @return The monotonic time in milliseconds.
+ */
+unsigned long long timer_wheel_clock_ms(void);
+
+/**
+ * Converts a monotonic time to the tick of a wheel, rounding up so a deadline never fires early.
+ *
+ * @param ms: The monotonic time in milliseconds.
+ * @return The tick.
+ */
+unsigned long long timer_wheel_tick(unsigned long long ms);
+
+/**
+ * Initializes an empty wheel.
+ *
+ * @param wheel: The wheel.
+ * @param now: The current tick.
+ */
+void timer_wheel_init(timer_wheel* wheel, unsigned long long now);
+
+/**
+ * Schedules a timer, or moves it if it is already scheduled. A tick that already passed fires
+ * on the next advance.
+ *
+ * @param wheel: The wheel.
+ * @param timer: The timer, with its context set.
+ * @param expires: The tick at which the timer fires.
+ */
+void timer_wheel_schedule(timer_wheel* wheel, wheel_timer* timer, unsigned long long expires);
+
+/**
+ * Cancels a timer. Does nothing if the timer is not scheduled.
+ *
+ * @param wheel: The wheel.
+ * @param timer: The timer.
+ */
+void timer_wheel_cancel(timer_wheel* wheel, wheel_timer* timer);
+
+/**
+ * Advances the wheel tick by tick up to a given tick and fires every timer that expires on the
+ * way. A fired timer is no longer scheduled when its callback runs, the callback may schedule
+ * it again or free it.
+ *
+ * @param wheel: The wheel.
+ * @param now: The current tick.
+ * @param expire: Called for every timer that fires.
+ */
+void timer_wheel_advance(timer_wheel* wheel, unsigned long long now, void (*expire)(wheel_timer* timer));
+
+/**
+ * Fires every scheduled timer now, whatever its expiry. A fired timer is no longer scheduled
+ * when its callback runs, the callback may schedule it again, and it then fires on a later
+ * advance.
+ *
+ * @param wheel: The wheel.
+ * @param expire: Called for every timer.
+ */
+void timer_wheel_expire_all(timer_wheel* wheel, void (*expire)(wheel_timer* timer));
+
+#endif //PROXYSERVER_TIMERWHEEL_H
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "upstream.h"
+#include "affinity.h"
+
+
+static upstream_shard* shards = NULL;   // one pool per affinity unit
+static int shard_count = 0;             // number of shards
+static int shard_idle_limit = 0;        // idle connections each shard keeps at most
+
+
+
+/**
+ * Returns the current monotonic time in seconds.
+ *
+ * @return The monotonic second.
+ */
+static time_t now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Maps an origin to its bucket.
+ *
+ * @param address: The origin address.
+ * @param port: The origin port.
+ * @return The bucket index.
+ */
+static size_t bucket_of(const resolver_address* address, int port)
+{
+    uint32_t hash = 2166136261u ^ (uint32_t)port; // FNV-1a over the address bytes, seeded with the port
+    for (int i = 0; i < 16; i++)
+    {
+        hash ^= address->bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash % UPSTREAM_BUCKETS;
+}
+
+/**
+ * Checks whether an idle connection goes to a given origin.
+ *
+ * @param conn: The idle connection.
+ * @param address: The origin address.
+ * @param port: The origin port.
+ * @return
+ *   - 1 if the connection goes to the origin.
+ *   - 0 otherwise.
+ */
+static int same_origin(const upstream_conn* conn, const resolver_address* address, int port)
+{
+    return conn->port == port && conn->address.family == address->family &&
+           memcmp(conn->address.bytes, address->bytes, sizeof(address->bytes)) == 0;
+}
+
+/**
+ * Checks that an idle connection is still usable: the origin must not have closed it
+ * and must not have sent anything while it was idle.
+ *
+ * @param sd: The idle socket.
+ * @return
+ *   - 1 if the connection looks healthy.
+ *   - 0 otherwise.
+ */
+static int is_healthy(int sd)
+{
+    char probe;
+    ssize_t result = recv(sd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    // Nothing to read is the only healthy state, EOF or stray bytes mean the connection is done
+    return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/**
+ * Returns the shard of the unit the calling thread runs on. Connections stay on the unit
+ * that opened them, like the client connections they serve.
+ *
+ * @return The shard.
+ */
+static upstream_shard* current_shard(void)
+{
+    return &shards[affinity_current_unit() % shard_count];
+}
+
+/**
+ * Closes idle connections of a shard that exceeded UPSTREAM_IDLE_TIMEOUT. The shard lock
+ * must be held.
+ *
+ * @param shard: The shard.
+ * @param now: The current monotonic second.
+ */
+static void sweep_expired(upstream_shard* shard, time_t now)
+{
+    for (int i = 0; i < UPSTREAM_BUCKETS; i++)
+    {
+        upstream_conn** link = &shard->buckets[i];
+        while (*link != NULL)
+        {
+            upstream_conn* conn = *link;
+            if (now - conn->idle_since >= UPSTREAM_IDLE_TIMEOUT)
+            {
+                *link = conn->next;
+                close(conn->sd);
+                free(conn);
+                shard->idle_total--;
+            }
+            else
+                link = &conn->next;
+        }
+    }
+
+    shard->last_sweep = now;
+}
+
+
+int upstream_init(void)
+{
+    shard_count = affinity_units();
+    shards = calloc(shard_count, sizeof(upstream_shard));
+    if (shards == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    // The total is split between the shards, each still fits a full set for one origin
+    shard_idle_limit = UPSTREAM_MAX_IDLE_TOTAL / shard_count;
+    if (shard_idle_limit < UPSTREAM_MAX_IDLE_PER_HOST)
+        shard_idle_limit = UPSTREAM_MAX_IDLE_PER_HOST;
+
+    for (int i = 0; i < shard_count; i++)
+    {
+        if (pthread_mutex_init(&shards[i].lock, NULL) != 0)
+        {
+            fprintf(stderr, "Failed to initialize upstream pool mutex\n");
+            while (i-- > 0)
+                pthread_mutex_destroy(&shards[i].lock);
+            free(shards);
+            shards = NULL;
+            return -1;
+        }
+        shards[i].last_sweep = now_seconds();
+    }
+
+    return 1;
+}
+
+
+int upstream_acquire(const resolver_address* address, int port)
+{
+    time_t now = now_seconds();
+    int sd = -1;
+    upstream_shard* shard = current_shard();
+
+    pthread_mutex_lock(&shard->lock);
+
+    upstream_conn** link = &shard->buckets[bucket_of(address, port)];
+    while (*link != NULL && sd == -1)
+    {
+        upstream_conn* conn = *link;
+        if (!same_origin(conn, address, port))
+        {
+            link = &conn->next;
+            continue;
+        }
+
+        // Unlink the connection, it is either handed out or discarded
+        *link = conn->next;
+        shard->idle_total--;
+
+        if (now - conn->idle_since < UPSTREAM_IDLE_TIMEOUT && is_healthy(conn->sd))
+            sd = conn->sd;
+        else
+            close(conn->sd);
+
+        free(conn);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return sd;
+}
+
+
+void upstream_release(const resolver_address* address, int port, int sd, int reusable)
+{
+    if (!reusable)
+    {
+        close(sd);
+        return;
+    }
+
+    upstream_conn* conn = malloc(sizeof(upstream_conn));
+    if (conn == NULL)
+    {
+        close(sd);
+        return;
+    }
+
+    time_t now = now_seconds();
+    conn->address = *address;
+    conn->port = port;
+    conn->sd = sd;
+    conn->idle_since = now;
+
+    upstream_shard* shard = current_shard();
+    pthread_mutex_lock(&shard->lock);
+
+    // Closing timed out connections here keeps origins nobody asks for anymore from holding sockets
+    if (now != shard->last_sweep)
+        sweep_expired(shard, now);
+
+    // Count the idle connections already kept for this origin
+    size_t bucket = bucket_of(address, port);
+    int per_host = 0;
+    for (upstream_conn* other = shard->buckets[bucket]; other != NULL; other = other->next)
+        if (same_origin(other, address, port))
+            per_host++;
+
+    if (per_host >= UPSTREAM_MAX_IDLE_PER_HOST || shard->idle_total >= shard_idle_limit)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        close(sd);
+        free(conn);
+        return;
+    }
+
+    // Most recently used first, so the warmest connection is reused next
+    conn->next = shard->buckets[bucket];
+    shard->buckets[bucket] = conn;
+    shard->idle_total++;
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+
+void upstream_shutdown(void)
+{
+    for (int s = 0; s < shard_count; s++)
+    {
+        upstream_shard* shard = &shards[s];
+        pthread_mutex_lock(&shard->lock);
+
+        for (int i = 0; i < UPSTREAM_BUCKETS; i++)
+        {
+            while (shard->buckets[i] != NULL)
+            {
+                upstream_conn* conn = shard->buckets[i];
+                shard->buckets[i] = conn->next;
+                close(conn->sd);
+                free(conn);
+            }
+        }
+
+        shard->idle_total = 0;
+        pthread_mutex_unlock(&shard->lock);
+        pthread_mutex_destroy(&shard->lock);
+    }
+
+    free(shards);
+    shards = NULL;
+    shard_count = 0;
+}
@@ -0,0 +1,93 @@
+#ifndef PROXYSERVER_UPSTREAM_H
+#define PROXYSERVER_UPSTREAM_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "resolver.h"
+
+/**
+ * upstream.h
+ *
+ * This file declares the pool of idle keep-alive connections to origin
+ * servers. Connections are kept per origin address and port, and are
+ * checked for liveness before they are handed out again. With pinned
+ * workers, every affinity unit has a shard of its own, so a connection is
+ * reused by the unit that opened it and the units never share a lock.
+ */
+
+// maximum number of idle connections kept per origin
+#define UPSTREAM_MAX_IDLE_PER_HOST 8
+
+// maximum number of idle connections kept in total, split between the shards
+#define UPSTREAM_MAX_IDLE_TOTAL 1024
+
+// seconds an idle connection is kept before it is closed
+#define UPSTREAM_IDLE_TIMEOUT 30
+
+// number of hash buckets of the pool
+#define UPSTREAM_BUCKETS 1024
+
+
+/**
+ * An idle connection to an origin
+ */
+typedef struct upstream_conn_st {
+    struct upstream_conn_st* next;   // next idle connection in the same bucket
+    resolver_address address;        // origin address
+    int port;                        // origin port
+    int sd;                          // the connected socket
+    time_t idle_since;               // monotonic second at which the connection became idle
+} upstream_conn;
+
+
+/**
+ * The idle connections of one affinity unit
+ */
+typedef struct {
+    pthread_mutex_t lock;                      // protects everything below
+    upstream_conn* buckets[UPSTREAM_BUCKETS];  // idle connections by origin
+    int idle_total;                            // number of idle connections
+    time_t last_sweep;                         // monotonic second of the last timeout sweep
+} upstream_shard;
+
+
+/**
+ * Initializes the upstream pool with a shard per affinity unit. Must be called after
+ * affinity_init() and before any other upstream function.
+ *
+ * @return
+ *   - 1 on success.
+ *   - -1 if the shards cannot be allocated or their locks initialized.
+ */
+int upstream_init(void);
+
+/**
+ * Takes an idle connection to an origin out of the pool. Connections that timed out, were
+ * closed by the origin or have unexpected data waiting are discarded on the way.
+ *
+ * @param address: The origin address.
+ * @param port: The origin port.
+ * @return
+ *   - The socket descriptor of a live idle connection.
+ *   - -1 if the pool has no usable connection to that origin.
+ */
+int upstream_acquire(const resolver_address* address, int port);
+
+/**
+ * Returns a connection to the pool after a response was fully read from it. The connection
+ * is closed instead if it cannot be reused or the pool limits are reached.
+ *
+ * @param address: The origin address.
+ * @param port: The origin port.
+ * @param sd: The connected socket.
+ * @param reusable: 1 if the connection may carry another request, 0 to close it.
+ */
+void upstream_release(const resolver_address* address, int port, int sd, int reusable);
+
+/**
+ * Closes every idle connection and frees the pool.
+ */
+void upstream_shutdown(void);
+
+#endif //PROXYSERVER_UPSTREAM_H